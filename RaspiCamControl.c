@@ -27,6 +27,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <memory.h>
 
 #include "interface/vcos/vcos.h"
@@ -257,6 +259,144 @@ static MMAL_PARAM_EXPOSUREMETERINGMODE_T metering_mode_from_string(const char *s
    return MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE;
 }
 
+enum
+{
+   CommandSharpness,
+   CommandContrast,
+   CommandBrightness,
+   CommandSaturation,
+   CommandISO,
+   CommandVideoStab,
+   CommandEVComp,
+   CommandExposure,
+   CommandAWB,
+   CommandImageFX,
+   CommandColourFX,
+   CommandMeterMode,
+   CommandRotation,
+   CommandHFlip,
+   CommandVFlip,
+   CommandROI
+};
+
+/// Camera setting options, as accepted by raspivid
+static const struct
+{
+   int id;
+   const char *command;
+   const char *abbrev;
+   int num_parameters;     /// 0 for flags, which take an optional 0 or 1
+} cmdline_commands[] =
+{
+   {CommandSharpness,  "-sharpness", "sh",  1},
+   {CommandContrast,   "-contrast",  "co",  1},
+   {CommandBrightness, "-brightness","br",  1},
+   {CommandSaturation, "-saturation","sa",  1},
+   {CommandISO,        "-ISO",       "ISO", 1},
+   {CommandVideoStab,  "-vstab",     "vs",  0},
+   {CommandEVComp,     "-ev",        "ev",  1},
+   {CommandExposure,   "-exposure",  "ex",  1},
+   {CommandAWB,        "-awb",       "awb", 1},
+   {CommandImageFX,    "-imxfx",     "ifx", 1},
+   {CommandColourFX,   "-colfx",     "cfx", 1},
+   {CommandMeterMode,  "-metering",  "mm",  1},
+   {CommandRotation,   "-rotation",  "rot", 1},
+   {CommandHFlip,      "-hflip",     "hf",  0},
+   {CommandVFlip,      "-vflip",     "vf",  0},
+   {CommandROI,        "-roi",       "roi", 1}
+};
+
+static const int cmdline_commands_size = sizeof(cmdline_commands) / sizeof(cmdline_commands[0]);
+
+/**
+ * Parse a camera setting given as a raspivid style option
+ * @param params Parameter block to update
+ * @param arg1 Option, e.g. "-ex" or "--exposure"
+ * @param arg2 Its value, or the next option for flags; may be NULL
+ * @return Number of arguments used, 0 if arg1 is not a camera setting or its value is invalid
+ */
+int raspicamcontrol_parse_cmdline(RASPICAM_CAMERA_PARAMETERS *params, const char *arg1, const char *arg2)
+{
+   int i, used = 2;
+
+   if (!arg1 || arg1[0] != '-')
+      return 0;
+
+   for (i = 0; i < cmdline_commands_size; i++)
+   {
+      if (!strcmp(arg1 + 1, cmdline_commands[i].command) || !strcmp(arg1 + 1, cmdline_commands[i].abbrev))
+         break;
+   }
+   if (i == cmdline_commands_size)
+      return 0;
+
+   if (cmdline_commands[i].num_parameters && !arg2)
+      return 0;
+
+   switch (cmdline_commands[i].id)
+   {
+   case CommandSharpness:
+      return sscanf(arg2, "%d", &params->sharpness) == 1 ? used : 0;
+   case CommandContrast:
+      return sscanf(arg2, "%d", &params->contrast) == 1 ? used : 0;
+   case CommandBrightness:
+      return sscanf(arg2, "%d", &params->brightness) == 1 ? used : 0;
+   case CommandSaturation:
+      return sscanf(arg2, "%d", &params->saturation) == 1 ? used : 0;
+   case CommandISO:
+      return sscanf(arg2, "%d", &params->ISO) == 1 ? used : 0;
+   case CommandEVComp:
+      return sscanf(arg2, "%d", &params->exposureCompensation) == 1 ? used : 0;
+   case CommandRotation:
+      return sscanf(arg2, "%d", &params->rotation) == 1 ? used : 0;
+   case CommandExposure:
+      params->exposureMode = exposure_mode_from_string(arg2);
+      return used;
+   case CommandAWB:
+      params->awbMode = awb_mode_from_string(arg2);
+      return used;
+   case CommandImageFX:
+      params->imageEffect = imagefx_mode_from_string(arg2);
+      return used;
+   case CommandMeterMode:
+      params->exposureMeterMode = metering_mode_from_string(arg2);
+      return used;
+   case CommandColourFX:
+      if (sscanf(arg2, "%d:%d", &params->colourEffects.u, &params->colourEffects.v) != 2)
+         return 0;
+      params->colourEffects.enable = 1;
+      return used;
+   case CommandROI:
+   {
+      PARAM_FLOAT_RECT_T roi;
+      if (sscanf(arg2, "%lf,%lf,%lf,%lf", &roi.x, &roi.y, &roi.w, &roi.h) != 4 ||
+          roi.x < 0 || roi.y < 0 || roi.w <= 0 || roi.h <= 0 || roi.x + roi.w > 1 || roi.y + roi.h > 1)
+         return 0;
+      params->roi = roi;
+      return used;
+   }
+   case CommandVideoStab:
+   case CommandHFlip:
+   case CommandVFlip:
+   {
+      // A bare flag turns the setting on; "0" or "1" after it sets it either way
+      int value = 1;
+      if (arg2 && (!strcmp(arg2, "0") || !strcmp(arg2, "1")))
+         value = arg2[0] - '0';
+      else
+         used = 1;
+      if (cmdline_commands[i].id == CommandVideoStab)
+         params->videoStabilisation = value;
+      else if (cmdline_commands[i].id == CommandHFlip)
+         params->hflip = value;
+      else
+         params->vflip = value;
+      return used;
+   }
+   }
+   return 0;
+}
+
 /**
  * Convert a MMAL status return value to a simple boolean of success
  * ALso displays a fault if code is not success
@@ -320,6 +460,10 @@ void raspicamcontrol_set_defaults(RASPICAM_CAMERA_PARAMETERS *params)
    params->hflip = params->vflip = 0;
    params->roi.x = params->roi.y = 0.0;
    params->roi.w = params->roi.h = 1.0;
+   params->thumbnailConfig.enable = 1;
+   params->thumbnailConfig.width = 320;
+   params->thumbnailConfig.height = 180;
+   params->thumbnailConfig.quality = 60;
 }
 
 /**
@@ -336,7 +480,6 @@ int raspicamcontrol_get_all_parameters(MMAL_COMPONENT_T *camera, RASPICAM_CAMERA
    if (!camera || !params)
       return 1;
 
-/* TODO : Write these get functions
    params->sharpness = raspicamcontrol_get_sharpness(camera);
    params->contrast = raspicamcontrol_get_contrast(camera);
    params->brightness = raspicamcontrol_get_brightness(camera);
@@ -345,12 +488,80 @@ int raspicamcontrol_get_all_parameters(MMAL_COMPONENT_T *camera, RASPICAM_CAMERA
    params->videoStabilisation = raspicamcontrol_get_video_stabilisation(camera);
    params->exposureCompensation = raspicamcontrol_get_exposure_compensation(camera);
    params->exposureMode = raspicamcontrol_get_exposure_mode(camera);
+   params->exposureMeterMode = raspicamcontrol_get_metering_mode(camera);
    params->awbMode = raspicamcontrol_get_awb_mode(camera);
-   params->imageEffect = raspicamcontrol_get_image_effect(camera);
-   params->colourEffects = raspicamcontrol_get_colour_effect(camera);
-   params->thumbnailConfig = raspicamcontrol_get_thumbnail_config(camera);
-*/
-   return 0;
+   params->imageEffect = raspicamcontrol_get_imageFX(camera);
+   params->colourEffects = raspicamcontrol_get_colourFX(camera);
+   params->rotation = raspicamcontrol_get_rotation(camera);
+   params->roi = raspicamcontrol_get_ROI(camera);
+   // thumbnailConfig stays as configured; it sizes snoopmon's own snapshots
+   return raspicamcontrol_get_flips(camera, &params->hflip, &params->vflip);
+}
+
+/**
+ * Apply only the settings that differ from those last applied, leaving
+ * the camera running. Fields that apply successfully are copied into
+ * current, so a failed field is retried on the next call.
+ * @param camera Pointer to camera component
+ * @param current Settings the camera has now; updated
+ * @param params Settings wanted
+ * @return 0 if successful, non-zero if any setting failed
+ */
+int raspicamcontrol_apply_parameters(MMAL_COMPONENT_T *camera, RASPICAM_CAMERA_PARAMETERS *current,
+                                     const RASPICAM_CAMERA_PARAMETERS *params)
+{
+   int result = 0;
+
+#define APPLY_IF_CHANGED(field, call) \
+   if (current->field != params->field) \
+   { \
+      int r = (call); \
+      if (!r) \
+         current->field = params->field; \
+      result += r; \
+   }
+
+   APPLY_IF_CHANGED(saturation, raspicamcontrol_set_saturation(camera, params->saturation));
+   APPLY_IF_CHANGED(sharpness, raspicamcontrol_set_sharpness(camera, params->sharpness));
+   APPLY_IF_CHANGED(contrast, raspicamcontrol_set_contrast(camera, params->contrast));
+   APPLY_IF_CHANGED(brightness, raspicamcontrol_set_brightness(camera, params->brightness));
+   APPLY_IF_CHANGED(ISO, raspicamcontrol_set_ISO(camera, params->ISO));
+   APPLY_IF_CHANGED(videoStabilisation, raspicamcontrol_set_video_stabilisation(camera, params->videoStabilisation));
+   APPLY_IF_CHANGED(exposureCompensation, raspicamcontrol_set_exposure_compensation(camera, params->exposureCompensation));
+   APPLY_IF_CHANGED(exposureMode, raspicamcontrol_set_exposure_mode(camera, params->exposureMode));
+   APPLY_IF_CHANGED(exposureMeterMode, raspicamcontrol_set_metering_mode(camera, params->exposureMeterMode));
+   APPLY_IF_CHANGED(awbMode, raspicamcontrol_set_awb_mode(camera, params->awbMode));
+   APPLY_IF_CHANGED(imageEffect, raspicamcontrol_set_imageFX(camera, params->imageEffect));
+   APPLY_IF_CHANGED(rotation, raspicamcontrol_set_rotation(camera, params->rotation));
+#undef APPLY_IF_CHANGED
+
+   if (memcmp(&current->colourEffects, &params->colourEffects, sizeof(params->colourEffects)))
+   {
+      int r = raspicamcontrol_set_colourFX(camera, &params->colourEffects);
+      if (!r)
+         current->colourEffects = params->colourEffects;
+      result += r;
+   }
+   if (current->hflip != params->hflip || current->vflip != params->vflip)
+   {
+      int r = raspicamcontrol_set_flips(camera, params->hflip, params->vflip);
+      if (!r)
+      {
+         current->hflip = params->hflip;
+         current->vflip = params->vflip;
+      }
+      result += r;
+   }
+   if (memcmp(&current->roi, &params->roi, sizeof(params->roi)))
+   {
+      int r = raspicamcontrol_set_ROI(camera, params->roi);
+      if (!r)
+         current->roi = params->roi;
+      result += r;
+   }
+   current->thumbnailConfig = params->thumbnailConfig;
+
+   return result;
 }
 
 /**
@@ -742,6 +953,268 @@ int raspicamcontrol_set_ROI(MMAL_COMPONENT_T *camera, PARAM_FLOAT_RECT_T rect)
 }
 
 
+/**
+ * Read a -100 to 100 (or 0 to 100) rational camera setting
+ * @param camera Pointer to camera component
+ * @param id MMAL parameter id
+ * @param def Value to return if the camera cannot be read
+ */
+static int raspicamcontrol_get_rational(MMAL_COMPONENT_T *camera, uint32_t id, int def)
+{
+   MMAL_RATIONAL_T value = {0, 100};
+
+   if (!camera)
+      return def;
+
+   if (mmal_status_to_int(mmal_port_parameter_get_rational(camera->control, id, &value)) || value.den == 0)
+      return def;
+
+   return (value.num * 100) / value.den;
+}
+
+/**
+ * Get the saturation level for images
+ * @param camera Pointer to camera component
+ * @return Saturation, -100 to 100
+ */
+int raspicamcontrol_get_saturation(MMAL_COMPONENT_T *camera)
+{
+   return raspicamcontrol_get_rational(camera, MMAL_PARAMETER_SATURATION, 0);
+}
+
+/**
+ * Get the sharpness of the image
+ * @param camera Pointer to camera component
+ * @return Sharpness, -100 to 100
+ */
+int raspicamcontrol_get_sharpness(MMAL_COMPONENT_T *camera)
+{
+   return raspicamcontrol_get_rational(camera, MMAL_PARAMETER_SHARPNESS, 0);
+}
+
+/**
+ * Get the contrast adjustment for the image
+ * @param camera Pointer to camera component
+ * @return Contrast, -100 to 100
+ */
+int raspicamcontrol_get_contrast(MMAL_COMPONENT_T *camera)
+{
+   return raspicamcontrol_get_rational(camera, MMAL_PARAMETER_CONTRAST, 0);
+}
+
+/**
+ * Get the brightness level for images
+ * @param camera Pointer to camera component
+ * @return Brightness, 0 to 100
+ */
+int raspicamcontrol_get_brightness(MMAL_COMPONENT_T *camera)
+{
+   return raspicamcontrol_get_rational(camera, MMAL_PARAMETER_BRIGHTNESS, 50);
+}
+
+/**
+ * Get the ISO used for images
+ * @param camera Pointer to camera component
+ * @return ISO, 0 for auto
+ */
+int raspicamcontrol_get_ISO(MMAL_COMPONENT_T *camera)
+{
+   uint32_t ISO = 0;
+
+   if (!camera)
+      return 0;
+
+   mmal_status_to_int(mmal_port_parameter_get_uint32(camera->control, MMAL_PARAMETER_ISO, &ISO));
+   return ISO;
+}
+
+/**
+ * Get the metering mode for images
+ * @param camera Pointer to camera component
+ * @return Metering mode, AVERAGE if it cannot be read
+ */
+MMAL_PARAM_EXPOSUREMETERINGMODE_T raspicamcontrol_get_metering_mode(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_EXPOSUREMETERINGMODE_T meter_mode = {{MMAL_PARAMETER_EXP_METERING_MODE,sizeof(meter_mode)},
+                                                      MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE};
+   if (camera)
+      mmal_status_to_int(mmal_port_parameter_get(camera->control, &meter_mode.hdr));
+
+   return meter_mode.value;
+}
+
+/**
+ * Get the video stabilisation flag
+ * @param camera Pointer to camera component
+ * @return 0 off, 1 on
+ */
+int raspicamcontrol_get_video_stabilisation(MMAL_COMPONENT_T *camera)
+{
+   MMAL_BOOL_T vstabilisation = 0;
+
+   if (camera)
+      mmal_status_to_int(mmal_port_parameter_get_boolean(camera->control, MMAL_PARAMETER_VIDEO_STABILISATION, &vstabilisation));
+
+   return vstabilisation ? 1 : 0;
+}
+
+/**
+ * Get the exposure compensation for images (EV)
+ * @param camera Pointer to camera component
+ * @return Compensation, -10 to +10
+ */
+int raspicamcontrol_get_exposure_compensation(MMAL_COMPONENT_T *camera)
+{
+   int32_t exp_comp = 0;
+
+   if (camera)
+      mmal_status_to_int(mmal_port_parameter_get_int32(camera->control, MMAL_PARAMETER_EXPOSURE_COMP, &exp_comp));
+
+   return exp_comp;
+}
+
+/**
+ * Get the thumbnail settings the camera embeds in stills
+ * @param camera Pointer to camera component
+ * @return Thumbnail settings, disabled if they cannot be read
+ */
+MMAL_PARAM_THUMBNAIL_CONFIG_T raspicamcontrol_get_thumbnail_parameters(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_THUMBNAIL_CONFIG_T param = {{MMAL_PARAMETER_THUMBNAIL_CONFIGURATION, sizeof(param)}, 0, 0, 0, 0};
+   MMAL_PARAM_THUMBNAIL_CONFIG_T config = {0, 0, 0, 0};
+
+   if (camera && !mmal_status_to_int(mmal_port_parameter_get(camera->control, &param.hdr)))
+   {
+      config.enable = param.enable;
+      config.width = param.width;
+      config.height = param.height;
+      config.quality = param.quality;
+   }
+
+   return config;
+}
+
+/**
+ * Get the exposure mode for images
+ * @param camera Pointer to camera component
+ * @return Exposure mode, AUTO if it cannot be read
+ */
+MMAL_PARAM_EXPOSUREMODE_T raspicamcontrol_get_exposure_mode(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_EXPOSUREMODE_T exp_mode = {{MMAL_PARAMETER_EXPOSURE_MODE,sizeof(exp_mode)}, MMAL_PARAM_EXPOSUREMODE_AUTO};
+
+   if (camera)
+      mmal_status_to_int(mmal_port_parameter_get(camera->control, &exp_mode.hdr));
+
+   return exp_mode.value;
+}
+
+/**
+ * Get the AWB (auto white balance) mode for images
+ * @param camera Pointer to camera component
+ * @return AWB mode, AUTO if it cannot be read
+ */
+MMAL_PARAM_AWBMODE_T raspicamcontrol_get_awb_mode(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_AWBMODE_T param = {{MMAL_PARAMETER_AWB_MODE,sizeof(param)}, MMAL_PARAM_AWBMODE_AUTO};
+
+   if (camera)
+      mmal_status_to_int(mmal_port_parameter_get(camera->control, &param.hdr));
+
+   return param.value;
+}
+
+/**
+ * Get the image effect for the images
+ * @param camera Pointer to camera component
+ * @return Image effect, NONE if it cannot be read
+ */
+MMAL_PARAM_IMAGEFX_T raspicamcontrol_get_imageFX(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_IMAGEFX_T imgFX = {{MMAL_PARAMETER_IMAGE_EFFECT,sizeof(imgFX)}, MMAL_PARAM_IMAGEFX_NONE};
+
+   if (camera)
+      mmal_status_to_int(mmal_port_parameter_get(camera->control, &imgFX.hdr));
+
+   return imgFX.value;
+}
+
+/**
+ * Get the colour effect for images
+ * @param camera Pointer to camera component
+ * @return Enable state and U and V values, disabled if it cannot be read
+ */
+MMAL_PARAM_COLOURFX_T raspicamcontrol_get_colourFX(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_COLOURFX_T colfx = {{MMAL_PARAMETER_COLOUR_EFFECT,sizeof(colfx)}, 0, 128, 128};
+   MMAL_PARAM_COLOURFX_T colourFX;
+
+   if (camera)
+      mmal_status_to_int(mmal_port_parameter_get(camera->control, &colfx.hdr));
+
+   colourFX.enable = colfx.enable;
+   colourFX.u = colfx.u;
+   colourFX.v = colfx.v;
+   return colourFX;
+}
+
+/**
+ * Get the rotation of the image
+ * @param camera Pointer to camera component
+ * @return Rotation, 0, 90, 180 or 270
+ */
+int raspicamcontrol_get_rotation(MMAL_COMPONENT_T *camera)
+{
+   int32_t rotation = 0;
+
+   if (camera)
+      mmal_status_to_int(mmal_port_parameter_get_int32(camera->output[0], MMAL_PARAMETER_ROTATION, &rotation));
+
+   return rotation;
+}
+
+/**
+ * Get the flips state of the image
+ * @param camera Pointer to camera component
+ * @param hflip Set non-zero if the image is flipped horizontally
+ * @param vflip Set non-zero if the image is flipped vertically
+ * @return 0 if successful, non-zero if the camera could not be read
+ */
+int raspicamcontrol_get_flips(MMAL_COMPONENT_T *camera, int *hflip, int *vflip)
+{
+   MMAL_PARAMETER_MIRROR_T mirror = {{MMAL_PARAMETER_MIRROR, sizeof(MMAL_PARAMETER_MIRROR_T)}, MMAL_PARAM_MIRROR_NONE};
+   int ret;
+
+   if (!camera)
+      return 1;
+
+   ret = mmal_status_to_int(mmal_port_parameter_get(camera->output[0], &mirror.hdr));
+   *hflip = (mirror.value == MMAL_PARAM_MIRROR_HORIZONTAL || mirror.value == MMAL_PARAM_MIRROR_BOTH);
+   *vflip = (mirror.value == MMAL_PARAM_MIRROR_VERTICAL || mirror.value == MMAL_PARAM_MIRROR_BOTH);
+   return ret;
+}
+
+/**
+ * Get the ROI of the sensor used for captures/preview
+ * @param camera Pointer to camera component
+ * @return Normalised coordinates of ROI rectangle, the full sensor if it cannot be read
+ */
+PARAM_FLOAT_RECT_T raspicamcontrol_get_ROI(MMAL_COMPONENT_T *camera)
+{
+   MMAL_PARAMETER_INPUT_CROP_T crop = {{MMAL_PARAMETER_INPUT_CROP, sizeof(MMAL_PARAMETER_INPUT_CROP_T)}};
+   PARAM_FLOAT_RECT_T rect = {0.0, 0.0, 1.0, 1.0};
+
+   if (camera && !mmal_status_to_int(mmal_port_parameter_get(camera->control, &crop.hdr)))
+   {
+      rect.x = crop.rect.x / 65536.0;
+      rect.y = crop.rect.y / 65536.0;
+      rect.w = crop.rect.width / 65536.0;
+      rect.h = crop.rect.height / 65536.0;
+   }
+
+   return rect;
+}
+
 /**
  * Asked GPU how much memory it has allocated
  *
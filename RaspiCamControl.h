@@ -129,6 +129,7 @@ typedef struct
    int hflip;                 /// 0 or 1
    int vflip;                 /// 0 or 1
    PARAM_FLOAT_RECT_T  roi;   /// region of interest to use on the sensor. Normalised [0,1] values in the rect
+   MMAL_PARAM_THUMBNAIL_CONFIG_T thumbnailConfig; /// Size and quality of trigger-time snapshots
 } RASPICAM_CAMERA_PARAMETERS;
 
 
@@ -140,6 +141,8 @@ int raspicamcontrol_cycle_test(MMAL_COMPONENT_T *camera);
 
 int raspicamcontrol_set_all_parameters(MMAL_COMPONENT_T *camera, const RASPICAM_CAMERA_PARAMETERS *params);
 int raspicamcontrol_get_all_parameters(MMAL_COMPONENT_T *camera, RASPICAM_CAMERA_PARAMETERS *params);
+int raspicamcontrol_apply_parameters(MMAL_COMPONENT_T *camera, RASPICAM_CAMERA_PARAMETERS *current,
+                                     const RASPICAM_CAMERA_PARAMETERS *params);
 void raspicamcontrol_dump_parameters(const RASPICAM_CAMERA_PARAMETERS *params);
 
 void raspicamcontrol_set_defaults(RASPICAM_CAMERA_PARAMETERS *params);
@@ -177,6 +180,9 @@ MMAL_PARAM_EXPOSUREMODE_T raspicamcontrol_get_exposure_mode(MMAL_COMPONENT_T *ca
 MMAL_PARAM_AWBMODE_T raspicamcontrol_get_awb_mode(MMAL_COMPONENT_T *camera);
 MMAL_PARAM_IMAGEFX_T raspicamcontrol_get_imageFX(MMAL_COMPONENT_T *camera);
 MMAL_PARAM_COLOURFX_T raspicamcontrol_get_colourFX(MMAL_COMPONENT_T *camera);
+int raspicamcontrol_get_rotation(MMAL_COMPONENT_T *camera);
+int raspicamcontrol_get_flips(MMAL_COMPONENT_T *camera, int *hflip, int *vflip);
+PARAM_FLOAT_RECT_T raspicamcontrol_get_ROI(MMAL_COMPONENT_T *camera);
 
 
 #endif /* RASPICAMCONTROL_H_ */
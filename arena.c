@@ -0,0 +1,131 @@
+/*
+ * File:   arena.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "report.h"
+
+/**
+ * Map and prefault an arena
+ *
+ * @param size   Bytes needed, the sum of ARENA_BYTES() of every buffer
+ * @param budget Most bytes the arena may take
+ * @return 0 if successful, -1 if over budget or the mapping failed
+ */
+int arena_open(ARENA_T *arena, size_t size, size_t budget)
+{
+    memset(arena, 0, sizeof(*arena));
+    size = ARENA_BYTES(size);
+    if (size > budget) {
+        fprintf(stderr, "Error: frame buffers need %zu KB, over the %zu KB budget\n",
+                size/1024, budget/1024);
+        return -1;
+    }
+    // Prefault now so the first frames do not take page faults
+    arena->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (arena->base == MAP_FAILED) {
+        perror("arena");
+        arena->base = NULL;
+        return -1;
+    }
+    arena->size = size;
+    arena->budget = budget;
+    vcos_mutex_create(&arena->lock, "snoop_arena-lock");
+    return 0;
+}
+
+void arena_close(ARENA_T *arena)
+{
+    if (!arena->base)
+        return;
+    munmap(arena->base, arena->size);
+    vcos_mutex_delete(&arena->lock);
+    arena->base = NULL;
+}
+
+/**
+ * Take a page-aligned buffer from the arena
+ *
+ * @param name Label for the usage report
+ * @return The buffer, or NULL if the arena was sized too small
+ */
+void *arena_alloc(ARENA_T *arena, const char *name, size_t size)
+{
+    ARENA_REGION_T *region;
+    void *p = NULL;
+
+    vcos_mutex_lock(&arena->lock);
+    if (arena->used + ARENA_BYTES(size) <= arena->size && arena->numRegions < ARENA_MAX_REGIONS) {
+        region = &arena->region[arena->numRegions++];
+        snprintf(region->name, sizeof(region->name), "%s", name);
+        region->offset = arena->used;
+        region->size = size;
+        p = arena->base + arena->used;
+        arena->used += ARENA_BYTES(size);
+    }
+    vcos_mutex_unlock(&arena->lock);
+    if (!p)
+        fprintf(stderr, "Error: no arena space for %s (%zu bytes)\n", name, size);
+    return p;
+}
+
+/**
+ * Read the process resident set size
+ *
+ * @param peak Set to the high water mark, may be NULL
+ * @return Resident bytes, -1 if unknown
+ */
+long arena_rss_bytes(long *peak)
+{
+    char line[128];
+    long rss = -1, hwm = -1, kb;
+    FILE *fp = fopen("/proc/self/status", "r");
+
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+                rss = kb*1024;
+            else if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+                hwm = kb*1024;
+        }
+        fclose(fp);
+    }
+    if (peak)
+        *peak = hwm;
+    return rss;
+}
+
+void arena_dump(ARENA_T *arena, FILE *fp)
+{
+    long rss, peak;
+    int i;
+
+    rss = arena_rss_bytes(&peak);
+    vcos_mutex_lock(&arena->lock);
+    fprintf(fp, "%-24s %10s %10s\n", "buffer", "offset(KB)", "size(KB)");
+    for (i = 0; i < arena->numRegions; i++) {
+        const ARENA_REGION_T *r = &arena->region[i];
+        fprintf(fp, "%-24s %10.1f %10.1f\n", r->name, r->offset/1024.0, r->size/1024.0);
+    }
+    fprintf(fp, "%-24s %10s %10.1f\n", "arena used", "", arena->used/1024.0);
+    fprintf(fp, "%-24s %10s %10.1f\n", "arena mapped", "", arena->size/1024.0);
+    fprintf(fp, "%-24s %10s %10.1f\n", "arena budget", "", arena->budget/1024.0);
+    vcos_mutex_unlock(&arena->lock);
+    fprintf(fp, "%-24s %10s %10.1f\n", "process rss", "", rss/1024.0);
+    fprintf(fp, "%-24s %10s %10.1f\n", "process peak rss", "", peak/1024.0);
+}
+
+static void dump_report(void *ctx, FILE *fp)
+{
+    arena_dump((ARENA_T *) ctx, fp);
+}
+
+void arena_write_report(ARENA_T *arena)
+{
+    report_write(ARENA_REPORT_FILE, dump_report, arena);
+}
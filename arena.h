@@ -0,0 +1,51 @@
+/*
+ * File:   arena.h
+ *
+ * Frame buffer arena. Every frame-sized buffer is carved out of one
+ * page-aligned mapping, sized at startup from the configured resolution
+ * and features and checked against a memory budget, so the footprint of
+ * a configuration is known before the first frame arrives. Buffers are
+ * never freed individually; the whole arena goes at exit.
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "interface/vcos/vcos.h"
+
+#define ARENA_REPORT_FILE  "/tmp/snoop_memory.txt"
+#define ARENA_BUDGET_BYTES (96*1024*1024)   // Default; leaves a 512 MB unit room for GPU and page cache
+#define ARENA_MAX_REGIONS  64
+#define ARENA_ALIGN        4096
+
+typedef struct {
+    char   name[24];
+    size_t offset;
+    size_t size;          /// Bytes asked for, before rounding to ARENA_ALIGN
+} ARENA_REGION_T;
+
+typedef struct {
+    VCOS_MUTEX_T   lock;
+    unsigned char *base;
+    size_t         size;          /// Bytes mapped
+    size_t         used;          /// Bytes handed out, including alignment
+    size_t         budget;
+    ARENA_REGION_T region[ARENA_MAX_REGIONS];
+    int            numRegions;
+} ARENA_T;
+
+/// Arena bytes a buffer of size bytes will take
+#define ARENA_BYTES(size) (((size_t)(size) + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+
+int   arena_open(ARENA_T *arena, size_t size, size_t budget);
+void  arena_close(ARENA_T *arena);
+void *arena_alloc(ARENA_T *arena, const char *name, size_t size);
+
+long  arena_rss_bytes(long *peak);
+void  arena_dump(ARENA_T *arena, FILE *fp);
+void  arena_write_report(ARENA_T *arena);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,78 @@
+/*
+ * File:   autocrop.c
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "autocrop.h"
+
+static double clamp(double v, double lo, double hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+/**
+ * Crop that frames a motion box: expanded, square in normalised units so
+ * the output keeps the frame's pixel aspect, and inside the frame
+ */
+static void frame_box(const AUTOCROP_RECT_T *box, AUTOCROP_RECT_T *out)
+{
+    double cx = box->x + box->w/2;
+    double cy = box->y + box->h/2;
+    double size = (box->w > box->h ? box->w : box->h)*(1 + 2*AUTOCROP_EXPAND);
+
+    size = clamp(size, 1/AUTOCROP_MAX_ZOOM, 1.0);
+    out->w = out->h = size;
+    out->x = clamp(cx - size/2, 0.0, 1.0 - size);
+    out->y = clamp(cy - size/2, 0.0, 1.0 - size);
+}
+
+void autocrop_reset(AUTOCROP_T *crop)
+{
+    memset(crop, 0, sizeof(*crop));
+    crop->applied.w = crop->applied.h = 1.0;
+    crop->target = crop->applied;
+}
+
+/**
+ * Fold a new motion box into the crop
+ *
+ * @param box Changed pixels, in uncropped frame coordinates
+ * @return 1 if crop->applied has moved and should be applied, 0 otherwise
+ */
+int autocrop_update(AUTOCROP_T *crop, const AUTOCROP_RECT_T *box)
+{
+    AUTOCROP_RECT_T want;
+    double drift;
+
+    frame_box(box, &want);
+    if (!crop->active) {
+        crop->target = want;
+    } else {
+        crop->target.x += AUTOCROP_SMOOTHING*(want.x - crop->target.x);
+        crop->target.y += AUTOCROP_SMOOTHING*(want.y - crop->target.y);
+        crop->target.w += AUTOCROP_SMOOTHING*(want.w - crop->target.w);
+        crop->target.h = crop->target.w;
+        drift = fabs(crop->target.x - crop->applied.x) + fabs(crop->target.y - crop->applied.y) +
+                fabs(crop->target.w - crop->applied.w);
+        if (drift < AUTOCROP_HYSTERESIS*crop->applied.w)
+            return 0;
+    }
+    crop->active = 1;
+    crop->applied = crop->target;
+    crop->moves++;
+    return 1;
+}
+
+/**
+ * Map a rectangle from the applied crop's coordinates to the uncropped
+ * frame's
+ */
+void autocrop_to_frame(const AUTOCROP_T *crop, AUTOCROP_RECT_T *rect)
+{
+    rect->x = crop->applied.x + rect->x*crop->applied.w;
+    rect->y = crop->applied.y + rect->y*crop->applied.h;
+    rect->w *= crop->applied.w;
+    rect->h *= crop->applied.h;
+}
@@ -0,0 +1,37 @@
+/*
+ * File:   autocrop.h
+ *
+ * Motion-following crop for recorded clips. The bounding box of the
+ * changed pixels is expanded by a margin, squared up so the crop keeps
+ * the frame's aspect ratio, limited to AUTOCROP_MAX_ZOOM and smoothed
+ * over successive boxes; the crop only moves once the smoothed box has
+ * drifted by more than AUTOCROP_HYSTERESIS, so the camera ROI is not
+ * rewritten on every analysed frame.
+ *
+ * All rectangles are normalised [0,1] coordinates of the uncropped frame.
+ */
+
+#ifndef AUTOCROP_H_
+#define AUTOCROP_H_
+
+#define AUTOCROP_EXPAND      0.5   // Margin on each side, as a fraction of the box size
+#define AUTOCROP_MAX_ZOOM    3.0   // Smallest crop is 1/AUTOCROP_MAX_ZOOM of the frame
+#define AUTOCROP_SMOOTHING   0.3   // Weight of each new box in the smoothed crop
+#define AUTOCROP_HYSTERESIS  0.1   // Drift, as a fraction of the crop size, that moves it
+
+typedef struct {
+    double x, y, w, h;
+} AUTOCROP_RECT_T;
+
+typedef struct {
+    int             active;     /// A crop has been applied since the last reset
+    AUTOCROP_RECT_T target;     /// Smoothed crop
+    AUTOCROP_RECT_T applied;    /// Crop last returned by autocrop_update()
+    int             moves;      /// Crops applied since the last reset
+} AUTOCROP_T;
+
+void autocrop_reset(AUTOCROP_T *crop);
+int  autocrop_update(AUTOCROP_T *crop, const AUTOCROP_RECT_T *box);
+void autocrop_to_frame(const AUTOCROP_T *crop, AUTOCROP_RECT_T *rect);
+
+#endif /* AUTOCROP_H_ */
@@ -0,0 +1,96 @@
+/*
+ * File:   bitrate.c
+ */
+
+#include <stdio.h>
+
+#include "bitrate.h"
+
+/**
+ * @param dutyCycle Capture time over capture plus suspend time: a stream
+ *                  can never produce clips for longer than this fraction
+ *                  of the time, so its share of the uplink stretches by
+ *                  the inverse while it is recording.
+ */
+void bitrate_init(BITRATE_T *br, double dutyCycle)
+{
+    br->throughput = 0;
+    br->samples = 0;
+    br->dutyCycle = dutyCycle;
+    vcos_mutex_create(&br->lock, "snoop_bitrate-lock");
+}
+
+void bitrate_destroy(BITRATE_T *br)
+{
+    vcos_mutex_delete(&br->lock);
+}
+
+/**
+ * Fold in an uplink sample reported by snoop.py, covering every upload
+ * that ran in the period, so concurrent uploads are not each taken for
+ * the whole link
+ *
+ * @param bytes Bytes the uploads delivered
+ * @param usec  Time any upload was running
+ */
+void bitrate_uplink_sample(BITRATE_T *br, uint32_t bytes, uint32_t usec)
+{
+    double rate;
+
+    if (usec == 0 || bytes == 0)
+        return;
+    rate = bytes*1e6/usec;
+    vcos_mutex_lock(&br->lock);
+    if (br->samples++ == 0)
+        br->throughput = rate;
+    else
+        br->throughput += BITRATE_EWMA_WEIGHT*(rate - br->throughput);
+    vcos_mutex_unlock(&br->lock);
+}
+
+static uint32_t lerp(uint32_t a, uint32_t b, double f)
+{
+    return (uint32_t)(a + (b - (double)a)*f + 0.5);
+}
+
+/**
+ * Choose encoder settings for a clip that is about to start
+ *
+ * @param backlogBytes Bytes spooled but not yet uploaded
+ * @param streams      Streams sharing the uplink
+ * @param motion       Fraction of the analysis frame that changed, 0-1
+ */
+void bitrate_choose(BITRATE_T *br, int64_t backlogBytes, int streams, double motion,
+                    BITRATE_CHOICE_T *choice)
+{
+    double throughput, rate, pressure, f;
+
+    vcos_mutex_lock(&br->lock);
+    throughput = br->throughput;
+    vcos_mutex_unlock(&br->lock);
+
+    if (throughput <= 0) {
+        rate = BITRATE_DEFAULT;
+    } else {
+        // What this stream can sustain if it records back to back
+        rate = throughput*8/(streams > 0 ? streams : 1)/br->dutyCycle;
+        // Give up the share the backlog needs to drain in time
+        pressure = backlogBytes/(throughput*BITRATE_DRAIN_SECONDS);
+        rate *= (pressure < 1) ? 1 - pressure : 0;
+    }
+    // Busy scenes need more bits to stay legible, quiet ones fewer
+    if (motion > 1)
+        motion = 1;
+    rate *= 0.75 + 0.5*motion;
+
+    if (rate < BITRATE_MIN)
+        rate = BITRATE_MIN;
+    if (rate > BITRATE_MAX)
+        rate = BITRATE_MAX;
+    choice->bitrate = (uint32_t) rate;
+
+    // Let the rate controller quantise harder the lower the target
+    f = (BITRATE_MAX - rate)/(BITRATE_MAX - BITRATE_MIN);
+    choice->minQuant = lerp(BITRATE_QUANT_MIN_LO, BITRATE_QUANT_MIN_HI, f);
+    choice->maxQuant = lerp(BITRATE_QUANT_MAX_LO, BITRATE_QUANT_MAX_HI, f);
+}
@@ -0,0 +1,47 @@
+/*
+ * File:   bitrate.h
+ *
+ * Per-clip encoder rate selection. Each clip's bitrate and quantiser
+ * limits are chosen when it starts, from the bytes still waiting in the
+ * spool, the uplink throughput snoop.py has measured, and how much of
+ * the frame is moving, so that the spool drains within
+ * BITRATE_DRAIN_SECONDS instead of growing through a busy day.
+ */
+
+#ifndef BITRATE_H_
+#define BITRATE_H_
+
+#include <stdint.h>
+
+#include "interface/vcos/vcos.h"
+
+#define BITRATE_DEFAULT        1500000   // bits/s until the uplink has been measured
+#define BITRATE_MIN            250000
+#define BITRATE_MAX            4000000
+#define BITRATE_DRAIN_SECONDS  600       // Backlog should clear within this
+#define BITRATE_EWMA_WEIGHT    0.3       // Weight of the newest throughput sample
+#define BITRATE_QUANT_MIN_LO   10        // H.264 QP limits at BITRATE_MAX...
+#define BITRATE_QUANT_MIN_HI   22        // ...and at BITRATE_MIN
+#define BITRATE_QUANT_MAX_LO   35
+#define BITRATE_QUANT_MAX_HI   45
+
+typedef struct {
+    VCOS_MUTEX_T lock;
+    double       throughput;    /// Smoothed uplink bytes/s, 0 until measured
+    uint32_t     samples;
+    double       dutyCycle;     /// Longest fraction of time a stream can spend recording
+} BITRATE_T;
+
+typedef struct {
+    uint32_t bitrate;           /// bits/s
+    uint32_t minQuant;
+    uint32_t maxQuant;
+} BITRATE_CHOICE_T;
+
+void bitrate_init(BITRATE_T *br, double dutyCycle);
+void bitrate_destroy(BITRATE_T *br);
+void bitrate_uplink_sample(BITRATE_T *br, uint32_t bytes, uint32_t usec);
+void bitrate_choose(BITRATE_T *br, int64_t backlogBytes, int streams, double motion,
+                    BITRATE_CHOICE_T *choice);
+
+#endif /* BITRATE_H_ */
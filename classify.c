@@ -0,0 +1,409 @@
+/*
+ * File:   classify.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/objdetect/objdetect.hpp>
+
+#include "classify.h"
+#include "report.h"
+
+void classify_init(CLASSIFY_T *cls)
+{
+    memset(cls, 0, sizeof(*cls));
+    vcos_mutex_create(&cls->lock, "snoop_classify-lock");
+    vcos_semaphore_create(&cls->ready, "snoop_classify-sem", 0);
+}
+
+/**
+ * Add a cascade to load at classify_open()
+ *
+ * @param spec label=cascade.xml; the string must outlive the classifier
+ * @return 0 if successful, -1 if it is malformed or there are too many
+ */
+int classify_add_cascade(CLASSIFY_T *cls, const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    CLASSIFY_CASCADE_T *c;
+
+    if (!eq || eq == spec || eq - spec >= (int)sizeof(c->label) || !eq[1]) {
+        fprintf(stderr, "Error: cascade %s is not label=cascade.xml\n", spec);
+        return -1;
+    }
+    if (cls->numCascades == CLASSIFY_MAX_CASCADES) {
+        fprintf(stderr, "Error: at most %d cascades\n", CLASSIFY_MAX_CASCADES);
+        return -1;
+    }
+    c = &cls->cascades[cls->numCascades++];
+    snprintf(c->label, sizeof(c->label), "%.*s", (int)(eq - spec), spec);
+    c->path = eq + 1;
+    return 0;
+}
+
+static CLASSIFY_SLOT_T *next_region(CLASSIFY_T *cls)
+{
+    CLASSIFY_SLOT_T *slot = NULL;
+
+    vcos_mutex_lock(&cls->lock);
+    if (cls->queueLen) {
+        slot = cls->queue[cls->queueHead];
+        cls->queueHead = (cls->queueHead + 1) % CLASSIFY_MAX_QUEUE;
+        cls->queueLen--;
+    }
+    vcos_mutex_unlock(&cls->lock);
+    return slot;
+}
+
+static void *classify_thread(void *arg)
+{
+    CLASSIFY_T *cls = (CLASSIFY_T *) arg;
+
+    for (;;) {
+        CLASSIFY_SLOT_T *slot;
+        uint32_t labels = 0;
+        int64_t start, wait, run;
+        char text[80];
+        int i;
+
+        vcos_semaphore_wait(&cls->ready);
+        if (!cls->running)
+            break;
+        if ((slot = next_region(cls)) == NULL)
+            continue;
+        start = report_now_us();
+        wait = start - slot->queued;
+        for (i = 0; i < cls->numCascades; i++) {
+            CLASSIFY_CASCADE_T *c = &cls->cascades[i];
+            CvSeq *found;
+
+            cvClearMemStorage(cls->storage);
+            found = cvHaarDetectObjects(slot->roi, c->cascade, cls->storage, CLASSIFY_SCALE_FACTOR,
+                                        CLASSIFY_MIN_NEIGHBORS, CV_HAAR_DO_CANNY_PRUNING, cvSize(0, 0), cvSize(0, 0));
+            c->runs++;
+            if (found && found->total > 0) {
+                labels |= 1 << i;
+                c->matches++;
+            }
+        }
+        run = report_now_us() - start;
+        cls->runs++;
+        if (labels)
+            cls->matched++;
+        cls->waitTotal += wait;
+        cls->runTotal += run;
+        cls->runLast = run;
+        if (run > cls->runMax)
+            cls->runMax = run;
+
+        vcos_mutex_lock(&cls->lock);
+        if (slot->clip == slot->current) {
+            slot->labels |= labels;
+            slot->runs++;
+        }
+        vcos_mutex_unlock(&cls->lock);
+        classify_labels(cls, labels, text, sizeof(text));
+        printf("Classified stream %d at %lld: %s in %lld ms, queued %lld ms\n", slot->stream,
+               (long long)slot->pts, text, (long long)(run/1000), (long long)(wait/1000));
+        __sync_synchronize();  // Done with roi before it is handed back
+        slot->busy = 0;
+        vcos_mutex_lock(&cls->lock);
+        if (slot->waiting) {
+            slot->waiting = 0;
+            vcos_semaphore_post(&slot->done);
+        }
+        vcos_mutex_unlock(&cls->lock);
+        classify_write_report(cls);
+    }
+    return NULL;
+}
+
+/**
+ * Undo a failed classify_open(), leaving no cascades so every stream
+ * runs without the classifier
+ */
+static int open_failed(CLASSIFY_T *cls)
+{
+    int i;
+
+    for (i = 0; i < cls->numCascades; i++) {
+        if (cls->cascades[i].cascade)
+            cvReleaseHaarClassifierCascade(&cls->cascades[i].cascade);
+    }
+    if (cls->storage)
+        cvReleaseMemStorage(&cls->storage);
+    cls->numCascades = 0;
+    return -1;
+}
+
+/**
+ * Load the cascades and start the classifier thread. On failure there
+ * are no cascades left, as if none had been added.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int classify_open(CLASSIFY_T *cls)
+{
+    int i;
+
+    for (i = 0; i < cls->numCascades; i++) {
+        CLASSIFY_CASCADE_T *c = &cls->cascades[i];
+        c->cascade = (CvHaarClassifierCascade *) cvLoad(c->path, 0, 0, 0);
+        if (!c->cascade) {
+            fprintf(stderr, "Error: unable to load %s cascade %s\n", c->label, c->path);
+            return open_failed(cls);
+        }
+    }
+    cls->storage = cvCreateMemStorage(0);
+    if (!cls->storage)
+        return open_failed(cls);
+    cls->running = 1;
+    if (vcos_thread_create(&cls->thread, "snoop_classify", NULL, classify_thread, cls) != VCOS_SUCCESS) {
+        fprintf(stderr, "Error: unable to start classifier thread\n");
+        cls->running = 0;
+        return open_failed(cls);
+    }
+    printf("Classifier running %d cascades on motion regions\n", cls->numCascades);
+    classify_write_report(cls);
+    return 0;
+}
+
+void classify_close(CLASSIFY_T *cls)
+{
+    int i;
+
+    if (!cls->running)
+        return;
+    cls->running = 0;
+    vcos_semaphore_post(&cls->ready);
+    vcos_thread_join(&cls->thread, NULL);
+    for (i = 0; i < cls->numCascades; i++)
+        cvReleaseHaarClassifierCascade(&cls->cascades[i].cascade);
+    cvReleaseMemStorage(&cls->storage);
+}
+
+/**
+ * Give a stream its slot, with the region buffer from the arena
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int classify_add_stream(CLASSIFY_T *cls, CLASSIFY_SLOT_T *slot, int stream, ARENA_T *arena)
+{
+    void *data;
+
+    memset(slot, 0, sizeof(*slot));
+    slot->stream = stream;
+    data = arena_alloc(arena, "classify region", (size_t)CLASSIFY_WIDTH*CLASSIFY_HEIGHT);
+    if (!data)
+        return -1;
+    vcos_semaphore_create(&slot->done, "snoop_classify-done", 0);
+    slot->roi = cvCreateImageHeader(cvSize(CLASSIFY_WIDTH, CLASSIFY_HEIGHT), IPL_DEPTH_8U, 1);
+    cvSetData(slot->roi, data, CLASSIFY_WIDTH);
+    return 0;
+}
+
+/**
+ * Start a new verdict for a stream's next clip. Regions of the previous
+ * clip still queued no longer count towards any clip.
+ */
+void classify_begin_clip(CLASSIFY_T *cls, CLASSIFY_SLOT_T *slot)
+{
+    vcos_mutex_lock(&cls->lock);
+    slot->current++;
+    slot->labels = 0;
+    slot->runs = 0;
+    vcos_mutex_unlock(&cls->lock);
+    slot->tries = 0;
+}
+
+/**
+ * Hand over the motion region of a frame. Only the copy, and scaling if
+ * the region is larger than CLASSIFY_WIDTH x CLASSIFY_HEIGHT, runs on the
+ * caller's thread.
+ *
+ * @param frame  8 bit luma frame, its ROI is reset
+ * @param region Motion bounding box in frame pixels, CLASSIFY_MARGIN is
+ *               added to it
+ * @return 1 if the region was taken, 0 if the clip needs no more, -1 if
+ *         dropped because the stream's last region is still queued
+ */
+int classify_region(CLASSIFY_T *cls, CLASSIFY_SLOT_T *slot, IplImage *frame, CvRect region, int64_t pts)
+{
+    int mx = region.width*CLASSIFY_MARGIN;
+    int my = region.height*CLASSIFY_MARGIN;
+    int x0 = region.x - mx < 0 ? 0 : region.x - mx;
+    int y0 = region.y - my < 0 ? 0 : region.y - my;
+    int x1 = region.x + region.width + mx;
+    int y1 = region.y + region.height + my;
+    double scale = 1.0;
+    uint32_t labels;
+    CvRect r;
+
+    if (!cls->running || !slot->roi || slot->tries >= CLASSIFY_MAX_TRIES)
+        return 0;
+    vcos_mutex_lock(&cls->lock);
+    labels = slot->labels;
+    vcos_mutex_unlock(&cls->lock);
+    if (labels == (1u << cls->numCascades) - 1)
+        return 0;  // Every label has matched, nothing more to learn
+    if (slot->busy) {
+        __sync_fetch_and_add(&cls->dropped, 1);
+        return -1;
+    }
+    if (x1 > frame->width)
+        x1 = frame->width;
+    if (y1 > frame->height)
+        y1 = frame->height;
+    if (x1 - x0 < 8 || y1 - y0 < 8)
+        return 0;
+    r = cvRect(x0, y0, x1 - x0, y1 - y0);
+    if (r.width > CLASSIFY_WIDTH)
+        scale = (double)CLASSIFY_WIDTH/r.width;
+    if (r.height*scale > CLASSIFY_HEIGHT)
+        scale = (double)CLASSIFY_HEIGHT/r.height;
+    cvSetImageROI(frame, r);
+    cvSetImageROI(slot->roi, cvRect(0, 0, r.width*scale, r.height*scale));
+    if (scale < 1.0)
+        cvResize(frame, slot->roi, CV_INTER_AREA);
+    else
+        cvCopy(frame, slot->roi, NULL);
+    cvResetImageROI(frame);
+    slot->tries++;
+    slot->pts = pts;
+    slot->queued = report_now_us();
+    slot->clip = slot->current;
+    slot->busy = 1;
+    vcos_mutex_lock(&cls->lock);
+    cls->queue[(cls->queueHead + cls->queueLen) % CLASSIFY_MAX_QUEUE] = slot;
+    cls->queueLen++;
+    vcos_mutex_unlock(&cls->lock);
+    vcos_semaphore_post(&cls->ready);
+    return 1;
+}
+
+/**
+ * Wait for the thread to finish the stream's last region, if it has not,
+ * so the verdict that follows counts it. Takes up to one run of the
+ * cascades.
+ */
+void classify_wait(CLASSIFY_T *cls, CLASSIFY_SLOT_T *slot)
+{
+    int waiting;
+
+    if (!cls->running)
+        return;
+    vcos_mutex_lock(&cls->lock);
+    slot->waiting = slot->busy;
+    waiting = slot->waiting;
+    vcos_mutex_unlock(&cls->lock);
+    if (waiting)
+        vcos_semaphore_wait(&slot->done);
+}
+
+/**
+ * @param labels Receives the cascades matched in the current clip, bit per
+ *               cascade
+ * @return Regions of the current clip classified so far; 0 means there is
+ *         no verdict
+ */
+int classify_verdict(CLASSIFY_T *cls, CLASSIFY_SLOT_T *slot, uint32_t *labels)
+{
+    int runs;
+
+    vcos_mutex_lock(&cls->lock);
+    *labels = slot->labels;
+    runs = slot->runs;
+    vcos_mutex_unlock(&cls->lock);
+    return runs;
+}
+
+/**
+ * Space separated labels of the cascades in a set, or "none"
+ */
+void classify_labels(const CLASSIFY_T *cls, uint32_t labels, char *text, int len)
+{
+    int pos = 0;
+    int i;
+
+    text[0] = '\0';
+    for (i = 0; i < cls->numCascades && pos < len; i++) {
+        if (labels & (1 << i))
+            pos += snprintf(text + pos, len - pos, "%s%s", pos ? " " : "", cls->cascades[i].label);
+    }
+    if (!pos)
+        snprintf(text, len, "none");
+}
+
+/**
+ * Name of a clip's verdict sidecar, the clip's name with CLASSIFY_TAGS_EXT
+ * in place of its extension
+ */
+void classify_tags_path(const char *clip, char *path, int len)
+{
+    const char *ext = strrchr(clip, '.');
+    const char *slash = strrchr(clip, '/');
+    int stem = (ext && (!slash || ext > slash)) ? (int)(ext - clip) : (int)strlen(clip);
+
+    snprintf(path, len, "%.*s%s", stem, clip, CLASSIFY_TAGS_EXT);
+}
+
+/**
+ * @return 0 if successful, -1 otherwise
+ */
+int classify_write_tags(const char *path, const char *text)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    fprintf(fp, "%s\n", text);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/**
+ * @return 1 if the sidecar has labels, 0 if it says "none", -1 if there is
+ *         no sidecar
+ */
+int classify_read_tags(const char *path)
+{
+    char text[80];
+    FILE *fp = fopen(path, "r");
+    int matched;
+
+    if (!fp)
+        return -1;
+    matched = fgets(text, sizeof(text), fp) ? strncmp(text, "none", 4) != 0 : -1;
+    fclose(fp);
+    return matched;
+}
+
+void classify_dump(CLASSIFY_T *cls, FILE *fp)
+{
+    double runs = cls->runs ? cls->runs : 1;
+    int i;
+
+    fprintf(fp, "%8s %8s %8s %10s %10s %10s %10s\n", "regions", "matched", "dropped", "wait(ms)", "run(ms)",
+            "max(ms)", "last(ms)");
+    fprintf(fp, "%8u %8u %8u %10.1f %10.1f %10.1f %10.1f\n", cls->runs, cls->matched, cls->dropped,
+            cls->waitTotal/runs/1000.0, cls->runTotal/runs/1000.0, cls->runMax/1000.0, cls->runLast/1000.0);
+    fprintf(fp, "\n%-16s %8s %8s  %s\n", "label", "runs", "matches", "cascade");
+    for (i = 0; i < cls->numCascades; i++) {
+        const CLASSIFY_CASCADE_T *c = &cls->cascades[i];
+        fprintf(fp, "%-16s %8u %8u  %s\n", c->label, c->runs, c->matches, c->path);
+    }
+}
+
+static void dump_report(void *ctx, FILE *fp)
+{
+    classify_dump((CLASSIFY_T *) ctx, fp);
+}
+
+void classify_write_report(CLASSIFY_T *cls)
+{
+    report_write(CLASSIFY_REPORT_FILE, dump_report, cls);
+}
@@ -0,0 +1,112 @@
+/*
+ * File:   classify.h
+ *
+ * Second stage object classifier for motion events. Only frames that
+ * passed the pixel detector are classified, and only the motion region
+ * of them: the analysis worker copies the region out of the full
+ * resolution luma plane, at most CLASSIFY_WIDTH x CLASSIFY_HEIGHT, and
+ * one background thread shared by all streams runs every configured Haar
+ * cascade over it, so motion decisions never wait for a verdict. A
+ * region due while the stream's last one is still queued is dropped.
+ *
+ * Each cascade has a label, such as "person" or "vehicle"; a clip's
+ * verdict is the set of labels matched in any region classified while it
+ * was recorded, up to CLASSIFY_MAX_TRIES regions a clip. Per-cascade runs
+ * and matches, and the queueing and run time of each invocation, are
+ * written to CLASSIFY_REPORT_FILE.
+ *
+ * The verdict is stored next to the clip as <clip>.tags, one line of
+ * space separated labels, or "none" when regions were classified and
+ * nothing matched; no sidecar means the clip was never classified.
+ */
+
+#ifndef CLASSIFY_H_
+#define CLASSIFY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/objdetect/objdetect.hpp>
+
+#include "interface/vcos/vcos.h"
+
+#include "arena.h"
+
+#define CLASSIFY_REPORT_FILE    "/tmp/snoop_classify.txt"
+#define CLASSIFY_TAGS_EXT       ".tags"
+#define CLASSIFY_MAX_CASCADES   4
+#define CLASSIFY_MAX_QUEUE      8       // Regions waiting, one per stream at most
+#define CLASSIFY_WIDTH          320     // Largest region handed over, bigger ones are scaled down
+#define CLASSIFY_HEIGHT         320
+#define CLASSIFY_MARGIN         0.25    // Added on each side of the motion box, as a fraction of its size
+#define CLASSIFY_MAX_TRIES      4       // Regions classified per clip before the verdict stands
+#define CLASSIFY_SCALE_FACTOR   1.1
+#define CLASSIFY_MIN_NEIGHBORS  3
+
+/// Frame arena bytes a stream's classifier slot takes
+#define CLASSIFY_ARENA_BYTES ARENA_BYTES((size_t)CLASSIFY_WIDTH*CLASSIFY_HEIGHT)
+
+typedef struct {
+    char                     label[16];
+    const char              *path;
+    CvHaarClassifierCascade *cascade;
+    uint32_t                 runs;
+    uint32_t                 matches;
+} CLASSIFY_CASCADE_T;
+
+typedef struct {
+    int            stream;
+    IplImage      *roi;         /// Region awaiting classification, in its ROI
+    int64_t        pts;
+    int64_t        queued;      /// usec, when the region was handed over
+    uint32_t       clip;        /// Clip the region belongs to
+    volatile int   busy;        /// roi holds a region the thread has not classified yet
+    uint32_t       tries;       /// Regions handed over in the current clip, analysis thread only
+    uint32_t       current;     /// Clip being recorded; this and below under the lock
+    uint32_t       labels;      /// Cascades matched in the current clip, bit per cascade
+    uint32_t       runs;        /// Regions classified in the current clip
+    int            waiting;     /// classify_wait() is blocked on done
+    VCOS_SEMAPHORE_T done;
+} CLASSIFY_SLOT_T;
+
+typedef struct {
+    CLASSIFY_CASCADE_T cascades[CLASSIFY_MAX_CASCADES];
+    int                numCascades;
+    CvMemStorage      *storage;
+    VCOS_MUTEX_T       lock;
+    VCOS_SEMAPHORE_T   ready;
+    VCOS_THREAD_T      thread;
+    volatile int       running;
+    CLASSIFY_SLOT_T   *queue[CLASSIFY_MAX_QUEUE];
+    int                queueHead;
+    int                queueLen;
+    uint32_t           runs;        /// Classifier thread only from here on, apart from dropped
+    uint32_t           matched;     /// Regions with at least one match
+    volatile uint32_t  dropped;     /// Regions due while the stream's last was queued
+    int64_t            waitTotal;   /// usec from hand over to the start of the run
+    int64_t            runTotal;    /// usec running the cascades
+    int64_t            runMax;
+    int64_t            runLast;
+} CLASSIFY_T;
+
+void classify_init(CLASSIFY_T *cls);
+int  classify_add_cascade(CLASSIFY_T *cls, const char *spec);
+int  classify_open(CLASSIFY_T *cls);
+void classify_close(CLASSIFY_T *cls);
+int  classify_add_stream(CLASSIFY_T *cls, CLASSIFY_SLOT_T *slot, int stream, ARENA_T *arena);
+
+void classify_begin_clip(CLASSIFY_T *cls, CLASSIFY_SLOT_T *slot);
+int  classify_region(CLASSIFY_T *cls, CLASSIFY_SLOT_T *slot, IplImage *frame, CvRect region, int64_t pts);
+void classify_wait(CLASSIFY_T *cls, CLASSIFY_SLOT_T *slot);
+int  classify_verdict(CLASSIFY_T *cls, CLASSIFY_SLOT_T *slot, uint32_t *labels);
+void classify_labels(const CLASSIFY_T *cls, uint32_t labels, char *text, int len);
+
+void classify_tags_path(const char *clip, char *path, int len);
+int  classify_write_tags(const char *path, const char *text);
+int  classify_read_tags(const char *path);
+
+void classify_dump(CLASSIFY_T *cls, FILE *fp);
+void classify_write_report(CLASSIFY_T *cls);
+
+#endif /* CLASSIFY_H_ */
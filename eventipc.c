@@ -0,0 +1,433 @@
+/*
+ * File:   eventipc.c
+ *
+ * Producers append records to a bounded queue and never block. A single
+ * IPC thread moves whatever has accumulated to every client in one write
+ * (batching), reads commands, and hands them to the command callback as
+ * soon as they arrive. A client that stops reading has its backlog capped
+ * at EVENTIPC_CLIENT_BYTES; records it misses are counted and reported to
+ * it in an EV_OVERRUN record once it catches up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "eventipc.h"
+
+#define HDR_SIZE ((int)sizeof(EVENTIPC_HDR_T))
+
+struct EVENTIPC_CLIENT_T {
+    int           fd;
+    unsigned char out[EVENTIPC_CLIENT_BYTES];
+    int           outLen;
+    unsigned char in[HDR_SIZE + EVENTIPC_MAX_RECORD];
+    int           inLen;
+    uint32_t      seq;
+    uint32_t      dropped;
+};
+
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static void fill_header(EVENTIPC_HDR_T *hdr, int type, uint32_t len, uint32_t seq)
+{
+    hdr->magic = EVENTIPC_MAGIC;
+    hdr->version = EVENTIPC_VERSION;
+    hdr->type = type;
+    hdr->length = len;
+    hdr->seq = seq;
+}
+
+/**
+ * Append one record to a client's backlog
+ *
+ * @return 0 if queued, -1 if the client has no room for it
+ */
+static int client_append(EVENTIPC_CLIENT_T *client, int type, const void *payload, uint32_t len)
+{
+    EVENTIPC_HDR_T hdr;
+
+    if (client->outLen + HDR_SIZE + (int)len > EVENTIPC_CLIENT_BYTES)
+        return -1;
+    fill_header(&hdr, type, len, client->seq++);
+    memcpy(client->out + client->outLen, &hdr, HDR_SIZE);
+    memcpy(client->out + client->outLen + HDR_SIZE, payload, len);
+    client->outLen += HDR_SIZE + len;
+    return 0;
+}
+
+/**
+ * Queue a record for a client, preceded by an EV_OVERRUN if it has missed
+ * any since the last one that fitted.
+ */
+static void client_deliver(EVENTIPC_CLIENT_T *client, int type, const void *payload, uint32_t len)
+{
+    if (client->dropped) {
+        if (client->outLen + 2*HDR_SIZE + (int)sizeof(uint32_t) + (int)len > EVENTIPC_CLIENT_BYTES) {
+            client->dropped++;
+            return;
+        }
+        client_append(client, EV_OVERRUN, &client->dropped, sizeof(uint32_t));
+        client->dropped = 0;
+    }
+    if (client_append(client, type, payload, len) != 0)
+        client->dropped++;
+}
+
+static void client_free(EVENTIPC_T *ipc, int i)
+{
+    close(ipc->clients[i]->fd);
+    free(ipc->clients[i]);
+    ipc->clients[i] = NULL;
+}
+
+/**
+ * Write as much of a client's backlog as the socket will take
+ *
+ * @return 0 if the client is still usable, -1 if it has gone away
+ */
+static int client_flush(EVENTIPC_CLIENT_T *client)
+{
+    while (client->outLen > 0) {
+        ssize_t n = send(client->fd, client->out, client->outLen, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        memmove(client->out, client->out + n, client->outLen - n);
+        client->outLen -= n;
+    }
+    return 0;
+}
+
+/**
+ * Read from a client and dispatch every complete command record
+ *
+ * @return 0 if the client is still usable, -1 if it has gone away
+ */
+static int client_read(EVENTIPC_T *ipc, EVENTIPC_CLIENT_T *client)
+{
+    ssize_t n = recv(client->fd, client->in + client->inLen, sizeof(client->in) - client->inLen, 0);
+
+    if (n == 0)
+        return -1;
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    client->inLen += n;
+
+    while (client->inLen >= HDR_SIZE) {
+        EVENTIPC_HDR_T hdr;
+        int recLen;
+
+        memcpy(&hdr, client->in, HDR_SIZE);
+        if (hdr.magic != EVENTIPC_MAGIC || hdr.length > EVENTIPC_MAX_RECORD) {
+            fprintf(stderr, "eventipc: bad record from client, dropping it\n");
+            return -1;
+        }
+        recLen = HDR_SIZE + hdr.length;
+        if (client->inLen < recLen)
+            break;
+        if (ipc->command_cb)
+            ipc->command_cb(ipc->command_ctx, hdr.type, client->in + HDR_SIZE, hdr.length);
+        memmove(client->in, client->in + recLen, client->inLen - recLen);
+        client->inLen -= recLen;
+    }
+    return 0;
+}
+
+static void accept_client(EVENTIPC_T *ipc)
+{
+    int fd = accept(ipc->listenFd, NULL, NULL);
+    uint32_t pid = getpid();
+    int i;
+
+    if (fd < 0)
+        return;
+    for (i = 0; i < EVENTIPC_MAX_CLIENTS; i++) {
+        if (!ipc->clients[i])
+            break;
+    }
+    if (i == EVENTIPC_MAX_CLIENTS) {
+        fprintf(stderr, "eventipc: too many clients\n");
+        close(fd);
+        return;
+    }
+    ipc->clients[i] = calloc(1, sizeof(EVENTIPC_CLIENT_T));
+    if (!ipc->clients[i]) {
+        close(fd);
+        return;
+    }
+    set_nonblocking(fd);
+    ipc->clients[i]->fd = fd;
+    client_append(ipc->clients[i], EV_HELLO, &pid, sizeof(pid));
+}
+
+/**
+ * Move every queued record to every client. The queue is swapped out
+ * under the lock so producers are held up only for a memcpy.
+ */
+static void fan_out(EVENTIPC_T *ipc, unsigned char *batch)
+{
+    int len, off, i;
+
+    vcos_mutex_lock(&ipc->lock);
+    len = ipc->queueLen;
+    memcpy(batch, ipc->queue, len);
+    ipc->queueLen = 0;
+    vcos_mutex_unlock(&ipc->lock);
+
+    for (off = 0; off < len; ) {
+        EVENTIPC_HDR_T hdr;
+        memcpy(&hdr, batch + off, HDR_SIZE);
+        for (i = 0; i < EVENTIPC_MAX_CLIENTS; i++) {
+            if (ipc->clients[i])
+                client_deliver(ipc->clients[i], hdr.type, batch + off + HDR_SIZE, hdr.length);
+        }
+        off += HDR_SIZE + hdr.length;
+    }
+}
+
+/**
+ * Let the idle callback queue more once everything queued so far has been
+ * written to every client, so a long run of records is paced by the
+ * slowest reader instead of overflowing the queue or a client's backlog
+ */
+static void run_idle(EVENTIPC_T *ipc)
+{
+    EVENTIPC_IDLE_CB cb;
+    void *ctx;
+    int i;
+
+    for (i = 0; i < EVENTIPC_MAX_CLIENTS; i++) {
+        if (ipc->clients[i] && ipc->clients[i]->outLen)
+            return;
+    }
+    vcos_mutex_lock(&ipc->lock);
+    cb = ipc->queueLen ? NULL : ipc->idle_cb;
+    ctx = ipc->idle_ctx;
+    vcos_mutex_unlock(&ipc->lock);
+    if (cb)
+        cb(ctx);
+}
+
+static void *eventipc_thread(void *arg)
+{
+    EVENTIPC_T *ipc = (EVENTIPC_T *) arg;
+    unsigned char *batch = malloc(EVENTIPC_QUEUE_BYTES);
+    struct pollfd fds[2 + EVENTIPC_MAX_CLIENTS];
+    int slot[EVENTIPC_MAX_CLIENTS];
+
+    while (ipc->running) {
+        int nfds = 2;
+        int i;
+
+        fds[0].fd = ipc->listenFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = ipc->wakeFd[0];
+        fds[1].events = POLLIN;
+        for (i = 0; i < EVENTIPC_MAX_CLIENTS; i++) {
+            if (ipc->clients[i]) {
+                fds[nfds].fd = ipc->clients[i]->fd;
+                fds[nfds].events = POLLIN | (ipc->clients[i]->outLen ? POLLOUT : 0);
+                slot[nfds-2] = i;
+                nfds++;
+            }
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("eventipc poll");
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(ipc->wakeFd[0], drain, sizeof(drain)) > 0)
+                ;
+            fan_out(ipc, batch);
+        }
+        for (i = 2; i < nfds; i++) {
+            int c = slot[i-2];
+            EVENTIPC_CLIENT_T *client = ipc->clients[c];
+            int gone = 0;
+
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                gone = client_read(ipc, client);
+            if (!gone && client->outLen)
+                gone = client_flush(client);
+            if (gone)
+                client_free(ipc, c);
+        }
+        if (fds[0].revents & POLLIN)
+            accept_client(ipc);
+        run_idle(ipc);
+    }
+    free(batch);
+    return NULL;
+}
+
+/**
+ * Create the listening socket and start the IPC thread
+ *
+ * @param path Socket path, replaced if it already exists
+ * @param cb   Called on the IPC thread for every command record received
+ * @return 0 if successful, -1 otherwise
+ */
+int eventipc_open(EVENTIPC_T *ipc, const char *path, EVENTIPC_COMMAND_CB cb, void *ctx)
+{
+    struct sockaddr_un addr;
+
+    memset(ipc, 0, sizeof(*ipc));
+    ipc->command_cb = cb;
+    ipc->command_ctx = ctx;
+
+    ipc->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ipc->listenFd < 0) {
+        perror("eventipc socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    if (bind(ipc->listenFd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(ipc->listenFd, EVENTIPC_MAX_CLIENTS) < 0) {
+        perror("eventipc bind");
+        close(ipc->listenFd);
+        return -1;
+    }
+    set_nonblocking(ipc->listenFd);
+
+    if (pipe(ipc->wakeFd) < 0) {
+        perror("eventipc pipe");
+        close(ipc->listenFd);
+        return -1;
+    }
+    set_nonblocking(ipc->wakeFd[0]);
+    set_nonblocking(ipc->wakeFd[1]);
+
+    vcos_mutex_create(&ipc->lock, "snoop_eventipc-lock");
+    ipc->running = 1;
+    if (vcos_thread_create(&ipc->thread, "snoop_eventipc", NULL, eventipc_thread, ipc) != VCOS_SUCCESS) {
+        fprintf(stderr, "eventipc: unable to start thread\n");
+        ipc->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void eventipc_close(EVENTIPC_T *ipc)
+{
+    int i;
+
+    if (!ipc->running)
+        return;
+    ipc->running = 0;
+    if (write(ipc->wakeFd[1], "", 1) < 0)
+        perror("eventipc wake");
+    vcos_thread_join(&ipc->thread, NULL);
+    for (i = 0; i < EVENTIPC_MAX_CLIENTS; i++) {
+        if (ipc->clients[i]) {
+            client_flush(ipc->clients[i]);
+            client_free(ipc, i);
+        }
+    }
+    close(ipc->listenFd);
+    close(ipc->wakeFd[0]);
+    close(ipc->wakeFd[1]);
+    vcos_mutex_delete(&ipc->lock);
+}
+
+/**
+ * Set a callback run on the IPC thread whenever the queue and every
+ * client's backlog are empty, for a producer with more to send than fits
+ * at once. It may publish.
+ */
+void eventipc_set_idle(EVENTIPC_T *ipc, EVENTIPC_IDLE_CB cb, void *ctx)
+{
+    vcos_mutex_lock(&ipc->lock);
+    ipc->idle_cb = cb;
+    ipc->idle_ctx = ctx;
+    vcos_mutex_unlock(&ipc->lock);
+}
+
+/**
+ * Queue a record for all clients. Never blocks: if the IPC thread has
+ * fallen behind and the queue is full, the record is refused.
+ *
+ * @return 0 if queued, -1 if refused
+ */
+int eventipc_publish(EVENTIPC_T *ipc, int type, const void *payload, uint32_t len)
+{
+    EVENTIPC_HDR_T hdr;
+    int wake;
+
+    vcos_mutex_lock(&ipc->lock);
+    if (ipc->queueLen + HDR_SIZE + (int)len > EVENTIPC_QUEUE_BYTES) {
+        ipc->rejected++;
+        vcos_mutex_unlock(&ipc->lock);
+        return -1;
+    }
+    fill_header(&hdr, type, len, ipc->seq++);
+    memcpy(ipc->queue + ipc->queueLen, &hdr, HDR_SIZE);
+    memcpy(ipc->queue + ipc->queueLen + HDR_SIZE, payload, len);
+    wake = (ipc->queueLen == 0);
+    ipc->queueLen += HDR_SIZE + len;
+    vcos_mutex_unlock(&ipc->lock);
+
+    // One wakeup per batch; the IPC thread takes everything queued since
+    if (wake && write(ipc->wakeFd[1], "", 1) < 0 && errno != EAGAIN)
+        perror("eventipc wake");
+    return 0;
+}
+
+/**
+ * Publish an EV_CLIP record
+ *
+ * @param clip    Fixed part; path_len and num_samples must be filled in
+ * @param samples clip->num_samples motion samples
+ */
+int eventipc_publish_clip(EVENTIPC_T *ipc, const char *path, const EVENTIPC_CLIP_T *clip,
+                          const EVENTIPC_SAMPLE_T *samples)
+{
+    unsigned char rec[EVENTIPC_MAX_RECORD];
+    uint32_t len = sizeof(*clip) + clip->path_len + clip->num_samples*sizeof(*samples);
+
+    if (len > sizeof(rec)) {
+        fprintf(stderr, "eventipc: clip record too large (%u)\n", len);
+        return -1;
+    }
+    memcpy(rec, clip, sizeof(*clip));
+    memcpy(rec + sizeof(*clip), path, clip->path_len);
+    memcpy(rec + sizeof(*clip) + clip->path_len, samples, clip->num_samples*sizeof(*samples));
+    return eventipc_publish(ipc, EV_CLIP, rec, len);
+}
+
+/**
+ * Publish an EV_SNAPSHOT record
+ *
+ * @param snap Fixed part; path_len must be filled in
+ */
+int eventipc_publish_snapshot(EVENTIPC_T *ipc, const char *path, const EVENTIPC_SNAPSHOT_T *snap)
+{
+    unsigned char rec[sizeof(*snap) + 256];
+    uint32_t len = sizeof(*snap) + snap->path_len;
+
+    if (len > sizeof(rec))
+        return -1;
+    memcpy(rec, snap, sizeof(*snap));
+    memcpy(rec + sizeof(*snap), path, snap->path_len);
+    return eventipc_publish(ipc, EV_SNAPSHOT, rec, len);
+}
@@ -0,0 +1,118 @@
+/*
+ * File:   eventipc.h
+ *
+ * Binary event channel between snoopmon and its consumers (snoop.py,
+ * diagnostics tools) over a Unix domain socket.
+ *
+ * Every record is an EVENTIPC_HDR_T followed by `length` payload bytes,
+ * little-endian. Records from snoopmon are fanned out to every connected
+ * client; records sent by a client are commands. Unknown record types
+ * and newer versions can be skipped using `length`.
+ */
+
+#ifndef EVENTIPC_H_
+#define EVENTIPC_H_
+
+#include <stdint.h>
+
+#include "interface/vcos/vcos.h"
+
+#define EVENTIPC_SOCKET       "/tmp/snoopmon.sock"
+#define EVENTIPC_MAGIC        0x504f4e53  // "SNOP"
+#define EVENTIPC_VERSION      2
+#define EVENTIPC_MAX_CLIENTS  8
+#define EVENTIPC_QUEUE_BYTES  (64*1024)   // Records waiting for the IPC thread
+#define EVENTIPC_CLIENT_BYTES (64*1024)   // Unsent backlog allowed per client
+#define EVENTIPC_MAX_RECORD   4096        // Largest accepted command record
+
+// Records from snoopmon
+#define EV_HELLO      1   /// uint32 pid, sent to each new client
+#define EV_CLIP       2   /// EVENTIPC_CLIP_T, path, samples
+#define EV_OVERRUN    3   /// uint32 records this client missed
+#define EV_SNAPSHOT   4   /// EVENTIPC_SNAPSHOT_T, path of the trigger-time JPEG
+
+// Records to snoopmon
+#define CMD_EXIT      64  /// no payload
+#define CMD_UPLOADED  65  /// int64 wall clock usec, then clip path
+#define CMD_CLIP_STATE 66 /// uint32 spool state, then clip path
+#define CMD_RESYNC    67  /// no payload; republish every clip not yet uploaded
+#define CMD_UPLINK    68  /// uint32 bytes uploaded, uint32 usec uploads were running, all of them together
+#define CMD_CAMERA    69  /// uint32 stream, then NUL-separated raspivid style options, e.g. "-ex\0night\0"
+
+// EVENTIPC_CLIP_T flags
+#define EV_CLIP_FLAG_RECOVERED 1  /// Republished from the spool, stats are not known
+#define EV_CLIP_FLAG_CROPPED   2  /// Recorded through a motion-following crop; sample boxes are uncropped
+#define EV_CLIP_FLAG_LORES     4  /// Low resolution companion clip, upload first
+#define EV_CLIP_FLAG_DEFERRED  8  /// Full resolution clip with a companion; upload on request or when idle
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint32_t length;      /// Payload bytes following the header
+    uint32_t seq;         /// Per-sender record sequence number
+} EVENTIPC_HDR_T;
+
+typedef struct {
+    uint16_t x, y, w, h;  /// Analysis-resolution pixels
+} EVENTIPC_BOX_T;
+
+typedef struct {
+    uint32_t score;       /// Changed pixel count
+    EVENTIPC_BOX_T box;   /// Bounding box of the changed pixels
+} EVENTIPC_SAMPLE_T;
+
+typedef struct {
+    int64_t  start_pts;       /// pts of the first frame sent to the encoder
+    int64_t  end_pts;         /// pts of the last frame sent to the encoder
+    uint32_t frames;          /// Frames sent to the encoder
+    uint32_t encoder_drops;   /// Frames with no encoder input buffer
+    uint32_t analysis_skips;  /// Frames not analysed because analysis was busy
+    uint16_t path_len;        /// Path bytes following this struct
+    uint16_t num_samples;     /// EVENTIPC_SAMPLE_T following the path
+    uint32_t stream;          /// Stream the clip came from
+    uint32_t flags;           /// EV_CLIP_FLAG_*
+} EVENTIPC_CLIP_T;
+
+typedef struct {
+    int64_t  pts;             /// pts of the triggering frame
+    uint32_t stream;          /// Stream the trigger came from
+    uint32_t score;           /// Changed pixel count that triggered capture
+    EVENTIPC_BOX_T box;       /// Bounding box of the changed pixels
+    uint16_t path_len;        /// Path bytes following this struct
+    uint16_t reserved;
+    uint32_t size;            /// JPEG bytes
+} EVENTIPC_SNAPSHOT_T;
+
+typedef void (*EVENTIPC_COMMAND_CB)(void *ctx, int type, const unsigned char *payload, uint32_t len);
+typedef void (*EVENTIPC_IDLE_CB)(void *ctx);
+
+typedef struct EVENTIPC_CLIENT_T EVENTIPC_CLIENT_T;
+
+typedef struct {
+    int             listenFd;
+    int             wakeFd[2];
+    int             running;
+    VCOS_THREAD_T   thread;
+    VCOS_MUTEX_T    lock;
+    unsigned char   queue[EVENTIPC_QUEUE_BYTES];
+    int             queueLen;
+    uint32_t        seq;
+    uint32_t        rejected;     /// Records refused because the queue was full
+    EVENTIPC_CLIENT_T *clients[EVENTIPC_MAX_CLIENTS];
+    EVENTIPC_COMMAND_CB command_cb;
+    void           *command_ctx;
+    EVENTIPC_IDLE_CB idle_cb;     /// Under the lock
+    void           *idle_ctx;
+} EVENTIPC_T;
+
+int  eventipc_open(EVENTIPC_T *ipc, const char *path, EVENTIPC_COMMAND_CB cb, void *ctx);
+void eventipc_close(EVENTIPC_T *ipc);
+void eventipc_set_idle(EVENTIPC_T *ipc, EVENTIPC_IDLE_CB cb, void *ctx);
+
+int  eventipc_publish(EVENTIPC_T *ipc, int type, const void *payload, uint32_t len);
+int  eventipc_publish_clip(EVENTIPC_T *ipc, const char *path, const EVENTIPC_CLIP_T *clip,
+                           const EVENTIPC_SAMPLE_T *samples);
+int  eventipc_publish_snapshot(EVENTIPC_T *ipc, const char *path, const EVENTIPC_SNAPSHOT_T *snap);
+
+#endif /* EVENTIPC_H_ */
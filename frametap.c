@@ -0,0 +1,186 @@
+/*
+ * File:   frametap.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frametap.h"
+
+#define FRAMETAP_DATA_OFFSET 64     // Header rounded up to a cache line
+
+/**
+ * Create, or take over, a stream's segment and map it for publishing
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int frametap_create(FRAMETAP_T *tap, int stream, int width, int height)
+{
+    void *base;
+
+    memset(tap, 0, sizeof(*tap));
+    snprintf(tap->name, sizeof(tap->name), FRAMETAP_NAME, stream);
+    tap->writer = 1;
+    tap->size = FRAMETAP_DATA_OFFSET + 2*(size_t)width*height;
+    tap->fd = shm_open(tap->name, O_RDWR | O_CREAT, 0644);
+    if (tap->fd < 0) {
+        perror(tap->name);
+        return -1;
+    }
+    if (ftruncate(tap->fd, tap->size) != 0) {
+        perror(tap->name);
+        close(tap->fd);
+        return -1;
+    }
+    base = mmap(NULL, tap->size, PROT_READ | PROT_WRITE, MAP_SHARED, tap->fd, 0);
+    if (base == MAP_FAILED) {
+        perror(tap->name);
+        close(tap->fd);
+        return -1;
+    }
+    tap->hdr = (FRAMETAP_HDR_T *) base;
+    tap->image = (unsigned char *) base + FRAMETAP_DATA_OFFSET;
+    tap->mask = tap->image + (size_t)width*height;
+    memset(base, 0, tap->size);
+    tap->hdr->version = FRAMETAP_VERSION;
+    tap->hdr->stream = stream;
+    tap->hdr->width = width;
+    tap->hdr->height = height;
+    tap->hdr->dataOffset = FRAMETAP_DATA_OFFSET;
+    __sync_synchronize();  // Layout before the magic that tells readers it is valid
+    tap->hdr->magic = FRAMETAP_MAGIC;
+    return 0;
+}
+
+/**
+ * Start writing a frame; the detector may write tap->mask until
+ * frametap_end()
+ */
+void frametap_begin(FRAMETAP_T *tap)
+{
+    tap->hdr->seq++;
+    __sync_synchronize();
+}
+
+/**
+ * Copy in the frame the mask was made from and publish both
+ */
+void frametap_end(FRAMETAP_T *tap, const unsigned char *image, int64_t pts, int score,
+                  int x, int y, int w, int h)
+{
+    FRAMETAP_HDR_T *hdr = tap->hdr;
+
+    memcpy(tap->image, image, (size_t)hdr->width*hdr->height);
+    hdr->pts = pts;
+    hdr->score = score;
+    hdr->box.x = x;
+    hdr->box.y = y;
+    hdr->box.w = w;
+    hdr->box.h = h;
+    hdr->frames++;
+    hdr->checks++;
+    __sync_synchronize();
+    hdr->seq++;
+}
+
+/**
+ * Count a check that published no frame
+ */
+void frametap_checked(FRAMETAP_T *tap)
+{
+    tap->hdr->checks++;
+}
+
+/**
+ * Map a stream's segment read-only
+ *
+ * @return 0 if successful, -1 if it does not exist or is not a tap
+ */
+int frametap_open(FRAMETAP_T *tap, int stream)
+{
+    struct stat st;
+    void *base;
+
+    memset(tap, 0, sizeof(*tap));
+    snprintf(tap->name, sizeof(tap->name), FRAMETAP_NAME, stream);
+    tap->fd = shm_open(tap->name, O_RDONLY, 0);
+    if (tap->fd < 0)
+        return -1;
+    if (fstat(tap->fd, &st) != 0 || st.st_size < FRAMETAP_DATA_OFFSET) {
+        close(tap->fd);
+        return -1;
+    }
+    tap->size = st.st_size;
+    base = mmap(NULL, tap->size, PROT_READ, MAP_SHARED, tap->fd, 0);
+    if (base == MAP_FAILED) {
+        close(tap->fd);
+        return -1;
+    }
+    tap->hdr = (FRAMETAP_HDR_T *) base;
+    if (tap->hdr->magic != FRAMETAP_MAGIC || tap->hdr->version != FRAMETAP_VERSION ||
+        tap->hdr->dataOffset + 2*(size_t)tap->hdr->width*tap->hdr->height > tap->size) {
+        fprintf(stderr, "Error: %s is not a version %d frame tap\n", tap->name, FRAMETAP_VERSION);
+        frametap_close(tap);
+        return -1;
+    }
+    tap->image = (unsigned char *) base + tap->hdr->dataOffset;
+    tap->mask = tap->image + (size_t)tap->hdr->width*tap->hdr->height;
+    return 0;
+}
+
+/**
+ * Copy out the latest frame, if it is newer than lastFrame
+ *
+ * @param info  Receives the header of the frame copied
+ * @param image width*height bytes
+ * @param mask  width*height bytes, or NULL to skip the mask
+ * @return 1 if a frame was copied, 0 if there is none newer, -1 if the
+ *         writer kept overwriting it
+ */
+int frametap_read(FRAMETAP_T *tap, FRAMETAP_HDR_T *info, unsigned char *image, unsigned char *mask,
+                  uint32_t lastFrame)
+{
+    const FRAMETAP_HDR_T *hdr = tap->hdr;
+    size_t bytes = (size_t)hdr->width*hdr->height;
+    int i;
+
+    for (i = 0; i < FRAMETAP_READ_TRIES; i++) {
+        uint32_t seq = hdr->seq;
+
+        __sync_synchronize();
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        if (hdr->frames == lastFrame)
+            return 0;
+        memcpy(info, hdr, sizeof(*info));
+        memcpy(image, tap->image, bytes);
+        if (mask)
+            memcpy(mask, tap->mask, bytes);
+        __sync_synchronize();
+        if (hdr->seq == seq)
+            return 1;
+    }
+    return -1;
+}
+
+/**
+ * Unmap; the writer also removes the segment
+ */
+void frametap_close(FRAMETAP_T *tap)
+{
+    if (tap->hdr)
+        munmap(tap->hdr, tap->size);
+    if (tap->fd >= 0)
+        close(tap->fd);
+    if (tap->writer)
+        shm_unlink(tap->name);
+    tap->hdr = NULL;
+    tap->fd = -1;
+}
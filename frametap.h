@@ -0,0 +1,69 @@
+/*
+ * File:   frametap.h
+ *
+ * Live view of what the detector sees. Each stream publishes its latest
+ * analysis-resolution luma frame (image2) and motion mask into a POSIX
+ * shared memory segment, FRAMETAP_NAME with the stream number, which any
+ * number of local readers can map read-only.
+ *
+ * The segment is a FRAMETAP_HDR_T followed, at dataOffset, by the frame
+ * and then the mask, width*height bytes each. Publishing is a seqlock:
+ * seq is odd while a frame is being written, and a reader that copies a
+ * frame keeps it only if seq was even and unchanged across the copy. The
+ * writer never waits for readers, and readers make no syscalls.
+ *
+ * The mask is the detector's own output buffer, so a check only adds the
+ * copy of the frame. Checks the coarse gate keeps from full resolution
+ * analysis publish nothing but advance `checks`.
+ */
+
+#ifndef FRAMETAP_H_
+#define FRAMETAP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "eventipc.h"
+
+#define FRAMETAP_NAME    "/snoopmon_tap%d"
+#define FRAMETAP_MAGIC   0x50415453  // "STAP"
+#define FRAMETAP_VERSION 1
+#define FRAMETAP_READ_TRIES 100      // Torn copies a read retries before giving up
+
+typedef struct {
+    uint32_t          magic;
+    uint16_t          version;
+    uint16_t          stream;
+    uint16_t          width;
+    uint16_t          height;
+    uint32_t          dataOffset;   /// Frame, then mask
+    volatile uint32_t seq;          /// Odd while a frame is being written
+    volatile uint32_t checks;       /// Motion checks made, published or not
+    uint32_t          frames;       /// Frames published
+    uint32_t          score;        /// Changed pixel count of the published frame
+    EVENTIPC_BOX_T    box;          /// Bounding box of its mask
+    int64_t           pts;          /// pts of the frame it was scaled from
+} FRAMETAP_HDR_T;
+
+typedef struct {
+    char            name[32];
+    int             fd;
+    int             writer;
+    size_t          size;
+    FRAMETAP_HDR_T *hdr;
+    unsigned char  *image;
+    unsigned char  *mask;
+} FRAMETAP_T;
+
+int  frametap_create(FRAMETAP_T *tap, int stream, int width, int height);
+void frametap_begin(FRAMETAP_T *tap);
+void frametap_end(FRAMETAP_T *tap, const unsigned char *image, int64_t pts, int score,
+                  int x, int y, int w, int h);
+void frametap_checked(FRAMETAP_T *tap);
+
+int  frametap_open(FRAMETAP_T *tap, int stream);
+int  frametap_read(FRAMETAP_T *tap, FRAMETAP_HDR_T *info, unsigned char *image, unsigned char *mask,
+                   uint32_t lastFrame);
+void frametap_close(FRAMETAP_T *tap);
+
+#endif /* FRAMETAP_H_ */
@@ -0,0 +1,285 @@
+/*
+ * File:   heatmap.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "heatmap.h"
+
+#define HEATMAP_MAGIC "snoophm1"
+
+typedef struct {
+    char     magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t samples;
+    uint32_t decays;
+} HEATMAP_FILE_T;
+
+static void heatmap_path(HEATMAP_T *hm, const char *suffix, char *path, int len)
+{
+    snprintf(path, len, "%s/%d%s", hm->dir, hm->stream, suffix);
+}
+
+/**
+ * Write a file through a temporary name, so a crash leaves the old one
+ */
+static int write_file(const char *path, const void *head, size_t headLen, const void *data, size_t len)
+{
+    char tmpname[128];
+    FILE *fp;
+    int ok;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", path);
+    fp = fopen(tmpname, "wb");
+    if (!fp) {
+        perror(tmpname);
+        return -1;
+    }
+    ok = fwrite(head, 1, headLen, fp) == headLen && fwrite(data, 1, len, fp) == len;
+    if (fclose(fp) != 0 || !ok || rename(tmpname, path) != 0) {
+        perror(path);
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_pgm(HEATMAP_T *hm, const char *suffix, const unsigned char *mask)
+{
+    char path[128], head[32];
+
+    heatmap_path(hm, suffix, path, sizeof(path));
+    snprintf(head, sizeof(head), "P5\n%d %d\n255\n", hm->width, hm->height);
+    return write_file(path, head, strlen(head), mask, (size_t)hm->width*hm->height);
+}
+
+/**
+ * Read a mask written by write_pgm(), or edited by hand
+ *
+ * @return Pixels set, or -1 if there is no usable mask
+ */
+static int read_pgm(HEATMAP_T *hm, const char *suffix, unsigned char *mask)
+{
+    size_t size = (size_t)hm->width*hm->height;
+    char path[128];
+    int w, h, maxval;
+    int count = 0;
+    size_t i;
+    FILE *fp;
+
+    heatmap_path(hm, suffix, path, sizeof(path));
+    fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+    if (fscanf(fp, "P5 %d %d %d", &w, &h, &maxval) != 3 || fgetc(fp) == EOF ||
+        w != hm->width || h != hm->height || maxval != 255 || fread(mask, 1, size, fp) != size) {
+        fprintf(stderr, "Error: %s is not a %dx%d PGM, ignored\n", path, hm->width, hm->height);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    for (i = 0; i < size; i++) {
+        mask[i] = mask[i] ? 255 : 0;
+        count += mask[i] & 1;
+    }
+    return count;
+}
+
+static void save_counts(HEATMAP_T *hm)
+{
+    HEATMAP_FILE_T head;
+    char path[128];
+
+    memcpy(head.magic, HEATMAP_MAGIC, sizeof(head.magic));
+    head.width = hm->width;
+    head.height = hm->height;
+    head.samples = hm->samples;
+    head.decays = hm->decays;
+    heatmap_path(hm, ".heat", path, sizeof(path));
+    write_file(path, &head, sizeof(head), hm->count, (size_t)hm->width*hm->height*sizeof(uint16_t));
+}
+
+static void load_counts(HEATMAP_T *hm)
+{
+    size_t size = (size_t)hm->width*hm->height;
+    HEATMAP_FILE_T head;
+    char path[128];
+    FILE *fp;
+
+    heatmap_path(hm, ".heat", path, sizeof(path));
+    fp = fopen(path, "rb");
+    if (!fp)
+        return;
+    if (fread(&head, sizeof(head), 1, fp) != 1 || memcmp(head.magic, HEATMAP_MAGIC, sizeof(head.magic)) != 0 ||
+        head.width != (uint32_t)hm->width || head.height != (uint32_t)hm->height ||
+        fread(hm->count, sizeof(uint16_t), size, fp) != size) {
+        fprintf(stderr, "Error: %s does not match, activity starts again\n", path);
+        memset(hm->count, 0, size*sizeof(uint16_t));
+    } else {
+        hm->samples = head.samples;
+        hm->decays = head.decays;
+    }
+    fclose(fp);
+}
+
+/**
+ * Mark the coarse pixels whose whole area is excluded, so the gate only
+ * ignores changes the full check would
+ */
+static void build_coarse(HEATMAP_T *hm)
+{
+    int cx, cy, x, y;
+
+    for (cy = 0; cy < hm->coarseHeight; cy++) {
+        int y0 = cy*hm->height/hm->coarseHeight;
+        int y1 = (cy+1)*hm->height/hm->coarseHeight;
+        for (cx = 0; cx < hm->coarseWidth; cx++) {
+            int x0 = cx*hm->width/hm->coarseWidth;
+            int x1 = (cx+1)*hm->width/hm->coarseWidth;
+            unsigned char all = 255;
+            for (y = y0; y < y1 && all; y++)
+                for (x = x0; x < x1 && all; x++)
+                    all = hm->exclude[y*hm->width+x];
+            hm->coarseExclude[cy*hm->coarseWidth+cx] = all;
+        }
+    }
+}
+
+/**
+ * Build a mask from the counters, with hysteresis against the one in
+ * use, and propose or apply it
+ */
+static void build_mask(HEATMAP_T *hm)
+{
+    int size = hm->width*hm->height;
+    int on = HEATMAP_FULL*HEATMAP_EXCLUDE_PERCENT/100;
+    int off = HEATMAP_FULL*HEATMAP_RELEASE_PERCENT/100;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        int c = hm->count[i];
+        hm->mask[i] = (c >= on || (hm->exclude[i] && c >= off)) ? 255 : 0;
+        count += hm->mask[i] & 1;
+    }
+    if (count > (int64_t)size*HEATMAP_MAX_EXCLUDE_PERCENT/100) {
+        printf("Heatmap stream %d: %d%% of the frame is active, mask held back\n", hm->stream,
+               (int)((int64_t)count*100/size));
+        return;
+    }
+    if (hm->apply) {
+        if (count == hm->excluded && memcmp(hm->mask, hm->exclude, size) == 0)
+            return;
+        memcpy(hm->exclude, hm->mask, size);
+        hm->excluded = count;
+        build_coarse(hm);
+        write_pgm(hm, "_exclude.pgm", hm->exclude);
+        printf("Heatmap stream %d: excluding %d pixels, %.1f%% of the frame\n", hm->stream, count,
+               count*100.0/size);
+    } else if (count != hm->proposed) {
+        write_pgm(hm, "_proposed.pgm", hm->mask);
+        printf("Heatmap stream %d: proposing %d pixels, %.1f%% of the frame\n", hm->stream, count,
+               count*100.0/size);
+    }
+    hm->proposed = count;
+}
+
+/**
+ * Start a stream's heatmap, picking up its saved counters and mask
+ *
+ * @param spoolDir Files go in its HEATMAP_DIR, created if missing
+ * @param width    Analysis resolution
+ * @param coarseWidth Resolution of the coarse gate
+ * @param apply    Non-zero to use the masks built, zero to only propose them
+ * @param arena    Frame arena to take the buffers from
+ * @return 0 if successful, -1 otherwise
+ */
+int heatmap_open(HEATMAP_T *hm, const char *spoolDir, int stream, int width, int height,
+                 int coarseWidth, int coarseHeight, int apply, ARENA_T *arena)
+{
+    size_t size = (size_t)width*height;
+    int excluded;
+
+    memset(hm, 0, sizeof(*hm));
+    hm->stream = stream;
+    hm->apply = apply;
+    hm->width = width;
+    hm->height = height;
+    hm->coarseWidth = coarseWidth;
+    hm->coarseHeight = coarseHeight;
+    snprintf(hm->dir, sizeof(hm->dir), "%s/%s", spoolDir, HEATMAP_DIR);
+    if (mkdir(hm->dir, 0755) != 0 && errno != EEXIST) {
+        perror(hm->dir);
+        return -1;
+    }
+    hm->count = arena_alloc(arena, "heatmap count", size*sizeof(uint16_t));
+    hm->exclude = arena_alloc(arena, "heatmap exclude", size);
+    hm->mask = arena_alloc(arena, "heatmap mask", size);
+    hm->coarseExclude = arena_alloc(arena, "heatmap coarse", (size_t)coarseWidth*coarseHeight);
+    if (!hm->count || !hm->exclude || !hm->mask || !hm->coarseExclude)
+        return -1;
+    memset(hm->count, 0, size*sizeof(uint16_t));
+    memset(hm->exclude, 0, size);
+    memset(hm->coarseExclude, 0, (size_t)coarseWidth*coarseHeight);
+    load_counts(hm);
+    excluded = read_pgm(hm, "_exclude.pgm", hm->exclude);
+    if (excluded > 0) {
+        hm->excluded = excluded;
+        hm->proposed = excluded;
+        build_coarse(hm);
+    } else {
+        memset(hm->exclude, 0, size);
+    }
+    printf("Heatmap for stream %d in %s, %u samples so far, excluding %.1f%% of the frame%s\n", stream, hm->dir,
+           hm->samples, hm->excluded*100.0/size, apply ? "" : ", proposing only");
+    __sync_synchronize();  // Buffers before the flag that publishes them
+    hm->ready = 1;
+    return 0;
+}
+
+/**
+ * Count a motion check
+ *
+ * @return 1 if this check is to be sampled: the caller runs the full check
+ *         without the coarse gate and passes an unexcluded mask to
+ *         heatmap_add()
+ */
+int heatmap_sample_due(HEATMAP_T *hm)
+{
+    if (!hm->ready)
+        return 0;
+    return ++hm->checks % HEATMAP_SAMPLE_CHECKS == 0;
+}
+
+/**
+ * Add a sample, decaying and rebuilding the mask when they are due
+ *
+ * @param mask Detector mask taken without exclusion, 255 where changed;
+ *             may be the heatmap's own scratch mask
+ */
+void heatmap_add(HEATMAP_T *hm, const unsigned char *mask)
+{
+    int size = hm->width*hm->height;
+    uint16_t *count = hm->count;
+    int i;
+
+    // Saturating add, a counter stops at 0x8000, far above HEATMAP_FULL
+    for (i = 0; i < size; i++)
+        count[i] += (mask[i] & 1) & ~(count[i] >> 15);
+    hm->samples++;
+    if (hm->samples % HEATMAP_DECAY_SAMPLES != 0)
+        return;
+    for (i = 0; i < size; i++)
+        count[i] -= (count[i] + (1 << HEATMAP_DECAY_SHIFT) - 1) >> HEATMAP_DECAY_SHIFT;
+    hm->decays++;
+    if (hm->decays % HEATMAP_SAVE_DECAYS != 0)
+        return;
+    if (hm->samples >= HEATMAP_MIN_SAMPLES)
+        build_mask(hm);
+    save_counts(hm);
+}
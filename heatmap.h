@@ -0,0 +1,75 @@
+/*
+ * File:   heatmap.h
+ *
+ * Long-term activity map that finds chronically active areas, such as
+ * trees and water, and builds an exclusion mask for the detector. Every
+ * HEATMAP_SAMPLE_CHECKS motion checks the detector's mask is sampled,
+ * without any exclusion or coarse gate so the sample is not biased by
+ * the mask it feeds, and each changed pixel's counter takes a saturating
+ * add. Every HEATMAP_DECAY_SAMPLES samples the counters lose
+ * 1/2^HEATMAP_DECAY_SHIFT, so a counter settles at its pixel's changed
+ * fraction of HEATMAP_FULL and the map forgets over a few hours.
+ *
+ * Once enough samples have been taken, pixels changed in more than
+ * HEATMAP_EXCLUDE_PERCENT of samples join the mask and leave it again
+ * below HEATMAP_RELEASE_PERCENT; a mask covering more than
+ * HEATMAP_MAX_EXCLUDE_PERCENT of the frame is held back as a scene change
+ * rather than activity. A mask is written as a PGM to
+ * HEATMAP_DIR/<stream>_proposed.pgm, or with apply straight to
+ * <stream>_exclude.pgm, which is what the detector uses; an exclude mask
+ * found at open is used as well, so a proposal is accepted by copying it
+ * and restarting. The counters are saved every HEATMAP_SAVE_DECAYS decays
+ * and reloaded at open, so the history survives restarts.
+ */
+
+#ifndef HEATMAP_H_
+#define HEATMAP_H_
+
+#include <stdint.h>
+
+#include "arena.h"
+
+#define HEATMAP_DIR                 "heatmap"   // Under the spool directory
+#define HEATMAP_SAMPLE_CHECKS       8       // Motion checks per sample, every ~3 s
+#define HEATMAP_DECAY_SAMPLES       64      // Samples between decays, ~3 min
+#define HEATMAP_DECAY_SHIFT         5       // Each decay keeps 31/32, a time constant of ~1.5 h
+#define HEATMAP_FULL                (HEATMAP_DECAY_SAMPLES << HEATMAP_DECAY_SHIFT)  // Counter of a pixel always changed
+#define HEATMAP_MIN_SAMPLES         (HEATMAP_DECAY_SAMPLES << HEATMAP_DECAY_SHIFT)  // One time constant before any mask
+#define HEATMAP_EXCLUDE_PERCENT     30
+#define HEATMAP_RELEASE_PERCENT     15
+#define HEATMAP_MAX_EXCLUDE_PERCENT 25
+#define HEATMAP_SAVE_DECAYS         10      // Decays between saves of the counters, ~30 min
+
+/// Frame arena bytes a heatmap takes
+#define HEATMAP_ARENA_BYTES(w, h, cw, ch) (ARENA_BYTES((size_t)(w)*(h)*sizeof(uint16_t)) + \
+                                           2*ARENA_BYTES((size_t)(w)*(h)) + ARENA_BYTES((size_t)(cw)*(ch)))
+
+typedef struct {
+    int            stream;
+    char           dir[96];
+    int            apply;           /// Masks built here are used, not just proposed
+    int            width, height;
+    int            coarseWidth, coarseHeight;
+    uint16_t      *count;           /// Per-pixel activity
+    unsigned char *exclude;         /// 255 where the detector ignores changes
+    unsigned char *coarseExclude;   /// Coarse pixels wholly under exclude
+    unsigned char *mask;            /// Scratch for a sample taken while exclude is in use
+    int            excluded;        /// Pixels set in exclude
+    int            proposed;        /// Pixels set in the last mask built
+    uint32_t       checks;
+    uint32_t       samples;         /// Taken since the counters began, kept across restarts
+    uint32_t       decays;
+    volatile int   ready;           /// Set once the above may be used from the analysis thread
+} HEATMAP_T;
+
+/// Exclusion masks for motion_compare() and motion_coarse(), NULL when there is nothing to exclude
+#define HEATMAP_EXCLUDE(hm)        (((hm)->ready && (hm)->excluded) ? (hm)->exclude : NULL)
+#define HEATMAP_COARSE_EXCLUDE(hm) (((hm)->ready && (hm)->excluded) ? (hm)->coarseExclude : NULL)
+
+int  heatmap_open(HEATMAP_T *hm, const char *spoolDir, int stream, int width, int height,
+                  int coarseWidth, int coarseHeight, int apply, ARENA_T *arena);
+
+int  heatmap_sample_due(HEATMAP_T *hm);
+void heatmap_add(HEATMAP_T *hm, const unsigned char *mask);
+
+#endif /* HEATMAP_H_ */
@@ -0,0 +1,1019 @@
+/*
+ * File:   httpc.c
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "httpc.h"
+#include "report.h"
+
+// Response parser states
+#define ST_HEAD         0   // Status line and headers
+#define ST_BODY         1   // Content-Length bytes
+#define ST_CHUNK_SIZE   2
+#define ST_CHUNK_DATA   3
+#define ST_CHUNK_END    4   // CRLF after a chunk's data
+#define ST_TRAILER      5
+#define ST_UNTIL_CLOSE  6   // No length, the body ends with the connection
+#define ST_DONE         7
+
+#define EXT_EVENT       HTTPC_MAX_CONNS     // epoll data of the caller's descriptor
+
+static const char closing[] = "--" HTTPC_BOUNDARY "--\r\n";
+
+static void base64(const unsigned char *in, int len, char *out)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+
+    for (i = 0; i < len; i += 3) {
+        uint32_t v = in[i] << 16 | (i+1 < len ? in[i+1] << 8 : 0) | (i+2 < len ? in[i+2] : 0);
+        *out++ = table[v >> 18];
+        *out++ = table[(v >> 12) & 63];
+        *out++ = i+1 < len ? table[(v >> 6) & 63] : '=';
+        *out++ = i+2 < len ? table[v & 63] : '=';
+    }
+    *out = 0;
+}
+
+/**
+ * Connect to the server and look it up once, so a busy resolver never
+ * holds up an upload
+ *
+ * @param host       host[:port], port 80 if none
+ * @param userPass   user:password for basic authentication, or NULL
+ * @param maxUploads Upload connections, POSTs in flight at once
+ * @return 0 if successful, -1 otherwise
+ */
+int httpc_open(HTTPC_T *c, const char *host, const char *userPass, int maxUploads)
+{
+    struct addrinfo hints, *res;
+    char name[128];
+    const char *port = "80";
+    char *colon;
+    int err, i;
+
+    memset(c, 0, sizeof(*c));
+    c->epfd = -1;
+    c->extFd = -1;
+    for (i = 0; i < HTTPC_MAX_CONNS; i++)
+        c->conns[i].fd = -1;
+    if (maxUploads < 1 || maxUploads > HTTPC_MAX_CONNS-1) {
+        fprintf(stderr, "Error: between 1 and %d upload connections\n", HTTPC_MAX_CONNS-1);
+        return -1;
+    }
+    c->numConns = maxUploads + 1;
+    c->conns[0].control = 1;
+    snprintf(c->host, sizeof(c->host), "%s", host);
+    snprintf(name, sizeof(name), "%s", host);
+    colon = strrchr(name, ':');
+    if (colon) {
+        *colon = 0;
+        port = colon + 1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(name, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Error: %s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    memcpy(&c->addr, res->ai_addr, res->ai_addrlen);
+    c->addrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+    if (userPass && *userPass) {
+        char encoded[128];
+        int len = strlen(userPass);
+        if (len > 3*(int)(sizeof(encoded)-1)/4) {
+            fprintf(stderr, "Error: credentials too long\n");
+            return -1;
+        }
+        base64((const unsigned char *)userPass, len, encoded);
+        snprintf(c->auth, sizeof(c->auth), "Authorization: Basic %s\r\n", encoded);
+    }
+    c->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (c->epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Set the upload caps, see HTTPC_NIGHT_START
+ *
+ * @param dayBps Bytes/s, 0 for no cap
+ */
+void httpc_cap(HTTPC_T *c, int64_t dayBps, int64_t nightBps)
+{
+    c->dayBps = dayBps;
+    c->nightBps = nightBps;
+    c->tokens = 0;
+    c->stamp = report_now_us();
+}
+
+static int64_t cap_rate(HTTPC_T *c)
+{
+    time_t t;
+    struct tm tm;
+
+    if (!c->dayBps && !c->nightBps)
+        return 0;
+    t = time(NULL);
+    localtime_r(&t, &tm);
+    if (HTTPC_NIGHT_START > HTTPC_NIGHT_END ?
+        (tm.tm_hour >= HTTPC_NIGHT_START || tm.tm_hour < HTTPC_NIGHT_END) :
+        (tm.tm_hour >= HTTPC_NIGHT_START && tm.tm_hour < HTTPC_NIGHT_END))
+        return c->nightBps;
+    return c->dayBps;
+}
+
+/**
+ * Top up the token bucket
+ *
+ * @return The cap in force, 0 for none
+ */
+static int64_t shaper_fill(HTTPC_T *c)
+{
+    int64_t rate = cap_rate(c);
+    int64_t now = report_now_us();
+
+    if (rate > 0) {
+        c->tokens += (now - c->stamp)*rate/1e6;
+        if (c->tokens > rate*HTTPC_SHAPE_BURST)
+            c->tokens = rate*HTTPC_SHAPE_BURST;
+    }
+    c->stamp = now;
+    return rate;
+}
+
+/**
+ * Bytes that may be written now under the cap. Writes take the bucket
+ * into debt, which holds later ones back until it is paid off.
+ *
+ * @return want, or up to HTTPC_SHAPE_CHUNK of it while capped, 0 if the
+ *         bucket is empty
+ */
+static int64_t shaper_allow(HTTPC_T *c, int64_t want)
+{
+    if (shaper_fill(c) <= 0)
+        return want;
+    if (c->tokens <= 0)
+        return 0;
+    return want < HTTPC_SHAPE_CHUNK ? want : HTTPC_SHAPE_CHUNK;
+}
+
+/**
+ * @return ms until the bucket has tokens again, -1 if writing may go on
+ */
+static int shaper_wait_ms(HTTPC_T *c)
+{
+    int64_t rate = shaper_fill(c);
+
+    if (rate <= 0 || c->tokens > 0)
+        return -1;
+    return (int)(-c->tokens*1000/rate) + 1;
+}
+
+/**
+ * Start a request; add any parts and hand it to httpc_submit()
+ *
+ * @param post      Non-zero for a multipart POST, zero for a GET
+ * @param timeoutMs Time its connection may make no progress, 0 for HTTPC_TIMEOUT_MS
+ * @param done      Called once it has finished, however it finished
+ * @return The request, or NULL if out of memory
+ */
+HTTPC_REQ_T *httpc_request(uint32_t id, int post, const char *path, int timeoutMs,
+                           HTTPC_DONE_FN done, void *ctx)
+{
+    HTTPC_REQ_T *req = calloc(1, sizeof(*req));
+
+    if (!req) {
+        fprintf(stderr, "Error: out of memory for request %u\n", id);
+        return NULL;
+    }
+    req->id = id;
+    req->post = post;
+    snprintf(req->path, sizeof(req->path), "%s", path);
+    req->timeoutMs = timeoutMs > 0 ? timeoutMs : HTTPC_TIMEOUT_MS;
+    req->done = done;
+    req->ctx = ctx;
+    return req;
+}
+
+static HTTPC_PART_T *add_part(HTTPC_REQ_T *req, const char *field, const char *filename)
+{
+    HTTPC_PART_T *part;
+
+    if (!req->post || req->numParts >= HTTPC_MAX_PARTS) {
+        fprintf(stderr, "Error: request %u cannot take part %s\n", req->id, field);
+        return NULL;
+    }
+    part = &req->parts[req->numParts];
+    part->headLen = snprintf(part->head, sizeof(part->head),
+                             "--" HTTPC_BOUNDARY "\r\n"
+                             "Content-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
+                             "Content-Type: application/octet-stream\r\n\r\n", field, filename);
+    if (part->headLen >= (int)sizeof(part->head)) {
+        fprintf(stderr, "Error: part %s of request %u has too long a name\n", field, req->id);
+        return NULL;
+    }
+    part->fd = -1;
+    part->data = NULL;
+    return part;
+}
+
+/**
+ * Add a file part. The file is opened now and sent with sendfile(), so it
+ * may be unlinked once this returns.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int httpc_add_file(HTTPC_REQ_T *req, const char *field, const char *filename, const char *path)
+{
+    HTTPC_PART_T *part = add_part(req, field, filename);
+    struct stat st;
+    int fd;
+
+    if (!part)
+        return -1;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    part->fd = fd;
+    part->len = st.st_size;
+    req->numParts++;
+    return 0;
+}
+
+/**
+ * Add a part from a buffer
+ *
+ * @param data malloc()ed, the request owns it from here on, even on error
+ * @return 0 if successful, -1 otherwise
+ */
+int httpc_add_data(HTTPC_REQ_T *req, const char *field, const char *filename, unsigned char *data, int64_t len)
+{
+    HTTPC_PART_T *part = add_part(req, field, filename);
+
+    if (!part) {
+        free(data);
+        return -1;
+    }
+    part->data = data;
+    part->len = len;
+    req->numParts++;
+    return 0;
+}
+
+void httpc_free(HTTPC_REQ_T *req)
+{
+    int i;
+
+    for (i = 0; i < req->numParts; i++) {
+        if (req->parts[i].fd >= 0)
+            close(req->parts[i].fd);
+        free(req->parts[i].data);
+    }
+    free(req->body);
+    free(req);
+}
+
+/**
+ * Find a segment of the request to write: its head, then for each part
+ * the part head, the content and a CRLF, then the closing boundary
+ *
+ * @return 1 with the segment in ptr or fd, 0 past the last one
+ */
+static int segment(HTTPC_REQ_T *req, int seg, const char **ptr, int *fd, int64_t *len)
+{
+    int numSegs = req->numParts ? 2 + 3*req->numParts : 1;
+    HTTPC_PART_T *part;
+
+    *fd = -1;
+    if (seg >= numSegs)
+        return 0;
+    if (seg == 0) {
+        *ptr = req->head;
+        *len = req->headLen;
+        return 1;
+    }
+    if (seg == numSegs-1) {
+        *ptr = closing;
+        *len = sizeof(closing)-1;
+        return 1;
+    }
+    part = &req->parts[(seg-1)/3];
+    switch ((seg-1) % 3) {
+    case 0:
+        *ptr = part->head;
+        *len = part->headLen;
+        break;
+    case 1:
+        *ptr = (const char *)part->data;
+        *fd = part->fd;
+        *len = part->len;
+        break;
+    default:
+        *ptr = "\r\n";
+        *len = 2;
+        break;
+    }
+    return 1;
+}
+
+static void finish(HTTPC_T *c, HTTPC_REQ_T *req, int status, const char *error)
+{
+    req->next = NULL;
+    req->status = status;
+    if (status == 0 && error) {
+        // The error replaces anything read of a response
+        free(req->body);
+        req->body = (unsigned char *)strdup(error);
+        req->bodyLen = req->body ? strlen(error) : 0;
+    }
+    c->requests++;
+    if (status == 0)
+        c->failures++;
+    req->done(req->ctx, req);
+    httpc_free(req);
+}
+
+static void watch(HTTPC_T *c, HTTPC_CONN_T *conn, int events)
+{
+    struct epoll_event ev;
+
+    if (conn->events == events)
+        return;
+    ev.events = events;
+    ev.data.u32 = conn - c->conns;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0)
+        perror("epoll_ctl");
+    conn->events = events;
+}
+
+static int open_conn(HTTPC_T *c, HTTPC_CONN_T *conn)
+{
+    struct epoll_event ev;
+    int one = 1;
+    int fd;
+
+    fd = socket(c->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    // Heads and heartbeats go out as soon as they are complete, MSG_MORE holds back the partial ones
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&c->addr, c->addrLen) != 0 && errno != EINPROGRESS) {
+        perror(c->host);
+        close(fd);
+        return -1;
+    }
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u32 = conn - c->conns;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("epoll_ctl");
+        close(fd);
+        return -1;
+    }
+    conn->fd = fd;
+    conn->connecting = 1;
+    conn->events = ev.events;
+    conn->answered = 0;
+    conn->inLen = 0;
+    conn->state = ST_HEAD;
+    conn->close = 0;
+    conn->lastProgress = report_now_us();
+    c->connects++;
+    return 0;
+}
+
+static void dispatch(HTTPC_T *c);
+
+/**
+ * Close a connection, finishing or resending the requests still on it
+ *
+ * @param error    Why, NULL if the server said it would close; what was
+ *                 not answered then was never looked at and goes again
+ * @param retry    Non-zero if a request the server may not have seen is
+ *                 sent again, once, on a new connection
+ */
+static void close_conn(HTTPC_T *c, HTTPC_CONN_T *conn, const char *error, int retry)
+{
+    HTTPC_REQ_T *req = conn->head;
+    HTTPC_REQ_T *resend = NULL, **resendTail = &resend;
+
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->connecting = 0;
+    conn->head = conn->tail = NULL;
+    while (req) {
+        HTTPC_REQ_T *next = req->next;
+        // A stale keep-alive connection fails the first request written to it
+        int stale = retry && conn->answered > 0 && !req->answering && req->retries < 1;
+        if (!error || stale) {
+            if (error) {
+                req->retries++;
+                c->retried++;
+            }
+            req->seg = 0;
+            req->segOff = 0;
+            req->written = 0;
+            req->answering = 0;
+            free(req->body);
+            req->body = NULL;
+            req->bodyLen = 0;
+            req->next = NULL;
+            *resendTail = req;
+            resendTail = &req->next;
+        } else {
+            finish(c, req, 0, error);
+        }
+        req = next;
+    }
+    // Resent ahead of anything submitted since; an upload connection carries one POST
+    while (resend) {
+        HTTPC_REQ_T *next = resend->next;
+        if (resend->post) {
+            resend->next = c->waiting;
+            c->waiting = resend;
+            if (!c->waitingTail)
+                c->waitingTail = resend;
+        } else {
+            httpc_submit(c, resend);
+        }
+        resend = next;
+    }
+    dispatch(c);
+}
+
+static void append(HTTPC_CONN_T *conn, HTTPC_REQ_T *req)
+{
+    req->next = NULL;
+    if (!conn->head) {
+        conn->head = req;
+        // Time spent idle does not count against the request
+        conn->lastProgress = report_now_us();
+    } else {
+        conn->tail->next = req;
+    }
+    conn->tail = req;
+}
+
+/**
+ * Hand waiting POSTs to free upload connections, reusing open ones before
+ * opening new ones
+ */
+static void dispatch(HTTPC_T *c)
+{
+    while (c->waiting) {
+        HTTPC_REQ_T *req = c->waiting;
+        HTTPC_CONN_T *conn = NULL;
+        int i;
+
+        for (i = 1; i < c->numConns && !conn; i++)
+            if (c->conns[i].fd >= 0 && !c->conns[i].head)
+                conn = &c->conns[i];
+        for (i = 1; i < c->numConns && !conn; i++)
+            if (c->conns[i].fd < 0)
+                conn = &c->conns[i];
+        if (!conn)
+            return;
+        c->waiting = req->next;
+        if (!c->waiting)
+            c->waitingTail = NULL;
+        if (conn->fd < 0 && open_conn(c, conn) != 0) {
+            finish(c, req, 0, "cannot connect");
+            continue;
+        }
+        append(conn, req);
+    }
+}
+
+/**
+ * Queue a request, formatting its head. Its done callback may be called
+ * from here if it cannot be sent at all.
+ */
+void httpc_submit(HTTPC_T *c, HTTPC_REQ_T *req)
+{
+    HTTPC_CONN_T *conn = &c->conns[0];
+    int i;
+
+    if (req->seg == 0 && req->headLen == 0) {
+        req->queued = report_now_us();
+        if (req->post) {
+            req->contentLength = req->numParts ? sizeof(closing)-1 : 0;
+            for (i = 0; i < req->numParts; i++)
+                req->contentLength += req->parts[i].headLen + req->parts[i].len + 2;
+            req->headLen = snprintf(req->head, sizeof(req->head),
+                                    "POST %s HTTP/1.1\r\nHost: %s\r\n%sUser-Agent: snoopup\r\nAccept: */*\r\n"
+                                    "Content-Type: multipart/form-data; boundary=" HTTPC_BOUNDARY "\r\n"
+                                    "Content-Length: %lld\r\n\r\n",
+                                    req->path, c->host, c->auth, (long long)req->contentLength);
+        } else {
+            req->headLen = snprintf(req->head, sizeof(req->head),
+                                    "GET %s HTTP/1.1\r\nHost: %s\r\n%sUser-Agent: snoopup\r\nAccept: */*\r\n\r\n",
+                                    req->path, c->host, c->auth);
+        }
+        if (req->headLen >= (int)sizeof(req->head)) {
+            finish(c, req, 0, "path too long");
+            return;
+        }
+    }
+    if (req->post) {
+        req->next = NULL;
+        if (c->waitingTail)
+            c->waitingTail->next = req;
+        else
+            c->waiting = req;
+        c->waitingTail = req;
+        dispatch(c);
+        return;
+    }
+    if (conn->fd < 0 && open_conn(c, conn) != 0) {
+        finish(c, req, 0, "cannot connect");
+        return;
+    }
+    append(conn, req);
+}
+
+/**
+ * Write as much of the connection's requests as the socket and the cap
+ * take, pipelining each behind the last
+ *
+ * @return 0 if successful, -1 with errno set otherwise
+ */
+static int conn_write(HTTPC_T *c, HTTPC_CONN_T *conn)
+{
+    HTTPC_REQ_T *req = conn->head;
+
+    while (req && req->written)
+        req = req->next;
+    while (req) {
+        const char *ptr;
+        int64_t len, left, allow;
+        ssize_t n;
+        int fd;
+
+        if (!segment(req, req->seg, &ptr, &fd, &len)) {
+            req->written = 1;
+            req = req->next;
+            continue;
+        }
+        left = len - req->segOff;
+        if (left == 0) {
+            req->seg++;
+            req->segOff = 0;
+            continue;
+        }
+        allow = shaper_allow(c, left);
+        if (allow == 0)
+            return 0;
+        if (fd >= 0) {
+            off_t off = req->segOff;
+            n = sendfile(conn->fd, fd, &off, allow);
+            if (n == 0) {
+                errno = EIO;    // The file got shorter than the Content-Length sent
+                return -1;
+            }
+        } else {
+            const char *nextPtr;
+            int64_t nextLen;
+            int nextFd;
+            // Hold the packet open for what follows unless this ends what is queued
+            int more = allow < left || req->next || segment(req, req->seg+1, &nextPtr, &nextFd, &nextLen);
+            n = send(conn->fd, ptr + req->segOff, allow, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        }
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        req->segOff += n;
+        req->sent += n;
+        c->bytesSent += n;
+        if (fd >= 0)
+            c->fileBytes += n;
+        if (c->dayBps || c->nightBps)
+            c->tokens -= n;
+        conn->lastProgress = report_now_us();
+    }
+    return 0;
+}
+
+static void keep(HTTPC_REQ_T *req, const unsigned char *data, int len)
+{
+    if (req->bodyLen + len > HTTPC_MAX_BODY)
+        len = HTTPC_MAX_BODY - req->bodyLen;
+    if (len <= 0)
+        return;
+    if (!req->body) {
+        req->body = malloc(HTTPC_MAX_BODY + 1);
+        if (!req->body)
+            return;
+    }
+    memcpy(req->body + req->bodyLen, data, len);
+    req->bodyLen += len;
+    req->body[req->bodyLen] = 0;
+}
+
+/**
+ * Find a header's value in a header block
+ *
+ * @return Its value, up to the CRLF, or NULL
+ */
+static const char *header(const char *head, const char *name, int *len)
+{
+    int nameLen = strlen(name);
+    const char *p = strstr(head, "\r\n");
+
+    while (p && p[2]) {
+        p += 2;
+        if (strncasecmp(p, name, nameLen) == 0 && p[nameLen] == ':') {
+            const char *v = p + nameLen + 1;
+            const char *end = strstr(v, "\r\n");
+            while (*v == ' ' || *v == '\t')
+                v++;
+            *len = end - v;
+            return v;
+        }
+        p = strstr(p, "\r\n");
+    }
+    return NULL;
+}
+
+/**
+ * Parse a status line and headers at the start of the read buffer
+ *
+ * @return Bytes taken, 0 if more are needed, -1 if it is not a response
+ */
+static int parse_head(HTTPC_CONN_T *conn, HTTPC_REQ_T *req)
+{
+    char *end, *v;
+    int minor, status, len, headLen;
+    const char *value;
+
+    end = memmem(conn->in, conn->inLen, "\r\n\r\n", 4);
+    if (!end)
+        return conn->inLen == sizeof(conn->in) ? -1 : 0;
+    headLen = end + 4 - (char *)conn->in;
+    end[2] = 0;     // Headers end with a CRLF before the terminator
+    if (sscanf((char *)conn->in, "HTTP/1.%d %d", &minor, &status) != 2)
+        return -1;
+    req->status = status;
+    conn->close = minor == 0;
+    value = header((char *)conn->in, "Connection", &len);
+    if (value) {
+        if (len >= 5 && strncasecmp(value, "close", 5) == 0)
+            conn->close = 1;
+        else if (len >= 10 && strncasecmp(value, "keep-alive", 10) == 0)
+            conn->close = 0;
+    }
+    if (status < 200) {
+        conn->state = ST_HEAD;     // Informational, the real response follows
+    } else if (status == 204 || status == 304) {
+        conn->state = ST_BODY;
+        conn->remaining = 0;
+    } else if ((value = header((char *)conn->in, "Transfer-Encoding", &len)) && len >= 7 &&
+               strncasecmp(value + len - 7, "chunked", 7) == 0) {
+        conn->state = ST_CHUNK_SIZE;
+    } else if ((value = header((char *)conn->in, "Content-Length", &len))) {
+        conn->state = ST_BODY;
+        conn->remaining = strtoll(value, &v, 10);
+        if (v == value || conn->remaining < 0)
+            return -1;
+    } else {
+        conn->state = ST_UNTIL_CLOSE;
+        conn->close = 1;
+    }
+    return headLen;
+}
+
+/**
+ * Parse what has been read of the connection's responses, finishing the
+ * requests they answer
+ *
+ * @return 0 if successful, 1 if the connection was closed as the server
+ *         asked, -1 if the response made no sense
+ */
+static int parse(HTTPC_T *c, HTTPC_CONN_T *conn)
+{
+    int pos = 0;
+
+    while (conn->head) {
+        HTTPC_REQ_T *req = conn->head;
+        unsigned char *p = conn->in + pos;
+        int avail = conn->inLen - pos;
+        int n = 0;
+        char *eol;
+
+        if (avail == 0 && conn->state != ST_DONE && !(conn->state == ST_BODY && conn->remaining == 0))
+            break;
+        req->answering = 1;
+        switch (conn->state) {
+        case ST_HEAD:
+            if (pos) {
+                // Headers are parsed in place from the start of the buffer
+                memmove(conn->in, p, avail);
+                conn->inLen = avail;
+                pos = 0;
+                p = conn->in;
+            }
+            n = parse_head(conn, req);
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                return 0;
+            break;
+        case ST_BODY:
+            n = avail < conn->remaining ? avail : conn->remaining;
+            keep(req, p, n);
+            conn->remaining -= n;
+            if (conn->remaining == 0)
+                conn->state = ST_DONE;
+            break;
+        case ST_UNTIL_CLOSE:
+            keep(req, p, avail);
+            n = avail;
+            break;
+        case ST_CHUNK_DATA:
+            n = avail < conn->remaining ? avail : conn->remaining;
+            keep(req, p, n);
+            conn->remaining -= n;
+            if (conn->remaining == 0)
+                conn->state = ST_CHUNK_END;
+            break;
+        case ST_CHUNK_SIZE:
+        case ST_CHUNK_END:
+        case ST_TRAILER:
+            eol = memmem(p, avail, "\r\n", 2);
+            if (!eol) {
+                if (avail > 256)
+                    return -1;
+                n = 0;
+                break;
+            }
+            n = eol + 2 - (char *)p;
+            if (conn->state == ST_CHUNK_SIZE) {
+                char *end;
+                conn->remaining = strtoll((char *)p, &end, 16);
+                if (end == (char *)p || conn->remaining < 0)
+                    return -1;
+                conn->state = conn->remaining ? ST_CHUNK_DATA : ST_TRAILER;
+            } else if (conn->state == ST_CHUNK_END) {
+                conn->state = ST_CHUNK_SIZE;
+            } else if (n == 2) {
+                conn->state = ST_DONE;  // Empty line ends the trailer
+            }
+            break;
+        }
+        if (n == 0 && conn->state != ST_DONE)
+            break;
+        pos += n;
+        if (conn->state == ST_DONE) {
+            conn->head = req->next;
+            if (!conn->head)
+                conn->tail = NULL;
+            conn->answered++;
+            conn->state = ST_HEAD;
+            finish(c, req, req->status, NULL);
+            if (conn->close) {
+                // The slot may be opened again at once for what is left
+                close_conn(c, conn, NULL, 0);
+                return 1;
+            }
+            if (!conn->control)
+                dispatch(c);
+        }
+    }
+    memmove(conn->in, conn->in + pos, conn->inLen - pos);
+    conn->inLen -= pos;
+    return 0;
+}
+
+static void conn_read(HTTPC_T *c, HTTPC_CONN_T *conn)
+{
+    for (;;) {
+        ssize_t n = recv(conn->fd, conn->in + conn->inLen, sizeof(conn->in) - conn->inLen, 0);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            close_conn(c, conn, strerror(errno), 1);
+            return;
+        }
+        if (n == 0) {
+            if (conn->head && conn->state == ST_UNTIL_CLOSE) {
+                conn->state = ST_DONE;
+                if (parse(c, conn) == 1)
+                    return;
+            }
+            close_conn(c, conn, "connection closed", 1);
+            return;
+        }
+        conn->inLen += n;
+        conn->lastProgress = report_now_us();
+        if (!conn->head) {
+            close_conn(c, conn, "response to nothing", 0);
+            return;
+        }
+        switch (parse(c, conn)) {
+        case 0:
+            break;
+        case 1:
+            return;
+        default:
+            close_conn(c, conn, "bad response", 0);
+            return;
+        }
+    }
+}
+
+static void conn_writable(HTTPC_T *c, HTTPC_CONN_T *conn)
+{
+    if (conn->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            close_conn(c, conn, strerror(err), 0);
+            return;
+        }
+        conn->connecting = 0;
+        conn->lastProgress = report_now_us();
+    }
+    if (conn_write(c, conn) != 0)
+        close_conn(c, conn, strerror(errno), 1);
+}
+
+/**
+ * Ask for writable events only on connections with something to write,
+ * and not while the cap holds writing back
+ */
+static void update_events(HTTPC_T *c, int capped)
+{
+    int i;
+
+    for (i = 0; i < c->numConns; i++) {
+        HTTPC_CONN_T *conn = &c->conns[i];
+        HTTPC_REQ_T *req;
+        int out = conn->connecting;
+
+        if (conn->fd < 0)
+            continue;
+        for (req = conn->head; req && !out; req = req->next)
+            out = !req->written && !capped;
+        watch(c, conn, EPOLLIN | (out ? EPOLLOUT : 0));
+    }
+}
+
+/**
+ * Fail the requests on connections that made no progress for their
+ * timeout, and work out the next time one is due
+ *
+ * @return ms to the next timeout, or -1 if nothing is in flight
+ */
+static int check_timeouts(HTTPC_T *c)
+{
+    int64_t now = report_now_us();
+    int next = -1;
+    int i;
+
+    for (i = 0; i < c->numConns; i++) {
+        HTTPC_CONN_T *conn = &c->conns[i];
+        int64_t left;
+
+        if (conn->fd < 0 || !conn->head)
+            continue;
+        left = conn->lastProgress + (int64_t)conn->head->timeoutMs*1000 - now;
+        if (left <= 0) {
+            close_conn(c, conn, "timed out", 0);
+            continue;
+        }
+        if (next < 0 || left/1000 + 1 < next)
+            next = left/1000 + 1;
+    }
+    return next;
+}
+
+/**
+ * Wait for and handle socket events, polling the caller's descriptor too
+ *
+ * @param extFd     Descriptor to watch for reading, such as the command
+ *                  pipe, or -1; the same one on every call
+ * @param timeoutMs Longest wait, -1 for no limit
+ * @return 1 if extFd is readable, 0 if not, -1 on error
+ */
+int httpc_poll(HTTPC_T *c, int extFd, int timeoutMs)
+{
+    struct epoll_event evs[HTTPC_MAX_CONNS+1];
+    int capped, wait, n, i;
+    int extReady = 0;
+
+    if (extFd != c->extFd) {
+        struct epoll_event ev;
+        if (c->extFd >= 0)
+            epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->extFd, NULL);
+        c->extFd = extFd;
+        if (extFd >= 0) {
+            ev.events = EPOLLIN;
+            ev.data.u32 = EXT_EVENT;
+            if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, extFd, &ev) != 0) {
+                perror("epoll_ctl");
+                return -1;
+            }
+        }
+    }
+    wait = timeoutMs;
+    n = shaper_wait_ms(c);
+    capped = n >= 0;
+    if (capped && (wait < 0 || n < wait))
+        wait = n;
+    n = check_timeouts(c);
+    if (n >= 0 && (wait < 0 || n < wait))
+        wait = n;
+    update_events(c, capped);
+    n = epoll_wait(c->epfd, evs, HTTPC_MAX_CONNS+1, wait);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        HTTPC_CONN_T *conn;
+
+        if (evs[i].data.u32 == EXT_EVENT) {
+            extReady = 1;
+            continue;
+        }
+        conn = &c->conns[evs[i].data.u32];
+        if (conn->fd >= 0 && (evs[i].events & (EPOLLOUT | EPOLLERR)))
+            conn_writable(c, conn);
+        if (conn->fd >= 0 && !conn->connecting && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            conn_read(c, conn);
+    }
+    check_timeouts(c);
+    return extReady;
+}
+
+/**
+ * @return Non-zero while requests are waiting or in flight
+ */
+int httpc_busy(const HTTPC_T *c)
+{
+    int i;
+
+    if (c->waiting)
+        return 1;
+    for (i = 0; i < c->numConns; i++)
+        if (c->conns[i].head)
+            return 1;
+    return 0;
+}
+
+/**
+ * Close the connections, failing anything still on them
+ */
+void httpc_close(HTTPC_T *c)
+{
+    int i;
+
+    while (c->waiting) {
+        HTTPC_REQ_T *req = c->waiting;
+        c->waiting = req->next;
+        finish(c, req, 0, "closed");
+    }
+    c->waitingTail = NULL;
+    for (i = 0; i < c->numConns; i++)
+        if (c->conns[i].fd >= 0)
+            close_conn(c, &c->conns[i], "closed", 0);
+    if (c->epfd >= 0)
+        close(c->epfd);
+    c->epfd = -1;
+}
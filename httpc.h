@@ -0,0 +1,135 @@
+/*
+ * File:   httpc.h
+ *
+ * Event-driven HTTP/1.1 client for the uploader, talking to one server
+ * over persistent keep-alive connections from a single thread.
+ *
+ * POSTs carry multipart/form-data bodies built from parts that are
+ * either files, sent straight from the page cache with sendfile(), or
+ * small buffers; only the part headers are ever formatted in memory.
+ * Each POST takes an upload connection to itself, up to maxUploads of
+ * them, and waits in order for one to come free. GETs, such as the
+ * heartbeat, are pipelined on a separate control connection: a request
+ * is written as soon as it is submitted, without waiting for the
+ * responses ahead of it.
+ *
+ * A request that had no response on a reused connection that the server
+ * had closed is sent again, once, on a new one. Sending can be capped by
+ * a token bucket with separate day and night rates.
+ */
+
+#ifndef HTTPC_H_
+#define HTTPC_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define HTTPC_MAX_CONNS     8           // Control connection plus upload connections
+#define HTTPC_MAX_PARTS     32          // A batch of 8 clips with a timeline and tags each
+#define HTTPC_MAX_BODY      (64*1024)   // Response body bytes kept, the rest is read and dropped
+#define HTTPC_IN_BYTES      (16*1024)   // Response read buffer per connection
+#define HTTPC_TIMEOUT_MS    30000       // Default time a connection may make no progress
+#define HTTPC_SHAPE_CHUNK   (16*1024)   // Bytes written per token bucket take while capped
+#define HTTPC_SHAPE_BURST   0.5         // Seconds of the cap the token bucket can save up
+#define HTTPC_NIGHT_START   22          // Local hours the night cap runs from and to
+#define HTTPC_NIGHT_END     6
+#define HTTPC_BOUNDARY      "snoopup-b5a2f0d7c3e94618"
+
+typedef struct HTTPC_REQ_T HTTPC_REQ_T;
+
+/**
+ * Called once a request has finished
+ *
+ * @param req status is the HTTP status, or 0 if the request failed, with
+ *            the response or error text in body. Freed on return.
+ */
+typedef void (*HTTPC_DONE_FN)(void *ctx, HTTPC_REQ_T *req);
+
+typedef struct {
+    char           head[256];   /// Part boundary and headers
+    int            headLen;
+    int            fd;          /// File to send, or -1
+    unsigned char *data;        /// Buffer to send if there is no file, owned by the part
+    int64_t        len;
+} HTTPC_PART_T;
+
+struct HTTPC_REQ_T {
+    HTTPC_REQ_T   *next;
+    uint32_t       id;
+    int            post;
+    char           path[256];
+    int            timeoutMs;       /// Time the connection may make no progress
+    HTTPC_PART_T   parts[HTTPC_MAX_PARTS];
+    int            numParts;
+    char           head[1024];      /// Request line and headers, formatted at submit
+    int            headLen;
+    int64_t        contentLength;
+    int            seg;             /// Next segment to write, see segment()
+    int64_t        segOff;          /// Bytes of it already written
+    int            written;         /// All of the request has been written
+    int            answering;       /// Response bytes have arrived
+    int            retries;
+    int64_t        queued;          /// usec, when it was submitted
+    int64_t        sent;            /// Request bytes written, including any retried
+    int            status;
+    unsigned char *body;            /// Response body, up to HTTPC_MAX_BODY
+    int            bodyLen;
+    HTTPC_DONE_FN  done;
+    void          *ctx;
+};
+
+typedef struct {
+    int            fd;              /// -1 when closed
+    int            connecting;
+    int            control;         /// Carries pipelined GETs rather than one POST
+    HTTPC_REQ_T   *head;            /// Requests on it, oldest first; responses come in this order
+    HTTPC_REQ_T   *tail;
+    uint32_t       answered;        /// Responses read on this connection
+    int64_t        lastProgress;    /// usec
+    int            events;          /// epoll events asked for
+    unsigned char  in[HTTPC_IN_BYTES];
+    int            inLen;
+    int            state;           /// Response parser state
+    int64_t        remaining;       /// Body or chunk bytes still to come
+    int            close;           /// Server will close after this response
+} HTTPC_CONN_T;
+
+typedef struct {
+    char               host[128];   /// host[:port] for the Host header
+    struct sockaddr_storage addr;
+    socklen_t          addrLen;
+    char               auth[160];   /// Authorization header line, or empty
+    int                epfd;
+    int                extFd;       /// Caller's descriptor polled alongside, or -1
+    HTTPC_CONN_T       conns[HTTPC_MAX_CONNS];
+    int                numConns;    /// conns[0] is the control connection
+    HTTPC_REQ_T       *waiting;     /// POSTs waiting for an upload connection
+    HTTPC_REQ_T       *waitingTail;
+    int64_t            dayBps;      /// Caps in bytes/s, 0 for none
+    int64_t            nightBps;
+    double             tokens;
+    int64_t            stamp;       /// usec the tokens were last topped up
+    uint32_t           requests;    /// Finished
+    uint32_t           failures;
+    uint32_t           connects;
+    uint32_t           retried;
+    int64_t            bytesSent;
+    int64_t            fileBytes;   /// Of which sent with sendfile()
+} HTTPC_T;
+
+int  httpc_open(HTTPC_T *c, const char *host, const char *userPass, int maxUploads);
+void httpc_close(HTTPC_T *c);
+void httpc_cap(HTTPC_T *c, int64_t dayBps, int64_t nightBps);
+
+HTTPC_REQ_T *httpc_request(uint32_t id, int post, const char *path, int timeoutMs,
+                           HTTPC_DONE_FN done, void *ctx);
+int  httpc_add_file(HTTPC_REQ_T *req, const char *field, const char *filename, const char *path);
+int  httpc_add_data(HTTPC_REQ_T *req, const char *field, const char *filename, unsigned char *data, int64_t len);
+void httpc_free(HTTPC_REQ_T *req);
+void httpc_submit(HTTPC_T *c, HTTPC_REQ_T *req);
+
+int  httpc_poll(HTTPC_T *c, int extFd, int timeoutMs);
+int  httpc_busy(const HTTPC_T *c);
+
+#endif /* HTTPC_H_ */
@@ -0,0 +1,217 @@
+/*
+ * File:   latency.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+#include "report.h"
+
+static const char *span_names[LAT_NUM_SPANS] = {
+    "sensor->decision",
+    "decision->encoder",
+    "encoder->first_byte",
+    "first_byte->close",
+    "close->uploaded",
+    "sensor->uploaded"
+};
+
+static int64_t clock_us(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void latency_init(LATENCY_T *lat, const char *reportFile)
+{
+    memset(lat, 0, sizeof(*lat));
+    snprintf(lat->reportFile, sizeof(lat->reportFile), "%s", reportFile);
+    vcos_mutex_create(&lat->lock, "snoop_latency-lock");
+}
+
+/**
+ * Record the offset between the camera STC (which the MMAL pts values
+ * are based on) and the monotonic clock.
+ *
+ * @param stc_us Current STC as returned by MMAL_PARAMETER_SYSTEM_TIME
+ */
+void latency_sync_clock(LATENCY_T *lat, int64_t stc_us)
+{
+    lat->stc_offset = report_now_us() - stc_us;
+}
+
+int64_t latency_pts_to_mono(const LATENCY_T *lat, int64_t pts)
+{
+    return pts + lat->stc_offset;
+}
+
+static void hist_add(LATENCY_HIST_T *hist, int64_t us)
+{
+    int b = 0;
+
+    if (us < 0)
+        us = 0;
+    while (b < LATENCY_BUCKETS-1 && (us >> (b+1)) != 0)
+        b++;
+    hist->bucket[b]++;
+    hist->count++;
+    hist->sum += us;
+    if (us > hist->max)
+        hist->max = us;
+}
+
+/**
+ * Estimate a percentile as the upper edge of the bucket it falls in
+ *
+ * @return Latency in usec
+ */
+static int64_t hist_percentile(const LATENCY_HIST_T *hist, int pct)
+{
+    uint32_t want = (hist->count*pct + 99)/100;
+    uint32_t seen = 0;
+    int b;
+
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist->bucket[b];
+        if (seen >= want && seen > 0) {
+            int64_t edge = ((int64_t)1 << (b+1)) - 1;
+            return (edge < hist->max) ? edge : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static void add_span(LATENCY_T *lat, const LATENCY_EVENT_T *ev, int span, int from, int to)
+{
+    if (ev->stamp[from] && ev->stamp[to])
+        hist_add(&lat->span[span], ev->stamp[to] - ev->stamp[from]);
+}
+
+/**
+ * Start a new event. Called when ACTION_CHECK_MOTION decides there is motion.
+ *
+ * @param pts MMAL pts of the frame that triggered, negative if unknown
+ */
+void latency_begin(LATENCY_T *lat, int64_t pts)
+{
+    LATENCY_EVENT_T *ev = &lat->current;
+
+    memset(ev, 0, sizeof(*ev));
+    ev->pts = pts;
+    ev->stamp[LAT_DECISION] = report_now_us();
+    if (pts >= 0)
+        ev->stamp[LAT_SENSOR] = latency_pts_to_mono(lat, pts);
+}
+
+/**
+ * Stamp the current event, once. Safe to call from the MMAL callbacks;
+ * only the first call for each stamp after latency_begin() is recorded.
+ */
+void latency_mark(LATENCY_T *lat, LATENCY_STAMP_T stamp)
+{
+    LATENCY_EVENT_T *ev = &lat->current;
+
+    if (ev->stamp[LAT_DECISION] && !ev->stamp[stamp])
+        ev->stamp[stamp] = report_now_us();
+}
+
+/**
+ * Close the current event, fold its capture-side spans into the
+ * distributions and keep it until snoop.py reports the upload.
+ *
+ * @param clip      Filename of the closed clip
+ * @param companion Filename of its low resolution companion, or NULL.
+ *                  Whichever of the two is reported uploaded first
+ *                  completes the event.
+ */
+void latency_close(LATENCY_T *lat, const char *clip, const char *companion)
+{
+    LATENCY_EVENT_T *ev = &lat->current;
+    int s;
+
+    if (!ev->stamp[LAT_DECISION])
+        return;
+    vcos_mutex_lock(&lat->lock);
+    ev->stamp[LAT_CLIP_CLOSE] = report_now_us();
+    snprintf(ev->clip, sizeof(ev->clip), "%s", clip);
+    snprintf(ev->companion, sizeof(ev->companion), "%s", companion ? companion : "");
+    for (s = LAT_SENSOR; s < LAT_CLIP_CLOSE; s++)
+        add_span(lat, ev, s, s, s+1);
+
+    lat->pending[lat->pendingNext] = *ev;
+    lat->pendingNext = (lat->pendingNext + 1) % LATENCY_PENDING_EVENTS;
+    memset(ev, 0, sizeof(*ev));
+    latency_write_report(lat);
+    vcos_mutex_unlock(&lat->lock);
+}
+
+/**
+ * Complete a closed event with its upload time. May be called from the
+ * IPC thread.
+ *
+ * @param clip    Filename as originally posted to snoop.py, the clip or
+ *                its companion
+ * @param wall_us Wall clock usec at which the upload completed
+ * @return 0 if the event was found, -1 otherwise
+ */
+int latency_uploaded(LATENCY_T *lat, const char *clip, int64_t wall_us)
+{
+    int i;
+
+    vcos_mutex_lock(&lat->lock);
+    for (i = 0; i < LATENCY_PENDING_EVENTS; i++) {
+        LATENCY_EVENT_T *ev = &lat->pending[i];
+        if (ev->stamp[LAT_CLIP_CLOSE] &&
+            (strcmp(ev->clip, clip) == 0 || (ev->companion[0] && strcmp(ev->companion, clip) == 0))) {
+            int64_t now = report_now_us();
+            ev->stamp[LAT_UPLOADED] = now - (clock_us(CLOCK_REALTIME) - wall_us);
+            add_span(lat, ev, LAT_CLIP_CLOSE, LAT_CLIP_CLOSE, LAT_UPLOADED);
+            if (ev->stamp[LAT_SENSOR])
+                add_span(lat, ev, LAT_SPAN_TOTAL, LAT_SENSOR, LAT_UPLOADED);
+            else
+                add_span(lat, ev, LAT_SPAN_TOTAL, LAT_DECISION, LAT_UPLOADED);
+            memset(ev, 0, sizeof(*ev));
+            latency_write_report(lat);
+            vcos_mutex_unlock(&lat->lock);
+            return 0;
+        }
+    }
+    vcos_mutex_unlock(&lat->lock);
+    return -1;
+}
+
+void latency_dump(const LATENCY_T *lat, FILE *fp)
+{
+    int s;
+
+    fprintf(fp, "%-22s %8s %10s %10s %10s %10s %10s\n",
+            "span", "count", "mean(ms)", "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)");
+    for (s = 0; s < LAT_NUM_SPANS; s++) {
+        const LATENCY_HIST_T *h = &lat->span[s];
+        double mean = h->count ? (double)h->sum/h->count : 0.0;
+        fprintf(fp, "%-22s %8u %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                span_names[s], h->count, mean/1000.0,
+                hist_percentile(h, 50)/1000.0,
+                hist_percentile(h, 90)/1000.0,
+                hist_percentile(h, 99)/1000.0,
+                h->max/1000.0);
+    }
+}
+
+static void dump_report(void *ctx, FILE *fp)
+{
+    latency_dump((const LATENCY_T *) ctx, fp);
+}
+
+/**
+ * Rewrite the report file so the distributions can be read locally
+ * (cat /tmp/snoop_latency.txt) without talking to the process.
+ */
+void latency_write_report(const LATENCY_T *lat)
+{
+    report_write(lat->reportFile, dump_report, (void *) lat);
+}
@@ -0,0 +1,72 @@
+/*
+ * File:   latency.h
+ *
+ * End-to-end latency tracing for motion events, from the sensor timestamp
+ * of the triggering frame to the upload completion reported by snoop.py.
+ */
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "interface/vcos/vcos.h"
+
+#define LATENCY_REPORT_FILE "/tmp/snoop_latency.txt"
+#define LATENCY_PENDING_EVENTS 32   // Closed clips awaiting an upload report
+#define LATENCY_BUCKETS 32          // log2(usec) histogram buckets
+
+/// Points in the life of an event, in pipeline order
+typedef enum {
+    LAT_SENSOR = 0,     /// Sensor capture of the triggering frame (from MMAL pts)
+    LAT_DECISION,       /// ACTION_CHECK_MOTION decided there was motion
+    LAT_ENCODER_IN,     /// First frame sent to the encoder
+    LAT_FIRST_BYTE,     /// First encoded byte written to the clip
+    LAT_CLIP_CLOSE,     /// Clip file closed
+    LAT_UPLOADED,       /// Upload completed (reported back from snoop.py)
+    LAT_NUM_STAMPS
+} LATENCY_STAMP_T;
+
+/// Spans between consecutive stamps, plus sensor to upload
+#define LAT_SPAN_TOTAL (LAT_NUM_STAMPS-1)
+#define LAT_NUM_SPANS  (LAT_NUM_STAMPS)
+
+typedef struct {
+    char    clip[80];
+    char    companion[80];            /// Low resolution companion clip, "" if none
+    int64_t pts;                      /// MMAL pts of the triggering frame
+    int64_t stamp[LAT_NUM_STAMPS];    /// Monotonic usec, 0 if not reached
+} LATENCY_EVENT_T;
+
+typedef struct {
+    uint32_t count;
+    int64_t  sum;
+    int64_t  max;
+    uint32_t bucket[LATENCY_BUCKETS];
+} LATENCY_HIST_T;
+
+typedef struct {
+    VCOS_MUTEX_T    lock;             /// Guards pending and span, not current
+    char            reportFile[64];   /// Rewritten after every update
+    int64_t         stc_offset;       /// Monotonic usec minus camera STC usec
+    LATENCY_EVENT_T current;          /// Event being recorded
+    LATENCY_EVENT_T pending[LATENCY_PENDING_EVENTS];
+    int             pendingNext;
+    LATENCY_HIST_T  span[LAT_NUM_SPANS];
+} LATENCY_T;
+
+
+void latency_init(LATENCY_T *lat, const char *reportFile);
+void latency_sync_clock(LATENCY_T *lat, int64_t stc_us);
+int64_t latency_pts_to_mono(const LATENCY_T *lat, int64_t pts);
+
+void latency_begin(LATENCY_T *lat, int64_t pts);
+void latency_mark(LATENCY_T *lat, LATENCY_STAMP_T stamp);
+void latency_close(LATENCY_T *lat, const char *clip, const char *companion);
+int  latency_uploaded(LATENCY_T *lat, const char *clip, int64_t wall_us);
+
+void latency_dump(const LATENCY_T *lat, FILE *fp);
+void latency_write_report(const LATENCY_T *lat);
+
+#endif /* LATENCY_H_ */
@@ -0,0 +1,60 @@
+/*
+ * File:   latencytest.c
+ *
+ * Checks that an upload report completes a clip's latency event, whether
+ * it names the clip or its low resolution companion, and only once.
+ * Exits non-zero on the first check that fails.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "latency.h"
+
+#define REPORT_FILE "/tmp/snoop_latency_test.txt"
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static int64_t wall_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+int main(void)
+{
+    static LATENCY_T lat;
+
+    latency_init(&lat, REPORT_FILE);
+
+    // Single stream: the clip itself is uploaded
+    latency_begin(&lat, -1);
+    latency_close(&lat, "/spool/100.h264", NULL);
+    check(latency_uploaded(&lat, "/spool/100_lo.h264", wall_us()) != 0, "companion matched a clip without one");
+    check(latency_uploaded(&lat, "/spool/100.h264", wall_us()) == 0, "clip upload not matched");
+    check(lat.span[LAT_SPAN_TOTAL].count == 1, "total span not recorded for the clip");
+
+    // Dual stream: the companion goes up first and completes the event
+    latency_begin(&lat, -1);
+    latency_close(&lat, "/spool/200.h264", "/spool/200_lo.h264");
+    check(latency_uploaded(&lat, "/spool/200_lo.h264", wall_us()) == 0, "companion upload not matched");
+    check(lat.span[LAT_CLIP_CLOSE].count == 2, "close to upload span not recorded for the companion");
+    check(lat.span[LAT_SPAN_TOTAL].count == 2, "total span not recorded for the companion");
+    check(latency_uploaded(&lat, "/spool/200.h264", wall_us()) != 0, "event completed twice");
+    check(lat.span[LAT_SPAN_TOTAL].count == 2, "total span recorded twice");
+
+    remove(REPORT_FILE);
+    if (failures)
+        return 1;
+    printf("latencytest: all checks passed\n");
+    return 0;
+}
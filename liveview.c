@@ -0,0 +1,491 @@
+/*
+ * File:   liveview.c
+ *
+ * One thread serves every client. A client's next frame is taken when it
+ * has finished sending the previous one and its rate allows; only then
+ * is the stream's tap read, and a frame is encoded only if the tap has a
+ * new one. Encoded frames are reference counted so each client can send
+ * the shared bytes at its own pace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "liveview.h"
+#include "report.h"
+
+#define LIVEVIEW_BOUNDARY      "snoopframe"
+#define LIVEVIEW_REQUEST_BYTES 1024
+
+struct LIVEVIEW_FRAME_T {
+    int           refs;
+    uint32_t      tapFrame;     /// Tap frame it was encoded from
+    int           len;
+    unsigned char data[1];      /// Part header, JPEG, CRLF
+};
+
+struct LIVEVIEW_CLIENT_T {
+    int               fd;
+    int               stream;
+    int               streaming;    /// Request accepted, frames follow the response header
+    int               closing;      /// Close once the output has been sent
+    int64_t           interval;     /// usec between frames, from ?fps=
+    int64_t           due;          /// When the next frame may be sent
+    uint32_t          lastFrame;    /// Tap frame of the last frame sent
+    char              in[LIVEVIEW_REQUEST_BYTES];
+    int               inLen;
+    char              head[256];    /// Response header
+    LIVEVIEW_FRAME_T *frame;        /// Frame being sent, holds a reference
+    const char       *out;          /// head or frame->data, NULL when idle
+    int               outLen;
+    int               off;
+};
+
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static void frame_release(LIVEVIEW_FRAME_T *frame)
+{
+    if (frame && --frame->refs == 0)
+        free(frame);
+}
+
+/**
+ * Overlay the mask on the frame and JPEG-encode it as one multipart part
+ *
+ * @return The frame with one reference, NULL if encoding failed
+ */
+static LIVEVIEW_FRAME_T *encode_frame(LIVEVIEW_STREAM_T *s, uint32_t tapFrame)
+{
+    int params[] = { CV_IMWRITE_JPEG_QUALITY, LIVEVIEW_QUALITY, 0 };
+    int w = s->bgr->width, h = s->bgr->height;
+    LIVEVIEW_FRAME_T *frame;
+    char head[128];
+    int headLen, x, y;
+    CvMat *jpeg;
+
+    for (y = 0; y < h; y++) {
+        const unsigned char *src = s->image + y*w;
+        const unsigned char *mask = s->mask + y*w;
+        unsigned char *dst = (unsigned char *) s->bgr->imageData + y*s->bgr->widthStep;
+
+        for (x = 0; x < w; x++, dst += 3) {
+            int v = src[x];
+            if (mask[x]) {
+                dst[0] = dst[1] = v/2;
+                dst[2] = (v + 255)/2;
+            } else {
+                dst[0] = dst[1] = dst[2] = v;
+            }
+        }
+    }
+    jpeg = cvEncodeImage(".jpg", s->bgr, params);
+    if (!jpeg)
+        return NULL;
+    headLen = snprintf(head, sizeof(head), "--" LIVEVIEW_BOUNDARY "\r\nContent-Type: image/jpeg\r\n"
+                       "Content-Length: %d\r\n\r\n", jpeg->cols);
+    frame = malloc(sizeof(*frame) + headLen + jpeg->cols + 2);
+    if (frame) {
+        frame->refs = 1;
+        frame->tapFrame = tapFrame;
+        memcpy(frame->data, head, headLen);
+        memcpy(frame->data + headLen, jpeg->data.ptr, jpeg->cols);
+        memcpy(frame->data + headLen + jpeg->cols, "\r\n", 2);
+        frame->len = headLen + jpeg->cols + 2;
+    }
+    cvReleaseMat(&jpeg);
+    return frame;
+}
+
+static void client_free(LIVEVIEW_T *lv, int i)
+{
+    close(lv->clients[i]->fd);
+    frame_release(lv->clients[i]->frame);
+    free(lv->clients[i]);
+    lv->clients[i] = NULL;
+}
+
+static void client_send(LIVEVIEW_CLIENT_T *client, const char *data, int len)
+{
+    client->out = data;
+    client->outLen = len;
+    client->off = 0;
+}
+
+/**
+ * Write as much of the pending header or frame as the socket will take
+ *
+ * @return 0 if the client is still usable, -1 if it has gone away or is done
+ */
+static int client_flush(LIVEVIEW_CLIENT_T *client)
+{
+    while (client->out && client->off < client->outLen) {
+        ssize_t n = send(client->fd, client->out + client->off, client->outLen - client->off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        client->off += n;
+    }
+    if (client->out) {
+        client->out = NULL;
+        frame_release(client->frame);
+        client->frame = NULL;
+    }
+    return client->closing ? -1 : 0;
+}
+
+/**
+ * Queue a response header; anything but 200 closes the connection
+ */
+static void client_respond(LIVEVIEW_CLIENT_T *client, const char *status, const char *type)
+{
+    int len = snprintf(client->head, sizeof(client->head),
+                       "HTTP/1.0 %s\r\nContent-Type: %s\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n",
+                       status, type);
+    client->closing = strncmp(status, "200", 3) != 0;
+    client_send(client, client->head, len);
+}
+
+/**
+ * Parse "GET /<stream>?fps=<rate>" once the request is complete
+ */
+static void client_request(LIVEVIEW_T *lv, LIVEVIEW_CLIENT_T *client)
+{
+    char path[128];
+    const char *query;
+    double fps = LIVEVIEW_FPS;
+    char *end;
+
+    if (sscanf(client->in, "GET %127s", path) != 1) {
+        client_respond(client, "400 Bad Request", "text/plain");
+        return;
+    }
+    client->stream = strtol(path + 1, &end, 10);
+    if (end == path + 1)
+        client->stream = 0;
+    if (path[0] != '/' || (*end && *end != '?') || client->stream < 0 || client->stream >= lv->numStreams) {
+        client_respond(client, "404 Not Found", "text/plain");
+        return;
+    }
+    query = strchr(path, '?');
+    if (query && (query = strstr(query, "fps=")) != NULL)
+        fps = atof(query + 4);
+    if (fps <= 0 || fps > LIVEVIEW_FPS)
+        fps = LIVEVIEW_FPS;
+    client->interval = (int64_t)(1000000/fps);
+    client->due = 0;
+    client->lastFrame = 0;
+    client->streaming = 1;
+    client_respond(client, "200 OK", "multipart/x-mixed-replace; boundary=" LIVEVIEW_BOUNDARY);
+}
+
+/**
+ * Read the request; once streaming, reads only notice the client leaving
+ *
+ * @return 0 if the client is still usable, -1 if it has gone away
+ */
+static int client_read(LIVEVIEW_T *lv, LIVEVIEW_CLIENT_T *client)
+{
+    char discard[256];
+    ssize_t n;
+
+    if (client->streaming || client->closing) {
+        n = recv(client->fd, discard, sizeof(discard), 0);
+    } else {
+        n = recv(client->fd, client->in + client->inLen, sizeof(client->in) - 1 - client->inLen, 0);
+        if (n > 0) {
+            client->inLen += n;
+            client->in[client->inLen] = '\0';
+            if (strstr(client->in, "\r\n\r\n") || strstr(client->in, "\n\n"))
+                client_request(lv, client);
+            else if (client->inLen == (int)sizeof(client->in) - 1)
+                return -1;
+        }
+    }
+    if (n == 0)
+        return -1;
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    return 0;
+}
+
+static void accept_client(LIVEVIEW_T *lv)
+{
+    int fd = accept(lv->listenFd, NULL, NULL);
+    int i;
+
+    if (fd < 0)
+        return;
+    for (i = 0; i < LIVEVIEW_MAX_CLIENTS; i++) {
+        if (!lv->clients[i])
+            break;
+    }
+    if (i == LIVEVIEW_MAX_CLIENTS) {
+        close(fd);
+        return;
+    }
+    lv->clients[i] = calloc(1, sizeof(LIVEVIEW_CLIENT_T));
+    if (!lv->clients[i]) {
+        close(fd);
+        return;
+    }
+    set_nonblocking(fd);
+    lv->clients[i]->fd = fd;
+}
+
+static int client_ready(const LIVEVIEW_CLIENT_T *client, int stream, int64_t now)
+{
+    return client && client->streaming && !client->closing && client->stream == stream &&
+           !client->out && client->due <= now;
+}
+
+/**
+ * Give every client that is ready for one the stream's latest frame,
+ * encoding it first if the tap has a newer one
+ */
+static void deliver(LIVEVIEW_T *lv, int64_t now)
+{
+    int st, i;
+
+    for (st = 0; st < lv->numStreams; st++) {
+        LIVEVIEW_STREAM_T *s = &lv->streams[st];
+        FRAMETAP_HDR_T info;
+        int ready = 0;
+
+        for (i = 0; i < LIVEVIEW_MAX_CLIENTS; i++)
+            ready += client_ready(lv->clients[i], st, now);
+        if (!ready)
+            continue;
+        if (frametap_read(s->tap, &info, s->image, s->mask, s->lastFrame) == 1) {
+            LIVEVIEW_FRAME_T *frame = encode_frame(s, info.frames);
+
+            if (frame) {
+                frame_release(s->current);
+                s->current = frame;
+                s->lastFrame = info.frames;
+                lv->encoded++;
+                for (i = 0; i < LIVEVIEW_MAX_CLIENTS; i++) {
+                    LIVEVIEW_CLIENT_T *client = lv->clients[i];
+                    if (client && client->streaming && client->stream == st && client->out)
+                        lv->skipped++;
+                }
+            }
+        }
+        if (!s->current)
+            continue;
+        for (i = 0; i < LIVEVIEW_MAX_CLIENTS; i++) {
+            LIVEVIEW_CLIENT_T *client = lv->clients[i];
+
+            if (!client_ready(client, st, now) || client->lastFrame == s->current->tapFrame)
+                continue;
+            client->frame = s->current;
+            client->frame->refs++;
+            client->lastFrame = s->current->tapFrame;
+            client->due = now + client->interval;
+            client_send(client, (const char *) client->frame->data, client->frame->len);
+            lv->sent++;
+            if (client_flush(client) != 0)
+                client_free(lv, i);
+        }
+    }
+}
+
+/**
+ * @return poll() timeout: until the next client is due a frame, or
+ *         forever if no client is waiting for one
+ */
+static int next_timeout(LIVEVIEW_T *lv, int64_t now)
+{
+    int timeout = -1;
+    int i;
+
+    for (i = 0; i < LIVEVIEW_MAX_CLIENTS; i++) {
+        LIVEVIEW_CLIENT_T *client = lv->clients[i];
+        int wait;
+
+        if (!client || !client->streaming || client->closing || client->out)
+            continue;
+        // Past due means waiting for the tap to publish a new frame
+        wait = (client->due > now) ? (int)((client->due - now + 999)/1000) : LIVEVIEW_POLL_MS;
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+    return timeout;
+}
+
+static void *liveview_thread(void *arg)
+{
+    LIVEVIEW_T *lv = (LIVEVIEW_T *) arg;
+    struct pollfd fds[2 + LIVEVIEW_MAX_CLIENTS];
+    int slot[LIVEVIEW_MAX_CLIENTS];
+
+    while (lv->running) {
+        int nfds = 2;
+        int i;
+
+        fds[0].fd = lv->listenFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = lv->wakeFd[0];
+        fds[1].events = POLLIN;
+        for (i = 0; i < LIVEVIEW_MAX_CLIENTS; i++) {
+            if (lv->clients[i]) {
+                fds[nfds].fd = lv->clients[i]->fd;
+                fds[nfds].events = POLLIN | (lv->clients[i]->out ? POLLOUT : 0);
+                slot[nfds-2] = i;
+                nfds++;
+            }
+        }
+        if (poll(fds, nfds, next_timeout(lv, report_now_us())) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("liveview poll");
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(lv->wakeFd[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        for (i = 2; i < nfds; i++) {
+            int c = slot[i-2];
+            LIVEVIEW_CLIENT_T *client = lv->clients[c];
+            int gone = 0;
+
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                gone = client_read(lv, client);
+            if (!gone && client->out)
+                gone = client_flush(client);
+            if (gone)
+                client_free(lv, c);
+        }
+        deliver(lv, report_now_us());
+        if (fds[0].revents & POLLIN)
+            accept_client(lv);
+    }
+    return NULL;
+}
+
+/**
+ * Start serving the given streams' taps on 127.0.0.1:port
+ *
+ * @param taps  One frame tap per stream, in stream order
+ * @param arena Frame arena to take the buffers from, NULL for the heap
+ * @return 0 if successful, -1 otherwise
+ */
+int liveview_open(LIVEVIEW_T *lv, int port, FRAMETAP_T **taps, int numTaps, ARENA_T *arena)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int i;
+
+    memset(lv, 0, sizeof(*lv));
+    lv->arena = arena;
+    if (numTaps > LIVEVIEW_MAX_STREAMS)
+        numTaps = LIVEVIEW_MAX_STREAMS;
+    for (i = 0; i < numTaps; i++) {
+        LIVEVIEW_STREAM_T *s = &lv->streams[i];
+        int w = taps[i]->hdr->width, h = taps[i]->hdr->height;
+
+        s->tap = taps[i];
+        if (arena) {
+            unsigned char *bgr = arena_alloc(arena, "live view bgr", (size_t)w*h*3);
+            s->image = arena_alloc(arena, "live view image", (size_t)w*h);
+            s->mask = arena_alloc(arena, "live view mask", (size_t)w*h);
+            if (bgr) {
+                s->bgr = cvCreateImageHeader(cvSize(w, h), IPL_DEPTH_8U, 3);
+                cvSetData(s->bgr, bgr, w*3);
+            }
+        } else {
+            s->image = malloc((size_t)w*h);
+            s->mask = malloc((size_t)w*h);
+            s->bgr = cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, 3);
+        }
+        if (!s->image || !s->mask || !s->bgr) {
+            fprintf(stderr, "Error: no memory for live view\n");
+            return -1;
+        }
+    }
+    lv->numStreams = numTaps;
+
+    lv->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lv->listenFd < 0) {
+        perror("liveview socket");
+        return -1;
+    }
+    setsockopt(lv->listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lv->listenFd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(lv->listenFd, LIVEVIEW_MAX_CLIENTS) < 0) {
+        perror("liveview bind");
+        close(lv->listenFd);
+        return -1;
+    }
+    set_nonblocking(lv->listenFd);
+
+    if (pipe(lv->wakeFd) < 0) {
+        perror("liveview pipe");
+        close(lv->listenFd);
+        return -1;
+    }
+    set_nonblocking(lv->wakeFd[0]);
+    set_nonblocking(lv->wakeFd[1]);
+
+    lv->running = 1;
+    if (vcos_thread_create(&lv->thread, "snoop_liveview", NULL, liveview_thread, lv) != VCOS_SUCCESS) {
+        fprintf(stderr, "liveview: unable to start thread\n");
+        lv->running = 0;
+        return -1;
+    }
+    printf("Live view on http://127.0.0.1:%d/\n", port);
+    return 0;
+}
+
+void liveview_close(LIVEVIEW_T *lv)
+{
+    int i;
+
+    if (!lv->running)
+        return;
+    lv->running = 0;
+    if (write(lv->wakeFd[1], "", 1) < 0)
+        perror("liveview wake");
+    vcos_thread_join(&lv->thread, NULL);
+    for (i = 0; i < LIVEVIEW_MAX_CLIENTS; i++) {
+        if (lv->clients[i])
+            client_free(lv, i);
+    }
+    for (i = 0; i < lv->numStreams; i++) {
+        frame_release(lv->streams[i].current);
+        if (lv->arena) {
+            cvReleaseImageHeader(&lv->streams[i].bgr);
+        } else {
+            free(lv->streams[i].image);
+            free(lv->streams[i].mask);
+            cvReleaseImage(&lv->streams[i].bgr);
+        }
+    }
+    close(lv->listenFd);
+    close(lv->wakeFd[0]);
+    close(lv->wakeFd[1]);
+}
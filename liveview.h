@@ -0,0 +1,69 @@
+/*
+ * File:   liveview.h
+ *
+ * Local live view for aiming a camera or checking a site without
+ * stopping snoopmon. An HTTP server on 127.0.0.1 streams MJPEG of each
+ * stream's analysis frames, read from its frame tap, with the motion
+ * mask tinted red:
+ *
+ *   http://127.0.0.1:<port>/<stream>?fps=<rate>
+ *
+ * Each new frame is JPEG-encoded once and the same bytes are sent to
+ * every client of that stream. Sockets are non-blocking: a client still
+ * sending its last frame simply misses new ones, so a slow client never
+ * holds up another or the detector. With no client connected the server
+ * thread sleeps in poll() and encodes nothing.
+ */
+
+#ifndef LIVEVIEW_H_
+#define LIVEVIEW_H_
+
+#include <stdint.h>
+
+#include <opencv2/core/core_c.h>
+
+#include "interface/vcos/vcos.h"
+
+#include "arena.h"
+#include "frametap.h"
+
+#define LIVEVIEW_MAX_CLIENTS 4
+#define LIVEVIEW_MAX_STREAMS 4
+#define LIVEVIEW_FPS         3.0   // Default and highest useful rate, one frame per motion check
+#define LIVEVIEW_POLL_MS     50    // How often a waiting client's tap is checked for a new frame
+#define LIVEVIEW_QUALITY     70
+
+/// Frame arena bytes the live view of a width x height tap takes
+#define LIVEVIEW_ARENA_BYTES(width, height) (2*ARENA_BYTES((size_t)(width)*(height)) + \
+                                             ARENA_BYTES((size_t)(width)*(height)*3))
+
+typedef struct LIVEVIEW_FRAME_T LIVEVIEW_FRAME_T;
+typedef struct LIVEVIEW_CLIENT_T LIVEVIEW_CLIENT_T;
+
+typedef struct {
+    FRAMETAP_T       *tap;
+    uint32_t          lastFrame;    /// Tap frame the current JPEG was made from
+    LIVEVIEW_FRAME_T *current;      /// Latest encoded frame, shared by every client
+    unsigned char    *image;        /// Copied out of the tap
+    unsigned char    *mask;
+    IplImage         *bgr;          /// Image with the mask overlaid, for the encoder
+} LIVEVIEW_STREAM_T;
+
+typedef struct {
+    int               listenFd;
+    int               wakeFd[2];
+    int               running;
+    VCOS_THREAD_T     thread;
+    int               numStreams;
+    LIVEVIEW_STREAM_T streams[LIVEVIEW_MAX_STREAMS];
+    ARENA_T          *arena;        /// Owner of the stream buffers, NULL if heap allocated
+    LIVEVIEW_CLIENT_T *clients[LIVEVIEW_MAX_CLIENTS];
+    uint32_t          encoded;      /// Frames encoded
+    uint32_t          sent;         /// Frames sent, counting each client
+    uint32_t          skipped;      /// Frames clients missed while still sending an earlier one
+} LIVEVIEW_T;
+
+int  liveview_open(LIVEVIEW_T *lv, int port, FRAMETAP_T **taps, int numTaps, ARENA_T *arena);
+void liveview_close(LIVEVIEW_T *lv);
+
+#endif /* LIVEVIEW_H_ */
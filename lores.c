@@ -0,0 +1,273 @@
+/*
+ * File:   lores.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "interface/mmal/util/mmal_util.h"
+#include "interface/mmal/util/mmal_util_params.h"
+#include "interface/mmal/util/mmal_default_components.h"
+
+#include "lores.h"
+#include "snapshot.h"
+
+static void lores_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    mmal_buffer_header_release(buffer);
+}
+
+static void lores_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    LORES_T *lo = (LORES_T *) port->userdata;
+    MMAL_BUFFER_HEADER_T *new_buffer;
+
+    mmal_buffer_header_mem_lock(buffer);
+    vcos_mutex_lock(&lo->lock);
+    if (lo->fp && buffer->length)
+        fwrite(buffer->data, 1, buffer->length, lo->fp);
+    vcos_mutex_unlock(&lo->lock);
+    mmal_buffer_header_mem_unlock(buffer);
+    mmal_buffer_header_release(buffer);
+    if (port->is_enabled) {
+        new_buffer = mmal_queue_get(lo->output_pool->queue);
+        if (!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+            printf("Unable to return a buffer to the low resolution encoder\n");
+    }
+}
+
+/**
+ * @param width, height Clip size, multiples of 32 and 16
+ */
+void lores_init(LORES_T *lo, int width, int height, int fps)
+{
+    memset(lo, 0, sizeof(*lo));
+    lo->width = width;
+    lo->height = height;
+    lo->fps = fps;
+    vcos_mutex_create(&lo->lock, "snoop_lores-lock");
+    vcos_mutex_create(&lo->feed_lock, "snoop_lores-feed-lock");
+}
+
+/**
+ * Create and enable the encoder
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int lores_start_encoder(LORES_T *lo, uint32_t bitrate)
+{
+    MMAL_ES_FORMAT_T *format;
+    MMAL_BUFFER_HEADER_T *buffer;
+    MMAL_STATUS_T status;
+
+    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &lo->encoder);
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Error: unable to create low resolution encoder (%u)\n", status);
+        return -1;
+    }
+    lo->input_port = lo->encoder->input[0];
+    lo->output_port = lo->encoder->output[0];
+
+    format = lo->input_port->format;
+    format->encoding = MMAL_ENCODING_I420;
+    format->encoding_variant = MMAL_ENCODING_I420;
+    format->es->video.width = lo->width;
+    format->es->video.height = lo->height;
+    format->es->video.crop.x = 0;
+    format->es->video.crop.y = 0;
+    format->es->video.crop.width = lo->width;
+    format->es->video.crop.height = lo->height;
+    format->es->video.frame_rate.num = lo->fps;
+    format->es->video.frame_rate.den = 1;
+    lo->input_port->buffer_size = lo->input_port->buffer_size_recommended;
+    lo->input_port->buffer_num = 4;
+    status = mmal_port_format_commit(lo->input_port);
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Error: unable to commit low resolution encoder input format (%u)\n", status);
+        return -1;
+    }
+
+    mmal_format_copy(lo->output_port->format, lo->input_port->format);
+    lo->output_port->format->encoding = MMAL_ENCODING_H264;
+    lo->output_port->format->bitrate = bitrate;
+    lo->output_port->buffer_size = lo->output_port->buffer_size_recommended;
+    if (lo->output_port->buffer_size < lo->output_port->buffer_size_min)
+        lo->output_port->buffer_size = lo->output_port->buffer_size_min;
+    lo->output_port->buffer_num = 2;
+    if (lo->output_port->buffer_num < lo->output_port->buffer_num_min)
+        lo->output_port->buffer_num = lo->output_port->buffer_num_min;
+    status = mmal_port_format_commit(lo->output_port);
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Error: unable to commit low resolution encoder output format (%u)\n", status);
+        return -1;
+    }
+
+    lo->input_pool = mmal_port_pool_create(lo->input_port, lo->input_port->buffer_num, lo->input_port->buffer_size);
+    lo->output_pool = mmal_port_pool_create(lo->output_port, lo->output_port->buffer_num, lo->output_port->buffer_size);
+    lo->input_port->userdata = (struct MMAL_PORT_USERDATA_T *) lo;
+    lo->output_port->userdata = (struct MMAL_PORT_USERDATA_T *) lo;
+    if (mmal_port_enable(lo->input_port, lores_input_callback) != MMAL_SUCCESS ||
+        mmal_port_enable(lo->output_port, lores_output_callback) != MMAL_SUCCESS) {
+        fprintf(stderr, "Error: unable to enable low resolution encoder\n");
+        return -1;
+    }
+    while ((buffer = mmal_queue_get(lo->output_pool->queue)) != NULL) {
+        if (mmal_port_send_buffer(lo->output_port, buffer) != MMAL_SUCCESS)
+            fprintf(stderr, "Unable to send a buffer to the low resolution encoder\n");
+    }
+    __sync_synchronize();  // Ports and pools before the flag that publishes them
+    lo->ready = 1;
+    return 0;
+}
+
+/**
+ * Tear the encoder down, discarding anything it has not output yet
+ */
+void lores_stop_encoder(LORES_T *lo)
+{
+    vcos_mutex_lock(&lo->feed_lock);
+    lo->ready = 0;
+    if (!lo->encoder) {
+        vcos_mutex_unlock(&lo->feed_lock);
+        return;
+    }
+    mmal_port_disable(lo->input_port);
+    mmal_port_disable(lo->output_port);
+    if (lo->input_pool)
+        mmal_port_pool_destroy(lo->input_port, lo->input_pool);
+    if (lo->output_pool)
+        mmal_port_pool_destroy(lo->output_port, lo->output_pool);
+    mmal_component_destroy(lo->encoder);
+    lo->encoder = NULL;
+    lo->input_pool = NULL;
+    lo->output_pool = NULL;
+    vcos_mutex_unlock(&lo->feed_lock);
+}
+
+void lores_set_bitrate(LORES_T *lo, uint32_t bitrate)
+{
+    if (bitrate < LORES_MIN_BITRATE)
+        bitrate = LORES_MIN_BITRATE;
+    if (lo->encoder &&
+        mmal_port_parameter_set_uint32(lo->output_port, MMAL_PARAMETER_VIDEO_BIT_RATE, bitrate) != MMAL_SUCCESS)
+        fprintf(stderr, "Unable to set low resolution clip rate\n");
+}
+
+/**
+ * Start writing encoder output to a new clip file
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int lores_begin_clip(LORES_T *lo, const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    vcos_mutex_lock(&lo->lock);
+    lo->fp = fp;
+    vcos_mutex_unlock(&lo->lock);
+    return 0;
+}
+
+/**
+ * Close the clip file, durably
+ *
+ * @return Clip bytes, -1 if no clip was open
+ */
+long lores_end_clip(LORES_T *lo)
+{
+    long size = -1;
+
+    vcos_mutex_lock(&lo->lock);
+    if (lo->fp) {
+        fflush(lo->fp);
+        fdatasync(fileno(lo->fp));
+        size = ftell(lo->fp);
+        fclose(lo->fp);
+        lo->fp = NULL;
+    }
+    vcos_mutex_unlock(&lo->lock);
+    return size;
+}
+
+/**
+ * Take an encoder input buffer. On success feed_lock is held until
+ * lores_send() or lores_drop() hands it back.
+ */
+static MMAL_BUFFER_HEADER_T *lores_input_buffer(LORES_T *lo)
+{
+    MMAL_BUFFER_HEADER_T *buffer = NULL;
+
+    if (vcos_mutex_trylock(&lo->feed_lock) != VCOS_SUCCESS) {
+        lo->drops++;  // Being torn down, never wait on it from a port callback
+        return NULL;
+    }
+    if (lo->ready)
+        buffer = mmal_queue_get(lo->input_pool->queue);
+    if (!buffer) {
+        vcos_mutex_unlock(&lo->feed_lock);
+        lo->drops++;
+    }
+    return buffer;
+}
+
+static void lores_drop(LORES_T *lo, MMAL_BUFFER_HEADER_T *buffer)
+{
+    mmal_buffer_header_release(buffer);
+    vcos_mutex_unlock(&lo->feed_lock);
+    lo->drops++;
+}
+
+static void lores_send(LORES_T *lo, MMAL_BUFFER_HEADER_T *buffer, int64_t pts)
+{
+    buffer->pts = pts;
+    buffer->dts = pts;
+    if (mmal_port_send_buffer(lo->input_port, buffer) != MMAL_SUCCESS) {
+        lores_drop(lo, buffer);
+        return;
+    }
+    vcos_mutex_unlock(&lo->feed_lock);
+    lo->frames++;
+}
+
+/**
+ * Encode a frame that is already at the clip size, from the camera's
+ * preview port
+ */
+void lores_encode(LORES_T *lo, const unsigned char *frame, int length, int64_t pts)
+{
+    MMAL_BUFFER_HEADER_T *buffer = lores_input_buffer(lo);
+
+    if (!buffer)
+        return;
+    if ((uint32_t)length > buffer->alloc_size)
+        length = buffer->alloc_size;
+    memcpy(buffer->data, frame, length);
+    buffer->length = length;
+    lores_send(lo, buffer, pts);
+}
+
+/**
+ * Downscale a tightly packed width x height I420 frame straight into an
+ * encoder input buffer and encode it
+ */
+void lores_scale(LORES_T *lo, const unsigned char *frame, int width, int height, int64_t pts)
+{
+    MMAL_BUFFER_HEADER_T *buffer = lores_input_buffer(lo);
+    int w = lo->width, h = lo->height;
+
+    if (!buffer)
+        return;
+    if (buffer->alloc_size < (uint32_t)(w*h*3/2)) {
+        lores_drop(lo, buffer);
+        return;
+    }
+    snapshot_scale(frame, width, height, buffer->data, w, h);
+    buffer->length = w*h*3/2;
+    lores_send(lo, buffer, pts);
+}
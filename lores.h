@@ -0,0 +1,56 @@
+/*
+ * File:   lores.h
+ *
+ * Low-resolution companion clips. Alongside each full-resolution clip a
+ * second encoder records a small version of the same event, which
+ * snoop.py uploads straight away while the full clip waits in the spool
+ * until the server asks for it or the uplink is idle.
+ *
+ * Camera streams feed it from the camera's preview port, configured at
+ * LORES_WIDTH x LORES_HEIGHT; replay streams have no ISP to scale for
+ * them, so their full frames are downscaled in software.
+ */
+
+#ifndef LORES_H_
+#define LORES_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "interface/vcos/vcos.h"
+#include "interface/mmal/mmal.h"
+
+#define LORES_WIDTH       512     // 16:9, already aligned for the ISP and encoder
+#define LORES_HEIGHT      288
+#define LORES_MIN_BITRATE 100000
+#define LORES_SUFFIX      "_lo.h264"
+
+typedef struct {
+    int               width;
+    int               height;
+    int               fps;
+    MMAL_COMPONENT_T *encoder;
+    MMAL_PORT_T      *input_port;
+    MMAL_POOL_T      *input_pool;
+    MMAL_PORT_T      *output_port;
+    MMAL_POOL_T      *output_pool;
+    volatile int      ready;        /// Encoder may be fed
+    VCOS_MUTEX_T      feed_lock;    /// Held to feed the encoder, and across its teardown
+    VCOS_MUTEX_T      lock;         /// Guards fp
+    FILE             *fp;           /// Clip being written
+    uint32_t          frames;       /// Frames sent to the encoder, reset by the owner per clip
+    uint32_t          drops;        /// Frames with no encoder input buffer
+} LORES_T;
+
+void lores_init(LORES_T *lo, int width, int height, int fps);
+int  lores_start_encoder(LORES_T *lo, uint32_t bitrate);
+void lores_stop_encoder(LORES_T *lo);
+void lores_set_bitrate(LORES_T *lo, uint32_t bitrate);
+
+int  lores_begin_clip(LORES_T *lo, const char *path);
+long lores_end_clip(LORES_T *lo);
+
+void lores_encode(LORES_T *lo, const unsigned char *frame, int length, int64_t pts);
+void lores_scale(LORES_T *lo, const unsigned char *frame, int width, int height, int64_t pts);
+
+#endif /* LORES_H_ */
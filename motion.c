@@ -0,0 +1,122 @@
+/*
+ * File:   motion.c
+ */
+
+#include <string.h>
+
+#include "motion.h"
+
+/**
+ * Compare two analysis-resolution luma frames
+ *
+ * @param params Detector thresholds
+ * @param prev   Previous frame, w*h bytes
+ * @param cur    Current frame, w*h bytes
+ * @param exclude If not NULL, w*h bytes; 255 where changes are ignored
+ * @param diff   Scratch, w*h bytes; 255 where the pixel changed
+ * @param mask   Output, w*h bytes; 255 where the change survived noise filtering
+ * @param box    If not NULL, receives the bounding box of the mask
+ * @return Number of pixels marked in the mask (overlaps counted again)
+ */
+int motion_compare(const MOTION_PARAMS_T *params, const unsigned char *prev, const unsigned char *cur,
+                   const unsigned char *exclude, unsigned char *diff, unsigned char *mask, int w, int h, CvRect *box)
+{
+    int dataSize = w*h;
+    int i=0;
+    int j=0;
+    int x=0;
+    int y=0;
+    for(i = 0; i<dataSize; i++) {
+        int d = prev[i]-cur[i];
+        if (d < 0) d *= -1;
+        diff[i] = (d >= params->diffThreshold) ? 255: 0;
+    }
+    if (exclude) {
+        for (i = 0; i<dataSize; i++)
+            diff[i] &= ~exclude[i];
+    }
+    memset(mask, 0, dataSize);
+    int m = (params->noiseWindow*params->noiseWindow)/2;
+    int n = (params->noiseWindow-1)/2;
+    int total = 0;
+    int w1 = w-1;
+    int h1 = h-1;
+    int minx = w, miny = h, maxx = -1, maxy = -1;
+    for (x=1; x<w1; x++) {
+        for (y=1; y<h1; y++) {
+            int marked = 0;
+            int xstop = x+n;
+            int ystop = y+n;
+            if (exclude && exclude[y*w+x])
+                continue;
+            for (i=x-n; i<xstop+n; i++) {
+                for (j=y-n; j<ystop; j++) {
+                    if (diff[j*w+i] == 255)
+                        marked++;
+                    if (marked >=m) break;
+                }
+                if (marked >=m) break;
+            }
+            if (marked >= m) {
+                if (x-n < minx) minx = x-n;
+                if (y-n < miny) miny = y-n;
+                if (xstop > maxx) maxx = xstop;
+                if (ystop > maxy) maxy = ystop;
+                for(i=x-n; i<xstop; i++) {
+                    for(j=y-n; j<ystop; j++) {
+                        mask[j*w+i] = 255;
+                        total++;
+                    }
+                }
+            }
+        }
+    }
+    if (box) {
+        *box = (maxx < 0) ? cvRect(0, 0, 0, 0) : cvRect(minx, miny, maxx-minx, maxy-miny);
+    }
+    return total;
+}
+
+/**
+ * Count the pixels that changed between two coarse luma frames. An
+ * area-averaged coarse pixel moves by its share of the changed analysis
+ * pixels under it, so coarseDiff is set well below diffThreshold.
+ *
+ * @param prev    Previous coarse frame, w*h bytes
+ * @param cur     Current coarse frame, w*h bytes
+ * @param exclude If not NULL, w*h bytes; non-zero where changes are ignored
+ * @return Number of changed coarse pixels
+ */
+int motion_coarse(const MOTION_PARAMS_T *params, const unsigned char *prev, const unsigned char *cur,
+                  const unsigned char *exclude, int w, int h)
+{
+    int dataSize = w*h;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < dataSize; i++) {
+        int d = prev[i]-cur[i];
+        if (d < 0) d = -d;
+        if (d >= params->coarseDiff && !(exclude && exclude[i]))
+            count++;
+    }
+    return count;
+}
+
+/**
+ * @param coarseCount Result of motion_coarse()
+ * @return 1 if the full resolution check should run, 0 if the scene is static
+ */
+int motion_gate(const MOTION_PARAMS_T *params, int coarseCount)
+{
+    return params->coarseGate <= 0 || coarseCount >= params->coarseGate;
+}
+
+/**
+ * @param pixCount Result of motion_compare()
+ * @return 1 if the change is large enough to start a capture
+ */
+int motion_triggered(const MOTION_PARAMS_T *params, int pixCount)
+{
+    return pixCount > params->pixelThreshold;
+}
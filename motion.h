@@ -0,0 +1,56 @@
+/*
+ * File:   motion.h
+ *
+ * Pixel-difference motion detector, shared by snoopmon and the offline tools.
+ *
+ * Checks run coarse to fine: a cheap difference of MOTION_COARSE_WIDTH x
+ * MOTION_COARSE_HEIGHT frames gates motion_compare(), so a static scene
+ * never pays for the full resolution noise filter. The gate sits well
+ * below the full detector's threshold; motioncmp replays a recording
+ * through both paths and reports any trigger the gate would have missed.
+ *
+ * Both checks take an optional exclusion mask, such as heatmap.c builds
+ * for chronically active areas; changes under it are dropped before the
+ * noise filter, which also skips windows centred on excluded pixels.
+ */
+
+#ifndef MOTION_H_
+#define MOTION_H_
+
+#include <opencv2/core/core_c.h>
+
+typedef struct {
+    int diffThreshold;   /// Per-pixel luma difference that counts as changed
+    int noiseWindow;     /// Neighbourhood size for the noise filter, must be odd
+    int pixelThreshold;  /// Total number of pixels changed that means motion
+    int coarseDiff;      /// Coarse pixel difference that counts as changed
+    int coarseGate;      /// Coarse pixels changed before the full check runs, 0 always runs it
+} MOTION_PARAMS_T;
+
+#define MOTION_PARAMS_DEFAULT { 25, 3, 5000, 12, 6 }
+
+#define MOTION_COARSE_WIDTH  160     // 1/8 of the 1280x720 video
+#define MOTION_COARSE_HEIGHT 90
+
+#define VIDEO_WIDTH 1280
+#define VIDEO_HEIGHT 720
+#define VIDEO_FPS 30
+#define OPENCV_WIDTH (VIDEO_WIDTH/2)    // Analysis resolution
+#define OPENCV_HEIGHT (VIDEO_HEIGHT/2)
+
+// Capture state machine timing, shared by snoopmon and its evaluation tools
+#define CAPTURE_LENGTH 15  // Seconds
+#define SUSPEND_LENGTH 10  // Seconds
+#define MOTION_PERIOD (VIDEO_FPS/3)  // Times per second
+
+#define CAPTURE_FRAME_COUNT (VIDEO_FPS*CAPTURE_LENGTH)
+#define SUSPEND_FRAME_COUNT ((VIDEO_FPS*SUSPEND_LENGTH)-MOTION_PERIOD)
+
+int motion_compare(const MOTION_PARAMS_T *params, const unsigned char *prev, const unsigned char *cur,
+                   const unsigned char *exclude, unsigned char *diff, unsigned char *mask, int w, int h, CvRect *box);
+int motion_coarse(const MOTION_PARAMS_T *params, const unsigned char *prev, const unsigned char *cur,
+                  const unsigned char *exclude, int w, int h);
+int motion_gate(const MOTION_PARAMS_T *params, int coarseCount);
+int motion_triggered(const MOTION_PARAMS_T *params, int pixCount);
+
+#endif /* MOTION_H_ */
@@ -0,0 +1,210 @@
+/*
+ * File:   motioncmp.c
+ *
+ * Replays a raw 1280x720 I420 recording through the motion detector twice,
+ * as snoopmon checks it every MOTION_PERIOD frames: once always running the
+ * full resolution comparison, and once behind the coarse gate. Every check
+ * where the full detector triggers and the gated one does not is listed as
+ * a missed trigger, and the time per check of both paths is reported, so
+ * coarseDiff and coarseGate can be tuned against real footage.
+ *
+ * Both paths keep their own previous frame the way snoopmon does, so the
+ * gated path rebuilds its full resolution previous frame only when the
+ * gate opens.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "interface/vcos/vcos.h"
+
+#include "motion.h"
+#include "replay.h"
+
+typedef struct {
+    MOTION_PARAMS_T params;
+    int             period;
+    int             verbose;
+    uint32_t        frame;
+    IplImage       *frames[2];      /// Y planes of this and the previous checked frame
+    int             cur;
+    IplImage       *image;          /// Analysis resolution frame
+    IplImage       *prev;           /// Full path's previous frame
+    IplImage       *gatedPrev;      /// Gated path's previous frame, rebuilt when stale
+    int             gatedStale;
+    IplImage       *coarse;
+    IplImage       *prevCoarse;
+    IplImage       *diff;
+    IplImage       *mask;
+    uint32_t        checks;
+    uint32_t        fullTriggers;
+    uint32_t        gatedTriggers;
+    uint32_t        missed;
+    uint32_t        extra;
+    uint32_t        gateOpen;
+    double          fullNs;
+    double          gatedNs;
+} CMP_T;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static int full_check(CMP_T *c, IplImage *y, IplImage *prev)
+{
+    int pixCount;
+
+    cvResize(y, c->image, CV_INTER_LINEAR);
+    pixCount = motion_compare(&c->params, (unsigned char *) prev->imageData, (unsigned char *) c->image->imageData, NULL,
+                              (unsigned char *) c->diff->imageData, (unsigned char *) c->mask->imageData,
+                              OPENCV_WIDTH, OPENCV_HEIGHT, NULL);
+    memcpy(prev->imageData, c->image->imageData, OPENCV_WIDTH*OPENCV_HEIGHT);
+    return pixCount;
+}
+
+/**
+ * @return Full resolution pixel count, -1 if the gate kept the check coarse
+ */
+static int gated_check(CMP_T *c, IplImage *y, IplImage *prevY, int *coarseCount)
+{
+    IplImage *t;
+
+    cvResize(y, c->coarse, CV_INTER_AREA);
+    *coarseCount = motion_coarse(&c->params, (unsigned char *) c->prevCoarse->imageData,
+                                 (unsigned char *) c->coarse->imageData, NULL, MOTION_COARSE_WIDTH, MOTION_COARSE_HEIGHT);
+    t = c->prevCoarse;
+    c->prevCoarse = c->coarse;
+    c->coarse = t;
+    if (!motion_gate(&c->params, *coarseCount)) {
+        c->gatedStale = 1;
+        return -1;
+    }
+    if (c->gatedStale) {
+        cvResize(prevY, c->gatedPrev, CV_INTER_LINEAR);
+        c->gatedStale = 0;
+    }
+    return full_check(c, y, c->gatedPrev);
+}
+
+static void cmp_frame(void *ctx, const unsigned char *data, int length, int64_t pts)
+{
+    CMP_T *c = (CMP_T *) ctx;
+    IplImage *y, *prevY;
+    int full, gated, coarseCount, fullFlag, gatedFlag;
+    double t0, t1, t2;
+
+    if (c->frame++ % c->period)
+        return;
+    c->cur ^= 1;
+    y = c->frames[c->cur];
+    prevY = c->frames[c->cur ^ 1];
+    memcpy(y->imageData, data, VIDEO_WIDTH*VIDEO_HEIGHT);
+    if (c->frame == 1) {
+        // First frame only seeds both paths, as snoopmon's firstFrame does
+        cvResize(y, c->prev, CV_INTER_LINEAR);
+        memcpy(c->gatedPrev->imageData, c->prev->imageData, OPENCV_WIDTH*OPENCV_HEIGHT);
+        cvResize(y, c->prevCoarse, CV_INTER_AREA);
+        return;
+    }
+
+    t0 = now_ns();
+    full = full_check(c, y, c->prev);
+    t1 = now_ns();
+    gated = gated_check(c, y, prevY, &coarseCount);
+    t2 = now_ns();
+
+    c->checks++;
+    c->fullNs += t1 - t0;
+    c->gatedNs += t2 - t1;
+    fullFlag = motion_triggered(&c->params, full);
+    gatedFlag = motion_triggered(&c->params, gated);
+    c->fullTriggers += fullFlag;
+    c->gatedTriggers += gatedFlag;
+    if (gated >= 0)
+        c->gateOpen++;
+    if (fullFlag && !gatedFlag) {
+        c->missed++;
+        printf("missed  frame %7u  pixels %7d  coarse %5d\n", c->frame - 1, full, coarseCount);
+    } else if (gatedFlag && !fullFlag) {
+        c->extra++;
+        printf("extra   frame %7u  pixels %7d  coarse %5d\n", c->frame - 1, gated, coarseCount);
+    } else if (c->verbose) {
+        printf("check   frame %7u  pixels %7d  coarse %5d  %s\n", c->frame - 1, full, coarseCount,
+               gated >= 0 ? "open" : "gated");
+    }
+}
+
+static IplImage *cmp_image(int width, int height)
+{
+    IplImage *image = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1);
+
+    memset(image->imageData, 0, image->imageSize);
+    return image;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d coarse_diff] [-g coarse_gate] [-p period] [-v] frames.yuv\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    static CMP_T c;
+    MOTION_PARAMS_T defaults = MOTION_PARAMS_DEFAULT;
+    REPLAY_T replay;
+    int opt;
+
+    c.params = defaults;
+    c.period = MOTION_PERIOD;
+    while ((opt = getopt(argc, argv, "d:g:p:v")) != -1) {
+        switch (opt) {
+            case 'd': c.params.coarseDiff = atoi(optarg); break;
+            case 'g': c.params.coarseGate = atoi(optarg); break;
+            case 'p': c.period = atoi(optarg); break;
+            case 'v': c.verbose = 1; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || c.period < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    c.frames[0] = cmp_image(VIDEO_WIDTH, VIDEO_HEIGHT);
+    c.frames[1] = cmp_image(VIDEO_WIDTH, VIDEO_HEIGHT);
+    c.image = cmp_image(OPENCV_WIDTH, OPENCV_HEIGHT);
+    c.prev = cmp_image(OPENCV_WIDTH, OPENCV_HEIGHT);
+    c.gatedPrev = cmp_image(OPENCV_WIDTH, OPENCV_HEIGHT);
+    c.diff = cmp_image(OPENCV_WIDTH, OPENCV_HEIGHT);
+    c.mask = cmp_image(OPENCV_WIDTH, OPENCV_HEIGHT);
+    c.coarse = cmp_image(MOTION_COARSE_WIDTH, MOTION_COARSE_HEIGHT);
+    c.prevCoarse = cmp_image(MOTION_COARSE_WIDTH, MOTION_COARSE_HEIGHT);
+
+    if (replay_open(&replay, argv[optind], VIDEO_WIDTH, VIDEO_HEIGHT, 0, 0, NULL) != 0 ||
+        replay_start(&replay, cmp_frame, &c) != 0)
+        return 1;
+    while (replay.running)
+        usleep(10000);
+    replay_stop(&replay);
+    replay_close(&replay);
+
+    printf("checks %u  coarse_diff %d  coarse_gate %d\n", c.checks, c.params.coarseDiff, c.params.coarseGate);
+    printf("triggers full %u  gated %u  missed %u  extra %u\n", c.fullTriggers, c.gatedTriggers, c.missed, c.extra);
+    if (c.checks) {
+        printf("gate open %.1f%%  ns/check full %.0f  gated %.0f  (%.1fx)\n",
+               100.0*c.gateOpen/c.checks, c.fullNs/c.checks, c.gatedNs/c.checks,
+               c.gatedNs > 0 ? c.fullNs/c.gatedNs : 0.0);
+    }
+    return c.missed ? 2 : 0;
+}
@@ -0,0 +1,427 @@
+/*
+ * File:   motioneval.c
+ *
+ * Scores motion detector settings against labelled footage, so a site's
+ * thresholds can be tuned offline instead of on a live unit.
+ *
+ * The directory holds raw 1280x720 I420 recordings (*.yuv) and a
+ * labels.txt listing the real events, one per line:
+ *
+ *   clip.yuv start_sec end_sec
+ *
+ * A clip with no lines has no events, so every trigger in it is false.
+ * Every combination of the -d, -n and -t values is run over all clips,
+ * one setting per worker, through the same motion.c checks snoopmon makes
+ * every MOTION_PERIOD frames. Like snoopmon, a trigger starts a capture
+ * and the stream makes no checks again until capture and suspend are
+ * over.
+ *
+ * A trigger inside an event is a true positive. An event counts as
+ * detected if a trigger falls inside it or a capture already running
+ * covers its start; its latency is from the start to that trigger. Each
+ * setting reports precision, recall, mean and worst latency, and ns per
+ * check.
+ *
+ * The frames every setting checks are scaled once, when the clips are
+ * loaded, which holds about 0.75 MB per second of footage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "interface/vcos/vcos.h"
+
+#include "motion.h"
+#include "workpool.h"
+#include "replay.h"
+
+#define IMAGE_BYTES (OPENCV_WIDTH*OPENCV_HEIGHT)
+#define COARSE_BYTES (MOTION_COARSE_WIDTH*MOTION_COARSE_HEIGHT)
+
+#define MAX_CLIPS  256
+#define MAX_EVENTS 32      // Per clip
+#define MAX_VALUES 16      // Per swept parameter
+
+typedef struct {
+    double start;       /// Seconds into the clip
+    double end;
+} EVAL_EVENT_T;
+
+typedef struct {
+    char           name[64];
+    int            numChecks;   /// Frames snoopmon would check, every MOTION_PERIOD
+    int            loaded;
+    unsigned char *images;      /// numChecks analysis resolution frames
+    unsigned char *coarse;      /// numChecks coarse frames
+    int            numEvents;
+    EVAL_EVENT_T   events[MAX_EVENTS];
+} EVAL_CLIP_T;
+
+typedef struct {
+    WORKPOOL_JOB_T    job;
+    MOTION_PARAMS_T   params;
+    VCOS_SEMAPHORE_T *done;
+    unsigned char    *diff;
+    unsigned char    *mask;
+    uint32_t          checks;
+    uint32_t          triggers;
+    uint32_t          truePositives;
+    uint32_t          events;
+    uint32_t          detected;
+    double            latencySum;
+    double            latencyMax;
+    double            ns;
+} EVAL_RUN_T;
+
+static EVAL_CLIP_T g_clips[MAX_CLIPS];
+static int g_numClips = 0;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/**
+ * Seconds into a clip of check i
+ */
+static double check_time(int i)
+{
+    return (double)(i*MOTION_PERIOD + MOTION_PERIOD - 1)/VIDEO_FPS;
+}
+
+static EVAL_CLIP_T *find_clip(const char *name)
+{
+    int i;
+
+    for (i = 0; i < g_numClips; i++) {
+        if (strcmp(g_clips[i].name, name) == 0)
+            return &g_clips[i];
+    }
+    return NULL;
+}
+
+/**
+ * Scale the frames snoopmon would check the way processFrame() does
+ */
+static void load_frame(void *ctx, const unsigned char *data, int length, int64_t pts)
+{
+    EVAL_CLIP_T *clip = (EVAL_CLIP_T *) ctx;
+    IplImage y, image, coarse;
+    int frame = clip->loaded++;
+    int i = frame/MOTION_PERIOD;
+
+    if (frame % MOTION_PERIOD != MOTION_PERIOD - 1 || i >= clip->numChecks)
+        return;
+    cvInitImageHeader(&y, cvSize(VIDEO_WIDTH, VIDEO_HEIGHT), IPL_DEPTH_8U, 1, IPL_ORIGIN_TL, 4);
+    cvSetData(&y, (void *) data, VIDEO_WIDTH);
+    cvInitImageHeader(&image, cvSize(OPENCV_WIDTH, OPENCV_HEIGHT), IPL_DEPTH_8U, 1, IPL_ORIGIN_TL, 4);
+    cvSetData(&image, clip->images + (size_t)i*IMAGE_BYTES, OPENCV_WIDTH);
+    cvInitImageHeader(&coarse, cvSize(MOTION_COARSE_WIDTH, MOTION_COARSE_HEIGHT), IPL_DEPTH_8U, 1, IPL_ORIGIN_TL, 4);
+    cvSetData(&coarse, clip->coarse + (size_t)i*COARSE_BYTES, MOTION_COARSE_WIDTH);
+    cvResize(&y, &image, CV_INTER_LINEAR);
+    cvResize(&y, &coarse, CV_INTER_AREA);
+}
+
+/**
+ * @return 0 if successful, -1 otherwise
+ */
+static int load_clip(const char *dir, const char *name)
+{
+    EVAL_CLIP_T *clip;
+    REPLAY_T replay;
+    struct stat st;
+    char path[512];
+
+    if (g_numClips == MAX_CLIPS) {
+        fprintf(stderr, "Error: more than %d clips\n", MAX_CLIPS);
+        return -1;
+    }
+    clip = &g_clips[g_numClips];
+    snprintf(clip->name, sizeof(clip->name), "%s", name);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+    clip->numChecks = st.st_size/(VIDEO_WIDTH*VIDEO_HEIGHT*3/2)/MOTION_PERIOD;
+    clip->images = malloc((size_t)clip->numChecks*IMAGE_BYTES + 1);
+    clip->coarse = malloc((size_t)clip->numChecks*COARSE_BYTES + 1);
+    if (!clip->images || !clip->coarse) {
+        fprintf(stderr, "Error: no memory for %s\n", path);
+        return -1;
+    }
+    if (replay_open(&replay, path, VIDEO_WIDTH, VIDEO_HEIGHT, 0, 0, NULL) != 0 ||
+        replay_start(&replay, load_frame, clip) != 0)
+        return -1;
+    while (replay.running)
+        usleep(10000);
+    replay_stop(&replay);
+    replay_close(&replay);
+    g_numClips++;
+    return 0;
+}
+
+/**
+ * @return Number of clips, -1 on error
+ */
+static int load_clips(const char *dir)
+{
+    struct dirent *ent;
+    DIR *d = opendir(dir);
+
+    if (!d) {
+        perror(dir);
+        return -1;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        int len = strlen(ent->d_name);
+
+        if (len > 4 && strcmp(ent->d_name + len - 4, ".yuv") == 0 && load_clip(dir, ent->d_name) != 0) {
+            closedir(d);
+            return -1;
+        }
+    }
+    closedir(d);
+    return g_numClips;
+}
+
+/**
+ * @return Number of events, -1 on error
+ */
+static int load_labels(const char *dir)
+{
+    char path[512], line[256], name[64];
+    double start, end;
+    int events = 0;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/labels.txt", dir);
+    fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        EVAL_CLIP_T *clip;
+
+        if (line[0] == '#' || sscanf(line, "%63s %lf %lf", name, &start, &end) != 3)
+            continue;
+        clip = find_clip(name);
+        if (!clip) {
+            fprintf(stderr, "Warning: no clip %s for label\n", name);
+            continue;
+        }
+        if (clip->numEvents == MAX_EVENTS) {
+            fprintf(stderr, "Warning: more than %d events in %s\n", MAX_EVENTS, name);
+            continue;
+        }
+        clip->events[clip->numEvents].start = start;
+        clip->events[clip->numEvents].end = end;
+        clip->numEvents++;
+        events++;
+    }
+    fclose(fp);
+    return events;
+}
+
+/**
+ * Run one setting over one clip, as a stream would see it
+ */
+static void eval_clip(EVAL_RUN_T *run, const EVAL_CLIP_T *clip)
+{
+    double *triggers = malloc((clip->numChecks + 1)*sizeof(double));
+    int numTriggers = 0;
+    int resume = 1;     // The first check only seeds, as firstFrame does
+    int i, e, t;
+
+    if (!triggers) {
+        fprintf(stderr, "Error: no memory to evaluate %s\n", clip->name);
+        return;
+    }
+    for (i = resume; i < clip->numChecks; i++) {
+        const unsigned char *prev, *cur;
+        int pixCount = 0, open;
+        double t0;
+
+        if (i < resume)
+            continue;
+        t0 = now_ns();
+        open = motion_gate(&run->params, motion_coarse(&run->params, clip->coarse + (size_t)(i-1)*COARSE_BYTES,
+                                                       clip->coarse + (size_t)i*COARSE_BYTES, NULL,
+                                                       MOTION_COARSE_WIDTH, MOTION_COARSE_HEIGHT));
+        if (open) {
+            prev = clip->images + (size_t)(i-1)*IMAGE_BYTES;
+            cur = clip->images + (size_t)i*IMAGE_BYTES;
+            pixCount = motion_compare(&run->params, prev, cur, NULL, run->diff, run->mask,
+                                      OPENCV_WIDTH, OPENCV_HEIGHT, NULL);
+        }
+        run->ns += now_ns() - t0;
+        run->checks++;
+        if (!motion_triggered(&run->params, pixCount))
+            continue;
+        triggers[numTriggers++] = check_time(i);
+        // Capture, then suspend; the frame that ends suspend seeds the next check
+        resume = i + 1 + (CAPTURE_FRAME_COUNT + SUSPEND_FRAME_COUNT)/MOTION_PERIOD;
+    }
+
+    run->triggers += numTriggers;
+    for (t = 0; t < numTriggers; t++) {
+        for (e = 0; e < clip->numEvents; e++) {
+            if (triggers[t] >= clip->events[e].start && triggers[t] <= clip->events[e].end) {
+                run->truePositives++;
+                break;
+            }
+        }
+    }
+    run->events += clip->numEvents;
+    for (e = 0; e < clip->numEvents; e++) {
+        const EVAL_EVENT_T *ev = &clip->events[e];
+
+        for (t = 0; t < numTriggers; t++) {
+            double latency = -1;
+
+            if (triggers[t] <= ev->start && triggers[t] + (double)CAPTURE_FRAME_COUNT/VIDEO_FPS >= ev->start)
+                latency = 0;
+            else if (triggers[t] >= ev->start && triggers[t] <= ev->end)
+                latency = triggers[t] - ev->start;
+            if (latency >= 0) {
+                run->detected++;
+                run->latencySum += latency;
+                if (latency > run->latencyMax)
+                    run->latencyMax = latency;
+                break;
+            }
+        }
+    }
+    free(triggers);
+}
+
+static void eval_run(WORKPOOL_JOB_T *job)
+{
+    EVAL_RUN_T *run = (EVAL_RUN_T *) job;
+    int c;
+
+    for (c = 0; c < g_numClips; c++)
+        eval_clip(run, &g_clips[c]);
+    vcos_semaphore_post(run->done);
+}
+
+/**
+ * Parse a comma separated list of values
+ *
+ * @return Number of values, 0 if there are none or too many
+ */
+static int parse_values(const char *arg, int *values)
+{
+    int n = 0;
+    char *end;
+
+    while (*arg && n < MAX_VALUES) {
+        values[n++] = strtol(arg, &end, 10);
+        if (end == arg)
+            return 0;
+        arg = (*end == ',') ? end + 1 : end;
+    }
+    return *arg ? 0 : n;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d diff,...] [-n window,...] [-t pixels,...] [-w workers] clip_dir\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    MOTION_PARAMS_T defaults = MOTION_PARAMS_DEFAULT;
+    int diffs[MAX_VALUES] = { defaults.diffThreshold };
+    int windows[MAX_VALUES] = { defaults.noiseWindow };
+    int pixels[MAX_VALUES] = { defaults.pixelThreshold };
+    int numDiffs = 1, numWindows = 1, numPixels = 1;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    VCOS_SEMAPHORE_T done;
+    WORKPOOL_T pool;
+    EVAL_RUN_T *runs;
+    int numRuns, events, opt, d, n, p, r;
+
+    while ((opt = getopt(argc, argv, "d:n:t:w:")) != -1) {
+        switch (opt) {
+            case 'd': numDiffs = parse_values(optarg, diffs); break;
+            case 'n': numWindows = parse_values(optarg, windows); break;
+            case 't': numPixels = parse_values(optarg, pixels); break;
+            case 'w': workers = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || !numDiffs || !numWindows || !numPixels) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (n = 0; n < numWindows; n++) {
+        if (windows[n] < 1 || !(windows[n] & 1)) {
+            fprintf(stderr, "Error: noise window %d must be odd\n", windows[n]);
+            return 1;
+        }
+    }
+
+    if (load_clips(argv[optind]) <= 0) {
+        fprintf(stderr, "Error: no clips in %s\n", argv[optind]);
+        return 1;
+    }
+    if ((events = load_labels(argv[optind])) < 0)
+        return 1;
+    printf("%d clips, %d events\n", g_numClips, events);
+
+    numRuns = numDiffs*numWindows*numPixels;
+    runs = calloc(numRuns, sizeof(EVAL_RUN_T));
+    if (!runs || vcos_semaphore_create(&done, "motioneval-done", 0) != VCOS_SUCCESS ||
+        workpool_start(&pool, workers) != 0)
+        return 1;
+    r = 0;
+    for (d = 0; d < numDiffs; d++) {
+        for (n = 0; n < numWindows; n++) {
+            for (p = 0; p < numPixels; p++, r++) {
+                runs[r].job.run = eval_run;
+                runs[r].params = defaults;
+                runs[r].params.diffThreshold = diffs[d];
+                runs[r].params.noiseWindow = windows[n];
+                runs[r].params.pixelThreshold = pixels[p];
+                runs[r].done = &done;
+                runs[r].diff = malloc(IMAGE_BYTES);
+                runs[r].mask = malloc(IMAGE_BYTES);
+                if (!runs[r].diff || !runs[r].mask)
+                    return 1;
+                workpool_claim(&runs[r].job);
+                workpool_submit(&pool, &runs[r].job);
+            }
+        }
+    }
+    for (r = 0; r < numRuns; r++)
+        vcos_semaphore_wait(&done);
+
+    printf("%5s %6s %7s %8s %6s %9s %7s %8s %8s %8s\n",
+           "diff", "window", "pixels", "triggers", "false", "precision", "recall", "lat-avg", "lat-max", "ns/check");
+    for (r = 0; r < numRuns; r++) {
+        EVAL_RUN_T *run = &runs[r];
+
+        printf("%5d %6d %7d %8u %6u %9.3f %7.3f %8.2f %8.2f %8.0f\n",
+               run->params.diffThreshold, run->params.noiseWindow, run->params.pixelThreshold,
+               run->triggers, run->triggers - run->truePositives,
+               run->triggers ? (double)run->truePositives/run->triggers : 1.0,
+               run->events ? (double)run->detected/run->events : 1.0,
+               run->detected ? run->latencySum/run->detected : 0.0, run->latencyMax,
+               run->checks ? run->ns/run->checks : 0.0);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * File:   replay.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "replay.h"
+#include "report.h"
+
+static void *replay_thread(void *arg)
+{
+    REPLAY_T *replay = (REPLAY_T *) arg;
+    int64_t period = replay->fps ? 1000000/replay->fps : 0;
+    int64_t next = report_now_us();
+
+    while (replay->running) {
+        if (fread(replay->frame, 1, replay->frameSize, replay->fp) != (size_t)replay->frameSize) {
+            if (!replay->loop || fseek(replay->fp, 0, SEEK_SET) != 0)
+                break;
+            continue;
+        }
+        if (period) {
+            int64_t now = report_now_us();
+            if (next > now)
+                usleep(next - now);
+            next += period;
+        }
+        replay->frame_cb(replay->ctx, replay->frame, replay->frameSize, report_now_us());
+        replay->frames++;
+    }
+    replay->running = 0;
+    return NULL;
+}
+
+/**
+ * Open a raw I420 file for replay
+ *
+ * @param fps  Frame rate to pace delivery at, 0 for unpaced
+ * @param loop Non-zero to replay the file forever
+ * @param arena Frame arena to take the frame buffer from, NULL for the heap
+ * @return 0 if successful, -1 otherwise
+ */
+int replay_open(REPLAY_T *replay, const char *path, int width, int height, int fps, int loop,
+                ARENA_T *arena)
+{
+    memset(replay, 0, sizeof(*replay));
+    replay->fp = fopen(path, "rb");
+    if (!replay->fp) {
+        perror(path);
+        return -1;
+    }
+    replay->frameSize = width*height*3/2;
+    replay->fps = fps;
+    replay->loop = loop;
+    replay->arena = arena;
+    replay->frame = arena ? arena_alloc(arena, "replay frame", replay->frameSize) : malloc(replay->frameSize);
+    if (!replay->frame) {
+        fclose(replay->fp);
+        return -1;
+    }
+    return 0;
+}
+
+int replay_start(REPLAY_T *replay, REPLAY_FRAME_CB cb, void *ctx)
+{
+    replay->frame_cb = cb;
+    replay->ctx = ctx;
+    replay->running = 1;
+    if (vcos_thread_create(&replay->thread, "snoop_replay", NULL, replay_thread, replay) != VCOS_SUCCESS) {
+        fprintf(stderr, "Error: unable to start replay thread\n");
+        replay->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void replay_stop(REPLAY_T *replay)
+{
+    replay->running = 0;
+    vcos_thread_join(&replay->thread, NULL);
+}
+
+void replay_close(REPLAY_T *replay)
+{
+    if (replay->fp)
+        fclose(replay->fp);
+    if (!replay->arena)
+        free(replay->frame);
+    replay->fp = NULL;
+    replay->frame = NULL;
+}
@@ -0,0 +1,48 @@
+/*
+ * File:   replay.h
+ *
+ * File replay source: feeds raw I420 frames from a file to a stream as if
+ * they came from the camera video port.
+ */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "interface/vcos/vcos.h"
+
+#include "arena.h"
+
+/// Frame arena bytes a width x height replay takes
+#define REPLAY_ARENA_BYTES(width, height) ARENA_BYTES((size_t)(width)*(height)*3/2)
+
+/**
+ * Called for every frame read
+ *
+ * @param pts Monotonic usec at which the frame was read
+ */
+typedef void (*REPLAY_FRAME_CB)(void *ctx, const unsigned char *data, int length, int64_t pts);
+
+typedef struct {
+    FILE           *fp;
+    int             frameSize;      /// w*h*3/2
+    int             fps;            /// 0 replays as fast as the callback returns
+    int             loop;           /// Rewind at end of file
+    unsigned char  *frame;
+    ARENA_T        *arena;          /// Owner of frame, NULL if heap allocated
+    REPLAY_FRAME_CB frame_cb;
+    void           *ctx;
+    volatile int    running;
+    uint32_t        frames;         /// Frames delivered so far
+    VCOS_THREAD_T   thread;
+} REPLAY_T;
+
+int  replay_open(REPLAY_T *replay, const char *path, int width, int height, int fps, int loop,
+                 ARENA_T *arena);
+int  replay_start(REPLAY_T *replay, REPLAY_FRAME_CB cb, void *ctx);
+void replay_stop(REPLAY_T *replay);
+void replay_close(REPLAY_T *replay);
+
+#endif /* REPLAY_H_ */
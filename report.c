@@ -0,0 +1,43 @@
+/*
+ * File:   report.c
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "report.h"
+
+/**
+ * @return usec on CLOCK_MONOTONIC
+ */
+int64_t report_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/**
+ * Rewrite a report through a temporary file, so a reader never sees one
+ * half written
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int report_write(const char *path, REPORT_DUMP_FN dump, void *ctx)
+{
+    char tmpname[128];
+    FILE *fp;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", path);
+    fp = fopen(tmpname, "w");
+    if (!fp) {
+        perror(tmpname);
+        return -1;
+    }
+    dump(ctx, fp);
+    if (fclose(fp) != 0 || rename(tmpname, path) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
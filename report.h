@@ -0,0 +1,21 @@
+/*
+ * File:   report.h
+ *
+ * Plain text status reports kept in /tmp, so a module's counters can be
+ * read locally (cat /tmp/snoop_*.txt) without talking to the process,
+ * and the monotonic clock the modules take their timings from.
+ */
+
+#ifndef REPORT_H_
+#define REPORT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/// Writes a module's report to fp
+typedef void (*REPORT_DUMP_FN)(void *ctx, FILE *fp);
+
+int64_t report_now_us(void);
+int     report_write(const char *path, REPORT_DUMP_FN dump, void *ctx);
+
+#endif /* REPORT_H_ */
@@ -0,0 +1,205 @@
+/*
+ * File:   segbench.c
+ *
+ * Compares clip write paths on a real block device: buffered stdio as
+ * snoopmon used to write clips, and the preallocated segment ring with
+ * and without O_DIRECT. Encoder output is simulated as one chunk per
+ * frame at a given bitrate, with an I-frame every second.
+ *
+ * For each mode it reports the bytes the device actually saw against the
+ * bytes written (write amplification at the block layer), the number and
+ * average size of device write requests, and the latency of the per-frame
+ * write calls, which is what the encoder callback waits on.
+ *
+ * Run it on a scratch filesystem, e.g. a loopback image (see segbench.sh),
+ * so the device counters are not mixed with other traffic.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include "interface/vcos/vcos.h"
+
+#include "segstore.h"
+
+#define FRAME_RATE     30
+#define MAX_FRAME      (512*1024)
+#define LAG_CLIPS      3     // Clips waiting for "upload" before release
+
+typedef struct {
+    unsigned long long ios;
+    unsigned long long sectors;
+} DEV_STAT_T;
+
+static int read_dev_stat(const char *statPath, DEV_STAT_T *st)
+{
+    unsigned long long f[7];
+    FILE *fp = fopen(statPath, "r");
+
+    if (!fp)
+        return -1;
+    // read I/Os, merges, sectors, ticks, write I/Os, merges, sectors
+    if (fscanf(fp, "%llu %llu %llu %llu %llu %llu %llu", &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6]) != 7) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    st->ios = f[4];
+    st->sectors = f[6];
+    return 0;
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Frame sizes for a clip: an I-frame every second at eight times the
+ * size of the P-frames in between, averaging out to bitrate
+ */
+static int frame_size(int frame, int bitrate)
+{
+    int avg = bitrate/8/FRAME_RATE;
+    int p = avg*FRAME_RATE/(FRAME_RATE + 7);
+    int size = (frame % FRAME_RATE == 0) ? 8*p : p;
+    size += (rand() % (p/4 + 1)) - p/8;
+    return (size > MAX_FRAME) ? MAX_FRAME : size;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-m stdio|ring|direct] [-n clips] [-t clip_seconds] [-b bitrate] dir\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = "stdio";
+    int clips = 20, seconds = 15, bitrate = 1500000;
+    int frames, opt, c, f, n = 0;
+    char statPath[128], ringDir[256];
+    char names[LAG_CLIPS + 1][256];
+    unsigned char *frame;
+    double *lat, t0, elapsed;
+    DEV_STAT_T before, after;
+    SEGSTORE_T store;
+    long long logical = 0;
+    struct stat st;
+    const char *dir;
+
+    while ((opt = getopt(argc, argv, "m:n:t:b:")) != -1) {
+        switch (opt) {
+            case 'm': mode = optarg; break;
+            case 'n': clips = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'b': bitrate = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    dir = argv[optind];
+    if (stat(dir, &st) != 0) {
+        perror(dir);
+        return 1;
+    }
+    snprintf(statPath, sizeof(statPath), "/sys/dev/block/%u:%u/stat", major(st.st_dev), minor(st.st_dev));
+
+    if (strcmp(mode, "stdio") != 0) {
+        snprintf(ringDir, sizeof(ringDir), "%s/%s", dir, SEGSTORE_DIR);
+        if (segstore_open(&store, ringDir, SEGSTORE_SEGMENTS, SEGSTORE_SEGMENT_BYTES,
+                          SEGSTORE_CHUNK_BYTES, strcmp(mode, "direct") == 0) != 0)
+            return 1;
+    }
+
+    frames = seconds*FRAME_RATE;
+    frame = malloc(MAX_FRAME);
+    lat = malloc(sizeof(double)*frames*clips);
+    if (!frame || !lat)
+        return 1;
+    memset(frame, 0x5a, MAX_FRAME);
+    srand(1);
+
+    sync();
+    if (read_dev_stat(statPath, &before) != 0)
+        fprintf(stderr, "No block device counters at %s\n", statPath);
+    t0 = now_us();
+    for (c = 0; c < clips; c++) {
+        char *path = names[c % (LAG_CLIPS + 1)];
+        FILE *fp = NULL;
+        SEGSTORE_FILE_T *seg = NULL;
+
+        // The oldest clip has been "uploaded"; free it as snoopmon would
+        if (c > LAG_CLIPS) {
+            if (strcmp(mode, "stdio") != 0)
+                segstore_release(&store, path);
+            else
+                unlink(path);
+        }
+        snprintf(path, 256, "%s/bench_%d.h264", dir, c);
+        if (strcmp(mode, "stdio") == 0)
+            fp = fopen(path, "wb");
+        else
+            seg = segstore_create(&store, path);
+        if (!fp && !seg) {
+            fprintf(stderr, "Error: unable to create %s\n", path);
+            return 1;
+        }
+        for (f = 0; f < frames; f++) {
+            int len = frame_size(f, bitrate);
+            double t = now_us();
+            if (fp)
+                fwrite(frame, 1, len, fp);
+            else
+                segstore_write(seg, frame, len);
+            lat[n++] = now_us() - t;
+            logical += len;
+        }
+        if (fp) {
+            fflush(fp);
+            fdatasync(fileno(fp));
+            fclose(fp);
+        } else {
+            segstore_finish(seg);
+        }
+    }
+    sync();
+    elapsed = (now_us() - t0)/1e6;
+
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("mode %s: %d clips, %.1f MB in %.1f s\n", mode, clips, logical/1048576.0, elapsed);
+    printf("  write call us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           lat[n/2], lat[n*99/100], lat[n*999/1000], lat[n - 1]);
+    if (read_dev_stat(statPath, &after) == 0) {
+        double devBytes = (after.sectors - before.sectors)*512.0;
+        unsigned long long ios = after.ios - before.ios;
+        printf("  device: %.1f MB written, amplification %.3f, %llu writes, avg %.1f KB\n",
+               devBytes/1048576.0, devBytes/logical, ios, ios ? devBytes/ios/1024 : 0.0);
+    }
+
+    // Remove the clips still waiting; the ring stays for the next run
+    for (c = (clips > LAG_CLIPS + 1) ? clips - LAG_CLIPS - 1 : 0; c < clips; c++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/bench_%d.h264", dir, c);
+        unlink(path);
+    }
+    free(frame);
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Run segbench for each clip write mode on a fresh ext4 loopback image,
+# so the device counters only see the benchmark's own writes.
+# Usage: sudo ./segbench.sh [image_mb] [segbench options]
+set -e
+
+SIZE_MB=${1:-512}
+[ $# -gt 0 ] && shift
+BENCH=${SEGBENCH:-./segbench}
+IMG=$(mktemp /var/tmp/segbench.XXXXXX.img)
+MNT=$(mktemp -d)
+
+truncate -s ${SIZE_MB}M "$IMG"
+mkfs.ext4 -q -F "$IMG"
+for MODE in stdio ring direct; do
+    mount -o loop "$IMG" "$MNT"
+    "$BENCH" -m $MODE "$@" "$MNT"
+    umount "$MNT"
+done
+rm -f "$IMG"
+rmdir "$MNT"
@@ -0,0 +1,382 @@
+/*
+ * File:   segstore.c
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "segstore.h"
+
+static void segment_path(const SEGSTORE_T *store, int id, char *path, int len)
+{
+    snprintf(path, len, "%s/%d.seg", store->dir, id);
+}
+
+/**
+ * Empty a segment and reserve its blocks again without changing its size
+ */
+static int preallocate(SEGSTORE_T *store, int fd)
+{
+    if (ftruncate(fd, 0) != 0)
+        return -1;
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, store->segmentBytes) != 0) {
+        perror("segstore fallocate");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Top the ring up to its size with fresh segments. Called with the lock held.
+ */
+static void refill(SEGSTORE_T *store)
+{
+    while (store->numFree < store->segments) {
+        char path[192];
+        int id = store->nextId++;
+        int fd;
+
+        segment_path(store, id, path, sizeof(path));
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror(path);
+            return;
+        }
+        if (preallocate(store, fd) != 0) {
+            close(fd);
+            unlink(path);
+            return;
+        }
+        close(fd);
+        store->freeIds[store->numFree++] = id;
+        store->created++;
+    }
+}
+
+static int write_chunk(SEGSTORE_CHUNK_T *chunk)
+{
+    int done = 0;
+
+    while (done < chunk->len) {
+        ssize_t n = pwrite(chunk->file->fd, chunk->data + done, chunk->len - done, chunk->offset + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("segstore write");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * Write queued chunks in order, handing each back to its clip once it is
+ * on the file
+ */
+static void *segstore_thread(void *arg)
+{
+    SEGSTORE_T *store = (SEGSTORE_T *) arg;
+
+    for (;;) {
+        SEGSTORE_CHUNK_T *chunk;
+
+        vcos_semaphore_wait(&store->work);
+        vcos_mutex_lock(&store->lock);
+        chunk = store->queue;
+        if (chunk) {
+            store->queue = chunk->next;
+            if (!store->queue)
+                store->queueTail = NULL;
+        }
+        vcos_mutex_unlock(&store->lock);
+        if (!chunk) {
+            if (!store->running)
+                break;
+            continue;
+        }
+        if (!chunk->file->error && write_chunk(chunk) != 0)
+            chunk->file->error = 1;
+        vcos_semaphore_post(&chunk->file->free);
+    }
+    return NULL;
+}
+
+/**
+ * Open the segment ring, reusing segments left by the last run, and
+ * start its writer
+ *
+ * @param dir          Ring directory, created if missing
+ * @param segments     Free segments to keep ready
+ * @param segmentBytes Bytes to preallocate per segment, at least one clip
+ * @param chunkBytes   Write size, a multiple of SEGSTORE_ALIGN
+ * @param direct       Non-zero to bypass the page cache with O_DIRECT
+ * @return 0 if successful, -1 otherwise
+ */
+int segstore_open(SEGSTORE_T *store, const char *dir, int segments, long segmentBytes,
+                  int chunkBytes, int direct)
+{
+    DIR *d;
+    struct dirent *ent;
+    int maxFree = sizeof(store->freeIds)/sizeof(store->freeIds[0]);
+
+    memset(store, 0, sizeof(*store));
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    store->segments = (segments < maxFree) ? segments : maxFree;
+    store->segmentBytes = segmentBytes;
+    store->chunkBytes = (chunkBytes + SEGSTORE_ALIGN - 1) & ~(SEGSTORE_ALIGN - 1);
+    store->direct = direct;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    vcos_mutex_create(&store->lock, "snoop_segstore-lock");
+    vcos_semaphore_create(&store->work, "snoop_segstore-sem", 0);
+    store->running = 1;
+    if (vcos_thread_create(&store->thread, "snoop_segstore", NULL, segstore_thread, store) != VCOS_SUCCESS) {
+        fprintf(stderr, "Error: unable to start segment writer thread\n");
+        store->running = 0;
+        return -1;
+    }
+
+    d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        return -1;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        char *end;
+        int id = strtol(ent->d_name, &end, 10);
+        if (end == ent->d_name || strcmp(end, ".seg") != 0)
+            continue;
+        if (id >= store->nextId)
+            store->nextId = id + 1;
+        if (store->numFree < store->segments) {
+            store->freeIds[store->numFree++] = id;
+        } else {
+            char path[192];
+            segment_path(store, id, path, sizeof(path));
+            unlink(path);
+        }
+    }
+    closedir(d);
+    refill(store);
+    fprintf(stderr, "INFO: segment ring %s, %d x %ld MB, %d KB writes%s\n", dir, store->numFree,
+            segmentBytes/(1024*1024), store->chunkBytes/1024, direct ? ", O_DIRECT" : "");
+    return store->numFree ? 0 : -1;
+}
+
+/**
+ * Stop the writer once the chunks queued are written
+ */
+void segstore_close(SEGSTORE_T *store)
+{
+    if (store->running) {
+        store->running = 0;
+        vcos_semaphore_post(&store->work);
+        vcos_thread_join(&store->thread, NULL);
+    }
+    vcos_semaphore_delete(&store->work);
+    vcos_mutex_delete(&store->lock);
+}
+
+static void free_file(SEGSTORE_FILE_T *file)
+{
+    vcos_semaphore_delete(&file->free);
+    free(file->buffer);
+    free(file);
+}
+
+/**
+ * Start a clip at path in a preallocated segment
+ *
+ * @return Open clip, or NULL if no segment could be had
+ */
+SEGSTORE_FILE_T *segstore_create(SEGSTORE_T *store, const char *path)
+{
+    SEGSTORE_FILE_T *file;
+    char segPath[192];
+    int flags = O_WRONLY;
+    int i;
+
+    file = calloc(1, sizeof(SEGSTORE_FILE_T));
+    if (!file)
+        return NULL;
+    if (posix_memalign((void **) &file->buffer, SEGSTORE_ALIGN, (size_t)store->chunkBytes*SEGSTORE_CHUNKS) != 0) {
+        free(file);
+        return NULL;
+    }
+    file->store = store;
+    file->direct = store->direct;
+    for (i = 0; i < SEGSTORE_CHUNKS; i++) {
+        file->chunks[i].file = file;
+        file->chunks[i].data = file->buffer + (size_t)i*store->chunkBytes;
+    }
+    // The first chunk is being filled, the others are free
+    vcos_semaphore_create(&file->free, "snoop_segfile-sem", SEGSTORE_CHUNKS - 1);
+
+    vcos_mutex_lock(&store->lock);
+    refill(store);
+    if (store->numFree == 0) {
+        vcos_mutex_unlock(&store->lock);
+        fprintf(stderr, "Error: segment ring empty\n");
+        free_file(file);
+        return NULL;
+    }
+    segment_path(store, store->freeIds[--store->numFree], segPath, sizeof(segPath));
+    vcos_mutex_unlock(&store->lock);
+
+    if (rename(segPath, path) != 0) {
+        perror(path);
+        free_file(file);
+        return NULL;
+    }
+    if (file->direct)
+        flags |= O_DIRECT;
+    file->fd = open(path, flags);
+    if (file->fd < 0 && file->direct) {
+        // Not every filesystem supports O_DIRECT; aligned writes still help
+        file->direct = 0;
+        file->fd = open(path, O_WRONLY);
+    }
+    if (file->fd < 0) {
+        perror(path);
+        free_file(file);
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * Hand the current chunk to the writer
+ */
+static void queue_chunk(SEGSTORE_FILE_T *file, int len)
+{
+    SEGSTORE_T *store = file->store;
+    SEGSTORE_CHUNK_T *chunk = &file->chunks[file->current];
+
+    chunk->len = len;
+    chunk->offset = file->offset;
+    chunk->next = NULL;
+    vcos_mutex_lock(&store->lock);
+    if (store->queueTail)
+        store->queueTail->next = chunk;
+    else
+        store->queue = chunk;
+    store->queueTail = chunk;
+    vcos_mutex_unlock(&store->lock);
+    vcos_semaphore_post(&store->work);
+}
+
+/**
+ * Append to a clip. Data is staged and each chunk queued for the writer
+ * as it fills; this only waits if every chunk of the clip is still queued.
+ *
+ * @return 0 if successful, -1 if a chunk write has failed
+ */
+int segstore_write(SEGSTORE_FILE_T *file, const void *data, int len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    int chunkBytes = file->store->chunkBytes;
+
+    while (len > 0) {
+        int n = chunkBytes - file->fill;
+        if (n > len)
+            n = len;
+        memcpy(file->chunks[file->current].data + file->fill, p, n);
+        file->fill += n;
+        file->length += n;
+        p += n;
+        len -= n;
+        if (file->fill == chunkBytes) {
+            queue_chunk(file, chunkBytes);
+            file->offset += chunkBytes;
+            file->fill = 0;
+            // Chunks are written in the order queued, so the next one is the first to come free
+            vcos_semaphore_wait(&file->free);
+            file->current = (file->current + 1) % SEGSTORE_CHUNKS;
+        }
+    }
+    return file->error ? -1 : 0;
+}
+
+/**
+ * Write out the last partial chunk, wait for the writer to finish the
+ * clip, cut the file back to the logical end and close it
+ *
+ * @return Clip length in bytes, -1 on error
+ */
+int64_t segstore_finish(SEGSTORE_FILE_T *file)
+{
+    int64_t length = file->length;
+    int busy = SEGSTORE_CHUNKS - 1;
+    int ret = 0;
+    int i;
+
+    if (file->fill) {
+        unsigned char *data = file->chunks[file->current].data;
+        int len = file->fill;
+        if (file->direct) {
+            // O_DIRECT needs an aligned length; the padding is truncated below
+            len = (len + SEGSTORE_ALIGN - 1) & ~(SEGSTORE_ALIGN - 1);
+            memset(data + file->fill, 0, len - file->fill);
+        }
+        queue_chunk(file, len);
+        busy++;
+    }
+    for (i = 0; i < busy; i++)
+        vcos_semaphore_wait(&file->free);
+    if (file->error || ftruncate(file->fd, length) != 0)
+        ret = -1;
+    fdatasync(file->fd);
+    close(file->fd);
+    free_file(file);
+    return ret ? -1 : length;
+}
+
+/**
+ * Give a finished clip back to the ring, or unlink it if the ring is full
+ */
+void segstore_release(SEGSTORE_T *store, const char *path)
+{
+    char segPath[192];
+    int fd, id = -1;
+
+    vcos_mutex_lock(&store->lock);
+    if (store->numFree < store->segments)
+        id = store->nextId++;
+    vcos_mutex_unlock(&store->lock);
+
+    if (id < 0) {
+        unlink(path);
+        return;
+    }
+    segment_path(store, id, segPath, sizeof(segPath));
+    if (rename(path, segPath) != 0)
+        return;
+    fd = open(segPath, O_WRONLY);
+    if (fd < 0 || preallocate(store, fd) != 0) {
+        if (fd >= 0)
+            close(fd);
+        unlink(segPath);
+        return;
+    }
+    close(fd);
+    vcos_mutex_lock(&store->lock);
+    if (store->numFree < store->segments) {
+        store->freeIds[store->numFree++] = id;
+        store->recycled++;
+    } else {
+        unlink(segPath);
+    }
+    vcos_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,90 @@
+/*
+ * File:   segstore.h
+ *
+ * Clip storage backend for SD cards. Instead of growing each clip with
+ * small buffered writes, a ring of segment files is kept preallocated
+ * (fallocate, keeping the file size at 0) and clips are written into
+ * them in aligned chunks, optionally with O_DIRECT.
+ *
+ * Encoder output is only copied into a chunk by segstore_write(); full
+ * chunks are written by a writer thread shared by all clips, so a slow
+ * card never holds up the encoder callback. A clip stages up to
+ * SEGSTORE_CHUNKS chunks, and only waits for the writer when all of them
+ * are queued.
+ *
+ * A segment is renamed to the clip's path when recording starts. Each
+ * chunk written extends the file size, so while recording it trails the
+ * logical end by at most the chunks staged, and a clip cut short by a
+ * crash keeps everything written so far. Released clips go back into
+ * the ring rather than being unlinked, up to the ring size.
+ */
+
+#ifndef SEGSTORE_H_
+#define SEGSTORE_H_
+
+#include <stdint.h>
+
+#include "interface/vcos/vcos.h"
+
+#define SEGSTORE_DIR            "ring"             // Under the spool directory
+#define SEGSTORE_SEGMENTS       4                  // Free segments kept ready
+#define SEGSTORE_SEGMENT_BYTES  (16*1024*1024)     // Preallocated per segment
+#define SEGSTORE_CHUNK_BYTES    (256*1024)         // Write size, ~1.4 s of a 1.5 Mbit/s clip
+#define SEGSTORE_CHUNKS         16                 // Staged per clip, 4 MB, a typical SD erase block
+#define SEGSTORE_ALIGN          4096               // O_DIRECT offset and length alignment
+
+typedef struct SEGSTORE_T SEGSTORE_T;
+typedef struct SEGSTORE_FILE_T SEGSTORE_FILE_T;
+typedef struct SEGSTORE_CHUNK_T SEGSTORE_CHUNK_T;
+
+struct SEGSTORE_CHUNK_T {
+    SEGSTORE_CHUNK_T *next;        /// In the writer queue
+    SEGSTORE_FILE_T  *file;
+    unsigned char    *data;        /// Aligned, chunkBytes
+    int               len;         /// Bytes to write
+    int64_t           offset;      /// File offset of data
+};
+
+struct SEGSTORE_T {
+    char             dir[160];
+    int              segments;
+    long             segmentBytes;
+    int              chunkBytes;
+    int              direct;       /// Open clips with O_DIRECT
+    VCOS_MUTEX_T     lock;
+    int              freeIds[SEGSTORE_SEGMENTS*4];
+    int              numFree;
+    int              nextId;
+    uint32_t         created;      /// Segments allocated from scratch
+    uint32_t         recycled;     /// Segments reused from released clips
+    SEGSTORE_CHUNK_T *queue;       /// Chunks waiting for the writer, oldest first, under the lock
+    SEGSTORE_CHUNK_T *queueTail;
+    VCOS_SEMAPHORE_T work;
+    VCOS_THREAD_T    thread;
+    volatile int     running;
+};
+
+struct SEGSTORE_FILE_T {
+    SEGSTORE_T       *store;
+    int              fd;
+    int              direct;
+    unsigned char    *buffer;      /// Aligned, SEGSTORE_CHUNKS chunks
+    SEGSTORE_CHUNK_T chunks[SEGSTORE_CHUNKS];
+    VCOS_SEMAPHORE_T free;         /// Chunks other than current not queued or being written
+    int              current;      /// Chunk being filled
+    int              fill;         /// Bytes staged in it
+    int64_t          offset;       /// File offset of the current chunk
+    int64_t          length;       /// Logical end of the clip
+    volatile int     error;        /// A chunk write failed
+};
+
+int  segstore_open(SEGSTORE_T *store, const char *dir, int segments, long segmentBytes,
+                   int chunkBytes, int direct);
+void segstore_close(SEGSTORE_T *store);
+
+SEGSTORE_FILE_T *segstore_create(SEGSTORE_T *store, const char *path);
+int     segstore_write(SEGSTORE_FILE_T *file, const void *data, int len);
+int64_t segstore_finish(SEGSTORE_FILE_T *file);
+void    segstore_release(SEGSTORE_T *store, const char *path);
+
+#endif /* SEGSTORE_H_ */
@@ -0,0 +1,179 @@
+/*
+ * File:   snapshot.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "snapshot.h"
+
+/**
+ * Point a header at one plane of an I420 frame
+ */
+static void plane_header(IplImage *hdr, const unsigned char *data, int width, int height)
+{
+    cvInitImageHeader(hdr, cvSize(width, height), IPL_DEPTH_8U, 1, IPL_ORIGIN_TL, 4);
+    cvSetData(hdr, (void *) data, width);
+}
+
+/**
+ * Scale an I420 frame down, plane by plane
+ *
+ * @param dst sw x sh I420 frame, sw and sh even
+ */
+void snapshot_scale(const unsigned char *frame, int width, int height, unsigned char *dst, int sw, int sh)
+{
+    IplImage src, out;
+
+    plane_header(&src, frame, width, height);
+    plane_header(&out, dst, sw, sh);
+    cvResize(&src, &out, CV_INTER_AREA);
+    plane_header(&src, frame + width*height, width/2, height/2);
+    plane_header(&out, dst + sw*sh, sw/2, sh/2);
+    cvResize(&src, &out, CV_INTER_AREA);
+    plane_header(&src, frame + width*height + (width/2)*(height/2), width/2, height/2);
+    plane_header(&out, dst + sw*sh + (sw/2)*(sh/2), sw/2, sh/2);
+    cvResize(&src, &out, CV_INTER_AREA);
+}
+
+static int write_file(const char *path, const unsigned char *data, int len)
+{
+    char tmpPath[96];
+    FILE *fp;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        perror(tmpPath);
+        return -1;
+    }
+    if (fwrite(data, 1, len, fp) != (size_t)len) {
+        perror(tmpPath);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return rename(tmpPath, path);
+}
+
+static void *snapshot_thread(void *arg)
+{
+    SNAPSHOT_T *snap = (SNAPSHOT_T *) arg;
+    int params[] = { CV_IMWRITE_JPEG_QUALITY, snap->quality, 0 };
+
+    for (;;) {
+        struct timespec t0, t1;
+        CvMat *jpeg;
+
+        vcos_semaphore_wait(&snap->ready);
+        if (!snap->running)
+            break;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        cvCvtColor(snap->yuv, snap->bgr, CV_YUV2BGR_I420);
+        jpeg = cvEncodeImage(".jpg", snap->bgr, params);
+        if (jpeg && write_file(snap->path, jpeg->data.ptr, jpeg->cols) == 0) {
+            snap->event.size = jpeg->cols;
+            snap->event.path_len = strlen(snap->path);
+            if (eventipc_publish_snapshot(snap->events, snap->path, &snap->event) != 0)
+                fprintf(stderr, "Unable to publish snapshot %s\n", snap->path);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            printf("Snapshot %s, %d bytes in %ld us\n", snap->path, jpeg->cols,
+                   (long)((t1.tv_sec - t0.tv_sec)*1000000 + (t1.tv_nsec - t0.tv_nsec)/1000));
+        } else {
+            fprintf(stderr, "Error: snapshot encode %s\n", snap->path);
+        }
+        if (jpeg)
+            cvReleaseMat(&jpeg);
+        snap->busy = 0;
+    }
+    return NULL;
+}
+
+/**
+ * Set up a snapshot encoder and start its thread
+ *
+ * @param width, height Snapshot size, even
+ * @param arena Frame arena to take the buffers from, NULL for the heap
+ * @return 0 if successful, -1 otherwise
+ */
+int snapshot_open(SNAPSHOT_T *snap, int width, int height, int quality, EVENTIPC_T *events, ARENA_T *arena)
+{
+    memset(snap, 0, sizeof(*snap));
+    width &= ~1;
+    height &= ~1;
+    snap->quality = quality;
+    snap->events = events;
+    snap->arena = arena;
+    if (arena) {
+        unsigned char *yuv = arena_alloc(arena, "snapshot yuv", SNAPSHOT_YUV_BYTES(width, height));
+        unsigned char *bgr = arena_alloc(arena, "snapshot bgr", SNAPSHOT_BGR_BYTES(width, height));
+        if (!yuv || !bgr)
+            return -1;
+        snap->yuv = cvCreateImageHeader(cvSize(width, height*3/2), IPL_DEPTH_8U, 1);
+        snap->bgr = cvCreateImageHeader(cvSize(width, height), IPL_DEPTH_8U, 3);
+        cvSetData(snap->yuv, yuv, width);
+        cvSetData(snap->bgr, bgr, width*3);
+    } else {
+        snap->yuv = cvCreateImage(cvSize(width, height*3/2), IPL_DEPTH_8U, 1);
+        snap->bgr = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 3);
+    }
+    vcos_semaphore_create(&snap->ready, "snoop_snapshot-sem", 0);
+    snap->running = 1;
+    if (vcos_thread_create(&snap->thread, "snoop_snapshot", NULL, snapshot_thread, snap) != VCOS_SUCCESS) {
+        fprintf(stderr, "Error: unable to start snapshot thread\n");
+        snap->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void snapshot_close(SNAPSHOT_T *snap)
+{
+    if (snap->running) {
+        snap->running = 0;
+        vcos_semaphore_post(&snap->ready);
+        vcos_thread_join(&snap->thread, NULL);
+    }
+    if (snap->arena) {
+        cvReleaseImageHeader(&snap->yuv);
+        cvReleaseImageHeader(&snap->bgr);
+    } else {
+        cvReleaseImage(&snap->yuv);
+        cvReleaseImage(&snap->bgr);
+    }
+    vcos_semaphore_delete(&snap->ready);
+}
+
+/**
+ * Queue a snapshot of an I420 frame. Only the downscale runs on the
+ * caller's thread; if the previous snapshot is still encoding this one
+ * is dropped rather than waited for.
+ *
+ * @param frame  width x height I420 frame
+ * @param path   Where to write the JPEG
+ * @param event  EV_SNAPSHOT fields; size and path_len are filled in
+ * @return 0 if queued, -1 if dropped
+ */
+int snapshot_take(SNAPSHOT_T *snap, const unsigned char *frame, int width, int height,
+                  const char *path, const EVENTIPC_SNAPSHOT_T *event)
+{
+    if (!snap->running || snap->busy) {
+        snap->dropped++;
+        return -1;
+    }
+    snapshot_scale(frame, width, height, (unsigned char *) snap->yuv->imageData,
+                   snap->bgr->width, snap->bgr->height);
+
+    snprintf(snap->path, sizeof(snap->path), "%s", path);
+    snap->event = *event;
+    snap->taken++;
+    snap->busy = 1;
+    vcos_semaphore_post(&snap->ready);
+    return 0;
+}
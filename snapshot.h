@@ -0,0 +1,49 @@
+/*
+ * File:   snapshot.h
+ *
+ * Trigger-time JPEG snapshots. The analysis worker hands over the
+ * triggering frame, scaled down to thumbnail size, and a per-stream
+ * thread encodes it and publishes EV_SNAPSHOT, so the uploader can
+ * notify the server long before the clip itself is finished.
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdint.h>
+
+#include <opencv2/core/core_c.h>
+
+#include "interface/vcos/vcos.h"
+
+#include "eventipc.h"
+#include "arena.h"
+
+/// Buffer bytes for a width x height snapshot, for sizing a frame arena
+#define SNAPSHOT_YUV_BYTES(w, h) ((size_t)((w) & ~1)*((h) & ~1)*3/2)
+#define SNAPSHOT_BGR_BYTES(w, h) ((size_t)((w) & ~1)*((h) & ~1)*3)
+
+typedef struct {
+    int              quality;       /// JPEG quality, 1-100
+    IplImage        *yuv;           /// Thumbnail-sized I420 frame awaiting encode
+    IplImage        *bgr;
+    ARENA_T         *arena;         /// Owner of yuv and bgr data, NULL if heap allocated
+    VCOS_SEMAPHORE_T ready;
+    VCOS_THREAD_T    thread;
+    volatile int     running;
+    volatile int     busy;          /// yuv holds a frame the thread has not encoded yet
+    char             path[80];
+    EVENTIPC_SNAPSHOT_T event;
+    EVENTIPC_T      *events;
+    uint32_t         taken;
+    uint32_t         dropped;       /// Triggers while the previous snapshot was encoding
+} SNAPSHOT_T;
+
+int  snapshot_open(SNAPSHOT_T *snap, int width, int height, int quality, EVENTIPC_T *events, ARENA_T *arena);
+void snapshot_close(SNAPSHOT_T *snap);
+
+int  snapshot_take(SNAPSHOT_T *snap, const unsigned char *frame, int width, int height,
+                   const char *path, const EVENTIPC_SNAPSHOT_T *event);
+void snapshot_scale(const unsigned char *frame, int width, int height, unsigned char *dst, int sw, int sh);
+
+#endif /* SNAPSHOT_H_ */
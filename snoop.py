@@ -2,155 +2,998 @@
 import time
 import sys
 import os
-import sysv_ipc
+import socket
+import struct
 import requests
 import threading 
 import Queue
 import subprocess
+import heapq
+import getopt
+import json
 
 from requests.auth import HTTPBasicAuth
 
+# Event channel to snoopmon, see eventipc.h
+EVENT_SOCKET = "/tmp/snoopmon.sock"
+EVENT_MAGIC = 0x504f4e53
+EVENT_VERSION = 2
+EVENT_HDR = struct.Struct("<IHHII")       # magic, version, type, length, seq
+EVENT_CLIP = struct.Struct("<qqIIIHHII")  # EVENTIPC_CLIP_T
+EVENT_SAMPLE = struct.Struct("<IHHHH")    # EVENTIPC_SAMPLE_T
+EVENT_SNAPSHOT = struct.Struct("<qIIHHHHHHI")  # EVENTIPC_SNAPSHOT_T
+EV_HELLO = 1
+EV_CLIP = 2
+EV_OVERRUN = 3
+EV_SNAPSHOT = 4
+EV_CLIP_RECOVERED = 1
+EV_CLIP_LORES = 4
+EV_CLIP_DEFERRED = 8
+CMD_EXIT = 64
+CMD_UPLOADED = 65
+CMD_CLIP_STATE = 66
+CMD_RESYNC = 67
+CMD_UPLINK = 68
+
+# Spool clip states, see spool.h
+SPOOL_MUXED = 2
+SPOOL_UPLOADING = 3
+
+RESYNC_PERIOD = 300.0   # Seconds between asking snoopmon for clips still to upload
+BACKFILL_IDLE = 30.0    # Seconds without a clip to upload before full resolution clips are sent
+LORES_SUFFIX = "_lo"    # Low resolution clip names, see lores.h
+TIMELINE_EXT = ".tl"    # Motion timeline sidecar, see timeline.h
+TAGS_EXT = ".tags"      # Object classifier verdict sidecar, see classify.h
+BATCH_CLIPS = 8         # Most queued clips sent in one upload request
+BATCH_BYTES = 4*1024*1024   # Clip bytes past which no more are added to a batch
+MAX_UPLOADS = 4         # Most clip uploads in flight at once; the limit adapts up to this
+SMALL_CLIP_BYTES = 512*1024 # Clips this small go ahead of larger, older ones
+RECENT_CLIP_AGE = 120.0 # Seconds a clip counts as recent
+ADAPT_WINDOW = 20.0     # Busy seconds of uploading measured before the limit is changed
+ADAPT_GAIN = 0.1        # Throughput gain an extra concurrent upload must bring to be kept
+ADAPT_HOLD = 3          # Windows the limit stays put after an extra upload did not help
+UPLINK_DAY_BPS = 0      # Upload cap in bytes/s by day, 0 for none
+UPLINK_NIGHT_BPS = 0    # Upload cap in bytes/s by night, 0 for none
+NIGHT_HOURS = (22, 6)   # Local hours the night cap runs from and to
+SHAPER_BURST = 0.5      # Seconds of the cap the token bucket can save up
+SHAPER_CHUNK = 16*1024  # Bytes handed to the socket per token bucket take
+NATIVE_UPLOADER = "/opt/snoop/snoopup"  # Sends the requests if present, see snoopup.c
+NATIVE_WAIT = 1.0       # Seconds between checks that snoopup is still running
+AUTH = ("hambtw", "Snoop123")
+
+
+class ClipSet(object):
+    """ Thread-safe set of clip paths queued or being uploaded
+    """
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.paths = set()
+
+    def add(self, path):
+        with self.lock:
+            if path in self.paths:
+                return False
+            self.paths.add(path)
+            return True
+
+    def discard(self, path):
+        with self.lock:
+            self.paths.discard(path)
+
+
+def clip_key(path):
+    """ Event a clip belongs to, the same for a full clip and its low
+        resolution companion: <time> or <time>_<stream>
+    """
+    key = os.path.basename(path).split(".")[0]
+    if key.endswith(LORES_SUFFIX):
+        key = key[:-len(LORES_SUFFIX)]
+    return key
+
+
+def read_sidecar(filepath, ext):
+    """ Sidecar shared by a clip and its companion, as a (name, data)
+        upload part, or None if there is none
+    """
+    path = os.path.join(os.path.dirname(filepath), clip_key(filepath) + ext)
+    try:
+        with open(path, 'rb') as f:
+            return (os.path.basename(path), f.read())
+    except IOError:
+        return None
+
+def read_timeline(filepath):
+    return read_sidecar(filepath, TIMELINE_EXT)
+
+def read_tags(filepath):
+    """ Labels the classifier recognised in the clip, "none", or None if it
+        was never classified
+    """
+    return read_sidecar(filepath, TAGS_EXT)
+
+
+class Backfill(object):
+    """ Full resolution clips held back while their low resolution
+        companions go first. One is released when the server asks for
+        it, and the newest whenever the uplink has nothing else to do;
+        the oldest are the first the spool evicts anyway.
+    """
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.clips = {}     # clip_key -> path
+
+    def hold(self, path):
+        with self.lock:
+            self.clips[clip_key(path)] = path
+
+    def request(self, key):
+        with self.lock:
+            return self.clips.pop(key, None)
+
+    def next_idle(self):
+        with self.lock:
+            if not self.clips:
+                return None
+            key = max(self.clips, key=lambda k: int(k.split("_")[0]))
+            return self.clips.pop(key)
+
+
+def file_size(path):
+    try:
+        return os.path.getsize(path)
+    except OSError:
+        return 0
+
+
+def is_lores(path):
+    return os.path.basename(path).split(".")[0].endswith(LORES_SUFFIX)
+
+
+class Shaper(object):
+    """ Token bucket capping the upload bandwidth of all web threads
+        together, with separate day and night caps
+    """
+    def __init__(self, day_bps, night_bps, night=NIGHT_HOURS):
+        self.lock = threading.Lock()
+        self.day_bps = day_bps
+        self.night_bps = night_bps
+        self.night = night
+        self.tokens = 0.0
+        self.stamp = time.time()
+
+    def rate(self):
+        hour = time.localtime().tm_hour
+        start, end = self.night
+        if start > end:
+            at_night = hour >= start or hour < end
+        else:
+            at_night = start <= hour < end
+        return self.night_bps if at_night else self.day_bps
+
+    def take(self, n):
+        """ Wait until n more bytes may be sent. Bytes are granted as
+            they are asked for and paid back by sleeping, so threads
+            sharing the cap each get their turn.
+        """
+        rate = self.rate()
+        if rate <= 0:
+            return
+        with self.lock:
+            now = time.time()
+            self.tokens = min(self.tokens + (now - self.stamp)*rate, rate*SHAPER_BURST)
+            self.stamp = now
+            self.tokens -= n
+            wait = -self.tokens/rate
+        if wait > 0:
+            time.sleep(wait)
+
+
+class ShapedBody(object):
+    """ Encoded request body that httplib reads into the socket only as
+        fast as the shaper allows
+    """
+    def __init__(self, data, shaper):
+        self.data = data
+        self.off = 0
+        self.shaper = shaper
+
+    def __len__(self):
+        return len(self.data)
+
+    def read(self, n=-1):
+        if n < 0 or n > SHAPER_CHUNK:
+            n = SHAPER_CHUNK
+        chunk = self.data[self.off:self.off + n]
+        self.off += len(chunk)
+        if chunk:
+            self.shaper.take(len(chunk))
+        return chunk
+
+
+class UploadScheduler(object):
+    """ Work for the web threads, used in place of a FIFO queue. Messages
+        are handed out highest priority first:
+
+          control   PING and EXIT
+          snapshot  trigger-time JPEGs
+          clip      low resolution, small or recent clips, smallest first
+          old       other clips, such as ones recovered from the spool
+          backfill  held full resolution clips, once no other clip has
+                    been queued for BACKFILL_IDLE
+
+        At most `limit` clip uploads run at once, except that one clip of
+        the clip class may start beyond it, so an event's clip never waits
+        for a large old one to finish. Control messages and snapshots are
+        always handed out, and with one more web thread than MAX_UPLOADS a
+        snapshot never waits behind a clip either. The limit climbs
+        while another concurrent upload adds at least ADAPT_GAIN to the
+        measured throughput, and steps back when it does not.
+
+        The same throughput, of all concurrent uploads together, is sent
+        to snoopmon as UPLINK samples on output_q to size later clips: one
+        when the uploads go idle and one as each window closes.
+    """
+    PRI_CONTROL, PRI_SNAPSHOT, PRI_CLIP, PRI_OLD, PRI_BACKFILL = range(5)
+
+    def __init__(self, pending, backfill=None, output_q=None):
+        self.cond = threading.Condition()
+        self.output_q = output_q
+        self.heap = []
+        self.seq = 0
+        self.pending = pending
+        self.backfill = backfill
+        self.limit = 1
+        self.active = 0             # Clip uploads handed out and not yet done
+        self.urgent = {}            # Those of them in the clip class
+        self.last_clip = time.time()
+        self.window_bytes = 0       # Uploaded in the current window
+        self.window_busy = 0.0      # Seconds of it with a clip upload running
+        self.busy_since = None
+        self.sampled_bytes = 0      # Of the window, already sent as UPLINK samples
+        self.sampled_busy = 0.0
+        self.waited = False         # A clip waited for the limit in this window
+        self.last_rate = None
+        self.step = 0               # Last change to the limit
+        self.hold = 0
+
+    def priority(self, msg):
+        """ Sort key for a message, lowest first """
+        if msg[0] == "SNAPSHOT":
+            return (self.PRI_SNAPSHOT, 0)
+        if msg[0] != "UPLOAD":
+            return (self.PRI_CONTROL, 0)
+        path = msg[1]
+        size = file_size(path)
+        try:
+            age = time.time() - os.path.getmtime(path)
+        except OSError:
+            age = 0
+        if is_lores(path) or size <= SMALL_CLIP_BYTES or age < RECENT_CLIP_AGE:
+            return (self.PRI_CLIP, size)
+        return (self.PRI_OLD, size)
+
+    def put(self, msg):
+        pri, key = self.priority(msg)
+        with self.cond:
+            heapq.heappush(self.heap, (pri, key, self.seq, msg))
+            self.seq += 1
+            if msg[0] == "UPLOAD":
+                self.last_clip = time.time()
+            self.cond.notify_all()
+
+    def empty(self):
+        with self.cond:
+            return not self.heap
+
+    def get(self, block=True, timeout=None):
+        """ Next message this thread may handle. A clip upload holds one
+            of the limit's slots until done() is called for it.
+        """
+        deadline = None if timeout is None else time.time() + timeout
+        with self.cond:
+            while 1:
+                msg = self.take()
+                if msg is not None:
+                    return msg
+                if not block:
+                    raise Queue.Empty
+                wait = 1.0  # Backfill may become due without a put()
+                if deadline is not None:
+                    left = deadline - time.time()
+                    if left <= 0:
+                        raise Queue.Empty
+                    wait = min(wait, left)
+                self.cond.wait(wait)
+
+    def get_nowait(self):
+        return self.get(False)
+
+    def get_more(self):
+        """ Another queued clip to send in the same request as one taken
+            with get(), or None if the next message is not a clip
+        """
+        with self.cond:
+            if self.heap and self.heap[0][0] in (self.PRI_CLIP, self.PRI_OLD):
+                return heapq.heappop(self.heap)[-1]
+            return None
+
+    def take(self):
+        now = time.time()
+        if self.heap:
+            pri = self.heap[0][0]
+            if pri < self.PRI_CLIP:
+                return heapq.heappop(self.heap)[-1]
+            if self.active < self.limit or (pri == self.PRI_CLIP and not self.urgent and
+                                            self.active < MAX_UPLOADS):
+                msg = heapq.heappop(self.heap)[-1]
+                if pri == self.PRI_CLIP:
+                    self.urgent[msg] = now
+                self.start_clip(now)
+                return msg
+            self.waited = True
+            return None
+        if (self.backfill is not None and self.active < self.limit and
+                now - self.last_clip >= BACKFILL_IDLE):
+            path = self.backfill.next_idle()
+            if path is not None and self.pending.add(path):
+                print "Backfilling " + path
+                self.start_clip(now)
+                return ("UPLOAD", path, "backfill")
+        return None
+
+    def start_clip(self, now):
+        if self.active == 0:
+            self.busy_since = now
+        self.active += 1
+
+    def delivered(self, nbytes):
+        """ Count clip bytes the server has accepted towards throughput """
+        with self.cond:
+            self.window_bytes += nbytes
+
+    def done(self, msg):
+        """ A clip upload taken with get() has finished, successfully or
+            not. Backfill does not hold off more backfill.
+        """
+        with self.cond:
+            now = time.time()
+            self.active -= 1
+            self.urgent.pop(msg, None)
+            if len(msg) < 3:
+                self.last_clip = now
+            busy = self.window_busy + now - self.busy_since
+            if self.active == 0:
+                self.window_busy = busy
+                self.busy_since = None
+                self.sample_uplink(busy)
+            if busy >= ADAPT_WINDOW:
+                self.sample_uplink(busy)
+                if self.waited:
+                    self.adapt(self.window_bytes/busy)
+                self.window_bytes = 0
+                self.window_busy = 0.0
+                self.sampled_bytes = 0
+                self.sampled_busy = 0.0
+                if self.busy_since is not None:
+                    self.busy_since = now
+                self.waited = False
+            self.cond.notify_all()
+
+    def sample_uplink(self, busy):
+        """ Let snoopmon size later clips to what the uplink is managing,
+            from the bytes delivered since the last sample over the time
+            any clip upload was running
+        """
+        nbytes = self.window_bytes - self.sampled_bytes
+        elapsed = busy - self.sampled_busy
+        if self.output_q is not None and nbytes > 0 and elapsed > 0:
+            self.output_q.put(("UPLINK", nbytes, int(elapsed*1000000)))
+        self.sampled_bytes = self.window_bytes
+        self.sampled_busy = busy
+
+    def adapt(self, rate):
+        """ Hill-climb the limit on the throughput of a window in which
+            clips had to wait for it
+        """
+        last, self.last_rate = self.last_rate, rate
+        if self.hold:
+            self.hold -= 1
+            return
+        if self.step > 0 and last is not None and rate < last*(1 + ADAPT_GAIN):
+            # The extra upload did not pay for itself
+            self.step = -1
+            self.hold = ADAPT_HOLD
+        elif self.limit < MAX_UPLOADS:
+            self.step = 1
+        else:
+            self.step = 0
+            return
+        self.limit += self.step
+        print "Upload limit %d (%.0f KB/s)" % (self.limit, rate/1024)
+
+
+class NativeResponse(object):
+    """ The parts of a requests Response the web threads use """
+    def __init__(self, status_code, text):
+        self.status_code = status_code
+        self.text = text
+        self.ok = status_code < 400
+
+    def json(self):
+        return json.loads(self.text)
+
+
+class NativeSession(object):
+    """ Session stand-in shared by the web threads that hands their
+        requests to snoopup: clip files are sent from the page cache over
+        keep-alive connections and pings are pipelined on a connection of
+        their own. File parts go by path, other parts inline.
+    """
+    def __init__(self, host, day_bps=0, night_bps=0, conns=MAX_UPLOADS + 1, path=NATIVE_UPLOADER):
+        env = dict(os.environ)
+        env["SNOOPUP_AUTH"] = "%s:%s" % AUTH
+        args = [path, "-d", str(day_bps), "-n", str(night_bps), "-c", str(conns), host]
+        self.proc = subprocess.Popen(args, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                     env=env, close_fds=True)
+        self.prefix = "http://" + host
+        self.lock = threading.Lock()
+        self.next_id = 1
+        self.waiting = {}   # Request id -> [Event, NativeResponse]
+        self.reader = threading.Thread(target=self.read_responses)
+        self.reader.daemon = True
+        self.reader.start()
+
+    def read_responses(self):
+        out = self.proc.stdout
+        while 1:
+            line = out.readline()
+            if not line:
+                break
+            fields = line.split()
+            if len(fields) != 5 or fields[0] != "DONE":
+                continue
+            body = out.read(int(fields[4]))
+            with self.lock:
+                slot = self.waiting.pop(int(fields[1]), None)
+            if slot is not None:
+                slot[1] = NativeResponse(int(fields[2]), body)
+                slot[0].set()
+        # snoopup has gone, fail whatever is still waiting
+        with self.lock:
+            slots = self.waiting.values()
+            self.waiting.clear()
+        for slot in slots:
+            slot[0].set()
+
+    def request(self, verb, url, files, timeout):
+        if not url.startswith(self.prefix):
+            raise ValueError("snoopup only talks to " + self.prefix)
+        items = files.items() if isinstance(files, dict) else (files or [])
+        cmd = []
+        for field, value in items:
+            # As requests names them: (filename, content), or content named after the field
+            filename, content = value if isinstance(value, tuple) else (field, value)
+            if hasattr(content, "name"):
+                cmd.append("%s %s %s %d\n" % (field, filename, content.name, os.fstat(content.fileno()).st_size))
+            else:
+                cmd.append("%s %s - %d\n%s" % (field, filename, len(content), content))
+        slot = [threading.Event(), None]
+        with self.lock:
+            rid = self.next_id
+            self.next_id += 1
+            self.waiting[rid] = slot
+            head = "%s %d %d %s" % (verb, rid, timeout or 0, url[len(self.prefix):])
+            if verb == "POST":
+                head += " %d" % len(cmd)
+            # Written whole under the lock, snoopup opens the files as it reads them
+            self.proc.stdin.write(head + "\n" + "".join(cmd))
+            self.proc.stdin.flush()
+        while not slot[0].is_set():
+            slot[0].wait(NATIVE_WAIT)
+            if self.proc.poll() is not None:
+                slot[0].set()
+        r = slot[1]
+        if r is None:
+            raise IOError("snoopup exited")
+        if r.status_code == 0:
+            raise IOError(r.text)
+        return r
+
+    def post(self, url, files=None, timeout=None):
+        return self.request("POST", url, files, timeout)
+
+    def get(self, url, timeout=None):
+        return self.request("GET", url, None, timeout)
+
+    def close(self):
+        """ Let snoopup finish what is in flight and exit """
+        try:
+            self.proc.stdin.write("EXIT\n")
+            self.proc.stdin.close()
+        except IOError:
+            pass
+        self.proc.wait()
+
+
+def wanted_full(r, key=None):
+    """ Clips the server wants at full resolution, from a JSON body of
+        {"full": [keys]}, or {"full": true} in answer to an upload of key
+    """
+    try:
+        data = r.json()
+    except:
+        return []
+    want = data.get("full") if isinstance(data, dict) else None
+    if want is True and key:
+        return [key]
+    if isinstance(want, list):
+        return [str(k) for k in want]
+    return []
+
+
+def batch_accepted(r):
+    """ Clips a batch upload stored, from a JSON body of
+        {"uploaded": [file_times]}
+    """
+    try:
+        data = r.json()
+    except:
+        return set()
+    names = data.get("uploaded") if isinstance(data, dict) else None
+    if not isinstance(names, list):
+        return set()
+    return set(str(n) for n in names)
+
 
 class WebThread(threading.Thread):
     """ A worker thread that takes takes commands to 
         upload a file to the web server or ping the web server.
     """
-    def __init__(self, input_q, output_q, unit_id, host):
+    def __init__(self, input_q, output_q, unit_id, host, pending, backfill=None, shaper=None, session=None):
         super(WebThread, self).__init__()
-        self.input_q = input_q
+        self.input_q = input_q      # UploadScheduler shared by the web threads
         self.output_q = output_q
         self.unit_id = unit_id
         self.host = host
+        self.pending = pending
+        self.backfill = backfill
+        self.shaper = shaper
+        if session is not None:
+            # A NativeSession shared with the other web threads
+            self.session = session
+        else:
+            # One keep-alive connection for everything this thread sends
+            self.session = requests.Session()
+            self.session.auth = HTTPBasicAuth(*AUTH)
+        self.batch_ok = True    # Cleared if the server has no batch endpoint
 
     def run(self):
         while 1:
-            msg = self.input_q.get()
+            try:
+                msg = self.input_q.get(True, 1.0)
+            except Queue.Empty:
+                continue
             cmd = msg[0]
             print "CMD: " + cmd
             if (cmd == "PING"):
                 self.ping()
             elif (cmd == "UPLOAD"):
-                self.upload(msg[1])
+                paths = self.collect_uploads(msg[1])
+                self.upload_batch(paths)
+                for path in paths:
+                    self.pending.discard(path)
+                self.input_q.done(msg)
+            elif (cmd == "SNAPSHOT"):
+                self.upload_snapshot(msg[1])
             elif (cmd == "EXIT"):
                 break
             else:
                 print "Unknown cmd:" , cmd
         print "WebThread exiting"
 
+    def collect_uploads(self, first):
+        """ The clip to upload plus the next queued clips, up to
+            BATCH_CLIPS clips or BATCH_BYTES. Anything with a higher
+            priority ends the batch and is left for the next free thread.
+        """
+        paths = [first]
+        size = file_size(first)
+        while len(paths) < BATCH_CLIPS and size < BATCH_BYTES:
+            msg = self.input_q.get_more()
+            if msg is None:
+                break
+            paths.append(msg[1])
+            size += file_size(msg[1])
+        return paths
+
+    def post(self, url, files, timeout):
+        """ POST multipart files, through the shaper if there is one """
+        if self.shaper is None:
+            return self.session.post(url, files=files, timeout=timeout)
+        prep = self.session.prepare_request(requests.Request('POST', url, files=files))
+        prep.body = ShapedBody(prep.body, self.shaper)
+        return self.session.send(prep, timeout=timeout)
+
+    def request_full(self, keys):
+        """ Queue the full resolution clips the server has asked for
+        """
+        if self.backfill is None:
+            return
+        for key in keys:
+            path = self.backfill.request(key)
+            if path is not None and self.pending.add(path):
+                print "Server wants " + path
+                self.input_q.put(("UPLOAD", path))
+
     def upload(self, filepath):
-        """ Upload specified file to web server
+        """ Upload specified file to web server. The clip stays in the
+            spool until the server has accepted it.
         """
-        """Assume /tmp/<filename>.h264"
+        clip = self.mux(filepath)
+        if clip is not None:
+            self.finish(clip, self.post_clip(clip))
+
+    def upload_batch(self, paths):
+        """ Upload several clips in one request. Clips the server does not
+            confirm are retried on their own; any still failing stay in
+            the spool like a failed single upload.
         """
-        pieces = filepath.split("/")
-        basedir = pieces[1]
-        filename = pieces[2]
-        pieces = filename.split(".")
-        file_time = pieces[0]
+        if len(paths) == 1 or not self.batch_ok:
+            for path in paths:
+                self.upload(path)
+            return
+        clips = [c for c in (self.mux(path) for path in paths) if c is not None]
+        if not clips:
+            return
+        if len(clips) == 1:
+            self.finish(clips[0], self.post_clip(clips[0]))
+            return
+        accepted = self.post_batch(clips)
+        for clip in clips:
+            if accepted is None:
+                self.finish(clip, False)
+            elif clip["file_time"] in accepted:
+                self.finish(clip, True)
+            else:
+                print "Batch did not take " + clip["path"] + ", retrying it alone"
+                self.finish(clip, self.post_clip(clip))
+
+    def mux(self, filepath):
+        """ Wrap a raw clip in MP4 for upload
+
+            @return Clip dict, or None if it is gone or could not be muxed
+        """
+        """Assume <spool>/<time>.h264, or <spool>/<time>_<stream>.h264 for
+           streams after the first"
+        """
+        basedir, filename = os.path.split(filepath)
+        file_time = filename.split(".")[0]
         tempfilename = file_time + ".mp4"
-        event_time = int(file_time)
-        tempfilepath = "/"+ basedir + "/"+ tempfilename
+        tempfilepath = os.path.join(basedir, tempfilename)
+        if not os.path.exists(filepath):
+            print "Clip is gone: " + filepath
+            self.output_q.put(("UPLOADED", filepath, int(time.time()*1000000)))
+            return None
+        if os.path.exists(tempfilepath):
+            # Left over from an interrupted run; MP4Box -add would append to it
+            os.remove(tempfilepath)
         args = ["/usr/bin/MP4Box", "-fps", "30", "-add", filepath, tempfilepath]
         try:
             retCode = subprocess.call(args);
         except:
-	        print "MP4Box failed:" + retCode
+	        print "MP4Box failed:", sys.exc_info()[0]
+	        return None
+        if (retCode != 0):
+            print "Call to MP4Box failed: ", retCode
+            print "Upload failed, keeping " + filepath + " for retry"
+            return None
+        self.output_q.put(("STATE", filepath, SPOOL_MUXED))
+        return {"path": filepath, "file_time": file_time,
+                "temp": tempfilepath, "name": tempfilename}
+
+    def post_clip(self, clip):
+        """ POST one muxed clip
+
+            @return True if the server accepted it
+        """
+        url = "http://"+self.host+"/snoop/events/upload/"+self.unit_id+"/"+clip["file_time"]
+        print url
+        self.output_q.put(("STATE", clip["path"], SPOOL_UPLOADING))
+        try:
+            with open(clip["temp"], 'rb') as f:
+                files = {'file': (clip["name"], f)}
+                timeline = read_timeline(clip["path"])
+                if timeline is not None:
+                    files['timeline'] = timeline
+                tags = read_tags(clip["path"])
+                if tags is not None:
+                    files['tags'] = tags
+                r = self.post(url, files, 180)
+        except:
+            print "Unexpected request error:", sys.exc_info()[0]
+            return False
+        print r.status_code
+        #print r.headers
+        print r.text
+        if r.ok:
+            self.input_q.delivered(os.path.getsize(clip["temp"]))
+            self.request_full(wanted_full(r, clip_key(clip["path"])))
+        return r.ok
+
+    def post_batch(self, clips):
+        """ POST muxed clips as parts file0, timeline0, file1, ... of one
+            request
+
+            @return file_times of the clips the server stored, or None if
+                    the request failed and none should be retried now
+        """
+        url = "http://"+self.host+"/snoop/events/upload_batch/"+self.unit_id
+        print url, len(clips), "clips"
+        files = []
+        handles = []
+        for clip in clips:
+            self.output_q.put(("STATE", clip["path"], SPOOL_UPLOADING))
+        try:
+            for i, clip in enumerate(clips):
+                f = open(clip["temp"], 'rb')
+                handles.append(f)
+                files.append(("file%d" % i, (clip["name"], f)))
+                timeline = read_timeline(clip["path"])
+                if timeline is not None:
+                    files.append(("timeline%d" % i, timeline))
+                tags = read_tags(clip["path"])
+                if tags is not None:
+                    files.append(("tags%d" % i, tags))
+            r = self.post(url, files, 180)
+        except:
+            print "Unexpected request error:", sys.exc_info()[0]
+            return None
+        finally:
+            for f in handles:
+                f.close()
+        print r.status_code
+        if r.status_code == 404:
+            print "Server has no batch upload, sending clips one at a time"
+            self.batch_ok = False
+            return set()
+        if not r.ok:
+            return None
+        accepted = batch_accepted(r)
+        sent = sum(os.path.getsize(c["temp"]) for c in clips if c["file_time"] in accepted)
+        if sent:
+            self.input_q.delivered(sent)
+        self.request_full(wanted_full(r))
+        return accepted
+
+    def finish(self, clip, uploaded):
+        """ Drop the muxed copy and, if the server has the clip, tell
+            snoopmon so it can release it
+        """
+        print "Removing: " + clip["temp"]
+        try:
+            os.remove(clip["temp"])
+        except:
+            print "Unexpected os.remove error:", sys.exc_info()[0]
+        if not uploaded:
+            print "Upload failed, keeping " + clip["path"] + " for retry"
+            return
+        # snoopmon journals it, closes out its latency trace and releases the file
+        self.output_q.put(("UPLOADED", clip["path"], int(time.time()*1000000)))
+
+    def upload_snapshot(self, filepath):
+        """ Post a trigger-time snapshot. It is only useful as an early
+            notification, so it is not retried.
+        """
+        filename = os.path.basename(filepath)
+        file_time = filename.split(".")[0]
+        url = "http://"+self.host+"/snoop/events/snapshot/"+self.unit_id+"/"+file_time
+        print url
+        try:
+            with open(filepath, 'rb') as f:
+                files = {'file': (filename, f)}
+                r = self.post(url, files, 10)
+        except:
+            print "Unexpected request error:", sys.exc_info()[0]
         else:
-            if (retCode != 0):
-                print "Call to MP4Box failed: ", retCode
-            else:
-                url = "http://"+self.host+"/snoop/events/upload/"+self.unit_id+"/"+file_time
-                print url
-                files = {'file': (tempfilename, open(tempfilepath, 'rb'))}
-                try:
-                    r = requests.post(url, files=files, auth=HTTPBasicAuth('hambtw', 'Snoop123'), timeout=180)
-                except:
-                    print "Unexpected request error:", sys.exc_info()[0]
-                else:
-                    print r.status_code
-                    #print r.headers
-                    print r.text
-                    print "Removing: " + tempfilepath
-                    try:
-                        os.remove(tempfilepath)
-                    except:
-                        print "Unexpected os.remove error:", sys.exc_info()[0]
-
-        print "Removing: " + filepath
+            print r.status_code
         try:
             os.remove(filepath)
         except:
             print "Unexpected os.remove error:", sys.exc_info()[0]
-       
+
     def ping(self):
         """ Ping the web server of this unit
         """
         url = "http://"+self.host+"/snoop/unitping/"+self.unit_id
         print url
         try:
-            r = requests.get(url, auth=HTTPBasicAuth('hambtw', 'Snoop123'))
+            r = self.session.get(url)
         except:
             print "Unexpected request error:", sys.exc_info()[0]
         else:
             print r.status_code
             #print r.headers
             print r.text
+            if r.ok:
+                self.request_full(wanted_full(r))
 
-class MsgQueueThread(threading.Thread):
-    """ A worker thread that reads the SYSV message queue
+class EventThread(threading.Thread):
+    """ A worker thread that reads event records from snoopmon
     """
-    def __init__(self, sysv_msg_q, output_q):
-        super(MsgQueueThread, self).__init__()
-        self.sysv_msg_q = sysv_msg_q
+    def __init__(self, sock, output_q, snapshot_q, pending, backfill):
+        super(EventThread, self).__init__()
+        self.sock = sock
         self.output_q = output_q
+        self.snapshot_q = snapshot_q
+        self.pending = pending
+        self.backfill = backfill
 
     def run(self):
+        buf = ""
         while 1:
-            s,t = self.sysv_msg_q.receive(True, 1)
-            s = s.decode()
-            print("SYSV Msg Received: %s" %  s)
-            if (s == "EXIT"):
+            try:
+                data = self.sock.recv(65536)
+            except socket.error:
+                data = ""
+            if not data:
                 break
-            else:
-                self.output_q.put(("UPLOAD",s));
-        print "MsgQueueThread exiting"
+            buf += data
+            while len(buf) >= EVENT_HDR.size:
+                magic, version, rtype, length, seq = EVENT_HDR.unpack_from(buf)
+                if (magic != EVENT_MAGIC):
+                    print "Bad event record, closing channel"
+                    return
+                if (len(buf) < EVENT_HDR.size + length):
+                    break
+                payload = buf[EVENT_HDR.size:EVENT_HDR.size + length]
+                buf = buf[EVENT_HDR.size + length:]
+                if (version == EVENT_VERSION):
+                    self.handle(rtype, payload)
+        print "EventThread exiting"
+
+    def handle(self, rtype, payload):
+        if (rtype == EV_CLIP):
+            clip = parse_clip(payload)
+            print("Clip Received: %s frames=%d drops=%d skips=%d%s" % (clip["path"],
+                  clip["frames"], clip["encoder_drops"], clip["analysis_skips"],
+                  " (recovered)" if clip["flags"] & EV_CLIP_RECOVERED else ""))
+            if clip["flags"] & EV_CLIP_DEFERRED:
+                self.backfill.hold(clip["path"])
+            elif self.pending.add(clip["path"]):
+                self.output_q.put(("UPLOAD", clip["path"]))
+        elif (rtype == EV_SNAPSHOT):
+            (pts, stream, score, x, y, w, h, path_len, reserved, size) = EVENT_SNAPSHOT.unpack_from(payload)
+            path = payload[EVENT_SNAPSHOT.size:EVENT_SNAPSHOT.size + path_len]
+            print("Snapshot Received: %s score=%d bytes=%d" % (path, score, size))
+            self.snapshot_q.put(("SNAPSHOT", path))
+        elif (rtype == EV_HELLO):
+            print "Connected to snoopmon pid", struct.unpack_from("<I", payload)[0]
+        elif (rtype == EV_OVERRUN):
+            print "Missed events:", struct.unpack_from("<I", payload)[0]
+
+def parse_clip(payload):
+    """ Decode an EV_CLIP record into a dict
+    """
+    (start_pts, end_pts, frames, encoder_drops, analysis_skips,
+     path_len, num_samples, stream, flags) = EVENT_CLIP.unpack_from(payload)
+    off = EVENT_CLIP.size
+    clip = {"start_pts": start_pts, "end_pts": end_pts, "frames": frames,
+            "stream": stream, "flags": flags,
+            "encoder_drops": encoder_drops, "analysis_skips": analysis_skips,
+            "path": payload[off:off + path_len], "samples": []}
+    off += path_len
+    for i in range(num_samples):
+        clip["samples"].append(EVENT_SAMPLE.unpack_from(payload, off))
+        off += EVENT_SAMPLE.size
+    return clip
+
+def connect_events(proc, timeout=30.0):
+    """ Connect to snoopmon's event socket, waiting for it to come up
+    """
+    deadline = time.time() + timeout
+    while time.time() < deadline and proc.poll() is None:
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            sock.connect(EVENT_SOCKET)
+            return sock
+        except socket.error:
+            sock.close()
+            time.sleep(0.2)
+    return None
+
+def send_command(sock, ctype, payload=""):
+    sock.sendall(EVENT_HDR.pack(EVENT_MAGIC, EVENT_VERSION, ctype, len(payload), 0) + payload)
 
 def main(args):
     # Create a single input and a single output queue for all threads.
     unit_id = "1"
     #host = "snoop-env-hjrmvk5eey.elasticbeanstalk.com"
     host = "192.168.1.50"
+    day_bps = UPLINK_DAY_BPS
+    night_bps = UPLINK_NIGHT_BPS
+    native = os.path.exists(NATIVE_UPLOADER)
+    try:
+        opts, rest = getopt.getopt(args, "d:n:r")
+    except getopt.GetoptError:
+        print "Usage: snoop.py [-d day_cap_kbps] [-n night_cap_kbps] [-r]"
+        return
+    for opt, val in opts:
+        if opt == "-d":
+            day_bps = int(val)*1000/8
+        elif opt == "-n":
+            night_bps = int(val)*1000/8
+        elif opt == "-r":
+            # Upload with requests even if snoopup is there
+            native = False
+    shaper = None
+    session = None
+    if native:
+        # snoopup applies the caps itself
+        session = NativeSession(host, day_bps, night_bps)
+    elif day_bps or night_bps:
+        shaper = Shaper(day_bps, night_bps)
     # Create Thread Queues
-    web_q = Queue.Queue()
     my_q = Queue.Queue()
-    # Create the SYSV message queue.
-    mq = sysv_ipc.MessageQueue(500, sysv_ipc.IPC_CREAT, 0644)
-    web_thread = WebThread(web_q, my_q, unit_id, host)
-    web_thread.start()
-    mq_thread = MsgQueueThread(mq, web_q)
-    mq_thread.start()
-
-    args = ["/opt/snoop/snoopmon"]
+    pending = ClipSet()
+    backfill = Backfill()
+    web_q = UploadScheduler(pending, backfill, my_q)
+    # One more thread than concurrent clip uploads, so snapshots never wait behind a clip
+    web_threads = []
+    for i in range(MAX_UPLOADS + 1):
+        web_thread = WebThread(web_q, my_q, unit_id, host, pending, backfill, shaper, session)
+        web_thread.start()
+        web_threads.append(web_thread)
+
+    # Record a low resolution companion of every clip and upload that first
+    args = ["/opt/snoop/snoopmon", "-l"]
     proc = subprocess.Popen(args)
 
+    sock = connect_events(proc)
+    if sock is None:
+        print "Unable to connect to snoopmon"
+        for web_thread in web_threads:
+            web_q.put(("EXIT", ""))
+        proc.kill()
+        if session is not None:
+            for web_thread in web_threads:
+                web_thread.join()
+            session.close()
+        return
+    event_thread = EventThread(sock, web_q, web_q, pending, backfill)
+    event_thread.start()
+    # Pick up clips left in the spool by earlier runs or failed uploads
+    send_command(sock, CMD_RESYNC)
+    last_resync = time.time()
+
     while 1:
         try:
             params = my_q.get(True, 5.0)
             print params
-            # mq.send(msg, 2)
-            # Send to subproces via sysv queue
+            # Send to subprocess via the event channel
+            if (params[0] == "UPLOADED"):
+                send_command(sock, CMD_UPLOADED, struct.pack("<q", params[2]) + params[1])
+            elif (params[0] == "STATE"):
+                send_command(sock, CMD_CLIP_STATE, struct.pack("<I", params[2]) + params[1])
+            elif (params[0] == "UPLINK"):
+                send_command(sock, CMD_UPLINK, struct.pack("<II", params[1], params[2]))
         except Queue.Empty:
             if (proc.poll() is not None):
                 print "Subprocess Terminated!, code = ", proc.returncode
                 break;
             else:
                 web_q.put(("PING", ""))    
+        if (time.time() - last_resync > RESYNC_PERIOD):
+            send_command(sock, CMD_RESYNC)
+            last_resync = time.time()
 
-    web_q.put(("EXIT", ""))    
-    mq.send("EXIT", 1)
-    time.sleep(1)
-    print("Destroying the message queue.")
-    mq.remove()
+    for web_thread in web_threads:
+        web_q.put(("EXIT", ""))
+    sock.close()
+    event_thread.join(1)
+    if session is not None:
+        for web_thread in web_threads:
+            web_thread.join()
+        session.close()
 
 if __name__ == '__main__':
     import sys
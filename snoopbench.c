@@ -0,0 +1,173 @@
+/*
+ * File:   snoopbench.c
+ *
+ * Measures how motion analysis throughput scales with the number of
+ * streams sharing one worker pool, using file replay sources.
+ *
+ * Every stream replays the same raw 1280x720 I420 file unpaced, handing
+ * the next frame over as soon as its previous one has been analysed, so
+ * the pool is always saturated. For 1..max streams it reports total and
+ * per-stream analysed frames per second; the min/max spread shows how
+ * evenly the pool shares workers between streams.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "interface/vcos/vcos.h"
+
+#include "motion.h"
+#include "workpool.h"
+#include "replay.h"
+
+#define MAX_STREAMS 8
+
+typedef struct {
+    WORKPOOL_JOB_T   job;
+    WORKPOOL_T      *pool;
+    REPLAY_T         replay;
+    VCOS_SEMAPHORE_T idle;          /// Posted when the last frame has been analysed
+    IplImage        *full;
+    IplImage        *small;
+    IplImage        *prev;
+    IplImage        *diff;
+    IplImage        *mask;
+    volatile uint32_t analysed;
+} BENCH_STREAM_T;
+
+static MOTION_PARAMS_T params = MOTION_PARAMS_DEFAULT;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void bench_analyse(WORKPOOL_JOB_T *job)
+{
+    BENCH_STREAM_T *s = (BENCH_STREAM_T *) job;
+
+    cvResize(s->full, s->small, CV_INTER_LINEAR);
+    motion_compare(&params, (unsigned char *) s->prev->imageData, (unsigned char *) s->small->imageData, NULL,
+                   (unsigned char *) s->diff->imageData, (unsigned char *) s->mask->imageData,
+                   s->small->width, s->small->height, NULL);
+    memcpy(s->prev->imageData, s->small->imageData, s->small->width*s->small->height);
+    s->analysed++;
+    vcos_semaphore_post(&s->idle);
+}
+
+static void bench_frame(void *ctx, const unsigned char *data, int length, int64_t pts)
+{
+    BENCH_STREAM_T *s = (BENCH_STREAM_T *) ctx;
+
+    vcos_semaphore_wait(&s->idle);
+    // The worker marks the job idle just after posting
+    while (!workpool_claim(&s->job))
+        sched_yield();
+    memcpy(s->full->imageData, data, VIDEO_WIDTH*VIDEO_HEIGHT);
+    workpool_submit(s->pool, &s->job);
+}
+
+static int bench_init(BENCH_STREAM_T *s, WORKPOOL_T *pool, const char *file)
+{
+    CvSize small = cvSize(VIDEO_WIDTH/2, VIDEO_HEIGHT/2);
+
+    memset(s, 0, sizeof(*s));
+    s->job.run = bench_analyse;
+    s->pool = pool;
+    vcos_semaphore_create(&s->idle, "snoopbench-idle", 1);
+    s->full = cvCreateImage(cvSize(VIDEO_WIDTH, VIDEO_HEIGHT), IPL_DEPTH_8U, 1);
+    s->small = cvCreateImage(small, IPL_DEPTH_8U, 1);
+    s->prev = cvCreateImage(small, IPL_DEPTH_8U, 1);
+    s->diff = cvCreateImage(small, IPL_DEPTH_8U, 1);
+    s->mask = cvCreateImage(small, IPL_DEPTH_8U, 1);
+    memset(s->prev->imageData, 0, small.width*small.height);
+    return replay_open(&s->replay, file, VIDEO_WIDTH, VIDEO_HEIGHT, 0, 1, NULL);
+}
+
+static void bench_free(BENCH_STREAM_T *s)
+{
+    replay_close(&s->replay);
+    cvReleaseImage(&s->full);
+    cvReleaseImage(&s->small);
+    cvReleaseImage(&s->prev);
+    cvReleaseImage(&s->diff);
+    cvReleaseImage(&s->mask);
+    vcos_semaphore_delete(&s->idle);
+}
+
+int main(int argc, char **argv)
+{
+    static BENCH_STREAM_T streams[MAX_STREAMS];
+    WORKPOOL_T pool;
+    int maxStreams = 4;
+    int seconds = 10;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt, n, i;
+
+    while ((opt = getopt(argc, argv, "s:t:w:")) != -1) {
+        switch (opt) {
+            case 's': maxStreams = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-s max_streams] [-t seconds] [-w workers] frames.yuv\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-s max_streams] [-t seconds] [-w workers] frames.yuv\n", argv[0]);
+        return 1;
+    }
+    if (maxStreams < 1 || maxStreams > MAX_STREAMS)
+        maxStreams = MAX_STREAMS;
+
+    if (workpool_start(&pool, workers) != 0)
+        return 1;
+
+    printf("%7s %7s %10s %12s %12s %12s\n", "streams", "workers", "frames/s", "per-stream", "min-stream", "max-stream");
+    for (n = 1; n <= maxStreams; n++) {
+        double start, elapsed;
+        uint32_t total = 0, lo = ~0u, hi = 0;
+
+        for (i = 0; i < n; i++) {
+            if (bench_init(&streams[i], &pool, argv[optind]) != 0)
+                return 1;
+        }
+        start = now_sec();
+        for (i = 0; i < n; i++)
+            replay_start(&streams[i].replay, bench_frame, &streams[i]);
+        sleep(seconds);
+        for (i = 0; i < n; i++) {
+            streams[i].replay.running = 0;
+            vcos_semaphore_post(&streams[i].idle);  // Release a producer waiting on its last frame
+        }
+        for (i = 0; i < n; i++)
+            replay_stop(&streams[i].replay);
+        elapsed = now_sec() - start;
+        // Let the last submitted frames drain before freeing their buffers
+        for (i = 0; i < n; i++) {
+            while (streams[i].job.state != JOB_IDLE)
+                usleep(1000);
+        }
+
+        for (i = 0; i < n; i++) {
+            uint32_t a = streams[i].analysed;
+            total += a;
+            if (a < lo) lo = a;
+            if (a > hi) hi = a;
+            bench_free(&streams[i]);
+        }
+        printf("%7d %7d %10.1f %12.1f %12.1f %12.1f\n", n, pool.numThreads,
+               total/elapsed, total/elapsed/n, lo/elapsed, hi/elapsed);
+    }
+    return 0;
+}
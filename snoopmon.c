@@ -7,9 +7,9 @@
 #include <time.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <unistd.h>
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/msg.h>
 
 #include <opencv2/core/core_c.h>
 #include <opencv2/objdetect/objdetect.hpp>
@@ -25,6 +25,26 @@
 #include "interface/mmal/util/mmal_connection.h"
 
 #include "RaspiCamControl.h"
+#include "latency.h"
+#include "eventipc.h"
+#include "motion.h"
+#include "workpool.h"
+#include "replay.h"
+#include "spool.h"
+#include "snapshot.h"
+#include "bitrate.h"
+#include "segstore.h"
+#include "startup.h"
+#include "arena.h"
+#include "autocrop.h"
+#include "lores.h"
+#include "timeline.h"
+#include "frametap.h"
+#include "liveview.h"
+#include "watchdog.h"
+#include "timelapse.h"
+#include "heatmap.h"
+#include "classify.h"
 
 #include "vgfont.h"
 
@@ -32,18 +52,13 @@
 #define PREVIEW 0 
 
 
-#define VIDEO_WIDTH 1280
-#define VIDEO_HEIGHT 720
-#define VIDEO_FPS 30 
-
-#define BITRATE 1500000
-#define CAPTURE_LENGTH 15  // Seconds
-#define SUSPEND_LENGTH 10  // Seconds
-#define MOTION_PERIOD (VIDEO_FPS/3)  // Times per second
-
-#define CAPTURE_FRAME_COUNT (VIDEO_FPS*CAPTURE_LENGTH) 
-#define SUSPEND_FRAME_COUNT ((VIDEO_FPS*SUSPEND_LENGTH)-MOTION_PERIOD)
+/// I420 frame bytes as the camera pads it, stride to 32 and rows to 16
+#define FRAME_STRIDE(w) VCOS_ALIGN_UP(w, 32)
+#define FRAME_BYTES(w, h) ((size_t)FRAME_STRIDE(w)*VCOS_ALIGN_UP(h, 16)*3/2)
 
+#define BITRATE BITRATE_DEFAULT  // Until the first clip's rate is chosen
+/// Rate for a low resolution clip, the same bits per pixel as the full one
+#define LORES_BITRATE(b) ((uint32_t)((uint64_t)(b)*LORES_WIDTH*LORES_HEIGHT/(VIDEO_WIDTH*VIDEO_HEIGHT)))
 #define MMAL_CAMERA_PREVIEW_PORT 0
 #define MMAL_CAMERA_VIDEO_PORT 1
 #define MMAL_CAMERA_CAPTURE_PORT 2
@@ -51,12 +66,21 @@
 #define ACTION_NULL 0
 #define ACTION_CHECK_MOTION 1
 #define ACTION_STOP_CAPTURE 2
+#define ACTION_TRACK_MOTION 3
+
+#define MAX_CLIP_SAMPLES ((CAPTURE_FRAME_COUNT/MOTION_PERIOD)+2)
 
 #define STATE_NORMAL 0
 #define STATE_CAPTURE 1
 #define STATE_SUSPEND 2
 
+#define MAX_STREAMS 4
+#define RESYNC_BATCH 32     // Clips republished at a time, well within any client's backlog
+
 typedef struct {
+    int id;                 /// Stream index, 0 for the first camera
+    int camera_num;         /// CSI camera for camera streams
+    REPLAY_T *replay;       /// Source for file replay streams, NULL for cameras
     int video_width;
     int video_height;
     int preview_width;
@@ -73,33 +97,99 @@ typedef struct {
     MMAL_PORT_T *camera_video_port;
     MMAL_PORT_T *camera_still_port;
     MMAL_POOL_T *camera_video_port_pool;
+    MMAL_POOL_T *camera_preview_port_pool;   /// Low resolution frames, with -l and no PREVIEW
     MMAL_PORT_T *encoder_input_port;
     MMAL_POOL_T *encoder_input_pool;
     MMAL_PORT_T *encoder_output_port;
     MMAL_POOL_T *encoder_output_pool;
+    volatile int encoderReady;  /// Encoder ports may be used; motion checks run before this is set
+    VCOS_MUTEX_T encoder_lock;  /// Held to use the encoder, and across rebuilds at clip end or by the watchdog
+    BITRATE_CHOICE_T clipRate;  /// applyBitrate()'s pick for this clip, bitrate 0 for the default; under encoder_lock
+    WATCHDOG_PORT_T cameraWatch;    /// Camera video port callbacks
+    WATCHDOG_PORT_T previewWatch;   /// Camera preview port callbacks, with -l
+    WATCHDOG_PORT_T encoderWatch;   /// Encoder input buffers sent and returned
     RASPICAM_CAMERA_PARAMETERS camera_parameters; /// Camera setup parameters
-    unsigned char* videoBuffer;
+    RASPICAM_CAMERA_PARAMETERS camera_applied;    /// What the camera has now, read back after setup
+    VCOS_MUTEX_T camera_lock;                     /// Serialises live camera reconfiguration
+    unsigned char* videoBuffers[2]; /// Alternate between posted frames, keeping the last one intact
+    unsigned char* videoBuffer;     /// Frame being analysed, one of videoBuffers
+    int            videoBufferSize;
     int            videoBufferLen;
-    CvMemStorage* storage;
-    IplImage* image;
-    IplImage* image1;
+    int64_t        videoBufferPts;
+    int64_t        videoBufferDts;
+    IplImage* image1;       /// Y plane of videoBuffer
+    IplImage* prevFrame;    /// Y plane of the frame posted before it
     IplImage* image2;
     IplImage* prevImage;
+    IplImage* coarse;       /// image1 at MOTION_COARSE_WIDTH x MOTION_COARSE_HEIGHT
+    IplImage* prevCoarse;
     IplImage* py1;
     IplImage* py2;
-    VCOS_SEMAPHORE_T complete_semaphore;
+    WORKPOOL_T*      pool;
+    WORKPOOL_JOB_T   job;           /// Analysis of videoBuffer
     VCOS_SEMAPHORE_T filewrite_semaphore;
     VCOS_MUTEX_T     filewrite_lock;
     FILE* fptr;
+    SEGSTORE_FILE_T *segfile;   /// Clip being written, when the segment ring is in use
     int  bufferAction;
     int  state;
     int  pendingState;
+    int  frameCount;
+    int  firstFrame;
+    int  prevStale;         /// prevImage was skipped by the coarse gate, rebuild it from prevFrame
+    int  prevCoarseValid;   /// prevCoarse is from the frame in prevFrame
+    char filename[80];
+    char prevFilename[80];
+    char text[256];
+    LATENCY_T latency;
+    EVENTIPC_T *events;
+    SNAPSHOT_T snapshot;    /// Trigger-time JPEG, if thumbnailConfig.enable
+    AUTOCROP_T crop;        /// Camera ROI following the motion, with -z
+    LORES_T lores;          /// Companion low resolution clip, with -l
+    FRAMETAP_T tap;         /// Shared memory copy of image2 and py2, with -t; py2 lives in it
+    TIMELAPSE_T timelapse;  /// Low rate record between events, with -T
+    HEATMAP_T heatmap;      /// Activity map and exclusion mask, with -x
+    CLASSIFY_SLOT_T classify;   /// Motion regions for the object classifier, with -k
+    int     cropReseed;     /// prevImage was taken before the crop last moved
+    int64_t clipStartPts;
+    int64_t clipEndPts;
+    int     clipFrames;
+    int     encoderDrops;
+    int     analysisSkips;
+    int     numSamples;
+    EVENTIPC_SAMPLE_T samples[MAX_CLIP_SAMPLES];
+    int64_t sampleTimes[MAX_CLIP_SAMPLES];  /// pts of the frame each sample came from
 } PORT_USERDATA;
 
-struct my_msgbuf {
-    long mtype;
-    char mtext[80];
-};
+#define STREAM_FROM_JOB(j) ((PORT_USERDATA *)((char *)(j) - offsetof(PORT_USERDATA, job)))
+
+static PORT_USERDATA *g_streams[MAX_STREAMS];
+static int g_numStreams = 0;
+static EVENTIPC_T g_events;
+static struct {
+    char **paths;               /// Spooled clips left to republish, IPC thread only
+    int    num;
+    int    size;
+    int    next;
+} g_resync;
+static SPOOL_T g_spool;
+static BITRATE_T g_bitrate;
+static SEGSTORE_T g_segstore;
+static int g_useSegstore = 0;
+static STARTUP_T g_startup;
+static ARENA_T g_arena;
+static int g_autoCrop = 0;
+static int g_dualStream = 0;
+static int g_frameTap = 0;
+static LIVEVIEW_T g_liveview;
+static WATCHDOG_T g_watchdog;
+static int g_timelapseInterval = 0;    /// Seconds, 0 for no timelapse
+static int64_t g_timelapseBudget = TIMELAPSE_DAILY_BYTES;
+static int g_heatmap = 0;   /// 1 to propose exclusion masks, 2 to apply them
+static CLASSIFY_T g_classify;
+static int g_classifyHold = 0;  /// Hold back clips the classifier found nothing in
+static GRAPHICS_RESOURCE_HANDLE g_overlay;
+static int g_displayWidth;
 
 
 /**
@@ -110,125 +200,200 @@ struct my_msgbuf {
  */
 #define MOTION_CLEAR_SOAK 1
 
-int g_DiffThreshold = 25;
-int g_NoiseWindow = 3; // must be odd
-int g_PixelThreshold = 5000; // Total number of pixels changed
+MOTION_PARAMS_T g_MotionParams = MOTION_PARAMS_DEFAULT;
 
-static int compareImages(PORT_USERDATA* userdata)
+/**
+ * Coarse check of image1 against the previous posted frame
+ *
+ * @return 1 if the scene may have changed enough for compareImages() to
+ *         trigger, 0 if it is static
+ */
+static int coarseGate(PORT_USERDATA* userdata)
 {
-    int w = userdata->opencv_width;
-    int h = userdata->opencv_height;
-    unsigned char* buf0 = userdata->prevImage->imageData;
-    unsigned char* buf1 = userdata->image2->imageData;
-    int dataSize = w*h;
-    int i=0;
-    int j=0;
-    int x=0;
-    int y=0;
-    for(i = 0; i<dataSize; i++) {
-        int diff = buf0[i]-buf1[i];        
-        if (diff < 0) diff *= -1;
-        userdata->py1->imageData[i] = (diff >= g_DiffThreshold) ? 255: 0;
-    }
-    memset(userdata->py2->imageData, 0, dataSize);
-    int m = (g_NoiseWindow*g_NoiseWindow)/2;
-    int n = (g_NoiseWindow-1)/2;
-    int total = 0;
-    int w1 = w-1;
-    int h1 = h-1;
-    for (x=1; x<w1; x++) {
-        for (y=1; y<h1; y++) {
-            int marked = 0; 
-            int xstop = x+n;
-            int ystop = y+n;
-            for (i=x-n; i<xstop+n; i++) {
-                for (j=y-n; j<ystop; j++) {
-                    if (userdata->py1->imageData[j*w+i] == 255) 
-                        marked++;
-                    if (marked >=m) break;
-                }
-                if (marked >=m) break;
-            }
-            if (marked >= m) {
-                for(i=x-n; i<xstop; i++) {
-                    for(j=y-n; j<ystop; j++) {
-                        userdata->py2->imageData[j*w+i] = 255;
-                        total++;
-                    }
-                }
-            }
-        }
+    IplImage *t;
+    int count;
+
+    if (g_MotionParams.coarseGate <= 0)
+        return 1;
+    if (!userdata->prevCoarseValid)
+        cvResize(userdata->prevFrame, userdata->prevCoarse, CV_INTER_AREA);
+    cvResize(userdata->image1, userdata->coarse, CV_INTER_AREA);
+    count = motion_coarse(&g_MotionParams,
+                          (unsigned char *) userdata->prevCoarse->imageData,
+                          (unsigned char *) userdata->coarse->imageData,
+                          HEATMAP_COARSE_EXCLUDE(&userdata->heatmap),
+                          MOTION_COARSE_WIDTH, MOTION_COARSE_HEIGHT);
+    t = userdata->prevCoarse;
+    userdata->prevCoarse = userdata->coarse;
+    userdata->coarse = t;
+    userdata->prevCoarseValid = 1;
+    return motion_gate(&g_MotionParams, count);
+}
+
+static int compareImages(PORT_USERDATA* userdata, CvRect* box)
+{
+    // The mask is in uncropped coordinates
+    const unsigned char *exclude = userdata->crop.active ? NULL : HEATMAP_EXCLUDE(&userdata->heatmap);
+    int pixCount;
+
+    if (g_frameTap)
+        frametap_begin(&userdata->tap);
+    pixCount = motion_compare(&g_MotionParams,
+                              (unsigned char *) userdata->prevImage->imageData,
+                              (unsigned char *) userdata->image2->imageData,
+                              exclude,
+                              (unsigned char *) userdata->py1->imageData,
+                              (unsigned char *) userdata->py2->imageData,
+                              userdata->opencv_width, userdata->opencv_height, box);
+    if (g_frameTap)
+        frametap_end(&userdata->tap, (unsigned char *) userdata->image2->imageData, userdata->videoBufferPts,
+                     pixCount, box->x, box->y, box->width, box->height);
+    return pixCount;
+}
+
+/**
+ * Add the frame just compared to the activity heatmap. The detector's
+ * mask leaves out excluded pixels, so while there are any the check is
+ * run again without them; otherwise a chronically active area would look
+ * quiet once excluded and never be released.
+ */
+static void sampleHeatmap(PORT_USERDATA* userdata)
+{
+    HEATMAP_T *hm = &userdata->heatmap;
+
+    if (!HEATMAP_EXCLUDE(hm)) {
+        heatmap_add(hm, (unsigned char *) userdata->py2->imageData);
+        return;
     }
-    return total;
+    motion_compare(&g_MotionParams,
+                   (unsigned char *) userdata->prevImage->imageData,
+                   (unsigned char *) userdata->image2->imageData,
+                   NULL, (unsigned char *) userdata->py1->imageData, hm->mask,
+                   userdata->opencv_width, userdata->opencv_height, NULL);
+    heatmap_add(hm, hm->mask);
 }
 
-static void video_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
-    static int frame_count = 0;
-    MMAL_BUFFER_HEADER_T *new_buffer;
-    PORT_USERDATA * userdata = (PORT_USERDATA *) port->userdata;
-    MMAL_POOL_T *pool = userdata->camera_video_port_pool;
+/**
+ * Hand a frame to the analysis pool, unless this stream still has one
+ * waiting or being processed
+ *
+ * @param userdata Stream state
+ * @param action   ACTION_* to apply to the frame
+ */
+static void post_frame(PORT_USERDATA *userdata, const unsigned char *data, int length,
+                       int64_t pts, int64_t dts, int action) {
+    if (length > userdata->videoBufferSize) {
+        fprintf(stderr, "Frame of %d bytes too big for stream %d\n", length, userdata->id);
+        return;
+    }
+    if (workpool_claim(&userdata->job)) {
+        unsigned char *prev = userdata->videoBuffer;
+
+        userdata->videoBuffer = (prev == userdata->videoBuffers[0]) ? userdata->videoBuffers[1] : userdata->videoBuffers[0];
+        cvSetData(userdata->image1, userdata->videoBuffer, FRAME_STRIDE(userdata->video_width));
+        cvSetData(userdata->prevFrame, prev, FRAME_STRIDE(userdata->video_width));
+        memcpy(userdata->videoBuffer, data, length);
+        userdata->videoBufferLen = length;
+        userdata->videoBufferPts = pts;
+        userdata->videoBufferDts = dts;
+        userdata->bufferAction = action;
+        workpool_submit(userdata->pool, &userdata->job);  // Tell a worker to proc frame
+    } else {
+        userdata->analysisSkips++;
+    }
+}
 
+/**
+ * Run the capture state machine for one frame from a stream's source
+ *
+ * @param userdata Stream state
+ * @param data     I420 frame
+ */
+static void stream_frame(PORT_USERDATA *userdata, const unsigned char *data, int length,
+                         int64_t pts, int64_t dts) {
+    MMAL_BUFFER_HEADER_T *output_buffer;
+
+    startup_milestone(&g_startup, STARTUP_FIRST_FRAME);
+    if (g_timelapseInterval && length >= userdata->video_width*userdata->video_height*3/2) {
+        timelapse_frame(&userdata->timelapse, data, userdata->video_width, userdata->video_height, pts);
+    }
     if (userdata->state != userdata->pendingState) {
         userdata->state = userdata->pendingState;
-        frame_count = 1;
+        userdata->frameCount = 1;
     } else {
-        frame_count++;
+        userdata->frameCount++;
     }
     switch(userdata->state) {
         case STATE_NORMAL:
-            if ((frame_count % MOTION_PERIOD) == 0) {
-                userdata->bufferAction = ACTION_CHECK_MOTION;
-                if (vcos_semaphore_trywait(&(userdata->complete_semaphore)) != VCOS_SUCCESS) {
-                    mmal_buffer_header_mem_lock(buffer);
-                    memcpy(userdata->videoBuffer, buffer->data, buffer->length);
-                    userdata->videoBufferLen = buffer->length;
-                    mmal_buffer_header_mem_unlock(buffer);
-                    vcos_semaphore_post(&(userdata->complete_semaphore));  // Tell other thread to proc frame
-                }
+            if ((userdata->frameCount % MOTION_PERIOD) == 0) {
+                post_frame(userdata, data, length, pts, dts, ACTION_CHECK_MOTION);
             }
             break;
         case STATE_CAPTURE:
-            if (frame_count >= CAPTURE_FRAME_COUNT) {
-                userdata->bufferAction = ACTION_STOP_CAPTURE;
-                if (vcos_semaphore_trywait(&(userdata->complete_semaphore)) != VCOS_SUCCESS) {
-                    mmal_buffer_header_mem_lock(buffer);
-                    memcpy(userdata->videoBuffer, buffer->data, buffer->length);
-                    userdata->videoBufferLen = buffer->length;
-                    mmal_buffer_header_mem_unlock(buffer);
-                    vcos_semaphore_post(&(userdata->complete_semaphore));  // Tell other thread to proc frame
-                }
-            } else {
-                MMAL_BUFFER_HEADER_T *output_buffer = 0;
-                output_buffer = mmal_queue_get(userdata->encoder_input_pool->queue);
-                if (output_buffer) {
-                    mmal_buffer_header_mem_lock(buffer);
-                    memcpy(output_buffer->data, buffer->data, buffer->length);
-                    output_buffer->length = buffer->length;
-                    mmal_buffer_header_mem_unlock(buffer);
-                    if (mmal_port_send_buffer(userdata->encoder_input_port, output_buffer) != MMAL_SUCCESS) {
-                        fprintf(stderr, "ERROR: Unable to send buffer to encoder output\n");
-                    }
+            if (userdata->frameCount >= CAPTURE_FRAME_COUNT && userdata->filename[0]) {
+                // The clip keeps recording until the worker closes it
+                post_frame(userdata, data, length, pts, dts, ACTION_STOP_CAPTURE);
+            } else if ((userdata->frameCount % MOTION_PERIOD) == 0) {
+                post_frame(userdata, data, length, pts, dts, ACTION_TRACK_MOTION);
+            }
+            // Never wait on a rebuild from the camera's callback, the frame goes instead
+            if (vcos_mutex_trylock(&userdata->encoder_lock) != VCOS_SUCCESS) {
+                userdata->encoderDrops++;
+                break;
+            }
+            if (!userdata->encoderReady) {
+                vcos_mutex_unlock(&userdata->encoder_lock);
+                userdata->encoderDrops++;  // Triggered during startup, or the last rebuild failed
+                break;
+            }
+            if (userdata->pendingState != STATE_CAPTURE) {
+                vcos_mutex_unlock(&userdata->encoder_lock);
+                break;  // Stopped while this frame waited; the encoder is the next clip's now
+            }
+            if (g_dualStream && userdata->replay) {
+                lores_scale(&userdata->lores, data, userdata->video_width, userdata->video_height, pts);
+            }
+            output_buffer = mmal_queue_get(userdata->encoder_input_pool->queue);
+            if (output_buffer) {
+                memcpy(output_buffer->data, data, length);
+                output_buffer->length = length;
+                output_buffer->pts = pts;
+                output_buffer->dts = dts;
+                if (mmal_port_send_buffer(userdata->encoder_input_port, output_buffer) != MMAL_SUCCESS) {
+                    fprintf(stderr, "ERROR: Unable to send buffer to encoder output\n");
                 } else {
-                    printf("Unable to get encoder input buffer!\n");
+                    WATCHDOG_SENT(&userdata->encoderWatch);
+                    latency_mark(&userdata->latency, LAT_ENCODER_IN);
+                    if (userdata->clipFrames++ == 0)
+                        userdata->clipStartPts = pts;
+                    userdata->clipEndPts = pts;
                 }
+            } else {
+                userdata->encoderDrops++;
+                printf("Unable to get encoder input buffer!\n");
             }
+            vcos_mutex_unlock(&userdata->encoder_lock);
             break;
         case STATE_SUSPEND:
-            if (frame_count >= SUSPEND_FRAME_COUNT) {
+            if (userdata->frameCount >= SUSPEND_FRAME_COUNT) {
                 userdata->pendingState = STATE_NORMAL;
-                userdata->bufferAction = ACTION_NULL;
-                if (vcos_semaphore_trywait(&(userdata->complete_semaphore)) != VCOS_SUCCESS) {
-                    mmal_buffer_header_mem_lock(buffer);
-                    memcpy(userdata->videoBuffer, buffer->data, buffer->length);
-                    userdata->videoBufferLen = buffer->length;
-                    mmal_buffer_header_mem_unlock(buffer);
-                    vcos_semaphore_post(&(userdata->complete_semaphore));  // Tell other thread to proc frame
-                }
+                post_frame(userdata, data, length, pts, dts, ACTION_NULL);
             }
             break;
         default:
             printf("Unknown state: %d\n", userdata->state);
     }
+}
+
+static void video_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    MMAL_BUFFER_HEADER_T *new_buffer;
+    PORT_USERDATA * userdata = (PORT_USERDATA *) port->userdata;
+    MMAL_POOL_T *pool = userdata->camera_video_port_pool;
+
+    WATCHDOG_BEAT(&userdata->cameraWatch);
+    mmal_buffer_header_mem_lock(buffer);
+    stream_frame(userdata, buffer->data, buffer->length, buffer->pts, buffer->dts);
+    mmal_buffer_header_mem_unlock(buffer);
     mmal_buffer_header_release(buffer);
     // and send one back to the port (if still open)
     if (port->is_enabled) {
@@ -244,8 +409,47 @@ static void video_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffe
     }
 }
 
+/**
+ * Low resolution frames from the camera's preview port, encoded only
+ * while a clip is being captured
+ */
+static void preview_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    MMAL_BUFFER_HEADER_T *new_buffer;
+    PORT_USERDATA *userdata = (PORT_USERDATA *) port->userdata;
+
+    WATCHDOG_BEAT(&userdata->previewWatch);
+    if (userdata->state == STATE_CAPTURE) {
+        // Under the same gate as the main encoder, which is rebuilt with it
+        if (vcos_mutex_trylock(&userdata->encoder_lock) != VCOS_SUCCESS) {
+            userdata->lores.drops++;
+        } else {
+            if (userdata->encoderReady && userdata->pendingState == STATE_CAPTURE) {
+                mmal_buffer_header_mem_lock(buffer);
+                lores_encode(&userdata->lores, buffer->data, buffer->length, buffer->pts);
+                mmal_buffer_header_mem_unlock(buffer);
+            } else {
+                userdata->lores.drops++;
+            }
+            vcos_mutex_unlock(&userdata->encoder_lock);
+        }
+    }
+    mmal_buffer_header_release(buffer);
+    if (port->is_enabled) {
+        new_buffer = mmal_queue_get(userdata->camera_preview_port_pool->queue);
+        if (!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+            printf("Unable to return a buffer to the preview port\n");
+    }
+}
+
+static void replay_frame_callback(void *ctx, const unsigned char *data, int length, int64_t pts) {
+    stream_frame((PORT_USERDATA *) ctx, data, length, pts, pts);
+}
+
 
 static void encoder_input_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    PORT_USERDATA *userdata = (PORT_USERDATA *) port->userdata;
+
+    WATCHDOG_BEAT(&userdata->encoderWatch);
     //fprintf(stderr, "INFO:%s\n", __func__);    
     //mmal_buffer_header_mem_lock(buffer);
     //printf("In encoder_input_buffer_callback, len = %d\n", buffer->length);
@@ -253,6 +457,16 @@ static void encoder_input_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_
     mmal_buffer_header_release(buffer);
 }
 
+/**
+ * Append encoder output to the open clip. Called with filewrite_lock held.
+ */
+static void writeClip(PORT_USERDATA *userdata, const void *data, int len) {
+    if (userdata->segfile)
+        segstore_write(userdata->segfile, data, len);
+    else if (userdata->fptr)
+        fwrite(data, 1, len, userdata->fptr);
+}
+
 static void encoder_output_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
     MMAL_BUFFER_HEADER_T *new_buffer;
     PORT_USERDATA *userdata = (PORT_USERDATA *) port->userdata;
@@ -262,8 +476,10 @@ static void encoder_output_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER
     if (userdata) {
         mmal_buffer_header_mem_lock(buffer);
         vcos_mutex_lock(&userdata->filewrite_lock);
-        if (userdata->fptr) {
-            fwrite(buffer->data, 1, buffer->length, userdata->fptr);
+        if (userdata->fptr || userdata->segfile) {
+            writeClip(userdata, buffer->data, buffer->length);
+            if (buffer->length)
+                latency_mark(&userdata->latency, LAT_FIRST_BYTE);
         }
         vcos_mutex_unlock(&userdata->filewrite_lock);
         mmal_buffer_header_mem_unlock(buffer);
@@ -292,15 +508,18 @@ int setup_camera(PORT_USERDATA *userdata) {
     MMAL_PORT_T * camera_video_port;
     MMAL_PORT_T * camera_still_port;
     MMAL_POOL_T * camera_video_port_pool;
-    // Set up the camera_parameters to default
-    raspicamcontrol_set_defaults(&userdata->camera_parameters);
-
     status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera);
     if (status != MMAL_SUCCESS) {
         fprintf(stderr, "Error: create camera %x\n", status);
         return -1;
     }
     userdata->camera = camera;
+
+    status = mmal_port_parameter_set_int32(camera->control, MMAL_PARAMETER_CAMERA_NUM, userdata->camera_num);
+    if (status != MMAL_SUCCESS) {
+        fprintf(stderr, "Error: unable to select camera %d (%u)\n", userdata->camera_num, status);
+        return -1;
+    }
     userdata->camera_preview_port = camera->output[MMAL_CAMERA_PREVIEW_PORT];
     userdata->camera_video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
     userdata->camera_still_port = camera->output[MMAL_CAMERA_CAPTURE_PORT];
@@ -362,11 +581,8 @@ int setup_camera(PORT_USERDATA *userdata) {
     format->es->video.frame_rate.num = VIDEO_FPS;
     format->es->video.frame_rate.den = 1;
 
-    //camera_video_port->buffer_size = format->es->video.width * format->es->video.height * 12 / 8;
-    camera_video_port->buffer_size = format->es->video.width * format->es->video.height * 2;
+    camera_video_port->buffer_size = FRAME_BYTES(format->es->video.width, format->es->video.height);
     camera_video_port->buffer_num = 2;  // or 2?
-    userdata->videoBuffer = malloc(camera_video_port->buffer_size);
-    userdata->videoBufferLen  = 0;
 
     fprintf(stderr, "INFO:camera video buffer_size = %d\n", camera_video_port->buffer_size);
     fprintf(stderr, "INFO:camera video buffer_num = %d\n", camera_video_port->buffer_num);
@@ -392,6 +608,35 @@ int setup_camera(PORT_USERDATA *userdata) {
         return -1;
     }
 
+    if (g_dualStream && !PREVIEW) {
+        // The preview port has nothing to drive; have the ISP scale it for the low resolution clip
+        format = camera_preview_port->format;
+        format->encoding = MMAL_ENCODING_I420;
+        format->encoding_variant = MMAL_ENCODING_I420;
+        format->es->video.width = LORES_WIDTH;
+        format->es->video.height = LORES_HEIGHT;
+        format->es->video.crop.x = 0;
+        format->es->video.crop.y = 0;
+        format->es->video.crop.width = LORES_WIDTH;
+        format->es->video.crop.height = LORES_HEIGHT;
+        camera_preview_port->buffer_size = FRAME_BYTES(LORES_WIDTH, LORES_HEIGHT);
+        camera_preview_port->buffer_num = 3;
+        status = mmal_port_format_commit(camera_preview_port);
+        if (status != MMAL_SUCCESS) {
+            fprintf(stderr, "Error: unable to commit camera preview port format (%u)\n", status);
+            return -1;
+        }
+        userdata->camera_preview_port_pool = (MMAL_POOL_T *) mmal_port_pool_create(camera_preview_port,
+                                                                                   camera_preview_port->buffer_num,
+                                                                                   camera_preview_port->buffer_size);
+        camera_preview_port->userdata = (struct MMAL_PORT_USERDATA_T *) userdata;
+        status = mmal_port_enable(camera_preview_port, preview_buffer_callback);
+        if (status != MMAL_SUCCESS) {
+            fprintf(stderr, "Error: unable to enable camera preview port (%u)\n", status);
+            return -1;
+        }
+    }
+
     status = mmal_component_enable(camera);
     if (status != MMAL_SUCCESS) {
         fprintf(stderr, "Error: unable to enable camera (%u)\n", status);
@@ -399,6 +644,9 @@ int setup_camera(PORT_USERDATA *userdata) {
     }
 
     raspicamcontrol_set_all_parameters(camera, &userdata->camera_parameters);
+    // Cache what the firmware actually took, so live changes only send differences
+    raspicamcontrol_get_all_parameters(camera, &userdata->camera_applied);
+    userdata->camera_applied.thumbnailConfig = userdata->camera_parameters.thumbnailConfig;
 
     fprintf(stderr, "INFO: camera created\n");
     return 0;
@@ -439,9 +687,24 @@ int setup_encoder(PORT_USERDATA *userdata) {
     encoder_input_port = encoder->input[0];
     encoder_output_port = encoder->output[0];
     userdata->encoder_input_port = encoder_input_port;
-    userdata->encoder_output_port = encoder_input_port;
+    userdata->encoder_output_port = encoder_output_port;
 
-    mmal_format_copy(encoder_input_port->format, userdata->camera_video_port->format);
+    if (userdata->camera_video_port) {
+        mmal_format_copy(encoder_input_port->format, userdata->camera_video_port->format);
+    } else {
+        // Replay source, describe the raw frames it delivers
+        MMAL_ES_FORMAT_T *format = encoder_input_port->format;
+        format->encoding = MMAL_ENCODING_I420;
+        format->encoding_variant = MMAL_ENCODING_I420;
+        format->es->video.width = VIDEO_WIDTH;
+        format->es->video.height = VIDEO_HEIGHT;
+        format->es->video.crop.x = 0;
+        format->es->video.crop.y = 0;
+        format->es->video.crop.width = VIDEO_WIDTH;
+        format->es->video.crop.height = VIDEO_HEIGHT;
+        format->es->video.frame_rate.num = VIDEO_FPS;
+        format->es->video.frame_rate.den = 1;
+    }
     encoder_input_port->buffer_size = encoder_input_port->buffer_size_recommended;
     /*
     if (encoder_input_port->buffer_size < encoder_input_port->buffer_size_min) {
@@ -521,11 +784,19 @@ int setup_encoder(PORT_USERDATA *userdata) {
 
     fill_port_buffer(encoder_output_port, encoder_output_port_pool);
 
+    if (g_dualStream && lores_start_encoder(&userdata->lores, LORES_BITRATE(BITRATE)) != 0) {
+        return -1;
+    }
     fprintf(stderr, "INFO:Encoder has been created\n");
     return 0;
 }
 
 static void reset_encoder(PORT_USERDATA *userdata) {
+    userdata->encoderReady = 0;
+    watchdog_arm(&userdata->encoderWatch, 0);
+    lores_stop_encoder(&userdata->lores);
+    if (!userdata->encoder)
+        return;
     // Get rid of any port buffers first
    mmal_port_disable(userdata->encoder_input_port);
    mmal_port_disable(userdata->encoder_output_port);
@@ -602,185 +873,1370 @@ int setup_preview(PORT_USERDATA *userdata) {
 }
 
 
-static void setFilename(char* filename) {
+/**
+ * Align the latency tracer with the camera STC that buffer pts values use
+ */
+static void sync_latency_clock(PORT_USERDATA *userdata) {
+    uint64_t stc = 0;
+    if (!userdata->camera)
+        return;  // Replay pts are already monotonic
+    if (mmal_port_parameter_get_uint64(userdata->camera->control, MMAL_PARAMETER_SYSTEM_TIME, &stc) == MMAL_SUCCESS) {
+        latency_sync_clock(&userdata->latency, (int64_t)stc);
+    } else {
+        fprintf(stderr, "Unable to read camera STC for latency tracing\n");
+    }
+}
+
+static void setFilename(PORT_USERDATA *userdata) {
     time_t curTime = time(NULL);
-    sprintf(filename, "/tmp/%d.h264", curTime);
-}
-
-static void postToQueue(int msqid, char* filename) {
-    struct my_msgbuf buf;
-    strcpy(buf.mtext, filename);
-    buf.mtype = 1;  // sourced from me
-    int len = strlen(buf.mtext);
-
-    if (msgsnd(msqid, &buf, len, 0) == -1) 
-        perror("msgsnd");
-    //
-    // Look for something sent to me
-    // 
-    if (msgrcv(msqid, &buf, sizeof(buf.mtext), 2, IPC_NOWAIT) < 0) {
-        switch(errno) {
-            case ENOMSG:
-                // Cool
-                break;
-            default:
-                perror("msgrcv");
-                exit(1);
+    if (userdata->id == 0)
+        snprintf(userdata->filename, sizeof(userdata->filename), "%s/%d.h264", g_spool.dir, (int)curTime);
+    else
+        snprintf(userdata->filename, sizeof(userdata->filename), "%s/%d_%d.h264", g_spool.dir, (int)curTime, userdata->id);
+}
+
+/**
+ * Name of the low resolution companion of a clip: <time>[_<stream>]_lo.h264
+ */
+static void loresFilename(const char *filename, char *lores, int len) {
+    const char *ext = strrchr(filename, '.');
+    int stem = ext ? (int)(ext - filename) : (int)strlen(filename);
+
+    snprintf(lores, len, "%.*s%s", stem, filename, LORES_SUFFIX);
+}
+
+static int isLoresClip(const char *path) {
+    size_t n = strlen(path), m = strlen(LORES_SUFFIX);
+    return n >= m && strcmp(path + n - m, LORES_SUFFIX) == 0;
+}
+
+/**
+ * Close the clip's latency event. With a companion, whichever of the two
+ * snoop.py uploads first, normally the companion, completes it.
+ */
+static void closeLatency(PORT_USERDATA *userdata, const char *filename) {
+    char lores[80];
+
+    loresFilename(filename, lores, sizeof(lores));
+    latency_close(&userdata->latency, filename, g_dualStream ? lores : NULL);
+}
+
+/**
+ * Open a new clip file and journal it as recording, first making room
+ * for it if the spool is over quota
+ */
+static int openClip(PORT_USERDATA *userdata) {
+    spool_enforce_quota(&g_spool);
+    setFilename(userdata);
+    if (g_useSegstore) {
+        userdata->segfile = segstore_create(&g_segstore, userdata->filename);
+        if (!userdata->segfile)
+            return -1;
+    } else {
+        userdata->fptr = fopen(userdata->filename, "wb");
+        if (!userdata->fptr) {
+            perror(userdata->filename);
+            return -1;
         }
+    }
+    spool_set_state(&g_spool, userdata->filename, SPOOL_RECORDING, 0);
+    if (g_dualStream) {
+        char lores[80];
+        loresFilename(userdata->filename, lores, sizeof(lores));
+        if (lores_begin_clip(&userdata->lores, lores) == 0)
+            spool_set_state(&g_spool, lores, SPOOL_RECORDING, 0);
+    }
+    return 0;
+}
 
+/**
+ * Make a finished clip durable before journalling it as closed, so a
+ * crash never leaves a CLOSED entry pointing at unsynced data.
+ */
+static void closeClip(PORT_USERDATA *userdata, const char *filename, uint32_t peakScore) {
+    long size;
+
+    if (userdata->segfile) {
+        size = segstore_finish(userdata->segfile);
+        userdata->segfile = NULL;
+    } else if (userdata->fptr) {
+        fflush(userdata->fptr);
+        fdatasync(fileno(userdata->fptr));
+        size = ftell(userdata->fptr);
+        fclose(userdata->fptr);
+        userdata->fptr = NULL;
     } else {
-        printf("Client Received: \"%s\"\n", buf.mtext);
-        if (strncmp(buf.mtext, "EXIT", 4) == 0) 
+        return;  // openClip failed, nothing was recorded
+    }
+    // In dual-stream mode the full clip waits for an idle link, see publishClip()
+    spool_set_closed(&g_spool, filename, size, peakScore, g_dualStream);
+    if (g_dualStream && (size = lores_end_clip(&userdata->lores)) >= 0) {
+        char lores[80];
+        loresFilename(filename, lores, sizeof(lores));
+        spool_set_closed(&g_spool, lores, size, peakScore, 0);
+    }
+}
+
+/**
+ * Dispose of a clip the spool is done with, along with its timeline
+ * once the full resolution clip goes
+ */
+static void releaseClip(void *ctx, const char *path) {
+    char sidecar[96];
+
+    if (isLoresClip(path)) {
+        unlink(path);  // Always written with stdio, never a ring segment
+        return;
+    }
+    timeline_path(path, sidecar, sizeof(sidecar));
+    unlink(sidecar);
+    classify_tags_path(path, sidecar, sizeof(sidecar));
+    unlink(sidecar);
+    if (g_useSegstore)
+        segstore_release(&g_segstore, path);
+    else
+        unlink(path);
+}
+
+/**
+ * Store the clip's motion samples next to it, for snoop.py to upload
+ * with the clip
+ */
+static void writeTimeline(PORT_USERDATA *userdata, const char *filename) {
+    char path[96];
+
+    if (userdata->numSamples == 0)
+        return;
+    timeline_path(filename, path, sizeof(path));
+    if (timeline_write(path, userdata->clipFrames ? userdata->clipStartPts : userdata->sampleTimes[0],
+                       userdata->opencv_width, userdata->opencv_height,
+                       userdata->samples, userdata->sampleTimes, userdata->numSamples) != 0)
+        fprintf(stderr, "Unable to write timeline %s\n", path);
+}
+
+/**
+ * Store the classifier's verdict on a finished clip next to it. The
+ * stream's regions must be done, see classify_wait()
+ *
+ * @return 1 if the clip is to be held back from upload
+ */
+static int tagClip(PORT_USERDATA *userdata, const char *filename) {
+    char path[96], text[80];
+    uint32_t labels;
+
+    if (!g_classify.numCascades || classify_verdict(&g_classify, &userdata->classify, &labels) == 0)
+        return 0;  // Nothing classified in time, the clip goes up as before
+    classify_labels(&g_classify, labels, text, sizeof(text));
+    classify_tags_path(filename, path, sizeof(path));
+    if (classify_write_tags(path, text) != 0 || labels || !g_classifyHold)
+        return 0;
+    printf("Nothing recognised in %s, held back from upload\n", filename);
+    spool_set_deferred(&g_spool, filename, 1);
+    if (g_dualStream) {
+        char lores[80];
+        loresFilename(filename, lores, sizeof(lores));
+        spool_set_deferred(&g_spool, lores, 1);
+    }
+    return 1;
+}
+
+/**
+ * @return 1 if a spooled clip, or the clip a companion belongs to, was
+ *         held back by tagClip()
+ */
+static int heldClip(const char *path) {
+    char full[80], tags[96];
+
+    if (!g_classifyHold)
+        return 0;
+    if (isLoresClip(path)) {
+        snprintf(full, sizeof(full), "%.*s.h264", (int)(strlen(path) - strlen(LORES_SUFFIX)), path);
+        path = full;
+    }
+    classify_tags_path(path, tags, sizeof(tags));
+    return classify_read_tags(tags) == 0;
+}
+
+/**
+ * Republish a spooled clip that snoop.py has not confirmed as uploaded
+ *
+ * @return 0 if published or held back, -1 if the event queue is full
+ */
+static int resyncClip(const char *path) {
+    EVENTIPC_CLIP_T clip;
+
+    if (heldClip(path))
+        return 0;  // Stays in the spool until evicted
+    memset(&clip, 0, sizeof(clip));
+    clip.path_len = strlen(path);
+    clip.flags = EV_CLIP_FLAG_RECOVERED;
+    if (isLoresClip(path))
+        clip.flags |= EV_CLIP_FLAG_LORES;
+    else if (g_dualStream)
+        clip.flags |= EV_CLIP_FLAG_DEFERRED;
+    return eventipc_publish_clip(&g_events, path, &clip, NULL);
+}
+
+/**
+ * Copy out the path of a clip to republish; runs under the spool lock
+ */
+static void collectClip(void *ctx, const char *path, const SPOOL_CLIP_T *spooled) {
+    char *copy;
+
+    if (g_resync.num == g_resync.size) {
+        int size = g_resync.size ? 2*g_resync.size : 64;
+        char **paths = realloc(g_resync.paths, size*sizeof(char *));
+        if (!paths)
+            return;
+        g_resync.paths = paths;
+        g_resync.size = size;
+    }
+    copy = strdup(path);
+    if (copy)
+        g_resync.paths[g_resync.num++] = copy;
+}
+
+static void endResync(void) {
+    while (g_resync.next < g_resync.num)
+        free(g_resync.paths[g_resync.next++]);
+    g_resync.num = 0;
+    g_resync.next = 0;
+}
+
+/**
+ * Republish the next RESYNC_BATCH clips taken by a CMD_RESYNC. Runs on the
+ * IPC thread, again each time the batch before has reached every client.
+ */
+static void resyncBatch(void *ctx) {
+    int end = g_resync.next + RESYNC_BATCH;
+
+    while (g_resync.next < g_resync.num && g_resync.next < end) {
+        if (resyncClip(g_resync.paths[g_resync.next]) != 0)
+            return;  // Queue full, tried again once it drains
+        free(g_resync.paths[g_resync.next++]);
+    }
+    if (g_resync.num && g_resync.next == g_resync.num) {
+        printf("Republished %d spooled clips\n", g_resync.num);
+        endResync();
+    }
+}
+
+/**
+ * Change camera settings while capturing. Only the settings that differ
+ * from the cached ones are sent to the camera.
+ *
+ * @param payload uint32 stream, then NUL-separated options and values
+ */
+static void configureCamera(const unsigned char *payload, uint32_t len) {
+    char args[EVENTIPC_MAX_RECORD];
+    const char *argv[64];
+    RASPICAM_CAMERA_PARAMETERS wanted;
+    PORT_USERDATA *userdata = NULL;
+    uint32_t stream;
+    int argc = 0, i, used, result, roiChanged;
+    uint32_t off;
+
+    if (len < sizeof(stream) || len - sizeof(stream) >= sizeof(args))
+        return;
+    memcpy(&stream, payload, sizeof(stream));
+    memcpy(args, payload + sizeof(stream), len - sizeof(stream));
+    args[len - sizeof(stream)] = 0;
+    for (off = 0; off < len - sizeof(stream) && argc < 64; off += strlen(args + off) + 1)
+        argv[argc++] = args + off;
+
+    for (i = 0; i < g_numStreams; i++) {
+        if (g_streams[i]->id == (int)stream)
+            userdata = g_streams[i];
+    }
+    if (!userdata || !userdata->camera) {
+        printf("No camera for stream %u\n", stream);
+        return;
+    }
+
+    vcos_mutex_lock(&userdata->camera_lock);
+    wanted = userdata->camera_applied;
+    for (i = 0; i < argc; i += used) {
+        used = raspicamcontrol_parse_cmdline(&wanted, argv[i], (i + 1 < argc) ? argv[i + 1] : NULL);
+        if (!used) {
+            printf("Invalid camera setting: %s\n", argv[i]);
+            vcos_mutex_unlock(&userdata->camera_lock);
+            return;
+        }
+    }
+    roiChanged = memcmp(&wanted.roi, &userdata->camera_applied.roi, sizeof(wanted.roi)) != 0;
+    result = raspicamcontrol_apply_parameters(userdata->camera, &userdata->camera_applied, &wanted);
+    userdata->camera_parameters = userdata->camera_applied;
+    vcos_mutex_unlock(&userdata->camera_lock);
+    if (roiChanged && userdata->crop.active) {
+        // The camera now shows the whole new ROI, so the crop starts again from
+        // it; the clip keeps its moves so far, it has still been cropped
+        int moves = userdata->crop.moves;
+        autocrop_reset(&userdata->crop);
+        userdata->crop.moves = moves;
+        userdata->cropReseed = 1;
+    }
+    printf("Camera settings for stream %u %s\n", stream, result ? "partly applied" : "applied");
+}
+
+/**
+ * Commands from event channel clients. Runs on the IPC thread, so
+ * commands take effect as soon as they arrive.
+ */
+static void handleCommand(void *ctx, int type, const unsigned char *payload, uint32_t len) {
+    char clip[80];
+    int64_t wall_us;
+    uint32_t state;
+    uint32_t uplink[2];
+    int i;
+
+    switch (type) {
+        case CMD_EXIT:
+            printf("Client Received: EXIT\n");
             exit(0);
+        case CMD_UPLOADED:
+            if (len < sizeof(wall_us) || len - sizeof(wall_us) >= sizeof(clip))
+                break;
+            memcpy(&wall_us, payload, sizeof(wall_us));
+            memcpy(clip, payload + sizeof(wall_us), len - sizeof(wall_us));
+            clip[len - sizeof(wall_us)] = 0;
+            for (i = 0; i < g_numStreams; i++) {
+                if (latency_uploaded(&g_streams[i]->latency, clip, wall_us) == 0)
+                    break;
+            }
+            // The second of a clip and its companion finds its event already complete
+            if (i == g_numStreams && !(g_dualStream && !isLoresClip(clip)))
+                printf("No latency record for %s\n", clip);
+            spool_set_state(&g_spool, clip, SPOOL_UPLOADED, 0);
+            break;
+        case CMD_CLIP_STATE:
+            if (len < sizeof(state) || len - sizeof(state) >= sizeof(clip))
+                break;
+            memcpy(&state, payload, sizeof(state));
+            memcpy(clip, payload + sizeof(state), len - sizeof(state));
+            clip[len - sizeof(state)] = 0;
+            // Only the uploader's own steps; RECORDING and CLOSED belong to snoopmon
+            if (state == SPOOL_MUXED || state == SPOOL_UPLOADING)
+                spool_set_state(&g_spool, clip, state, 0);
+            break;
+        case CMD_RESYNC:
+            // Paths out under the spool lock, published in batches the clients can take
+            endResync();
+            spool_foreach_pending(&g_spool, collectClip, NULL);
+            resyncBatch(NULL);
+            break;
+        case CMD_CAMERA:
+            configureCamera(payload, len);
+            break;
+        case CMD_UPLINK:
+            if (len < sizeof(uplink))
+                break;
+            memcpy(uplink, payload, sizeof(uplink));
+            bitrate_uplink_sample(&g_bitrate, uplink[0], uplink[1]);
+            break;
+        default:
+            printf("Unknown command: %d\n", type);
     }
 }
 
-int main(int argc, char** argv) {
-    MMAL_STATUS_T status;
-    PORT_USERDATA userdata;
-    int display_width, display_height;
-    int msqid;
-    key_t key = 500;
-    char filename[80];
-    char prevFilename[80];
+/**
+ * Record a motion score and box for the clip being captured
+ */
+static void addSample(PORT_USERDATA *userdata, int score, CvRect box) {
+    EVENTIPC_SAMPLE_T *sample;
+
+    if (userdata->numSamples >= MAX_CLIP_SAMPLES)
+        return;
+    userdata->sampleTimes[userdata->numSamples] = userdata->videoBufferPts;
+    sample = &userdata->samples[userdata->numSamples++];
+    sample->score = score;
+    sample->box.x = box.x;
+    sample->box.y = box.y;
+    sample->box.w = box.width;
+    sample->box.h = box.height;
+}
 
-    setFilename(filename);
-    userdata.fptr = fopen(filename, "wb");
+static uint32_t peakScore(PORT_USERDATA *userdata) {
+    uint32_t peak = 0;
+    int i;
 
-    printf("Running...\n");
+    for (i = 0; i < userdata->numSamples; i++) {
+        if (userdata->samples[i].score > peak)
+            peak = userdata->samples[i].score;
+    }
+    return peak;
+}
 
-    bcm_host_init();
+static void resetClipStats(PORT_USERDATA *userdata) {
+    userdata->clipStartPts = 0;
+    userdata->clipEndPts = 0;
+    userdata->clipFrames = 0;
+    userdata->encoderDrops = 0;
+    userdata->analysisSkips = 0;
+    userdata->numSamples = 0;
+    userdata->lores.frames = 0;
+    userdata->lores.drops = 0;
+    if (g_classify.numCascades)
+        classify_begin_clip(&g_classify, &userdata->classify);
+}
 
-    if ((msqid = msgget(key, 0644 | IPC_CREAT)) == -1) {
-        perror("msgget");
-        exit(1);
+/**
+ * Set a rate choice on the stream's encoders, main and lores. The caller
+ * holds encoder_lock.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int setEncoderRate(PORT_USERDATA *userdata, const BITRATE_CHOICE_T *choice) {
+    MMAL_PORT_T *port = userdata->encoder->output[0];
+
+    if (mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_VIDEO_BIT_RATE, choice->bitrate) != MMAL_SUCCESS ||
+        mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT, choice->minQuant) != MMAL_SUCCESS ||
+        mmal_port_parameter_set_uint32(port, MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT, choice->maxQuant) != MMAL_SUCCESS) {
+        fprintf(stderr, "Unable to set encoder rate for stream %d\n", userdata->id);
+        return -1;
     }
-    if (GX) {
-        cvNamedWindow("camcvWin", CV_WINDOW_AUTOSIZE);
+    lores_set_bitrate(&userdata->lores, LORES_BITRATE(choice->bitrate));
+    return 0;
+}
+
+/**
+ * Pick this clip's bitrate and quantiser limits and apply them to the
+ * running encoder
+ */
+static void applyBitrate(PORT_USERDATA *userdata, int score) {
+    BITRATE_CHOICE_T choice;
+    double motion = (double)score/(userdata->opencv_width*userdata->opencv_height);
+    int64_t backlog;
+    int result;
+
+    if (!userdata->filename[0])
+        return;  // Triggered before the spool was open, the encoder keeps its default rate
+    // Deferred and held back clips never wait ahead of this one
+    backlog = spool_upload_backlog_bytes(&g_spool);
+    bitrate_choose(&g_bitrate, backlog, g_numStreams, motion, &choice);
+    vcos_mutex_lock(&userdata->encoder_lock);  // The watchdog may be rebuilding it
+    if (!userdata->encoder) {
+        vcos_mutex_unlock(&userdata->encoder_lock);
+        return;
     }
-    userdata.preview_width = VIDEO_WIDTH / 1;
-    userdata.preview_height = VIDEO_HEIGHT / 1;
-    userdata.video_width = VIDEO_WIDTH / 1;
-    userdata.video_height = VIDEO_HEIGHT / 1;
-    userdata.opencv_width = VIDEO_WIDTH / 2;
-    userdata.opencv_height = VIDEO_HEIGHT / 2;
+    userdata->clipRate = choice;  // Kept for a watchdog rebuild mid clip
+    result = setEncoderRate(userdata, &choice);
+    vcos_mutex_unlock(&userdata->encoder_lock);
+    if (result != 0)
+        return;
+    printf("Stream %d clip rate %u bps, QP %u-%u (backlog %lld bytes, motion %.3f)\n", userdata->id,
+           choice.bitrate, choice.minQuant, choice.maxQuant, (long long)backlog, motion);
+}
 
-    userdata.encoding = MMAL_ENCODING_JPEG;
-    userdata.quality = 75;
+/**
+ * Snapshot the frame in videoBuffer that triggered capture. The JPEG
+ * takes the clip's name so the server can match the two up.
+ */
+static void takeSnapshot(PORT_USERDATA *userdata, int score, CvRect box) {
+    EVENTIPC_SNAPSHOT_T event;
+    char path[80];
+    char *ext;
+
+    if (!userdata->camera_parameters.thumbnailConfig.enable || !userdata->filename[0])
+        return;  // Disabled, or triggered before the spool was open
+    snprintf(path, sizeof(path), "%s", userdata->filename);
+    ext = strrchr(path, '.');
+    if (ext)
+        *ext = 0;
+    strncat(path, ".jpg", sizeof(path) - strlen(path) - 1);
+
+    memset(&event, 0, sizeof(event));
+    event.pts = userdata->videoBufferPts;
+    event.stream = userdata->id;
+    event.score = score;
+    event.box.x = box.x;
+    event.box.y = box.y;
+    event.box.w = box.width;
+    event.box.h = box.height;
+    if (snapshot_take(&userdata->snapshot, userdata->videoBuffer, userdata->video_width, userdata->video_height,
+                      path, &event) != 0)
+        fprintf(stderr, "Snapshot dropped, previous one still encoding\n");
+}
 
-    graphics_get_display_size(0, &display_width, &display_height);
+/**
+ * Map a box from the analysed view, which may be cropped, to analysis
+ * pixels of the uncropped view
+ */
+static void cropToFrame(PORT_USERDATA *userdata, CvRect *box) {
+    AUTOCROP_RECT_T r;
+
+    if (!userdata->crop.active)
+        return;
+    r.x = (double)box->x/userdata->opencv_width;
+    r.y = (double)box->y/userdata->opencv_height;
+    r.w = (double)box->width/userdata->opencv_width;
+    r.h = (double)box->height/userdata->opencv_height;
+    autocrop_to_frame(&userdata->crop, &r);
+    box->x = r.x*userdata->opencv_width + 0.5;
+    box->y = r.y*userdata->opencv_height + 0.5;
+    box->width = r.w*userdata->opencv_width + 0.5;
+    box->height = r.h*userdata->opencv_height + 0.5;
+}
 
-    printf("Display resolution = (%d, %d)\n", display_width, display_height);
+/**
+ * Point the camera at a crop, given within the configured ROI
+ */
+static void setCropROI(PORT_USERDATA *userdata, const AUTOCROP_RECT_T *crop) {
+    PARAM_FLOAT_RECT_T base, roi;
+
+    vcos_mutex_lock(&userdata->camera_lock);
+    base = userdata->camera_applied.roi;
+    roi.x = base.x + crop->x*base.w;
+    roi.y = base.y + crop->y*base.h;
+    roi.w = crop->w*base.w;
+    roi.h = crop->h*base.h;
+    if (raspicamcontrol_set_ROI(userdata->camera, roi) != MMAL_SUCCESS)
+        fprintf(stderr, "Unable to crop stream %d\n", userdata->id);
+    vcos_mutex_unlock(&userdata->camera_lock);
+    userdata->cropReseed = 1;
+}
+
+/**
+ * Move the crop towards a box of changed pixels, in uncropped analysis
+ * pixels, when auto-crop is on
+ */
+static void followMotion(PORT_USERDATA *userdata, int score, CvRect box) {
+    AUTOCROP_RECT_T r;
+
+    if (!g_autoCrop || !userdata->camera || score <= g_MotionParams.pixelThreshold)
+        return;
+    r.x = (double)box.x/userdata->opencv_width;
+    r.y = (double)box.y/userdata->opencv_height;
+    r.w = (double)box.width/userdata->opencv_width;
+    r.h = (double)box.height/userdata->opencv_height;
+    if (autocrop_update(&userdata->crop, &r))
+        setCropROI(userdata, &userdata->crop.applied);
+}
+
+/**
+ * Hand the motion region of the frame being analysed to the object
+ * classifier
+ *
+ * @param box Bounding box of the motion, in analysis pixels of the frame
+ *            as captured
+ */
+static void classifyMotion(PORT_USERDATA *userdata, CvRect box) {
+    double sx = (double)userdata->video_width/userdata->opencv_width;
+    double sy = (double)userdata->video_height/userdata->opencv_height;
+
+    if (!g_classify.numCascades)
+        return;
+    classify_region(&g_classify, &userdata->classify, userdata->image1,
+                    cvRect(box.x*sx, box.y*sy, box.width*sx, box.height*sy), userdata->videoBufferPts);
+}
 
-    /* setup opencv */
-    userdata.storage = cvCreateMemStorage(0);
-    userdata.image1 = cvCreateImage(cvSize(userdata.video_width, userdata.video_height), IPL_DEPTH_8U, 1);
-    userdata.image2 = cvCreateImage(cvSize(userdata.opencv_width, userdata.opencv_height), IPL_DEPTH_8U, 1);
-    userdata.prevImage = cvCreateImage(cvSize(userdata.opencv_width, userdata.opencv_height), IPL_DEPTH_8U, 1);
-    userdata.py1 = cvCreateImage(cvSize(userdata.opencv_width, userdata.opencv_height), IPL_DEPTH_8U, 1);
-    userdata.py2 = cvCreateImage(cvSize(userdata.opencv_width, userdata.opencv_height), IPL_DEPTH_8U, 1);
+/**
+ * Return the camera to the configured ROI once a clip is over
+ */
+static void resetCrop(PORT_USERDATA *userdata) {
+    if (!userdata->crop.active)
+        return;
+    autocrop_reset(&userdata->crop);
+    setCropROI(userdata, &userdata->crop.applied);
+}
 
-    if (1 && (status = setup_camera(&userdata) != 0)) {
-        fprintf(stderr, "Error: setup camera %x\n", status);
+/**
+ * Publish a finished clip. In dual-stream mode the low resolution clip
+ * goes first and the full one is marked for deferred upload.
+ */
+static void publishClip(PORT_USERDATA *userdata, const char *filename) {
+    EVENTIPC_CLIP_T clip;
+
+    if (g_dualStream) {
+        char lores[80];
+        loresFilename(filename, lores, sizeof(lores));
+        clip.start_pts = userdata->clipStartPts;
+        clip.end_pts = userdata->clipEndPts;
+        clip.frames = userdata->lores.frames;
+        clip.encoder_drops = userdata->lores.drops;
+        clip.analysis_skips = userdata->analysisSkips;
+        clip.path_len = strlen(lores);
+        clip.num_samples = userdata->numSamples;
+        clip.stream = userdata->id;
+        clip.flags = EV_CLIP_FLAG_LORES | (userdata->crop.moves ? EV_CLIP_FLAG_CROPPED : 0);
+        if (eventipc_publish_clip(userdata->events, lores, &clip, userdata->samples) != 0)
+            fprintf(stderr, "Unable to publish clip %s\n", lores);
+    }
+
+    clip.start_pts = userdata->clipStartPts;
+    clip.end_pts = userdata->clipEndPts;
+    clip.frames = userdata->clipFrames;
+    clip.encoder_drops = userdata->encoderDrops;
+    clip.analysis_skips = userdata->analysisSkips;
+    clip.path_len = strlen(filename);
+    clip.num_samples = userdata->numSamples;
+    clip.stream = userdata->id;
+    clip.flags = userdata->crop.moves ? EV_CLIP_FLAG_CROPPED : 0;
+    if (g_dualStream)
+        clip.flags |= EV_CLIP_FLAG_DEFERRED;
+    if (eventipc_publish_clip(userdata->events, filename, &clip, userdata->samples) != 0)
+        fprintf(stderr, "Unable to publish clip %s\n", filename);
+}
+
+/**
+ * Analyse one frame handed over by stream_frame(). Runs on a pool worker;
+ * a stream never has more than one frame in flight, so the stream state
+ * below needs no locking.
+ */
+static void processFrame(WORKPOOL_JOB_T *job) {
+    PORT_USERDATA *userdata = STREAM_FROM_JOB(job);
+    int  dataSize = userdata->opencv_width*userdata->opencv_height;
+    int  motionFlag = 0;
+    int  pixCount = 0;
+    int  heatmapSample = 0;
+    int  held;
+    CvRect box;
+
+    if (userdata->bufferAction != ACTION_CHECK_MOTION)
+        userdata->prevCoarseValid = 0;  // Only checks keep prevCoarse current
+    switch (userdata->bufferAction) {
+        case ACTION_NULL:
+            cvResize(userdata->image1, userdata->image2, CV_INTER_LINEAR);
+            memcpy(userdata->prevImage->imageData, userdata->image2->imageData, dataSize);
+            userdata->prevStale = 0;
+            break;
+        case ACTION_CHECK_MOTION:
+            motionFlag = 0;
+            if (g_heatmap && !userdata->firstFrame)
+                heatmapSample = heatmap_sample_due(&userdata->heatmap);
+            if (userdata->firstFrame) {
+                userdata->firstFrame = 0;
+                cvResize(userdata->image1, userdata->image2, CV_INTER_LINEAR);
+                memcpy(userdata->prevImage->imageData, userdata->image2->imageData, dataSize);
+                userdata->prevStale = 0;
+            } else if (!heatmapSample && !coarseGate(userdata)) {
+                // Static scene, leave the full resolution frame until it is needed
+                userdata->prevStale = 1;
+                if (g_frameTap)
+                    frametap_checked(&userdata->tap);
+                startup_milestone(&g_startup, STARTUP_FIRST_CHECK);
+            } else {
+                if (heatmapSample)
+                    userdata->prevCoarseValid = 0;  // Samples skip the gate
+                if (userdata->prevStale) {
+                    cvResize(userdata->prevFrame, userdata->prevImage, CV_INTER_LINEAR);
+                    userdata->prevStale = 0;
+                }
+                cvResize(userdata->image1, userdata->image2, CV_INTER_LINEAR);
+                //
+                // Compare images
+                //
+                pixCount = compareImages(userdata, &box);
+                if (heatmapSample)
+                    sampleHeatmap(userdata);
+                startup_milestone(&g_startup, STARTUP_FIRST_CHECK);
+                // cvShowImage("camcvWin", userdata->image1); // display only gray channel
+                // cvWaitKey(1);
+                motionFlag = motion_triggered(&g_MotionParams, pixCount);
+                memcpy(userdata->prevImage->imageData, userdata->image2->imageData, dataSize);
+                if (motionFlag) {
+                    strcpy(userdata->text, "Capture Video");
+                    latency_begin(&userdata->latency, userdata->videoBufferPts);
+                    resetClipStats(userdata);
+                    addSample(userdata, pixCount, box);
+                    takeSnapshot(userdata, pixCount, box);
+                    classifyMotion(userdata, box);
+                    applyBitrate(userdata, pixCount);
+                    followMotion(userdata, pixCount, box);
+                    userdata->pendingState = STATE_CAPTURE;
+                }
+            }
+            break;
+        case ACTION_TRACK_MOTION:
+            cvResize(userdata->image1, userdata->image2, CV_INTER_LINEAR);
+            userdata->prevStale = 0;
+            if (userdata->cropReseed) {
+                // The view has changed, there is nothing to compare against
+                userdata->cropReseed = 0;
+                memcpy(userdata->prevImage->imageData, userdata->image2->imageData, dataSize);
+                break;
+            }
+            pixCount = compareImages(userdata, &box);
+            memcpy(userdata->prevImage->imageData, userdata->image2->imageData, dataSize);
+            if (motion_triggered(&g_MotionParams, pixCount))
+                classifyMotion(userdata, box);  // Before the box leaves image1's coordinates
+            cropToFrame(userdata, &box);
+            addSample(userdata, pixCount, box);
+            followMotion(userdata, pixCount, box);
+            break;
+        case ACTION_STOP_CAPTURE:
+            held = 0;
+            // The clip's last region counts for its verdict. stream_frame()
+            // keeps feeding this clip until reset_encoder() below, so the
+            // wait lengthens the clip rather than the gap after it
+            if (g_classify.numCascades)
+                classify_wait(&g_classify, &userdata->classify);
+            strcpy(userdata->prevFilename, userdata->filename);
+            vcos_mutex_lock(&userdata->encoder_lock);
+            reset_encoder(userdata);
+            memset(&userdata->clipRate, 0, sizeof(userdata->clipRate));  // The next clip picks its own
+            vcos_mutex_lock(&userdata->filewrite_lock);
+            closeClip(userdata, userdata->prevFilename, peakScore(userdata));
+            writeTimeline(userdata, userdata->prevFilename);
+            held = tagClip(userdata, userdata->prevFilename);
+            closeLatency(userdata, userdata->prevFilename);
+            openClip(userdata);
+            vcos_mutex_unlock(&userdata->filewrite_lock);
+            strcpy(userdata->text, "");
+            userdata->pendingState = STATE_SUSPEND;
+            if (setup_encoder(userdata) != 0) {
+                fprintf(stderr, "Error: setup encoder for stream %d\n", userdata->id);
+                exit(-1);
+            }
+            sync_latency_clock(userdata);
+            __sync_synchronize();  // Encoder ports before the flag that publishes them
+            userdata->encoderReady = 1;
+            watchdog_arm(&userdata->encoderWatch, 1);
+            vcos_mutex_unlock(&userdata->encoder_lock);
+            if (!held)
+                publishClip(userdata, userdata->prevFilename);
+            resetCrop(userdata);
+            arena_write_report(&g_arena);  // Keep RSS in view as clips come and go
+            break;
+        default:
+            printf("Unknown action: %d\n", userdata->bufferAction);
+    }
+    if (GX && userdata->id == 0) {
+        graphics_resource_fill(g_overlay, 0, 0, GRAPHICS_RESOURCE_WIDTH, GRAPHICS_RESOURCE_HEIGHT, GRAPHICS_RGBA32(0, 0, 0, 0x00));
+        graphics_resource_render_text_ext(g_overlay, 0, 0,
+                GRAPHICS_RESOURCE_WIDTH,
+                GRAPHICS_RESOURCE_HEIGHT,
+                GRAPHICS_RGBA32(0x00, 0xff, 0x00, 0xff), /* fg */
+                GRAPHICS_RGBA32(0, 0, 0, 0x00), /* bg */
+                userdata->text, strlen(userdata->text), 25);
+        graphics_display_resource(g_overlay, 0, 2, 0, g_displayWidth / 16, GRAPHICS_RESOURCE_WIDTH, GRAPHICS_RESOURCE_HEIGHT, VC_DISPMAN_ROT0, 1);
+    }
+}
+
+/**
+ * Frame arena bytes one stream needs, matching allocAnalysis() and, for
+ * a replay stream or with the live view, replay_open() and liveview_open()
+ */
+static size_t streamArenaBytes(const RASPICAM_CAMERA_PARAMETERS *params, int replay, int liveview) {
+    size_t bytes = 2*ARENA_BYTES(FRAME_BYTES(VIDEO_WIDTH, VIDEO_HEIGHT)) +
+                   4*ARENA_BYTES((size_t)OPENCV_WIDTH*OPENCV_HEIGHT) +
+                   2*ARENA_BYTES((size_t)MOTION_COARSE_WIDTH*MOTION_COARSE_HEIGHT);
+
+    if (params->thumbnailConfig.enable) {
+        bytes += ARENA_BYTES(SNAPSHOT_YUV_BYTES(params->thumbnailConfig.width, params->thumbnailConfig.height)) +
+                 ARENA_BYTES(SNAPSHOT_BGR_BYTES(params->thumbnailConfig.width, params->thumbnailConfig.height));
+    }
+    if (g_timelapseInterval) {
+        bytes += TIMELAPSE_ARENA_BYTES;
+    }
+    if (g_classify.numCascades) {
+        bytes += CLASSIFY_ARENA_BYTES;
+    }
+    if (g_heatmap) {
+        bytes += HEATMAP_ARENA_BYTES(OPENCV_WIDTH, OPENCV_HEIGHT, MOTION_COARSE_WIDTH, MOTION_COARSE_HEIGHT);
+    }
+    if (replay) {
+        bytes += REPLAY_ARENA_BYTES(VIDEO_WIDTH, VIDEO_HEIGHT);
+    }
+    if (liveview) {
+        bytes += LIVEVIEW_ARENA_BYTES(OPENCV_WIDTH, OPENCV_HEIGHT);
+    }
+    return bytes;
+}
+
+/**
+ * Wrap an 8 bit single channel image around arena memory
+ */
+static IplImage *arenaImage(PORT_USERDATA *userdata, const char *what, int width, int height) {
+    IplImage *image;
+    char name[24];
+    void *data;
+
+    snprintf(name, sizeof(name), "stream %d %s", userdata->id, what);
+    data = arena_alloc(&g_arena, name, (size_t)width*height);
+    if (!data)
+        return NULL;
+    image = cvCreateImageHeader(cvSize(width, height), IPL_DEPTH_8U, 1);
+    cvSetData(image, data, width);
+    return image;
+}
+
+/**
+ * Allocate a stream's frame and analysis buffers from the arena. Runs as
+ * a startup task while the stream's camera comes up.
+ */
+static int allocAnalysis(void *arg) {
+    PORT_USERDATA *userdata = (PORT_USERDATA *) arg;
+    char name[24];
+    int i;
+
+    userdata->videoBufferSize = FRAME_BYTES(userdata->video_width, userdata->video_height);
+    for (i = 0; i < 2; i++) {
+        snprintf(name, sizeof(name), "stream %d video %d", userdata->id, i);
+        userdata->videoBuffers[i] = arena_alloc(&g_arena, name, userdata->videoBufferSize);
+        if (!userdata->videoBuffers[i])
+            return -1;
+    }
+    userdata->videoBuffer = userdata->videoBuffers[0];
+    userdata->videoBufferLen = 0;
+
+    if (userdata->camera_parameters.thumbnailConfig.enable &&
+        snapshot_open(&userdata->snapshot, userdata->camera_parameters.thumbnailConfig.width,
+                      userdata->camera_parameters.thumbnailConfig.height,
+                      userdata->camera_parameters.thumbnailConfig.quality, &g_events, &g_arena) != 0) {
         return -1;
     }
-    if (1 && (status = setup_encoder(&userdata) != 0)) {
+
+    /* setup opencv, resizing straight from the Y plane of videoBuffer */
+    userdata->image1 = cvCreateImageHeader(cvSize(userdata->video_width, userdata->video_height), IPL_DEPTH_8U, 1);
+    cvSetData(userdata->image1, userdata->videoBuffer, FRAME_STRIDE(userdata->video_width));
+    userdata->prevFrame = cvCreateImageHeader(cvSize(userdata->video_width, userdata->video_height), IPL_DEPTH_8U, 1);
+    cvSetData(userdata->prevFrame, userdata->videoBuffers[1], FRAME_STRIDE(userdata->video_width));
+    userdata->image2 = arenaImage(userdata, "image2", userdata->opencv_width, userdata->opencv_height);
+    userdata->prevImage = arenaImage(userdata, "prevImage", userdata->opencv_width, userdata->opencv_height);
+    userdata->py1 = arenaImage(userdata, "py1", userdata->opencv_width, userdata->opencv_height);
+    if (g_frameTap) {
+        // The detector writes its mask straight into the tap
+        if (frametap_create(&userdata->tap, userdata->id, userdata->opencv_width, userdata->opencv_height) != 0)
+            return -1;
+        userdata->py2 = cvCreateImageHeader(cvSize(userdata->opencv_width, userdata->opencv_height), IPL_DEPTH_8U, 1);
+        cvSetData(userdata->py2, userdata->tap.mask, userdata->opencv_width);
+    } else {
+        userdata->py2 = arenaImage(userdata, "py2", userdata->opencv_width, userdata->opencv_height);
+    }
+    userdata->coarse = arenaImage(userdata, "coarse", MOTION_COARSE_WIDTH, MOTION_COARSE_HEIGHT);
+    userdata->prevCoarse = arenaImage(userdata, "prevCoarse", MOTION_COARSE_WIDTH, MOTION_COARSE_HEIGHT);
+    if (!userdata->image2 || !userdata->prevImage || !userdata->py1 || !userdata->py2 ||
+        !userdata->coarse || !userdata->prevCoarse)
+        return -1;
+    if (g_classify.numCascades && classify_add_stream(&g_classify, &userdata->classify, userdata->id, &g_arena) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Create a stream and its source, camera if replayFile is NULL. The
+ * stream can be started, and analyse motion, as soon as this returns;
+ * finish_stream() adds the encoder once the spool is open.
+ */
+static PORT_USERDATA *create_stream(int id, int camera_num, const char *replayFile, WORKPOOL_T *pool) {
+    MMAL_STATUS_T status;
+    PORT_USERDATA *userdata = calloc(1, sizeof(PORT_USERDATA));
+    STARTUP_TASK_T alloc;
+    char latencyFile[64];
+    char name[32];
+    int phase;
+
+    if (!userdata)
+        return NULL;
+    userdata->id = id;
+    userdata->camera_num = camera_num;
+    userdata->pool = pool;
+    userdata->job.run = processFrame;
+    userdata->events = &g_events;
+    userdata->firstFrame = 1;
+    autocrop_reset(&userdata->crop);
+    lores_init(&userdata->lores, LORES_WIDTH, LORES_HEIGHT, VIDEO_FPS);
+    vcos_mutex_create(&userdata->camera_lock, "snoop_camera-lock");
+    vcos_mutex_create(&userdata->encoder_lock, "snoop_encoder-lock");
+    vcos_mutex_create(&userdata->filewrite_lock, "snoop_filewrite-lock");
+    vcos_semaphore_create(&userdata->filewrite_semaphore, "snoop_filewrite-sem", 0);
+
+    if (id == 0)
+        snprintf(latencyFile, sizeof(latencyFile), "%s", LATENCY_REPORT_FILE);
+    else
+        snprintf(latencyFile, sizeof(latencyFile), "/tmp/snoop_latency_%d.txt", id);
+    latency_init(&userdata->latency, latencyFile);
+
+    userdata->preview_width = VIDEO_WIDTH / 1;
+    userdata->preview_height = VIDEO_HEIGHT / 1;
+    userdata->video_width = VIDEO_WIDTH / 1;
+    userdata->video_height = VIDEO_HEIGHT / 1;
+    userdata->opencv_width = OPENCV_WIDTH;
+    userdata->opencv_height = OPENCV_HEIGHT;
+
+    userdata->encoding = MMAL_ENCODING_JPEG;
+    userdata->quality = 75;
+
+    // Set up the camera_parameters to default; replay streams use the snapshot settings
+    raspicamcontrol_set_defaults(&userdata->camera_parameters);
+
+    snprintf(name, sizeof(name), "stream %d analysis buffers", id);
+    startup_spawn(&g_startup, &alloc, name, allocAnalysis, userdata);
+    phase = startup_begin(&g_startup, "stream %d %s", id, replayFile ? "replay" : "camera");
+    if (replayFile) {
+        userdata->replay = calloc(1, sizeof(REPLAY_T));
+        if (!userdata->replay || replay_open(userdata->replay, replayFile, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FPS, 1, &g_arena) != 0) {
+            fprintf(stderr, "Error: open replay %s\n", replayFile);
+            startup_join(&alloc);
+            return NULL;
+        }
+    } else if ((status = setup_camera(userdata)) != 0) {
+        fprintf(stderr, "Error: setup camera %x\n", status);
+        startup_join(&alloc);
+        return NULL;
+    }
+    startup_end(&g_startup, phase);
+    if (startup_join(&alloc) != 0) {
+        return NULL;
+    }
+    sync_latency_clock(userdata);
+
+    resetClipStats(userdata);
+    userdata->bufferAction = ACTION_NULL;
+    userdata->state = STATE_NORMAL;
+    userdata->pendingState = STATE_NORMAL;
+    return userdata;
+}
+
+/**
+ * Open a started stream's first clip and bring up its encoder, letting
+ * stream_frame() record captures from here on
+ */
+static int finish_stream(PORT_USERDATA *userdata) {
+    MMAL_STATUS_T status;
+
+    openClip(userdata);
+    if ((status = setup_encoder(userdata)) != 0) {
         fprintf(stderr, "Error: setup encoder %x\n", status);
         return -1;
     }
-    if (PREVIEW && (status = setup_preview(&userdata) != 0)) {
+    if (g_timelapseInterval && timelapse_open(&userdata->timelapse, g_spool.dir, userdata->id, g_timelapseInterval,
+                                              g_timelapseBudget, &g_arena) != 0) {
+        fprintf(stderr, "Timelapse disabled for stream %d\n", userdata->id);
+    }
+    if (g_heatmap && heatmap_open(&userdata->heatmap, g_spool.dir, userdata->id, userdata->opencv_width,
+                                  userdata->opencv_height, MOTION_COARSE_WIDTH, MOTION_COARSE_HEIGHT,
+                                  g_heatmap == 2, &g_arena) != 0) {
+        fprintf(stderr, "Heatmap disabled for stream %d\n", userdata->id);
+    }
+    if (PREVIEW && userdata->id == 0 && !userdata->replay && (status = setup_preview(userdata)) != 0) {
         fprintf(stderr, "Error: setup preview %x\n", status);
         return -1;
     }
+    __sync_synchronize();  // Encoder ports before the flag that publishes them
+    userdata->encoderReady = 1;
+    watchdog_arm(&userdata->encoderWatch, 1);
+    return 0;
+}
 
-    vcos_mutex_create(&userdata.filewrite_lock, "snoop_filewrite-lock");
-    vcos_semaphore_create(&userdata.complete_semaphore, "snoop_complete-sem", 0);
-    vcos_semaphore_create(&userdata.filewrite_semaphore, "snoop_filewrite-sem", 0);
-    int opencv_frames = 0;
+static int start_stream(PORT_USERDATA *userdata) {
+    if (userdata->replay)
+        return replay_start(userdata->replay, replay_frame_callback, userdata);
 
-    GRAPHICS_RESOURCE_HANDLE img_overlay2;
-    if (GX) {
-        gx_graphics_init("/opt/vc/src/hello_pi/hello_font");
-        gx_create_window(0, 900, 400, GRAPHICS_RESOURCE_RGBA32, &img_overlay2);
-        graphics_resource_fill(img_overlay2, 0, 0, GRAPHICS_RESOURCE_WIDTH, GRAPHICS_RESOURCE_HEIGHT, GRAPHICS_RGBA32(0xff, 0, 0, 0x55));
+    fill_port_buffer(userdata->camera_video_port, userdata->camera_video_port_pool);
+    if (userdata->camera_preview_port_pool)
+        fill_port_buffer(userdata->camera_preview_port, userdata->camera_preview_port_pool);
+    if (mmal_port_parameter_set_boolean(userdata->camera_video_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS) {
+        printf("%s: Failed to start capture\n", __func__);
+        return -1;
     }
+    watchdog_arm(&userdata->cameraWatch, 1);
+    if (userdata->camera_preview_port_pool)
+        watchdog_arm(&userdata->previewWatch, 1);
+    return 0;
+}
 
-    char text[256];
-    int  dataSize = userdata.opencv_width*userdata.opencv_height;
-    int  firstFrame = 1;
-    int  motionFlag = 0;
-    int  pixCount = 0;
-    userdata.bufferAction = ACTION_NULL;
-    userdata.state = STATE_NORMAL;
-    userdata.pendingState = STATE_NORMAL;
+/**
+ * Take down a stream's camera and its pools, leaving everything else
+ * alone. Called with camera_lock held.
+ */
+static void teardown_camera(PORT_USERDATA *userdata) {
+    watchdog_arm(&userdata->cameraWatch, 0);
+    watchdog_arm(&userdata->previewWatch, 0);
+    if (!userdata->camera)
+        return;
+    mmal_port_disable(userdata->camera_video_port);
+    if (userdata->camera_preview_port_pool)
+        mmal_port_disable(userdata->camera_preview_port);
+    mmal_component_disable(userdata->camera);
+    if (userdata->camera_video_port_pool)
+        mmal_port_pool_destroy(userdata->camera_video_port, userdata->camera_video_port_pool);
+    if (userdata->camera_preview_port_pool)
+        mmal_port_pool_destroy(userdata->camera_preview_port, userdata->camera_preview_port_pool);
+    mmal_component_destroy(userdata->camera);
+    userdata->camera = NULL;
+    userdata->camera_video_port = NULL;
+    userdata->camera_preview_port = NULL;
+    userdata->camera_still_port = NULL;
+    userdata->camera_video_port_pool = NULL;
+    userdata->camera_preview_port_pool = NULL;
+}
 
-    fill_port_buffer(userdata.camera_video_port, userdata.camera_video_port_pool);
-    if (mmal_port_parameter_set_boolean(userdata.camera_video_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS) {
-        printf("%s: Failed to start capture\n", __func__);
-        exit(-1);
-    }
-    while (1) {
-        if (vcos_semaphore_wait(&(userdata.complete_semaphore)) == VCOS_SUCCESS) {
-            switch (userdata.bufferAction) {
-                case ACTION_NULL:
-                    userdata.image1->imageData = userdata.videoBuffer;  // Hack to avoid memcpy, just copy Y, not UV
-                    cvResize(userdata.image1, userdata.image2, CV_INTER_LINEAR);
-                    memcpy(userdata.prevImage->imageData, userdata.image2->imageData, dataSize);
-                    break;
-                case ACTION_CHECK_MOTION:
-                    motionFlag = 0;
-                    userdata.image1->imageData = userdata.videoBuffer;  // Hack to avoid memcpy, just copy Y, not UV
-                    cvResize(userdata.image1, userdata.image2, CV_INTER_LINEAR);
-                    if (firstFrame) {
-                        firstFrame = 0;
-                        memcpy(userdata.prevImage->imageData, userdata.image2->imageData, dataSize);
-                    } else {
-                        //
-                        // Compare images
-                        //
-                        pixCount = compareImages(&userdata);
-                        // cvShowImage("camcvWin", userdata.image1); // display only gray channel
-                        // cvWaitKey(1);
-                        motionFlag = (pixCount > g_PixelThreshold) ? 1:0;
-                        memcpy(userdata.prevImage->imageData, userdata.image2->imageData, dataSize);
-                        if (motionFlag) {
-                            strcpy(text, "Capture Video");
-                            userdata.pendingState = STATE_CAPTURE;
-                        }
-                    }
-                    break;
-                case ACTION_STOP_CAPTURE:
-                    strcpy(prevFilename, filename); 
-                    reset_encoder(&userdata);
-                    vcos_mutex_lock(&userdata.filewrite_lock);
-                    fflush(userdata.fptr);
-                    fclose(userdata.fptr);
-                    setFilename(filename);
-                    userdata.fptr = fopen(filename, "wb");
-                    vcos_mutex_unlock(&userdata.filewrite_lock);
-                    strcpy(text, "");
-                    userdata.pendingState = STATE_SUSPEND;
-                    if (setup_encoder(&userdata) != 0) {
-                        fprintf(stderr, "Error: setup encoder %x\n", status);
-                        return -1;
-                    }
-                    postToQueue(msqid, prevFilename);
-                    break;
-                default:
-                    printf("Unknown action: %d\n", userdata.bufferAction);
-            }
-            if (GX) {
-                graphics_resource_fill(img_overlay2, 0, 0, GRAPHICS_RESOURCE_WIDTH, GRAPHICS_RESOURCE_HEIGHT, GRAPHICS_RGBA32(0, 0, 0, 0x00));
-                graphics_resource_render_text_ext(img_overlay2, 0, 0,
-                        GRAPHICS_RESOURCE_WIDTH,
-                        GRAPHICS_RESOURCE_HEIGHT,
-                        GRAPHICS_RGBA32(0x00, 0xff, 0x00, 0xff), /* fg */
-                        GRAPHICS_RGBA32(0, 0, 0, 0x00), /* bg */
-                        text, strlen(text), 25);
-                graphics_display_resource(img_overlay2, 0, 2, 0, display_width / 16, GRAPHICS_RESOURCE_WIDTH, GRAPHICS_RESOURCE_HEIGHT, VC_DISPMAN_ROT0, 1);
-            }
+/**
+ * Watchdog recovery for a stream's camera. The analysis buffers, clip
+ * and spool are untouched; only the first check after a rebuild reseeds
+ * the previous frame, since exposure starts over with the new camera.
+ */
+static int recoverCamera(void *ctx, int level) {
+    PORT_USERDATA *userdata = (PORT_USERDATA *) ctx;
+    int refilled = 0;
+    int result;
+
+    vcos_mutex_lock(&userdata->camera_lock);
+    if (level == WATCHDOG_REFILL) {
+        // A buffer that failed to go back to a port sits idle in its pool
+        if (userdata->camera_video_port_pool && mmal_queue_length(userdata->camera_video_port_pool->queue)) {
+            fill_port_buffer(userdata->camera_video_port, userdata->camera_video_port_pool);
+            refilled = 1;
+        }
+        if (userdata->camera_preview_port_pool && mmal_queue_length(userdata->camera_preview_port_pool->queue)) {
+            fill_port_buffer(userdata->camera_preview_port, userdata->camera_preview_port_pool);
+            refilled = 1;
+        }
+        vcos_mutex_unlock(&userdata->camera_lock);
+        return refilled ? 0 : 1;
+    }
+    fprintf(stderr, "Rebuilding camera for stream %d\n", userdata->id);
+    teardown_camera(userdata);
+    result = setup_camera(userdata);
+    if (result == 0)
+        result = start_stream(userdata);
+    if (result != 0)
+        teardown_camera(userdata);  // Leave nothing half built for the next attempt
+    vcos_mutex_unlock(&userdata->camera_lock);
+    if (result != 0)
+        return -1;
+    sync_latency_clock(userdata);
+    userdata->firstFrame = 1;
+    if (userdata->crop.active)
+        setCropROI(userdata, &userdata->crop.applied);
+    return 0;
+}
+
+/**
+ * Watchdog recovery for a stream's encoder. A clip being recorded stays
+ * open and the new encoder's stream is appended to it.
+ */
+static int recoverEncoder(void *ctx, int level) {
+    PORT_USERDATA *userdata = (PORT_USERDATA *) ctx;
+    int result = 1;
+
+    vcos_mutex_lock(&userdata->encoder_lock);
+    if (level == WATCHDOG_REFILL) {
+        // Nothing to refill if the last rebuild failed, go straight to another
+        if (userdata->encoder && mmal_queue_length(userdata->encoder_output_pool->queue)) {
+            fill_port_buffer(userdata->encoder_output_port, userdata->encoder_output_pool);
+            result = 0;
+        }
+        vcos_mutex_unlock(&userdata->encoder_lock);
+        return result;
+    }
+    fprintf(stderr, "Rebuilding encoder for stream %d\n", userdata->id);
+    userdata->encoderReady = 0;  // stream_frame() feeds it under encoder_lock, so none is mid send
+    reset_encoder(userdata);
+    result = setup_encoder(userdata);
+    if (result == 0 && userdata->clipRate.bitrate)
+        setEncoderRate(userdata, &userdata->clipRate);  // setup_encoder() starts from the default rate
+    if (result == 0) {
+        __sync_synchronize();  // Encoder ports before the flag that publishes them
+        userdata->encoderReady = 1;
+        watchdog_arm(&userdata->encoderWatch, 1);
+    } else {
+        reset_encoder(userdata);
+    }
+    vcos_mutex_unlock(&userdata->encoder_lock);
+    return result == 0 ? 0 : -1;
+}
+
+/**
+ * Put a stream's ports under the watchdog
+ */
+static void watchStream(PORT_USERDATA *userdata) {
+    char name[32];
+
+    if (!userdata->replay) {
+        snprintf(name, sizeof(name), "stream %d camera", userdata->id);
+        watchdog_add(&g_watchdog, &userdata->cameraWatch, name, 1, recoverCamera, userdata);
+        if (userdata->camera_preview_port_pool) {
+            snprintf(name, sizeof(name), "stream %d preview", userdata->id);
+            watchdog_add(&g_watchdog, &userdata->previewWatch, name, 1, recoverCamera, userdata);
+        }
+    }
+    snprintf(name, sizeof(name), "stream %d encoder", userdata->id);
+    watchdog_add(&g_watchdog, &userdata->encoderWatch, name, 0, recoverEncoder, userdata);
+}
+
+typedef struct {
+    const char *spoolDir;
+    int64_t     quotaBytes;
+    int         quotaClips;
+    int         numSources;
+} SERVICES_ARGS_T;
+
+/**
+ * Recover the spool and open the event channel. Runs as a startup task
+ * while the cameras come up; nothing may record a clip or publish an
+ * event until it has been joined.
+ */
+static int openServices(void *arg) {
+    SERVICES_ARGS_T *args = (SERVICES_ARGS_T *) arg;
+
+    // Recover clips from the last run before any new ones are started
+    if (spool_open(&g_spool, args->spoolDir) != 0) {
+        fprintf(stderr, "Error: unable to open spool %s\n", args->spoolDir);
+        return -1;
+    }
+    // Keep room for every stream to record a full clip at the highest rate
+    spool_set_quota(&g_spool, args->quotaBytes, args->quotaClips,
+                    (int64_t)args->numSources*BITRATE_MAX/8*CAPTURE_LENGTH);
+    if (g_useSegstore) {
+        char ringDir[192];
+        snprintf(ringDir, sizeof(ringDir), "%s/%s", args->spoolDir, SEGSTORE_DIR);
+        if (segstore_open(&g_segstore, ringDir, SEGSTORE_SEGMENTS, SEGSTORE_SEGMENT_BYTES,
+                          SEGSTORE_CHUNK_BYTES, g_useSegstore == 2) != 0) {
+            fprintf(stderr, "Error: unable to open segment ring %s\n", ringDir);
+            return -1;
         }
     }
+    spool_set_release(&g_spool, releaseClip, NULL);
+    if (eventipc_open(&g_events, EVENTIPC_SOCKET, handleCommand, NULL) != 0) {
+        fprintf(stderr, "Error: unable to open event channel\n");
+        return -1;
+    }
+    eventipc_set_idle(&g_events, resyncBatch, NULL);
     return 0;
 }
 
+/**
+ * Load the classifier's cascades. Runs as a startup task; motion regions
+ * are ignored until it is done.
+ */
+static int openClassifier(void *arg) {
+    return classify_open((CLASSIFY_T *) arg);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c camera_num]... [-r replay.yuv]... [-w workers] [-s spool_dir] [-q quota_mb] [-n quota_clips] [-m budget_mb] [-g ring|direct] [-z] [-l] [-t] [-p port] [-T seconds[:budget_mb]] [-x propose|apply] [-k label=cascade.xml]... [-K]\n", prog);
+    fprintf(stderr, "  -c  add a stream from CSI camera camera_num\n");
+    fprintf(stderr, "  -r  add a stream replaying raw %dx%d I420 frames from a file\n", VIDEO_WIDTH, VIDEO_HEIGHT);
+    fprintf(stderr, "  -w  number of analysis workers shared by all streams\n");
+    fprintf(stderr, "  -s  clip spool directory, default %s\n", SPOOL_DIR);
+    fprintf(stderr, "  -q  spool quota in MB, default %lld\n", SPOOL_QUOTA_BYTES/(1024*1024));
+    fprintf(stderr, "  -n  spool quota in clips, default %d\n", SPOOL_QUOTA_CLIPS);
+    fprintf(stderr, "  -m  frame buffer memory budget in MB, default %d\n", ARENA_BUDGET_BYTES/(1024*1024));
+    fprintf(stderr, "  -g  write clips into a preallocated segment ring: 'ring', or 'direct' for O_DIRECT\n");
+    fprintf(stderr, "  -z  crop camera streams to the moving area while recording\n");
+    fprintf(stderr, "  -t  publish analysed frames and motion masks in shared memory, /snoopmon_tap<stream>\n");
+    fprintf(stderr, "  -p  serve an MJPEG live view of the analysis frames on 127.0.0.1:port, implies -t\n");
+    fprintf(stderr, "  -l  also record a %dx%d clip of every event, uploaded ahead of the full one\n", LORES_WIDTH, LORES_HEIGHT);
+    fprintf(stderr, "  -T  keep a %dx%d frame every given seconds in hourly segments under <spool_dir>/%s,\n",
+            TIMELAPSE_WIDTH, TIMELAPSE_HEIGHT, TIMELAPSE_DIR);
+    fprintf(stderr, "      within a daily budget, default %d MB, for %d hours\n",
+            TIMELAPSE_DAILY_BYTES/(1024*1024), TIMELAPSE_KEEP_HOURS);
+    fprintf(stderr, "  -x  map long-term activity under <spool_dir>/%s and build masks that leave chronically\n",
+            HEATMAP_DIR);
+    fprintf(stderr, "      active areas out of motion detection: 'propose' to only write them, or 'apply'\n");
+    fprintf(stderr, "  -k  classify the motion region of triggering frames with a Haar cascade, tagging\n");
+    fprintf(stderr, "      clips with the label of each that matches; up to %d cascades\n", CLASSIFY_MAX_CASCADES);
+    fprintf(stderr, "  -K  keep clips no cascade matched in the spool rather than uploading them\n");
+    fprintf(stderr, "With no streams given, camera 0 is used.\n");
+}
+
+int main(int argc, char** argv) {
+    WORKPOOL_T pool;
+    int display_width, display_height;
+    int cameras[MAX_STREAMS];
+    const char *replays[MAX_STREAMS];
+    int numSources = 0;
+    int workers = 0;
+    const char *spoolDir = SPOOL_DIR;
+    int64_t quotaBytes = SPOOL_QUOTA_BYTES;
+    int quotaClips = SPOOL_QUOTA_CLIPS;
+    size_t memBudget = ARENA_BUDGET_BYTES;
+    size_t arenaBytes;
+    int liveviewPort = 0;
+    RASPICAM_CAMERA_PARAMETERS defaults;
+    SERVICES_ARGS_T services;
+    STARTUP_TASK_T servicesTask;
+    STARTUP_TASK_T classifyTask;
+    int classifying;
+    int phase;
+    int opt;
+    int i;
+
+    startup_init(&g_startup, STARTUP_REPORT_FILE);
+    watchdog_init(&g_watchdog);
+    classify_init(&g_classify);
+
+    while ((opt = getopt(argc, argv, "c:r:w:s:q:n:g:m:p:T:x:k:zlKth")) != -1) {
+        switch (opt) {
+            case 'c':
+            case 'r':
+                if (numSources == MAX_STREAMS) {
+                    fprintf(stderr, "Error: at most %d streams\n", MAX_STREAMS);
+                    return -1;
+                }
+                cameras[numSources] = (opt == 'c') ? atoi(optarg) : -1;
+                replays[numSources] = (opt == 'r') ? optarg : NULL;
+                numSources++;
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 's':
+                spoolDir = optarg;
+                break;
+            case 'q':
+                quotaBytes = atoll(optarg)*1024*1024;
+                break;
+            case 'n':
+                quotaClips = atoi(optarg);
+                break;
+            case 'l':
+                g_dualStream = 1;
+                break;
+            case 'z':
+                g_autoCrop = 1;
+                break;
+            case 't':
+                g_frameTap = 1;
+                break;
+            case 'p':
+                liveviewPort = atoi(optarg);
+                g_frameTap = 1;  // The live view reads the taps
+                break;
+            case 'm':
+                memBudget = (size_t)atoi(optarg)*1024*1024;
+                break;
+            case 'T': {
+                int budgetMB = TIMELAPSE_DAILY_BYTES/(1024*1024);
+                if (sscanf(optarg, "%d:%d", &g_timelapseInterval, &budgetMB) < 1 ||
+                    g_timelapseInterval <= 0 || budgetMB <= 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                g_timelapseBudget = (int64_t)budgetMB*1024*1024;
+                break;
+            }
+            case 'k':
+                if (classify_add_cascade(&g_classify, optarg) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'K':
+                g_classifyHold = 1;
+                break;
+            case 'x':
+                if (strcmp(optarg, "propose") == 0) {
+                    g_heatmap = 1;
+                } else if (strcmp(optarg, "apply") == 0) {
+                    g_heatmap = 2;
+                } else {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'g':
+                if (strcmp(optarg, "ring") == 0) {
+                    g_useSegstore = 1;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    g_useSegstore = 2;
+                } else {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (strlen(spoolDir) > 48) {
+        fprintf(stderr, "Error: spool directory name too long\n");
+        return -1;
+    }
+    if (numSources == 0) {
+        cameras[0] = 0;
+        replays[0] = NULL;
+        numSources = 1;
+    }
+    if (workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cores > 0 && cores < numSources) ? cores : numSources;
+    }
+
+    printf("Running...\n");
+
+    phase = startup_begin(&g_startup, "bcm_host_init");
+    bcm_host_init();
+    startup_end(&g_startup, phase);
+
+    bitrate_init(&g_bitrate, (double)CAPTURE_LENGTH/(CAPTURE_LENGTH + SUSPEND_LENGTH));
+    services.spoolDir = spoolDir;
+    services.quotaBytes = quotaBytes;
+    services.quotaClips = quotaClips;
+    services.numSources = numSources;
+    startup_spawn(&g_startup, &servicesTask, "spool, ring and ipc", openServices, &services);
+    classifying = g_classify.numCascades != 0;  // classify_open() clears them if it fails
+    if (classifying)
+        startup_spawn(&g_startup, &classifyTask, "classifier cascades", openClassifier, &g_classify);
+
+    // Every stream starts from the defaults, so they size its buffers
+    raspicamcontrol_set_defaults(&defaults);
+    phase = startup_begin(&g_startup, "frame arena");
+    arenaBytes = 0;
+    for (i = 0; i < numSources; i++)
+        arenaBytes += streamArenaBytes(&defaults, replays[i] != NULL, liveviewPort != 0);
+    if (arena_open(&g_arena, arenaBytes, memBudget) != 0) {
+        exit(1);
+    }
+    startup_end(&g_startup, phase);
+    if (GX) {
+        cvNamedWindow("camcvWin", CV_WINDOW_AUTOSIZE);
+    }
+
+    graphics_get_display_size(0, &display_width, &display_height);
+
+    printf("Display resolution = (%d, %d)\n", display_width, display_height);
+
+    if (GX) {
+        g_displayWidth = display_width;
+        gx_graphics_init("/opt/vc/src/hello_pi/hello_font");
+        gx_create_window(0, 900, 400, GRAPHICS_RESOURCE_RGBA32, &g_overlay);
+        graphics_resource_fill(g_overlay, 0, 0, GRAPHICS_RESOURCE_WIDTH, GRAPHICS_RESOURCE_HEIGHT, GRAPHICS_RGBA32(0xff, 0, 0, 0x55));
+    }
+
+    if (workpool_start(&pool, workers) != 0) {
+        return -1;
+    }
+    // Start analysing each source as soon as it is up; encoders follow
+    for (i = 0; i < numSources; i++) {
+        g_streams[i] = create_stream(i, cameras[i], replays[i], &pool);
+        if (!g_streams[i]) {
+            return -1;
+        }
+        g_numStreams++;
+        watchStream(g_streams[i]);
+        if (start_stream(g_streams[i]) != 0) {
+            exit(-1);
+        }
+    }
+    if (liveviewPort) {
+        FRAMETAP_T *taps[MAX_STREAMS];
+        for (i = 0; i < g_numStreams; i++)
+            taps[i] = &g_streams[i]->tap;
+        if (liveview_open(&g_liveview, liveviewPort, taps, g_numStreams, &g_arena) != 0)
+            fprintf(stderr, "Live view disabled\n");
+    }
+    if (startup_join(&servicesTask) != 0) {
+        exit(1);
+    }
+    if (classifying && startup_join(&classifyTask) != 0) {
+        fprintf(stderr, "Running without the classifier\n");
+    }
+    for (i = 0; i < g_numStreams; i++) {
+        phase = startup_begin(&g_startup, "stream %d encoder", i);
+        if (finish_stream(g_streams[i]) != 0) {
+            exit(-1);
+        }
+        startup_end(&g_startup, phase);
+    }
+    arena_dump(&g_arena, stderr);
+    arena_write_report(&g_arena);
+    if (watchdog_start(&g_watchdog) != 0) {
+        fprintf(stderr, "Running without a watchdog\n");
+    }
+    workpool_wait(&pool);
+    return 0;
+}
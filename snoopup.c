@@ -0,0 +1,250 @@
+/*
+ * File:   snoopup.c
+ *
+ * Native uploader run by snoop.py in place of the requests library. It
+ * keeps keep-alive connections to the server open, sends clip files with
+ * sendfile() and pipelines heartbeats on their own connection, see
+ * httpc.h, so snoop.py only muxes clips and decides what to send.
+ *
+ * Requests come in on stdin, one command line each:
+ *
+ *   GET <id> <timeout_s> <path>
+ *   POST <id> <timeout_s> <path> <nparts>
+ *
+ * a POST followed by one line per part, "<field> <filename> <source> <len>",
+ * where source is a file, opened at once so it may be removed as soon as
+ * the command is read, or "-" for len bytes of data straight after the
+ * line. "EXIT", or the end of stdin, finishes what is in flight and exits.
+ *
+ * Each request finished is written to stdout as
+ * "DONE <id> <status> <usec> <len>\n" and len bytes of response body,
+ * status 0 and an error text if it failed.
+ *
+ * The credentials come from SNOOPUP_AUTH, user:password, so they do not
+ * show in the process list.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "httpc.h"
+#include "report.h"
+
+#define CMD_MAX_LINE    512
+#define CMD_MAX_DATA    (1024*1024)     // Largest inline part
+#define IN_CHUNK        (64*1024)
+
+typedef struct {
+    HTTPC_T        http;
+    unsigned char *in;          /// Commands read and not yet taken
+    size_t         inLen;
+    size_t         inSize;
+    int            eof;
+    int            exiting;
+    uint32_t       commands;
+} SNOOPUP_T;
+
+static void request_done(void *ctx, HTTPC_REQ_T *req)
+{
+    printf("DONE %u %d %lld %d\n", req->id, req->status, (long long)(report_now_us() - req->queued), req->bodyLen);
+    if (req->bodyLen)
+        fwrite(req->body, 1, req->bodyLen, stdout);
+    fflush(stdout);
+}
+
+/**
+ * Find the next line in the command buffer
+ *
+ * @return Its length including the newline, 0 if it is not all there yet
+ */
+static size_t next_line(SNOOPUP_T *s, size_t pos, char *line)
+{
+    unsigned char *nl = memchr(s->in + pos, '\n', s->inLen - pos);
+    size_t len;
+
+    if (!nl)
+        return 0;
+    len = nl - (s->in + pos);
+    if (len >= CMD_MAX_LINE)
+        len = CMD_MAX_LINE - 1;
+    memcpy(line, s->in + pos, len);
+    line[len] = 0;
+    return nl + 1 - (s->in + pos);
+}
+
+/**
+ * Take one command, with all of its parts, from the start of the buffer
+ *
+ * @return Bytes taken, 0 if the command is not all there yet, -1 if the
+ *         input is out of step and cannot be followed any further
+ */
+static ssize_t take_command(SNOOPUP_T *s)
+{
+    char line[CMD_MAX_LINE], verb[8], path[256];
+    unsigned int id;
+    int timeout = 0, numParts = 0;
+    HTTPC_REQ_T *req;
+    size_t pos, n;
+    int i, ok = 1;
+
+    n = next_line(s, 0, line);
+    if (n == 0)
+        return s->inLen >= CMD_MAX_LINE ? -1 : 0;
+    pos = n;
+    if (strcmp(line, "EXIT") == 0) {
+        s->exiting = 1;
+        return pos;
+    }
+    if (sscanf(line, "%7s %u %d %255s %d", verb, &id, &timeout, path, &numParts) < 4) {
+        fprintf(stderr, "Error: bad command %s\n", line);
+        return -1;
+    }
+    // See that every part is there before anything is opened
+    for (i = 0; i < numParts; i++) {
+        char field[64], filename[128], source[256];
+        long long len;
+        n = next_line(s, pos, line);
+        if (n == 0)
+            return 0;
+        if (sscanf(line, "%63s %127s %255s %lld", field, filename, source, &len) != 4 ||
+            len < 0 || len > CMD_MAX_DATA) {
+            fprintf(stderr, "Error: bad part %s\n", line);
+            return -1;
+        }
+        pos += n;
+        if (strcmp(source, "-") == 0) {
+            if (s->inLen - pos < (size_t)len) {
+                // Room for the whole part, so the read loop can finish it
+                if (s->inSize < pos + len) {
+                    unsigned char *in = realloc(s->in, pos + len);
+                    if (!in)
+                        return -1;
+                    s->in = in;
+                    s->inSize = pos + len;
+                }
+                return 0;
+            }
+            pos += len;
+        }
+    }
+
+    s->commands++;
+    req = httpc_request(id, strcmp(verb, "POST") == 0, path, timeout*1000, request_done, s);
+    if (!req)
+        return pos;
+    pos = next_line(s, 0, line);
+    for (i = 0; i < numParts; i++) {
+        char field[64], filename[128], source[256];
+        long long len;
+        pos += next_line(s, pos, line);
+        sscanf(line, "%63s %127s %255s %lld", field, filename, source, &len);
+        if (strcmp(source, "-") == 0) {
+            unsigned char *data = malloc(len ? len : 1);
+            if (data)
+                memcpy(data, s->in + pos, len);
+            pos += len;
+            if (ok && (!data || httpc_add_data(req, field, filename, data, len) != 0))
+                ok = 0;
+        } else if (ok && httpc_add_file(req, field, filename, source) != 0) {
+            ok = 0;
+        }
+    }
+    if (ok) {
+        httpc_submit(&s->http, req);
+    } else {
+        req->queued = report_now_us();
+        req->body = (unsigned char *)strdup("bad part");
+        req->bodyLen = req->body ? strlen((char *)req->body) : 0;
+        request_done(s, req);
+        httpc_free(req);
+    }
+    return pos;
+}
+
+/**
+ * Read what stdin has and submit the commands completed by it
+ *
+ * @return 0 if successful, -1 if the input cannot be followed
+ */
+static int read_commands(SNOOPUP_T *s)
+{
+    ssize_t n;
+
+    if (s->inSize - s->inLen < IN_CHUNK) {
+        unsigned char *in = realloc(s->in, s->inLen + IN_CHUNK);
+        if (!in)
+            return -1;
+        s->in = in;
+        s->inSize = s->inLen + IN_CHUNK;
+    }
+    n = read(STDIN_FILENO, s->in + s->inLen, s->inSize - s->inLen);
+    if (n < 0)
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    if (n == 0) {
+        s->eof = 1;
+        return 0;
+    }
+    s->inLen += n;
+    while (!s->exiting) {
+        ssize_t taken = take_command(s);
+        if (taken < 0)
+            return -1;
+        if (taken == 0)
+            break;
+        memmove(s->in, s->in + taken, s->inLen - taken);
+        s->inLen -= taken;
+    }
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d day_cap_bps] [-n night_cap_bps] [-c upload_conns] host[:port]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    static SNOOPUP_T s;
+    int64_t dayBps = 0, nightBps = 0;
+    int conns = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:c:")) != -1) {
+        switch (opt) {
+            case 'd': dayBps = atoll(optarg); break;
+            case 'n': nightBps = atoll(optarg); break;
+            case 'c': conns = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc-1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (httpc_open(&s.http, argv[optind], getenv("SNOOPUP_AUTH"), conns) != 0)
+        return 1;
+    httpc_cap(&s.http, dayBps, nightBps);
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+
+    while (!((s.eof || s.exiting) && !httpc_busy(&s.http))) {
+        int ready = httpc_poll(&s.http, (s.eof || s.exiting) ? -1 : STDIN_FILENO, 1000);
+        if (ready < 0)
+            break;
+        if (ready && read_commands(&s) != 0) {
+            fprintf(stderr, "Error: lost track of the commands, exiting\n");
+            break;
+        }
+    }
+
+    fprintf(stderr, "snoopup: %u commands, %u requests, %u failed, %u connections, %u resent, "
+            "%.1f MB sent, %.1f MB of it with sendfile\n", s.commands, s.http.requests, s.http.failures,
+            s.http.connects, s.http.retried, s.http.bytesSent/1e6, s.http.fileBytes/1e6);
+    httpc_close(&s.http);
+    return 0;
+}
@@ -0,0 +1,596 @@
+/*
+ * File:   spool.c
+ *
+ * Journal lines are "<STATE> <name> <size> [<peak score> [<deferred>]]\n",
+ * appended and synced on every transition. A line without its newline was torn by a
+ * crash and is ignored. The last line for a name wins.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "spool.h"
+
+#define SCAN_CHUNK 65536
+#define JOURNAL_PATH_LEN 256
+
+static const char *state_names[SPOOL_NUM_STATES] = {
+    "RECORDING", "CLOSED", "MUXED", "UPLOADING", "UPLOADED", "EVICTED"
+};
+
+const char *spool_state_name(int state)
+{
+    return (state >= 0 && state < SPOOL_NUM_STATES) ? state_names[state] : "UNKNOWN";
+}
+
+static int state_from_name(const char *name)
+{
+    int i;
+    for (i = 0; i < SPOOL_NUM_STATES; i++) {
+        if (strcmp(name, state_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *spool_basename(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static unsigned hash_name(const char *name)
+{
+    unsigned h = 5381;
+    while (*name)
+        h = h*33 + (unsigned char) *name++;
+    return h % SPOOL_BUCKETS;
+}
+
+static SPOOL_CLIP_T **find_slot(SPOOL_T *spool, const char *name)
+{
+    SPOOL_CLIP_T **slot = &spool->bucket[hash_name(name)];
+    while (*slot && strcmp((*slot)->name, name) != 0)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+/**
+ * Change a clip's size in the backlog counters
+ */
+static void set_size(SPOOL_T *spool, SPOOL_CLIP_T *clip, long size)
+{
+    spool->backlogBytes += size - clip->size;
+    if (!clip->deferred)
+        spool->uploadBytes += size - clip->size;
+    clip->size = size;
+}
+
+static void set_deferred(SPOOL_T *spool, SPOOL_CLIP_T *clip, int deferred)
+{
+    deferred = deferred != 0;
+    if (deferred == clip->deferred)
+        return;
+    spool->uploadBytes += deferred ? -clip->size : clip->size;
+    clip->deferred = deferred;
+}
+
+/**
+ * Apply a state to the in-memory table only, adding the clip if it is
+ * missing, as journal replay needs
+ */
+static void apply_state(SPOOL_T *spool, const char *name, int state, long size, uint32_t score)
+{
+    SPOOL_CLIP_T **slot = find_slot(spool, name);
+    SPOOL_CLIP_T *clip = *slot;
+
+    if (state == SPOOL_UPLOADED || state == SPOOL_EVICTED) {
+        if (clip) {
+            *slot = clip->next;
+            set_size(spool, clip, 0);
+            free(clip);
+            spool->numClips--;
+        }
+        return;
+    }
+    if (!clip) {
+        clip = calloc(1, sizeof(SPOOL_CLIP_T));
+        if (!clip)
+            return;
+        snprintf(clip->name, sizeof(clip->name), "%s", name);
+        // Clip names start with their creation time; fall back to now
+        clip->created = (time_t) strtol(name, NULL, 10);
+        if (clip->created <= 0)
+            clip->created = time(NULL);
+        *slot = clip;
+        spool->numClips++;
+    }
+    clip->state = state;
+    if (size > 0)
+        set_size(spool, clip, size);
+    if (score > clip->peakScore)
+        clip->peakScore = score;
+}
+
+static int journal_append(SPOOL_T *spool, const char *name, int state, long size, uint32_t score)
+{
+    SPOOL_CLIP_T *clip = *find_slot(spool, name);
+
+    if (!spool->journal)
+        return -1;
+    if (fprintf(spool->journal, "%s %s %ld %u %d\n", spool_state_name(state), name, size, score,
+                clip ? clip->deferred : 0) < 0 ||
+        fflush(spool->journal) != 0) {
+        perror("spool journal");
+        return -1;
+    }
+    fdatasync(fileno(spool->journal));
+    spool->journalLines++;
+    return 0;
+}
+
+void spool_path(const SPOOL_T *spool, const char *name, char *path, int len)
+{
+    snprintf(path, len, "%s/%s", spool->dir, name);
+}
+
+/**
+ * Dispose of the file of a clip that has left the spool
+ */
+static void release_clip(SPOOL_T *spool, const char *name)
+{
+    char path[256];
+
+    spool_path(spool, name, path, sizeof(path));
+    if (spool->release)
+        spool->release(spool->releaseCtx, path);
+    else
+        unlink(path);
+}
+
+/**
+ * Hand finished clips to cb instead of unlinking them
+ */
+void spool_set_release(SPOOL_T *spool, SPOOL_RELEASE_CB cb, void *ctx)
+{
+    vcos_mutex_lock(&spool->lock);
+    spool->release = cb;
+    spool->releaseCtx = ctx;
+    vcos_mutex_unlock(&spool->lock);
+}
+
+/**
+ * Cut an H.264 Annex B stream back to its last start code, dropping the
+ * NAL unit a crash may have left half written.
+ *
+ * @return New length in bytes, 0 if nothing usable is left, -1 on error
+ */
+long spool_truncate_h264(const char *path)
+{
+    unsigned char *buf;
+    FILE *fp;
+    long size, pos, cut = 0;
+    int found = 0;
+
+    fp = fopen(path, "r+b");
+    if (!fp)
+        return -1;
+    buf = malloc(SCAN_CHUNK + 3);
+    if (!buf) {
+        fclose(fp);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    pos = size;
+    while (pos > 0 && !found) {
+        long start = (pos > SCAN_CHUNK) ? pos - SCAN_CHUNK : 0;
+        long n = ((pos + 3 < size) ? pos + 3 : size) - start;  // Overlap the chunk after
+        long i;
+
+        fseek(fp, start, SEEK_SET);
+        if (fread(buf, 1, n, fp) != (size_t)n)
+            break;
+        for (i = n - 3; i >= 0; i--) {
+            if (buf[i] == 0 && buf[i+1] == 0 && buf[i+2] == 1) {
+                cut = start + i;
+                if (i > 0 && buf[i-1] == 0)
+                    cut--;
+                found = 1;
+                break;
+            }
+        }
+        pos = start;
+    }
+    free(buf);
+    if (cut < size && ftruncate(fileno(fp), cut) != 0) {
+        perror(path);
+        fclose(fp);
+        return -1;
+    }
+    fsync(fileno(fp));
+    fclose(fp);
+    return cut;
+}
+
+static void replay_journal(SPOOL_T *spool, const char *journalPath)
+{
+    char line[256];
+    FILE *fp = fopen(journalPath, "r");
+    int lines = 0;
+
+    if (!fp)
+        return;
+    while (fgets(line, sizeof(line), fp)) {
+        char stateName[16];
+        char name[SPOOL_NAME_LEN];
+        long size = 0;
+        unsigned score = 0;
+        int deferred = 0;
+        int state;
+
+        if (!strchr(line, '\n'))
+            continue;  // Torn final write
+        if (sscanf(line, "%15s %63s %ld %u %d", stateName, name, &size, &score, &deferred) < 2)
+            continue;
+        state = state_from_name(stateName);
+        if (state >= 0) {
+            SPOOL_CLIP_T *clip;
+            apply_state(spool, name, state, size, score);
+            clip = *find_slot(spool, name);
+            if (clip)
+                set_deferred(spool, clip, deferred);
+        }
+        lines++;
+    }
+    fclose(fp);
+    fprintf(stderr, "INFO: spool journal replayed, %d lines, %d live clips\n", lines, spool->numClips);
+}
+
+/**
+ * Bring every live clip to a state it can resume from: truncate clips
+ * that were still recording, and forget clips whose file is gone.
+ */
+static void recover_clips(SPOOL_T *spool)
+{
+    int b;
+
+    for (b = 0; b < SPOOL_BUCKETS; b++) {
+        SPOOL_CLIP_T **slot = &spool->bucket[b];
+        while (*slot) {
+            SPOOL_CLIP_T *clip = *slot;
+            char path[256];
+            struct stat st;
+
+            spool_path(spool, clip->name, path, sizeof(path));
+            if (clip->state == SPOOL_MUXED || clip->state == SPOOL_UPLOADING)
+                clip->state = SPOOL_CLOSED;  // Interrupted, the upload starts over and it can be evicted again
+            if (clip->state == SPOOL_RECORDING) {
+                long size = spool_truncate_h264(path);
+                if (size > 0) {
+                    fprintf(stderr, "INFO: recovered %s, %ld bytes\n", clip->name, size);
+                    clip->state = SPOOL_CLOSED;
+                    set_size(spool, clip, size);
+                } else {
+                    unlink(path);
+                }
+            }
+            if (clip->state == SPOOL_RECORDING || stat(path, &st) != 0) {
+                *slot = clip->next;
+                set_size(spool, clip, 0);
+                free(clip);
+                spool->numClips--;
+                continue;
+            }
+            slot = &clip->next;
+        }
+    }
+}
+
+/**
+ * Rewrite the journal with one line per live clip
+ */
+static int compact_journal(SPOOL_T *spool, const char *journalPath)
+{
+    char tmpPath[JOURNAL_PATH_LEN + 4];  // journalPath and ".tmp"
+    FILE *fp;
+    int b;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", journalPath);
+    fp = fopen(tmpPath, "w");
+    if (!fp) {
+        perror(tmpPath);
+        return -1;
+    }
+    for (b = 0; b < SPOOL_BUCKETS; b++) {
+        SPOOL_CLIP_T *clip;
+        for (clip = spool->bucket[b]; clip; clip = clip->next)
+            fprintf(fp, "%s %s %ld %u %d\n", spool_state_name(clip->state), clip->name, clip->size,
+                    clip->peakScore, clip->deferred);
+    }
+    fflush(fp);
+    fsync(fileno(fp));
+    fclose(fp);
+    if (rename(tmpPath, journalPath) != 0) {
+        perror(journalPath);
+        return -1;
+    }
+    spool->journalLines = spool->numClips;
+    return 0;
+}
+
+/**
+ * Compact the open journal once enough of its lines are superseded, so a
+ * long-running spool does not grow it without bound. The caller holds the
+ * lock, and has applied every state it journalled.
+ */
+static void compact_if_dead(SPOOL_T *spool)
+{
+    char journalPath[JOURNAL_PATH_LEN];
+
+    if (!spool->journal || spool->journalLines - spool->numClips < SPOOL_COMPACT_DEAD)
+        return;
+    spool_path(spool, SPOOL_JOURNAL, journalPath, sizeof(journalPath));
+    fclose(spool->journal);
+    if (compact_journal(spool, journalPath) != 0)
+        spool->journalLines = spool->numClips;  // Keep appending, retry after as many lines again
+    else
+        fprintf(stderr, "INFO: spool journal compacted to %d live clips\n", spool->numClips);
+    spool->journal = fopen(journalPath, "a");
+    if (!spool->journal)
+        perror(journalPath);
+}
+
+/**
+ * Open the spool, recovering from whatever state the last run left it in
+ *
+ * @param dir Spool directory, created if missing
+ * @return 0 if successful, -1 otherwise
+ */
+int spool_open(SPOOL_T *spool, const char *dir)
+{
+    char journalPath[JOURNAL_PATH_LEN];
+
+    memset(spool, 0, sizeof(*spool));
+    snprintf(spool->dir, sizeof(spool->dir), "%s", dir);
+    spool->quotaBytes = SPOOL_QUOTA_BYTES;
+    spool->quotaClips = SPOOL_QUOTA_CLIPS;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    vcos_mutex_create(&spool->lock, "snoop_spool-lock");
+
+    spool_path(spool, SPOOL_JOURNAL, journalPath, sizeof(journalPath));
+    replay_journal(spool, journalPath);
+    recover_clips(spool);
+    if (compact_journal(spool, journalPath) != 0)
+        return -1;
+
+    spool->journal = fopen(journalPath, "a");
+    if (!spool->journal) {
+        perror(journalPath);
+        return -1;
+    }
+    return 0;
+}
+
+void spool_close(SPOOL_T *spool)
+{
+    int b;
+
+    if (spool->journal)
+        fclose(spool->journal);
+    spool->journal = NULL;
+    for (b = 0; b < SPOOL_BUCKETS; b++) {
+        while (spool->bucket[b]) {
+            SPOOL_CLIP_T *clip = spool->bucket[b];
+            spool->bucket[b] = clip->next;
+            free(clip);
+        }
+    }
+    vcos_mutex_delete(&spool->lock);
+}
+
+/**
+ * Journal a clip state change. Safe to call from any thread. A clip that
+ * reaches a terminal state has its file released. Only RECORDING adds a
+ * clip; any other state for a clip the spool does not hold, such as one
+ * already evicted, is ignored.
+ *
+ * @param name  Clip file name (a full path is reduced to its base name)
+ * @param size  Clip size in bytes, 0 if unchanged
+ * @return 0 if journalled, -1 otherwise
+ */
+int spool_set_state(SPOOL_T *spool, const char *name, int state, long size)
+{
+    int known, ret;
+
+    name = spool_basename(name);
+    vcos_mutex_lock(&spool->lock);
+    known = *find_slot(spool, name) != NULL;
+    if (!known && state != SPOOL_RECORDING) {
+        vcos_mutex_unlock(&spool->lock);
+        return 0;
+    }
+    apply_state(spool, name, state, size, 0);
+    ret = journal_append(spool, name, state, size, 0);
+    if (state == SPOOL_UPLOADED || state == SPOOL_EVICTED) {
+        release_clip(spool, name);
+        compact_if_dead(spool);
+    }
+    vcos_mutex_unlock(&spool->lock);
+    return ret;
+}
+
+/**
+ * Journal a clip as closed, with what it needs for eviction decisions
+ *
+ * @param peakScore Highest motion score seen while recording it
+ * @param deferred  Non-zero if it is only uploaded when the link is idle,
+ *                  see spool_set_deferred()
+ */
+int spool_set_closed(SPOOL_T *spool, const char *name, long size, uint32_t peakScore, int deferred)
+{
+    SPOOL_CLIP_T *clip;
+    int ret;
+
+    name = spool_basename(name);
+    vcos_mutex_lock(&spool->lock);
+    apply_state(spool, name, SPOOL_CLOSED, size, peakScore);
+    clip = *find_slot(spool, name);
+    if (clip)
+        set_deferred(spool, clip, deferred);
+    ret = journal_append(spool, name, SPOOL_CLOSED, size, peakScore);
+    vcos_mutex_unlock(&spool->lock);
+    return ret;
+}
+
+/**
+ * Mark a clip as deferred, so it leaves the backlog of clips waiting to
+ * be uploaded: it is only sent when the link is idle, or held back.
+ *
+ * @return 0 if journalled, -1 otherwise
+ */
+int spool_set_deferred(SPOOL_T *spool, const char *name, int deferred)
+{
+    SPOOL_CLIP_T *clip;
+    int ret = -1;
+
+    name = spool_basename(name);
+    vcos_mutex_lock(&spool->lock);
+    clip = *find_slot(spool, name);
+    if (clip) {
+        set_deferred(spool, clip, deferred);
+        ret = journal_append(spool, name, clip->state, clip->size, clip->peakScore);
+    }
+    vcos_mutex_unlock(&spool->lock);
+    return ret;
+}
+
+/**
+ * @param bytes   Most bytes the spool may hold
+ * @param clips   Most clips the spool may hold
+ * @param reserve Bytes to keep free for clips still being recorded
+ */
+void spool_set_quota(SPOOL_T *spool, int64_t bytes, int clips, int64_t reserve)
+{
+    vcos_mutex_lock(&spool->lock);
+    spool->quotaBytes = bytes;
+    spool->quotaClips = clips;
+    spool->reserveBytes = reserve;
+    vcos_mutex_unlock(&spool->lock);
+}
+
+/**
+ * Worth of keeping a clip: its peak motion score, halving every
+ * SPOOL_HALF_LIFE seconds of age
+ */
+static double clip_value(const SPOOL_CLIP_T *clip, time_t now)
+{
+    double age = difftime(now, clip->created);
+    return (1.0 + clip->peakScore)*pow(0.5, (age > 0 ? age : 0)/SPOOL_HALF_LIFE);
+}
+
+/**
+ * Evict the lowest-value clips until the spool is within quota. Clips
+ * being recorded, muxed for upload or uploaded are never evicted, so
+ * snoop.py never loses a clip or its sidecars mid post.
+ *
+ * @return Number of clips evicted
+ */
+int spool_enforce_quota(SPOOL_T *spool)
+{
+    time_t now = time(NULL);
+    int evicted = 0;
+
+    vcos_mutex_lock(&spool->lock);
+    while (spool->backlogBytes + spool->reserveBytes > spool->quotaBytes ||
+           spool->numClips > spool->quotaClips) {
+        SPOOL_CLIP_T *victim = NULL;
+        double lowest = 0;
+        int b;
+
+        for (b = 0; b < SPOOL_BUCKETS; b++) {
+            SPOOL_CLIP_T *clip;
+            for (clip = spool->bucket[b]; clip; clip = clip->next) {
+                double value;
+                if (clip->state == SPOOL_RECORDING || clip->state == SPOOL_MUXED ||
+                    clip->state == SPOOL_UPLOADING)
+                    continue;
+                value = clip_value(clip, now);
+                if (!victim || value < lowest) {
+                    victim = clip;
+                    lowest = value;
+                }
+            }
+        }
+        if (!victim)
+            break;
+        fprintf(stderr, "INFO: spool over quota, evicting %s (%ld bytes, peak %u)\n",
+                victim->name, victim->size, victim->peakScore);
+        release_clip(spool, victim->name);
+        journal_append(spool, victim->name, SPOOL_EVICTED, 0, 0);
+        apply_state(spool, victim->name, SPOOL_EVICTED, 0, 0);
+        spool->evicted++;
+        evicted++;
+    }
+    if (evicted)
+        compact_if_dead(spool);
+    vcos_mutex_unlock(&spool->lock);
+    return evicted;
+}
+
+/**
+ * Call cb for every closed clip that has not been uploaded yet
+ */
+void spool_foreach_pending(SPOOL_T *spool, SPOOL_CLIP_CB cb, void *ctx)
+{
+    int b;
+
+    vcos_mutex_lock(&spool->lock);
+    for (b = 0; b < SPOOL_BUCKETS; b++) {
+        SPOOL_CLIP_T *clip;
+        for (clip = spool->bucket[b]; clip; clip = clip->next) {
+            if (clip->state != SPOOL_RECORDING) {
+                char path[256];
+                spool_path(spool, clip->name, path, sizeof(path));
+                cb(ctx, path, clip);
+            }
+        }
+    }
+    vcos_mutex_unlock(&spool->lock);
+}
+
+/**
+ * @return Bytes journalled as closed but not yet uploaded
+ */
+int64_t spool_backlog_bytes(SPOOL_T *spool)
+{
+    int64_t bytes;
+
+    vcos_mutex_lock(&spool->lock);
+    bytes = spool->backlogBytes;
+    vcos_mutex_unlock(&spool->lock);
+    return bytes;
+}
+
+/**
+ * @return Of the backlog, the bytes queued for upload ahead of new clips,
+ *         leaving out deferred and held back clips
+ */
+int64_t spool_upload_backlog_bytes(SPOOL_T *spool)
+{
+    int64_t bytes;
+
+    vcos_mutex_lock(&spool->lock);
+    bytes = spool->uploadBytes;
+    vcos_mutex_unlock(&spool->lock);
+    return bytes;
+}
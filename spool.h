@@ -0,0 +1,89 @@
+/*
+ * File:   spool.h
+ *
+ * Persistent clip spool. Clips live in a spool directory alongside an
+ * append-only journal of their states. On startup the journal is replayed
+ * (never the directory), half-written clips are truncated to their last
+ * complete NAL, and the journal is compacted to one line per live clip.
+ * While running it is compacted again once SPOOL_COMPACT_DEAD of its
+ * lines have been superseded.
+ */
+
+#ifndef SPOOL_H_
+#define SPOOL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "interface/vcos/vcos.h"
+
+#define SPOOL_DIR         "/var/spool/snoop"
+#define SPOOL_JOURNAL     "journal"
+#define SPOOL_BUCKETS     256
+#define SPOOL_NAME_LEN    64
+#define SPOOL_QUOTA_BYTES (1024LL*1024*1024)
+#define SPOOL_QUOTA_CLIPS 2000
+#define SPOOL_HALF_LIFE   3600   // Seconds for a clip's eviction value to halve
+#define SPOOL_COMPACT_DEAD 4096  // Superseded journal lines before it is compacted
+
+/// Clip states, in the order a clip normally passes through them
+#define SPOOL_RECORDING   0
+#define SPOOL_CLOSED      1
+#define SPOOL_MUXED       2
+#define SPOOL_UPLOADING   3
+#define SPOOL_UPLOADED    4   /// Terminal; the clip is forgotten
+#define SPOOL_EVICTED     5   /// Terminal; deleted to stay within quota
+#define SPOOL_NUM_STATES  6
+
+typedef struct SPOOL_CLIP_T {
+    struct SPOOL_CLIP_T *next;        /// Hash chain
+    char  name[SPOOL_NAME_LEN];       /// File name within the spool directory
+    int   state;
+    long  size;                       /// Bytes, once closed
+    uint32_t peakScore;               /// Highest motion score seen in the clip
+    int   deferred;                   /// Only uploaded when the link is idle, or held back
+    time_t created;
+} SPOOL_CLIP_T;
+
+typedef void (*SPOOL_RELEASE_CB)(void *ctx, const char *path);
+
+typedef struct {
+    char          dir[128];
+    FILE         *journal;
+    int           journalLines;               /// Lines in the journal, live or superseded
+    VCOS_MUTEX_T  lock;
+    SPOOL_CLIP_T *bucket[SPOOL_BUCKETS];
+    int           numClips;
+    int64_t       backlogBytes;               /// Sizes of all live clips
+    int64_t       uploadBytes;                /// Of which not deferred
+    int64_t       quotaBytes;
+    int           quotaClips;
+    int64_t       reserveBytes;               /// Kept free for clips being recorded
+    uint32_t      evicted;
+    SPOOL_RELEASE_CB release;                 /// Disposes of finished clips, NULL to unlink
+    void         *releaseCtx;
+} SPOOL_T;
+
+typedef void (*SPOOL_CLIP_CB)(void *ctx, const char *path, const SPOOL_CLIP_T *clip);
+
+int  spool_open(SPOOL_T *spool, const char *dir);
+void spool_close(SPOOL_T *spool);
+
+void spool_path(const SPOOL_T *spool, const char *name, char *path, int len);
+int  spool_set_state(SPOOL_T *spool, const char *name, int state, long size);
+int  spool_set_closed(SPOOL_T *spool, const char *name, long size, uint32_t peakScore, int deferred);
+int  spool_set_deferred(SPOOL_T *spool, const char *name, int deferred);
+void spool_set_release(SPOOL_T *spool, SPOOL_RELEASE_CB cb, void *ctx);
+void spool_set_quota(SPOOL_T *spool, int64_t bytes, int clips, int64_t reserve);
+int  spool_enforce_quota(SPOOL_T *spool);
+void spool_foreach_pending(SPOOL_T *spool, SPOOL_CLIP_CB cb, void *ctx);
+int64_t spool_backlog_bytes(SPOOL_T *spool);
+int64_t spool_upload_backlog_bytes(SPOOL_T *spool);
+
+long spool_truncate_h264(const char *path);
+
+const char *spool_state_name(int state);
+const char *spool_basename(const char *path);
+
+#endif /* SPOOL_H_ */
@@ -0,0 +1,169 @@
+/*
+ * File:   startup.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "startup.h"
+#include "report.h"
+
+static const char *milestone_names[STARTUP_NUM_MILESTONES] = {
+    "first frame",
+    "first motion check"
+};
+
+static int64_t startup_now(const STARTUP_T *st)
+{
+    int64_t t = report_now_us() - st->t0;
+    return t > 0 ? t : 1;  // 0 means not reached
+}
+
+void startup_init(STARTUP_T *st, const char *reportFile)
+{
+    memset(st, 0, sizeof(*st));
+    st->t0 = report_now_us();
+    snprintf(st->reportFile, sizeof(st->reportFile), "%s", reportFile);
+    vcos_mutex_create(&st->lock, "snoop_startup-lock");
+}
+
+/**
+ * Start timing a phase
+ *
+ * @param fmt printf style phase name
+ * @return Phase handle for startup_end(), -1 if the table is full
+ */
+int startup_begin(STARTUP_T *st, const char *fmt, ...)
+{
+    STARTUP_PHASE_T *phase;
+    va_list ap;
+    int id = -1;
+
+    vcos_mutex_lock(&st->lock);
+    if (st->numPhases < STARTUP_MAX_PHASES) {
+        id = st->numPhases++;
+        phase = &st->phase[id];
+        va_start(ap, fmt);
+        vsnprintf(phase->name, sizeof(phase->name), fmt, ap);
+        va_end(ap);
+        phase->start = startup_now(st);
+    }
+    vcos_mutex_unlock(&st->lock);
+    return id;
+}
+
+void startup_end(STARTUP_T *st, int phase)
+{
+    if (phase < 0)
+        return;
+    vcos_mutex_lock(&st->lock);
+    st->phase[phase].end = startup_now(st);
+    vcos_mutex_unlock(&st->lock);
+}
+
+static void *startup_task_thread(void *arg)
+{
+    STARTUP_TASK_T *task = (STARTUP_TASK_T *) arg;
+
+    task->result = task->fn(task->arg);
+    startup_end(task->startup, task->phase);
+    return NULL;
+}
+
+/**
+ * Run fn(arg) as a timed phase on its own thread
+ *
+ * @return 0 if the thread started, otherwise fn has already been run
+ *         on the caller's thread and its result is returned by startup_join()
+ */
+int startup_spawn(STARTUP_T *st, STARTUP_TASK_T *task, const char *name, STARTUP_TASK_FN fn, void *arg)
+{
+    memset(task, 0, sizeof(*task));
+    task->startup = st;
+    task->fn = fn;
+    task->arg = arg;
+    task->phase = startup_begin(st, "%s", name);
+    if (task->phase >= 0)
+        st->phase[task->phase].async = 1;
+    if (vcos_thread_create(&task->thread, "snoop_startup", NULL, startup_task_thread, task) != VCOS_SUCCESS) {
+        fprintf(stderr, "Unable to start %s in parallel, running it inline\n", name);
+        if (task->phase >= 0)
+            st->phase[task->phase].async = 0;
+        startup_task_thread(task);
+        task->startup = NULL;  // Nothing to join
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Wait for a task started by startup_spawn()
+ *
+ * @return The task's result
+ */
+int startup_join(STARTUP_TASK_T *task)
+{
+    if (task->startup) {
+        vcos_thread_join(&task->thread, NULL);
+        task->startup = NULL;
+    }
+    return task->result;
+}
+
+/**
+ * Record the first time a milestone is reached. Reaching the first
+ * motion check ends startup, so the report is written then.
+ */
+void startup_milestone(STARTUP_T *st, STARTUP_MILESTONE_T m)
+{
+    int first = 0;
+
+    if (st->milestone[m])
+        return;  // Cheap enough to call on every frame
+    vcos_mutex_lock(&st->lock);
+    if (!st->milestone[m]) {
+        st->milestone[m] = startup_now(st);
+        first = 1;
+    }
+    vcos_mutex_unlock(&st->lock);
+    if (first && m == STARTUP_FIRST_CHECK) {
+        startup_dump(st, stderr);
+        startup_write_report(st);
+    }
+}
+
+void startup_dump(STARTUP_T *st, FILE *fp)
+{
+    int i;
+
+    vcos_mutex_lock(&st->lock);
+    fprintf(fp, "%-32s %6s %10s %10s %10s\n", "phase", "thread", "start(ms)", "end(ms)", "took(ms)");
+    for (i = 0; i < st->numPhases; i++) {
+        const STARTUP_PHASE_T *p = &st->phase[i];
+        if (p->end)
+            fprintf(fp, "%-32s %6s %10.1f %10.1f %10.1f\n", p->name, p->async ? "task" : "main",
+                    p->start/1000.0, p->end/1000.0, (p->end - p->start)/1000.0);
+        else
+            fprintf(fp, "%-32s %6s %10.1f %10s %10s\n", p->name, p->async ? "task" : "main",
+                    p->start/1000.0, "-", "-");
+    }
+    for (i = 0; i < STARTUP_NUM_MILESTONES; i++) {
+        if (st->milestone[i])
+            fprintf(fp, "%-32s %6s %10s %10.1f\n", milestone_names[i], "", "", st->milestone[i]/1000.0);
+        else
+            fprintf(fp, "%-32s %6s %10s %10s\n", milestone_names[i], "", "", "-");
+    }
+    vcos_mutex_unlock(&st->lock);
+}
+
+static void dump_report(void *ctx, FILE *fp)
+{
+    startup_dump((STARTUP_T *) ctx, fp);
+}
+
+void startup_write_report(STARTUP_T *st)
+{
+    report_write(st->reportFile, dump_report, st);
+}
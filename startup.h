@@ -0,0 +1,69 @@
+/*
+ * File:   startup.h
+ *
+ * Startup phase timing. Phases are stamped on the monotonic clock
+ * relative to startup_init(), may run on helper threads so independent
+ * work overlaps, and are reported together with the first frame and
+ * first motion check milestones once the latter is reached.
+ */
+
+#ifndef STARTUP_H_
+#define STARTUP_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "interface/vcos/vcos.h"
+
+#define STARTUP_REPORT_FILE "/tmp/snoop_startup.txt"
+#define STARTUP_MAX_PHASES  32
+
+/// Points that mark the unit as no longer blind
+typedef enum {
+    STARTUP_FIRST_FRAME = 0,    /// First frame delivered by any source
+    STARTUP_FIRST_CHECK,        /// First frame compared against a previous one
+    STARTUP_NUM_MILESTONES
+} STARTUP_MILESTONE_T;
+
+typedef struct {
+    char    name[32];
+    int     async;                /// Ran on a startup task thread
+    int64_t start;                /// usec since startup_init
+    int64_t end;                  /// usec since startup_init, 0 while running
+} STARTUP_PHASE_T;
+
+typedef struct {
+    VCOS_MUTEX_T    lock;
+    char            reportFile[64];
+    int64_t         t0;           /// Monotonic usec at startup_init
+    STARTUP_PHASE_T phase[STARTUP_MAX_PHASES];
+    int             numPhases;
+    volatile int64_t milestone[STARTUP_NUM_MILESTONES];  /// usec since startup_init, 0 if not reached
+} STARTUP_T;
+
+typedef int (*STARTUP_TASK_FN)(void *arg);
+
+/// A phase run on its own thread, overlapping whatever the caller does next
+typedef struct {
+    VCOS_THREAD_T   thread;
+    STARTUP_T      *startup;
+    STARTUP_TASK_FN fn;
+    void           *arg;
+    int             phase;
+    int             result;
+} STARTUP_TASK_T;
+
+void startup_init(STARTUP_T *st, const char *reportFile);
+
+int  startup_begin(STARTUP_T *st, const char *fmt, ...);
+void startup_end(STARTUP_T *st, int phase);
+
+int  startup_spawn(STARTUP_T *st, STARTUP_TASK_T *task, const char *name, STARTUP_TASK_FN fn, void *arg);
+int  startup_join(STARTUP_TASK_T *task);
+
+void startup_milestone(STARTUP_T *st, STARTUP_MILESTONE_T m);
+
+void startup_dump(STARTUP_T *st, FILE *fp);
+void startup_write_report(STARTUP_T *st);
+
+#endif /* STARTUP_H_ */
@@ -0,0 +1,260 @@
+/*
+ * File:   timelapse.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "timelapse.h"
+
+#define TIMELAPSE_EXT ".mjpeg"
+
+static int64_t wall_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+/**
+ * Segment name for an hour, <YYYYmmdd-HH>_<stream>.mjpeg in local time,
+ * so names sort in time order
+ */
+static void segment_name(TIMELAPSE_T *tl, long hour, char *name, int len)
+{
+    time_t t = (time_t)hour*3600;
+    struct tm tm;
+    char stamp[16];
+
+    localtime_r(&t, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H", &tm);
+    snprintf(name, len, "%s_%d%s", stamp, tl->stream, TIMELAPSE_EXT);
+}
+
+/**
+ * Delete this stream's segments from before the kept hours
+ */
+static void prune_segments(TIMELAPSE_T *tl, long hour)
+{
+    char oldest[32], suffix[16], path[160];
+    struct dirent *ent;
+    DIR *d;
+
+    segment_name(tl, hour - TIMELAPSE_KEEP_HOURS + 1, oldest, sizeof(oldest));
+    snprintf(suffix, sizeof(suffix), "_%d%s", tl->stream, TIMELAPSE_EXT);
+    d = opendir(tl->dir);
+    if (!d)
+        return;
+    while ((ent = readdir(d)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len <= strlen(suffix) || strcmp(ent->d_name + len - strlen(suffix), suffix) != 0 ||
+            strcmp(ent->d_name, oldest) >= 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", tl->dir, ent->d_name);
+        if (unlink(path) == 0)
+            printf("Timelapse %s expired\n", path);
+    }
+    closedir(d);
+}
+
+/**
+ * Move to the segment for an hour, appending if it already exists, as it
+ * does after a restart within the hour
+ */
+static void open_segment(TIMELAPSE_T *tl, long hour)
+{
+    char name[32], path[160];
+    struct stat st;
+
+    if (tl->fp)
+        fclose(tl->fp);
+    tl->hour = hour;
+    segment_name(tl, hour, name, sizeof(name));
+    snprintf(path, sizeof(path), "%s/%s", tl->dir, name);
+    tl->hourBytes = (stat(path, &st) == 0) ? st.st_size : 0;
+    tl->fp = fopen(path, "ab");
+    if (!tl->fp)
+        perror(path);
+    prune_segments(tl, hour);
+}
+
+/**
+ * Write a JPEG with a comment segment holding its wall clock time after
+ * the SOI marker
+ *
+ * @return Bytes written, or -1
+ */
+static int write_frame(TIMELAPSE_T *tl, const unsigned char *jpeg, int len)
+{
+    unsigned char com[40];
+    int clen;
+
+    clen = snprintf((char *) com + 4, sizeof(com) - 4, "snoop %lld", (long long)tl->wallTime);
+    com[0] = 0xff;
+    com[1] = 0xfe;
+    com[2] = (clen + 2) >> 8;
+    com[3] = (clen + 2) & 0xff;
+    if (fwrite(jpeg, 1, 2, tl->fp) != 2 ||
+        fwrite(com, 1, clen + 4, tl->fp) != (size_t)(clen + 4) ||
+        fwrite(jpeg + 2, 1, len - 2, tl->fp) != (size_t)(len - 2) ||
+        fflush(tl->fp) != 0) {
+        perror("timelapse");
+        return -1;
+    }
+    return len + clen + 4;
+}
+
+/**
+ * Steer quality so the frames left in the hour fit what is left of its
+ * budget
+ */
+static void adjust_quality(TIMELAPSE_T *tl, int lastBytes)
+{
+    int64_t secondsLeft = 3600 - (tl->wallTime/1000000) % 3600;
+    int64_t framesLeft = secondsLeft*1000000/tl->interval + 1;
+    int64_t target = (tl->hourBudget - tl->hourBytes)/framesLeft;
+
+    if (lastBytes > target + target/10 && tl->quality > TIMELAPSE_MIN_QUALITY)
+        tl->quality -= TIMELAPSE_QUALITY_STEP;
+    else if (lastBytes < target - target/5 && tl->quality < TIMELAPSE_MAX_QUALITY)
+        tl->quality += TIMELAPSE_QUALITY_STEP;
+}
+
+static void *timelapse_thread(void *arg)
+{
+    TIMELAPSE_T *tl = (TIMELAPSE_T *) arg;
+
+    for (;;) {
+        int params[] = { CV_IMWRITE_JPEG_QUALITY, tl->quality, 0 };
+        long hour;
+        CvMat *jpeg;
+        int written;
+
+        vcos_semaphore_wait(&tl->ready);
+        if (!tl->running)
+            break;
+        hour = (long)(tl->wallTime/1000000/3600);
+        if (hour != tl->hour || !tl->fp)
+            open_segment(tl, hour);
+        if (!tl->fp || tl->hourBytes >= tl->hourBudget) {
+            tl->skipped++;
+            tl->busy = 0;
+            continue;
+        }
+        cvCvtColor(tl->yuv, tl->bgr, CV_YUV2BGR_I420);
+        jpeg = cvEncodeImage(".jpg", tl->bgr, params);
+        if (!jpeg) {
+            fprintf(stderr, "Error: timelapse encode for stream %d\n", tl->stream);
+        } else if (tl->hourBytes + jpeg->cols > tl->hourBudget) {
+            tl->skipped++;
+            adjust_quality(tl, jpeg->cols);
+        } else if ((written = write_frame(tl, jpeg->data.ptr, jpeg->cols)) > 0) {
+            tl->hourBytes += written;
+            tl->frames++;
+            adjust_quality(tl, written);
+        }
+        if (jpeg)
+            cvReleaseMat(&jpeg);
+        tl->busy = 0;
+    }
+    return NULL;
+}
+
+/**
+ * Start a stream's timelapse
+ *
+ * @param spoolDir   Segments go in its TIMELAPSE_DIR, created if missing
+ * @param interval   Seconds between frames
+ * @param dailyBytes Budget for a day of segments
+ * @param arena      Frame arena to take the buffers from
+ * @return 0 if successful, -1 otherwise
+ */
+int timelapse_open(TIMELAPSE_T *tl, const char *spoolDir, int stream, int interval, int64_t dailyBytes,
+                   ARENA_T *arena)
+{
+    unsigned char *yuv, *bgr;
+
+    memset(tl, 0, sizeof(*tl));
+    tl->stream = stream;
+    tl->interval = (int64_t)interval*1000000;
+    tl->hourBudget = dailyBytes/24;
+    tl->quality = TIMELAPSE_QUALITY;
+    tl->hour = -1;
+    snprintf(tl->dir, sizeof(tl->dir), "%s/%s", spoolDir, TIMELAPSE_DIR);
+    if (mkdir(tl->dir, 0755) != 0 && errno != EEXIST) {
+        perror(tl->dir);
+        return -1;
+    }
+    yuv = arena_alloc(arena, "timelapse yuv", SNAPSHOT_YUV_BYTES(TIMELAPSE_WIDTH, TIMELAPSE_HEIGHT));
+    bgr = arena_alloc(arena, "timelapse bgr", SNAPSHOT_BGR_BYTES(TIMELAPSE_WIDTH, TIMELAPSE_HEIGHT));
+    if (!yuv || !bgr)
+        return -1;
+    tl->yuv = cvCreateImageHeader(cvSize(TIMELAPSE_WIDTH, TIMELAPSE_HEIGHT*3/2), IPL_DEPTH_8U, 1);
+    tl->bgr = cvCreateImageHeader(cvSize(TIMELAPSE_WIDTH, TIMELAPSE_HEIGHT), IPL_DEPTH_8U, 3);
+    cvSetData(tl->yuv, yuv, TIMELAPSE_WIDTH);
+    cvSetData(tl->bgr, bgr, TIMELAPSE_WIDTH*3);
+    vcos_semaphore_create(&tl->ready, "snoop_timelapse-sem", 0);
+    tl->running = 1;
+    if (vcos_thread_create(&tl->thread, "snoop_timelapse", NULL, timelapse_thread, tl) != VCOS_SUCCESS) {
+        fprintf(stderr, "Error: unable to start timelapse thread\n");
+        tl->running = 0;
+        return -1;
+    }
+    printf("Timelapse for stream %d every %d s into %s, %lld bytes an hour\n", stream, interval, tl->dir,
+           (long long)tl->hourBudget);
+    return 0;
+}
+
+void timelapse_close(TIMELAPSE_T *tl)
+{
+    if (!tl->running)
+        return;
+    tl->running = 0;
+    vcos_semaphore_post(&tl->ready);
+    vcos_thread_join(&tl->thread, NULL);
+    if (tl->fp)
+        fclose(tl->fp);
+    tl->fp = NULL;
+    cvReleaseImageHeader(&tl->yuv);
+    cvReleaseImageHeader(&tl->bgr);
+    vcos_semaphore_delete(&tl->ready);
+}
+
+/**
+ * Offer a frame. Only one every interval of pts is taken, and only its
+ * downscale runs on the caller's thread; a frame due while the last one
+ * is still encoding is dropped rather than waited for.
+ *
+ * @param frame width x height I420 frame
+ * @return 1 if the frame was taken, 0 if none was due, -1 if dropped
+ */
+int timelapse_frame(TIMELAPSE_T *tl, const unsigned char *frame, int width, int height, int64_t pts)
+{
+    if (!tl->running)
+        return 0;
+    // pts restart with a rebuilt camera
+    if (tl->havePts && pts >= tl->lastPts && pts - tl->lastPts < tl->interval)
+        return 0;
+    tl->havePts = 1;
+    tl->lastPts = pts;
+    if (tl->busy) {
+        tl->dropped++;
+        return -1;
+    }
+    snapshot_scale(frame, width, height, (unsigned char *) tl->yuv->imageData, TIMELAPSE_WIDTH, TIMELAPSE_HEIGHT);
+    tl->wallTime = wall_us();
+    tl->busy = 1;
+    vcos_semaphore_post(&tl->ready);
+    return 1;
+}
@@ -0,0 +1,75 @@
+/*
+ * File:   timelapse.h
+ *
+ * Continuous low-rate record between events, so the lead-up to an
+ * incident is kept. Every interval one frame is scaled down to
+ * TIMELAPSE_WIDTH x TIMELAPSE_HEIGHT on the caller's thread, and a
+ * per-stream thread JPEG-encodes it and appends it to the current
+ * hour's segment, TIMELAPSE_DIR/<YYYYmmdd-HH>_<stream>.mjpeg. Segments
+ * are plain concatenated JPEGs (ffmpeg -f mjpeg reads them); each frame
+ * carries its wall clock time in a JPEG comment, "snoop <usec>".
+ *
+ * Storage is fixed: each hour may use a 24th of the daily byte budget,
+ * JPEG quality follows what the rest of the hour can afford, frames are
+ * skipped once the hour's share is spent, and segments older than
+ * TIMELAPSE_KEEP_HOURS are deleted.
+ */
+
+#ifndef TIMELAPSE_H_
+#define TIMELAPSE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <opencv2/core/core_c.h>
+
+#include "interface/vcos/vcos.h"
+
+#include "arena.h"
+#include "snapshot.h"
+
+#define TIMELAPSE_DIR          "timelapse"      // Under the spool directory
+#define TIMELAPSE_WIDTH        384
+#define TIMELAPSE_HEIGHT       216
+#define TIMELAPSE_INTERVAL     10               // Default seconds between frames
+#define TIMELAPSE_DAILY_BYTES  (48*1024*1024)   // Default budget
+#define TIMELAPSE_KEEP_HOURS   48
+#define TIMELAPSE_QUALITY      60               // First frame's JPEG quality
+#define TIMELAPSE_MIN_QUALITY  10
+#define TIMELAPSE_MAX_QUALITY  90
+#define TIMELAPSE_QUALITY_STEP 5
+
+/// Frame arena bytes a timelapse takes
+#define TIMELAPSE_ARENA_BYTES (ARENA_BYTES(SNAPSHOT_YUV_BYTES(TIMELAPSE_WIDTH, TIMELAPSE_HEIGHT)) + \
+                               ARENA_BYTES(SNAPSHOT_BGR_BYTES(TIMELAPSE_WIDTH, TIMELAPSE_HEIGHT)))
+
+typedef struct {
+    int              stream;
+    char             dir[96];
+    int64_t          interval;      /// usec of pts between frames
+    int64_t          hourBudget;    /// Bytes each hourly segment may use
+    IplImage        *yuv;           /// Scaled I420 frame awaiting encode
+    IplImage        *bgr;
+    VCOS_SEMAPHORE_T ready;
+    VCOS_THREAD_T    thread;
+    volatile int     running;
+    volatile int     busy;          /// yuv holds a frame the thread has not encoded yet
+    int64_t          lastPts;       /// Caller's thread only
+    int              havePts;
+    int64_t          wallTime;      /// Wall clock usec of the frame in yuv
+    int              quality;       /// Encoder thread only from here on
+    FILE            *fp;
+    long             hour;          /// Hours since the epoch of the open segment
+    int64_t          hourBytes;
+    uint32_t         frames;
+    uint32_t         skipped;       /// Frames the hour's budget had no room for
+    uint32_t         dropped;       /// Frames due while the previous one was encoding
+} TIMELAPSE_T;
+
+int  timelapse_open(TIMELAPSE_T *tl, const char *spoolDir, int stream, int interval, int64_t dailyBytes,
+                    ARENA_T *arena);
+void timelapse_close(TIMELAPSE_T *tl);
+
+int  timelapse_frame(TIMELAPSE_T *tl, const unsigned char *frame, int width, int height, int64_t pts);
+
+#endif /* TIMELAPSE_H_ */
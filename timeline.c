@@ -0,0 +1,185 @@
+/*
+ * File:   timeline.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timeline.h"
+
+static int put_varint(unsigned char *out, int len, int pos, uint64_t v)
+{
+    do {
+        if (pos >= len)
+            return -1;
+        out[pos++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    return pos;
+}
+
+static int get_varint(const unsigned char *in, int len, int pos, uint64_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    do {
+        if (pos >= len || shift > 63)
+            return -1;
+        *v |= (uint64_t)(in[pos] & 0x7f) << shift;
+        shift += 7;
+    } while (in[pos++] & 0x80);
+    return pos;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void put_u16(unsigned char *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/**
+ * Encode a clip's motion samples
+ *
+ * @param basePts Clip's first frame pts, usec
+ * @param pts     pts of the frame each sample was taken from
+ * @return Bytes written to out, -1 if it is too small
+ */
+int timeline_encode(unsigned char *out, int len, int64_t basePts, int width, int height,
+                    const EVENTIPC_SAMPLE_T *samples, const int64_t *pts, int n)
+{
+    int64_t prev[6] = {0, 0, 0, 0, 0, 0};
+    int pos, i, f;
+
+    if (len < TIMELINE_HDR_BYTES || n > 0xffff)
+        return -1;
+    put_u16(out, TIMELINE_MAGIC & 0xffff);
+    put_u16(out + 2, TIMELINE_MAGIC >> 16);
+    put_u16(out + 4, TIMELINE_VERSION);
+    put_u16(out + 6, n);
+    put_u16(out + 8, width);
+    put_u16(out + 10, height);
+    pos = put_varint(out, len, TIMELINE_HDR_BYTES, (uint64_t)basePts);
+    for (i = 0; i < n && pos >= 0; i++) {
+        int64_t cur[6];
+        cur[0] = (pts[i] - basePts)/1000;
+        cur[1] = samples[i].score;
+        cur[2] = samples[i].box.x;
+        cur[3] = samples[i].box.y;
+        cur[4] = samples[i].box.w;
+        cur[5] = samples[i].box.h;
+        for (f = 0; f < 6 && pos >= 0; f++) {
+            pos = put_varint(out, len, pos, zigzag(cur[f] - prev[f]));
+            prev[f] = cur[f];
+        }
+    }
+    return pos;
+}
+
+/**
+ * Decode a timeline written by timeline_encode()
+ *
+ * @param max Most samples to return
+ * @return Number of samples, -1 if the data is not a valid timeline
+ */
+int timeline_decode(const unsigned char *in, int len, int64_t *basePts, int *width, int *height,
+                    EVENTIPC_SAMPLE_T *samples, int64_t *pts, int max)
+{
+    int64_t cur[6] = {0, 0, 0, 0, 0, 0};
+    uint64_t v;
+    int pos, n, i, f;
+
+    if (len < TIMELINE_HDR_BYTES ||
+        (get_u16(in) | ((uint32_t)get_u16(in + 2) << 16)) != TIMELINE_MAGIC ||
+        get_u16(in + 4) != TIMELINE_VERSION)
+        return -1;
+    n = get_u16(in + 6);
+    *width = get_u16(in + 8);
+    *height = get_u16(in + 10);
+    if ((pos = get_varint(in, len, TIMELINE_HDR_BYTES, &v)) < 0)
+        return -1;
+    *basePts = (int64_t)v;
+    for (i = 0; i < n; i++) {
+        for (f = 0; f < 6; f++) {
+            if ((pos = get_varint(in, len, pos, &v)) < 0)
+                return -1;
+            cur[f] += unzigzag(v);
+        }
+        if (i < max) {
+            pts[i] = *basePts + cur[0]*1000;
+            samples[i].score = cur[1];
+            samples[i].box.x = cur[2];
+            samples[i].box.y = cur[3];
+            samples[i].box.w = cur[4];
+            samples[i].box.h = cur[5];
+        }
+    }
+    return n < max ? n : max;
+}
+
+/**
+ * Write a clip's timeline sidecar, replacing any earlier one whole
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int timeline_write(const char *path, int64_t basePts, int width, int height,
+                   const EVENTIPC_SAMPLE_T *samples, const int64_t *pts, int n)
+{
+    int len = TIMELINE_HDR_BYTES + 10 + n*TIMELINE_MAX_ENTRY_BYTES;
+    unsigned char *buf = malloc(len);
+    char tmpPath[96];
+    FILE *fp;
+    int bytes;
+
+    if (!buf)
+        return -1;
+    bytes = timeline_encode(buf, len, basePts, width, height, samples, pts, n);
+    if (bytes < 0) {
+        free(buf);
+        return -1;
+    }
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        perror(tmpPath);
+        free(buf);
+        return -1;
+    }
+    if (fwrite(buf, 1, bytes, fp) != (size_t)bytes) {
+        perror(tmpPath);
+        fclose(fp);
+        free(buf);
+        return -1;
+    }
+    fclose(fp);
+    free(buf);
+    return rename(tmpPath, path);
+}
+
+/**
+ * Sidecar path for a clip: its name with the extension replaced
+ */
+void timeline_path(const char *clip, char *path, int len)
+{
+    const char *ext = strrchr(clip, '.');
+    const char *slash = strrchr(clip, '/');
+    int stem = (ext && (!slash || ext > slash)) ? (int)(ext - clip) : (int)strlen(clip);
+
+    snprintf(path, len, "%.*s%s", stem, clip, TIMELINE_EXT);
+}
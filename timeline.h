@@ -0,0 +1,44 @@
+/*
+ * File:   timeline.h
+ *
+ * Per-clip motion timeline sidecar. Every motion check made while a clip
+ * was recorded is stored next to the clip as <clip>.tl, so the server can
+ * seek to the busiest moment and pick thumbnails without decoding video.
+ *
+ * Layout, little-endian:
+ *
+ *   uint32 magic "SNTL", uint16 version, uint16 entries,
+ *   uint16 width, uint16 height    analysis resolution the boxes are in
+ *   varint base_pts                usec, pts of the clip's first frame
+ *
+ * then per entry six zigzag varints, each the difference from the
+ * previous entry (from zero for the first):
+ *
+ *   pts offset from base_pts in msec, score, box x, y, w, h
+ *
+ * Scores and boxes change slowly between checks, so an entry is usually
+ * 6-10 bytes and a 15 second clip a few hundred.
+ */
+
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+#include <stdint.h>
+
+#include "eventipc.h"
+
+#define TIMELINE_MAGIC    0x4c544e53  // "SNTL"
+#define TIMELINE_VERSION  1
+#define TIMELINE_EXT      ".tl"
+#define TIMELINE_HDR_BYTES 12
+#define TIMELINE_MAX_ENTRY_BYTES (6*5)  // Six varints of at most 32 bits
+
+int  timeline_encode(unsigned char *out, int len, int64_t basePts, int width, int height,
+                     const EVENTIPC_SAMPLE_T *samples, const int64_t *pts, int n);
+int  timeline_decode(const unsigned char *in, int len, int64_t *basePts, int *width, int *height,
+                     EVENTIPC_SAMPLE_T *samples, int64_t *pts, int max);
+int  timeline_write(const char *path, int64_t basePts, int width, int height,
+                    const EVENTIPC_SAMPLE_T *samples, const int64_t *pts, int n);
+void timeline_path(const char *clip, char *path, int len);
+
+#endif /* TIMELINE_H_ */
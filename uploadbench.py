@@ -0,0 +1,480 @@
+# Exercises snoop.py's uploader against a local stand-in for the web
+# server. The stand-in adds a round trip of latency to every new
+# connection and request, and can limit how fast it takes request bodies,
+# per connection and for the link as a whole, like the unit's uplink.
+#
+# Usage: python uploadbench.py [-s | -u snoopup] [-n clips] [-k clip_kb] [-r rtt_ms]
+#                              [-f reject_fraction] [-b conn_kbps] [-l link_kbps] [-c cap_kbps]
+#
+# By default a burst of small clips is uploaded the old way, one request
+# and one connection per clip, and then batched over a single keep-alive
+# connection. With -f the server refuses that fraction of the clips in
+# each batch, to exercise the per-clip retries.
+#
+# With -s a backlog of large, old clips is queued and then events arrive,
+# each a low resolution clip and a snapshot. The uploads are scheduled
+# FIFO on one thread, with snapshots on a thread of their own, and then
+# by UploadScheduler; each run reports how long the events' clips and
+# snapshots took to reach the server. With -c the scheduled run is
+# repeated under that bandwidth cap and the rate the link saw is shown.
+#
+# With -u the clips are uploaded by the web threads as main() runs them,
+# with a ping every second, first through requests and then through the
+# given snoopup binary, and the CPU time each took per MB is reported,
+# snoopup's included. The stand-in runs in a process of its own so its
+# CPU time is not counted, and muxing is a hard link.
+
+import BaseHTTPServer
+import SocketServer
+import StringIO
+import cgi
+import getopt
+import json
+import os
+import random
+import shutil
+import signal
+import sys
+import tempfile
+import threading
+import time
+import Queue
+
+import requests
+
+import snoop
+
+
+class StandIn(SocketServer.ThreadingMixIn, BaseHTTPServer.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, rtt, reject, conn_bps, link_bps):
+        BaseHTTPServer.HTTPServer.__init__(self, ("127.0.0.1", 0), StandInHandler)
+        self.rtt = rtt
+        self.reject = reject
+        self.conn_bps = conn_bps
+        self.link = snoop.Shaper(link_bps, link_bps) if link_bps else None
+        self.lock = threading.Lock()
+        self.reset()
+
+    def reset(self):
+        with self.lock:
+            self.connections = 0
+            self.requests = 0
+            self.clips = 0
+            self.body_bytes = 0
+            self.first_byte = None
+            self.last_byte = None
+            self.arrivals = {}  # Uploaded file name without extension -> time
+
+    def receive(self, rfile, length):
+        """ Read a request body no faster than the link allows """
+        data = []
+        left = length
+        while left > 0:
+            start = time.time()
+            chunk = rfile.read(min(left, snoop.SHAPER_CHUNK))
+            if not chunk:
+                break
+            left -= len(chunk)
+            if self.link is not None:
+                self.link.take(len(chunk))
+            if self.conn_bps:
+                pause = float(len(chunk))/self.conn_bps - (time.time() - start)
+                if pause > 0:
+                    time.sleep(pause)
+            data.append(chunk)
+            now = time.time()
+            with self.lock:
+                self.body_bytes += len(chunk)
+                if self.first_byte is None:
+                    self.first_byte = start
+                self.last_byte = now
+        return "".join(data)
+
+    def arrived(self, name):
+        with self.lock:
+            self.arrivals[name.split(".")[0]] = time.time()
+
+
+class StandInHandler(BaseHTTPServer.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"   # Keep-alive unless the client closes
+
+    def setup(self):
+        BaseHTTPServer.BaseHTTPRequestHandler.setup(self)
+        time.sleep(self.server.rtt)     # TCP handshake
+        with self.server.lock:
+            self.server.connections += 1
+
+    def log_message(self, *args):
+        pass
+
+    def reply(self, body):
+        data = json.dumps(body)
+        time.sleep(self.server.rtt)     # Request out, response back
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_GET(self):
+        with self.server.lock:
+            self.server.requests += 1
+        self.reply({})
+
+    def do_POST(self):
+        body = self.server.receive(self.rfile, int(self.headers["Content-Length"]))
+        form = cgi.FieldStorage(fp=StringIO.StringIO(body), headers=self.headers,
+                                environ={"REQUEST_METHOD": "POST",
+                                         "CONTENT_TYPE": self.headers["Content-Type"]})
+        with self.server.lock:
+            self.server.requests += 1
+        if "/upload_batch/" in self.path:
+            stored = []
+            for key in form.keys():
+                if key.startswith("file") and random.random() >= self.server.reject:
+                    stored.append(form[key].filename.split(".")[0])
+                    self.server.arrived(form[key].filename)
+            with self.server.lock:
+                self.server.clips += len(stored)
+            self.reply({"uploaded": stored})
+        else:
+            self.server.arrived(form["file"].filename)
+            if "/snapshot/" not in self.path:
+                with self.server.lock:
+                    self.server.clips += 1
+            self.reply({})
+
+
+class OneShot(object):
+    """ Session stand-in that opens a new connection per request, as the
+        uploader's bare requests.post() calls did
+    """
+    def __init__(self, auth):
+        self.auth = auth
+
+    def post(self, url, **kwargs):
+        return requests.post(url, auth=self.auth, headers={"Connection": "close"}, **kwargs)
+
+    def get(self, url, **kwargs):
+        return requests.get(url, auth=self.auth, headers={"Connection": "close"}, **kwargs)
+
+
+class FifoScheduler(snoop.UploadScheduler):
+    """ The old queueing: clips strictly in arrival order, one at a time,
+        with snapshots handled as if by their own thread
+    """
+    def priority(self, msg):
+        if msg[0] == "UPLOAD":
+            return (self.PRI_CLIP, 0)
+        return snoop.UploadScheduler.priority(self, msg)
+
+    def adapt(self, rate):
+        pass
+
+
+def fake_mux(args):
+    """ MP4Box stand-in: copy the raw clip to the MP4 path """
+    shutil.copyfile(args[-2], args[-1])
+    return 0
+
+
+def link_mux(args):
+    """ MP4Box stand-in that costs next to no CPU """
+    os.link(args[-2], args[-1])
+    return 0
+
+
+def make_clip(spool, name, size, age=0):
+    path = os.path.join(spool, name)
+    with open(path, "wb") as f:
+        f.write(os.urandom(size))
+    if age:
+        then = time.time() - age
+        os.utime(path, (then, then))
+    return path
+
+
+def make_clips(spool, n, size):
+    base = int(time.time())
+    return [make_clip(spool, "%d.h264" % (base + i), size) for i in range(n)]
+
+
+class Uploader(object):
+    """ Web threads sharing a scheduler, as snoop.py main() runs them """
+    def __init__(self, host, scheduler, threads, shaper=None, one_shot=False, session=None):
+        self.web_q = scheduler
+        self.out_q = Queue.Queue()
+        self.uploaded = 0
+        self.threads = []
+        for i in range(threads):
+            thread = snoop.WebThread(self.web_q, self.out_q, "1", host, scheduler.pending, None, shaper,
+                                     session)
+            if one_shot:
+                thread.session = OneShot(thread.session.auth)
+                thread.batch_ok = False
+            self.threads.append(thread)
+
+    def start(self):
+        for thread in self.threads:
+            thread.start()
+
+    def poll(self):
+        """ Count clips the uploader has confirmed """
+        while not self.out_q.empty():
+            if self.out_q.get()[0] == "UPLOADED":
+                self.uploaded += 1
+
+    def stop(self):
+        for thread in self.threads:
+            self.web_q.put(("EXIT", ""))
+        for thread in self.threads:
+            thread.join()
+        self.poll()
+
+
+def quiet():
+    stdout = sys.stdout
+    sys.stdout = open(os.devnull, "w")
+    return stdout
+
+
+def wait_for(check, timeout=600):
+    deadline = time.time() + timeout
+    while not check() and time.time() < deadline:
+        time.sleep(0.05)
+
+
+def run_batch(server, host, paths, batched):
+    """ Upload paths with one web thread, as queued by a burst of events
+
+        @return (seconds, clips confirmed)
+    """
+    uploader = Uploader(host, snoop.UploadScheduler(snoop.ClipSet()), 1, one_shot=not batched)
+    for path in paths:
+        uploader.web_q.put(("UPLOAD", path))
+    server.reset()
+    stdout = quiet()
+    start = time.time()
+    try:
+        uploader.start()
+
+        def finished():
+            uploader.poll()
+            return uploader.uploaded >= len(paths)
+        wait_for(finished)
+        elapsed = time.time() - start
+        uploader.stop()
+    finally:
+        sys.stdout.close()
+        sys.stdout = stdout
+    return elapsed, uploader.uploaded
+
+
+def bench_batch(server, host, spool, clips, clip_kb):
+    paths = make_clips(spool, clips, clip_kb*1024)
+    print "%-8s %8s %9s %9s %12s %9s" % ("mode", "seconds", "requests", "conns", "clips/s", "uploaded")
+    base = None
+    for mode, batched in (("single", False), ("batched", True)):
+        elapsed, uploaded = run_batch(server, host, paths, batched)
+        print "%-8s %8.2f %9d %9d %12.1f %9d" % (mode, elapsed, server.requests, server.connections,
+                                                 clips/elapsed, uploaded),
+        if base is None:
+            base = elapsed
+            print
+        else:
+            print " %.1fx" % (base/elapsed)
+
+
+def run_schedule(server, host, spool, scheduler, threads, shaper, backlog, events, clip_kb):
+    """ Queue a backlog of old full clips, then an event every half second
+
+        @return Result dict
+    """
+    base = int(time.time())
+    old = [make_clip(spool, "%d.h264" % (base - 3600 + i), 1500*1024, 3600) for i in range(backlog)]
+    lores = [make_clip(spool, "%d%s.h264" % (base + i, snoop.LORES_SUFFIX), clip_kb*1024) for i in range(events)]
+    snaps = [make_clip(spool, "%d_snap.jpg" % (base + i), 20*1024) for i in range(events)]
+    uploader = Uploader(host, scheduler, threads, shaper)
+    queued = {}
+    server.reset()
+    stdout = quiet()
+    start = time.time()
+    try:
+        uploader.start()
+        for path in old:
+            scheduler.pending.add(path)
+            scheduler.put(("UPLOAD", path))
+        time.sleep(1.0)
+        for i in range(events):
+            scheduler.pending.add(lores[i])
+            scheduler.put(("UPLOAD", lores[i]))
+            queued[os.path.basename(lores[i]).split(".")[0]] = time.time()
+            scheduler.put(("SNAPSHOT", snaps[i]))
+            queued[os.path.basename(snaps[i]).split(".")[0]] = time.time()
+            time.sleep(0.5)
+
+        def finished():
+            uploader.poll()
+            with server.lock:
+                snapped = all(k in server.arrivals for k in queued if k.endswith("_snap"))
+            return uploader.uploaded >= backlog + events and snapped
+        wait_for(finished)
+        elapsed = time.time() - start
+        uploader.stop()
+    finally:
+        sys.stdout.close()
+        sys.stdout = stdout
+
+    def delays(suffix):
+        return [server.arrivals.get(k, time.time()) - t for k, t in queued.items() if k.endswith(suffix)]
+    busy = (server.last_byte or start) - (server.first_byte or start)
+    return {"seconds": elapsed, "clip": delays(snoop.LORES_SUFFIX), "snap": delays("_snap"),
+            "limit": scheduler.limit, "rate": server.body_bytes/busy if busy > 0 else 0}
+
+
+def bench_schedule(server, host, spool, clips, clip_kb, cap_kbps):
+    backlog = max(clips/5, 2)
+    events = clips
+    print "%d old 1500 KB clips queued, then %d events of a %d KB clip and a 20 KB snapshot" % (
+        backlog, events, clip_kb)
+    print "%-9s %8s %17s %17s %6s %10s" % ("mode", "seconds", "clip mean/max(s)", "snap mean/max(s)",
+                                           "limit", "link KB/s")
+    runs = [("fifo", FifoScheduler(snoop.ClipSet()), 2, None),
+            ("priority", snoop.UploadScheduler(snoop.ClipSet()), snoop.MAX_UPLOADS + 1, None)]
+    if cap_kbps:
+        cap = cap_kbps*1000/8
+        runs.append(("capped", snoop.UploadScheduler(snoop.ClipSet()), snoop.MAX_UPLOADS + 1,
+                     snoop.Shaper(cap, cap)))
+    for mode, scheduler, threads, shaper in runs:
+        r = run_schedule(server, host, spool, scheduler, threads, shaper, backlog, events, clip_kb)
+        print "%-9s %8.2f %8.2f/%-8.2f %8.2f/%-8.2f %6d %10.1f" % (
+            mode, r["seconds"], sum(r["clip"])/len(r["clip"]), max(r["clip"]),
+            sum(r["snap"])/len(r["snap"]), max(r["snap"]), r["limit"], r["rate"]/1024)
+    if cap_kbps:
+        print "cap %.1f KB/s" % (cap_kbps*1000/8/1024.0)
+
+
+def run_cpu(host, paths, native):
+    """ Upload paths with the web threads main() runs, pinging every second
+
+        @return (seconds, CPU seconds, clips confirmed)
+    """
+    scheduler = snoop.UploadScheduler(snoop.ClipSet())
+    before = os.times()
+    session = snoop.NativeSession(host, path=native) if native else None
+    uploader = Uploader(host, scheduler, snoop.MAX_UPLOADS + 1, session=session)
+    for path in paths:
+        scheduler.pending.add(path)
+        scheduler.put(("UPLOAD", path))
+    stdout = quiet()
+    start = time.time()
+    try:
+        uploader.start()
+        last_ping = 0
+        while uploader.uploaded < len(paths) and time.time() - start < 600:
+            if time.time() - last_ping >= 1.0:
+                scheduler.put(("PING", ""))
+                last_ping = time.time()
+            time.sleep(0.05)
+            uploader.poll()
+        elapsed = time.time() - start
+        uploader.stop()
+        if session is not None:
+            # Waits for snoopup, so its CPU time shows in os.times()
+            session.close()
+    finally:
+        sys.stdout.close()
+        sys.stdout = stdout
+    after = os.times()
+    return elapsed, sum(after[:4]) - sum(before[:4]), uploader.uploaded
+
+
+def bench_cpu(host, spool, clips, clip_kb, native):
+    mb = clips*clip_kb/1024.0
+    print "%-9s %8s %8s %8s %10s %9s" % ("uploader", "seconds", "MB", "CPU s", "CPU ms/MB", "uploaded")
+    base = None
+    for mode, path in (("requests", None), ("snoopup", native)):
+        paths = make_clips(spool, clips, clip_kb*1024)
+        elapsed, cpu, uploaded = run_cpu(host, paths, path)
+        print "%-9s %8.2f %8.1f %8.2f %10.1f %9d" % (mode, elapsed, mb, cpu, cpu*1000/mb, uploaded),
+        if base is None:
+            base = cpu
+            print
+        else:
+            print " %.1fx" % (base/cpu if cpu > 0 else 0)
+        for path in paths:
+            if os.path.exists(path):
+                os.remove(path)
+
+
+def main(argv):
+    clips, clip_kb, rtt_ms, reject = 20, 100, 100, 0.0
+    conn_kbps, link_kbps, cap_kbps = 0, 0, 0
+    schedule = False
+    native = None
+    opts, args = getopt.getopt(argv, "su:n:k:r:f:b:l:c:")
+    for opt, val in opts:
+        if opt == "-s":
+            schedule = True
+        elif opt == "-u":
+            native = os.path.abspath(val)
+        elif opt == "-n":
+            clips = int(val)
+        elif opt == "-k":
+            clip_kb = int(val)
+        elif opt == "-r":
+            rtt_ms = int(val)
+        elif opt == "-f":
+            reject = float(val)
+        elif opt == "-b":
+            conn_kbps = int(val)
+        elif opt == "-l":
+            link_kbps = int(val)
+        elif opt == "-c":
+            cap_kbps = int(val)
+    if schedule:
+        # Scale the scheduler's measuring to a run of seconds rather than hours
+        snoop.ADAPT_WINDOW = 2.0
+        snoop.ADAPT_HOLD = 1
+
+    snoop.subprocess.call = link_mux if native else fake_mux
+    server = StandIn(rtt_ms/1000.0, reject, conn_kbps*1000/8, link_kbps*1000/8)
+    host = "127.0.0.1:%d" % server.server_address[1]
+    if native:
+        # Before any thread is started
+        pid = os.fork()
+        if pid == 0:
+            try:
+                server.serve_forever()
+            finally:
+                os._exit(0)
+        server.server_close()
+    else:
+        threading.Thread(target=server.serve_forever).start()
+    spool = tempfile.mkdtemp(prefix="uploadbench")
+    print "%d ms round trip, %s per connection, %s link" % (
+        rtt_ms, "%d kbps" % conn_kbps if conn_kbps else "unlimited",
+        "%d kbps" % link_kbps if link_kbps else "unlimited")
+    try:
+        if native:
+            print "%d clips of %d KB" % (clips, clip_kb)
+            bench_cpu(host, spool, clips, clip_kb, native)
+        elif schedule:
+            bench_schedule(server, host, spool, clips, clip_kb, cap_kbps)
+        else:
+            print "%d clips of %d KB, %.0f%% of batched clips refused" % (clips, clip_kb, reject*100)
+            bench_batch(server, host, spool, clips, clip_kb)
+    finally:
+        if native:
+            os.kill(pid, signal.SIGTERM)
+            os.waitpid(pid, 0)
+        else:
+            server.shutdown()
+        shutil.rmtree(spool)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
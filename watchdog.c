@@ -0,0 +1,182 @@
+/*
+ * File:   watchdog.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "watchdog.h"
+#include "report.h"
+
+void watchdog_init(WATCHDOG_T *wd)
+{
+    memset(wd, 0, sizeof(*wd));
+}
+
+/**
+ * Watch a port. It starts disarmed; ports may only be added before
+ * watchdog_start().
+ *
+ * @param continuous Non-zero for a port that calls back all the time,
+ *                   such as a camera output; zero for a work port that
+ *                   only has to call back for buffers sent to it
+ * @return 0 if successful, -1 if there are too many ports
+ */
+int watchdog_add(WATCHDOG_T *wd, WATCHDOG_PORT_T *port, const char *name, int continuous,
+                 WATCHDOG_RECOVER_FN recover, void *ctx)
+{
+    if (wd->numPorts == WATCHDOG_MAX_PORTS) {
+        fprintf(stderr, "Error: watchdog has no room for %s\n", name);
+        return -1;
+    }
+    memset(port, 0, sizeof(*port));
+    snprintf(port->name, sizeof(port->name), "%s", name);
+    port->continuous = continuous;
+    port->recover = recover;
+    port->ctx = ctx;
+    wd->ports[wd->numPorts++] = port;
+    return 0;
+}
+
+/**
+ * Start or stop expecting callbacks from a port, forgetting any work
+ * still outstanding. Call it whenever the port is enabled or torn down.
+ */
+void watchdog_arm(WATCHDOG_PORT_T *port, int armed)
+{
+    port->sent = port->beats;
+    port->armed = armed;
+    __sync_synchronize();
+    port->epoch++;
+}
+
+/**
+ * Take the next recovery step for a stalled port, skipping steps that
+ * have nothing to do
+ */
+static void recover_port(WATCHDOG_PORT_T *p, int64_t now)
+{
+    int level = (p->level < WATCHDOG_REBUILD) ? p->level + 1 : WATCHDOG_REBUILD;
+    int result;
+
+    if (p->level == 0) {
+        p->stalls++;
+        p->stalledAt = now;
+        fprintf(stderr, "watchdog: %s stalled, no callback for %d ms\n", p->name, WATCHDOG_TIMEOUT_MS);
+    }
+    while ((result = p->recover(p->ctx, level)) == 1 && level < WATCHDOG_REBUILD)
+        level++;
+    p->level = level;
+    if (result < 0) {
+        p->failures++;
+        fprintf(stderr, "watchdog: %s %s failed\n", p->name, level == WATCHDOG_REFILL ? "refill" : "rebuild");
+    }
+    // Callbacks made while the component was being taken down are not progress
+    p->lastBeats = p->beats;
+    p->lastProgress = report_now_us();
+}
+
+/**
+ * Check one port
+ *
+ * @return 1 if its counters changed
+ */
+static int check_port(WATCHDOG_PORT_T *p, int64_t now)
+{
+    uint32_t beats = p->beats;
+    uint32_t epoch = p->epoch;
+
+    if (epoch != p->lastEpoch || !p->armed) {
+        // Just armed, rebuilt or not running; the timeout starts again
+        p->lastEpoch = epoch;
+        p->lastBeats = beats;
+        p->lastProgress = now;
+        if (!p->armed)
+            p->level = 0;
+        return 0;
+    }
+    if (beats != p->lastBeats) {
+        p->lastBeats = beats;
+        p->lastProgress = now;
+        if (p->level) {
+            p->level = 0;
+            p->recoveries++;
+            p->lastRecovery = now - p->stalledAt;
+            fprintf(stderr, "watchdog: %s recovered after %lld ms\n", p->name, (long long)(p->lastRecovery/1000));
+            return 1;
+        }
+        return 0;
+    }
+    if (!p->continuous && p->sent == beats) {
+        p->lastProgress = now;  // Idle, nothing is owed
+        return 0;
+    }
+    if (now - p->lastProgress < (p->level ? WATCHDOG_RETRY_MS : WATCHDOG_TIMEOUT_MS)*1000LL)
+        return 0;
+    recover_port(p, now);
+    return 1;
+}
+
+static void *watchdog_thread(void *arg)
+{
+    WATCHDOG_T *wd = (WATCHDOG_T *) arg;
+
+    while (wd->running) {
+        int changed = 0;
+        int i;
+
+        vcos_sleep(WATCHDOG_PERIOD_MS);
+        for (i = 0; i < wd->numPorts; i++)
+            changed |= check_port(wd->ports[i], report_now_us());
+        if (changed)
+            watchdog_write_report(wd);
+    }
+    return NULL;
+}
+
+/**
+ * Start checking the ports
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int watchdog_start(WATCHDOG_T *wd)
+{
+    wd->running = 1;
+    if (vcos_thread_create(&wd->thread, "snoop_watchdog", NULL, watchdog_thread, wd) != VCOS_SUCCESS) {
+        fprintf(stderr, "Error: unable to start watchdog thread\n");
+        wd->running = 0;
+        return -1;
+    }
+    watchdog_write_report(wd);
+    return 0;
+}
+
+void watchdog_stop(WATCHDOG_T *wd)
+{
+    if (!wd->running)
+        return;
+    wd->running = 0;
+    vcos_thread_join(&wd->thread, NULL);
+}
+
+void watchdog_dump(WATCHDOG_T *wd, FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "%-24s %8s %10s %8s %10s\n", "port", "stalls", "recoveries", "failures", "last(ms)");
+    for (i = 0; i < wd->numPorts; i++) {
+        const WATCHDOG_PORT_T *p = wd->ports[i];
+        fprintf(fp, "%-24s %8u %10u %8u %10.1f\n", p->name, p->stalls, p->recoveries, p->failures,
+                p->lastRecovery/1000.0);
+    }
+}
+
+static void dump_report(void *ctx, FILE *fp)
+{
+    watchdog_dump((WATCHDOG_T *) ctx, fp);
+}
+
+void watchdog_write_report(WATCHDOG_T *wd)
+{
+    report_write(WATCHDOG_REPORT_FILE, dump_report, wd);
+}
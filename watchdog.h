@@ -0,0 +1,89 @@
+/*
+ * File:   watchdog.h
+ *
+ * Stall detection for the MMAL pipeline. Each watched port counts its
+ * callbacks, and work ports also count the buffers handed to them. A
+ * thread checks the counts every WATCHDOG_PERIOD_MS; an armed port that
+ * should be making progress but has not called back for its timeout is
+ * stalled, and its owner is asked to recover it one step at a time:
+ *
+ *   WATCHDOG_REFILL   send the pools' idle buffers back to the ports,
+ *                     for a buffer that failed to go back to a port
+ *   WATCHDOG_REBUILD  tear down and recreate the component and its pools
+ *
+ * The next step is only taken if the port is still silent after
+ * WATCHDOG_RETRY_MS, and the rebuild is repeated until it works. Stalls,
+ * recoveries and failed attempts are counted per port and written to
+ * WATCHDOG_REPORT_FILE whenever they change.
+ */
+
+#ifndef WATCHDOG_H_
+#define WATCHDOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "interface/vcos/vcos.h"
+
+#define WATCHDOG_REPORT_FILE "/tmp/snoop_watchdog.txt"
+#define WATCHDOG_MAX_PORTS   16
+#define WATCHDOG_PERIOD_MS   50     // How often the counts are checked
+#define WATCHDOG_TIMEOUT_MS  300    // Silence that makes a port stalled, ten frames at 30 fps
+#define WATCHDOG_RETRY_MS    150    // Wait after a recovery step before taking the next
+
+/// Recovery steps, in the order they are tried
+#define WATCHDOG_REFILL  1
+#define WATCHDOG_REBUILD 2
+
+/**
+ * Recover a stalled port's component
+ *
+ * @param level WATCHDOG_REFILL or WATCHDOG_REBUILD
+ * @return 0 if the step was taken, 1 if there was nothing to do at this
+ *         level, -1 if it failed
+ */
+typedef int (*WATCHDOG_RECOVER_FN)(void *ctx, int level);
+
+typedef struct {
+    char              name[32];
+    int               continuous;   /// Calls back all the time while armed, rather than only for work sent
+    volatile int      armed;
+    volatile uint32_t epoch;        /// Bumped by watchdog_arm(), restarts the timeout
+    volatile uint32_t sent;         /// Buffers handed to a work port
+    volatile uint32_t beats;        /// Callbacks
+    WATCHDOG_RECOVER_FN recover;
+    void             *ctx;
+    uint32_t          lastEpoch;    /// Watchdog thread only from here on
+    uint32_t          lastBeats;
+    int64_t           lastProgress; /// usec
+    int64_t           stalledAt;    /// usec, when the current stall was found
+    int               level;        /// Last recovery step taken for it, 0 if not stalled
+    uint32_t          stalls;
+    uint32_t          recoveries;
+    uint32_t          failures;     /// Recovery steps that failed
+    int64_t           lastRecovery; /// usec from finding the last stall to the first callback after it
+} WATCHDOG_PORT_T;
+
+typedef struct {
+    VCOS_THREAD_T     thread;
+    volatile int      running;
+    int               numPorts;
+    WATCHDOG_PORT_T  *ports[WATCHDOG_MAX_PORTS];
+} WATCHDOG_T;
+
+/// Called from the port's callback
+#define WATCHDOG_BEAT(p) __sync_fetch_and_add(&(p)->beats, 1)
+/// Called when a buffer has been sent to a work port
+#define WATCHDOG_SENT(p) __sync_fetch_and_add(&(p)->sent, 1)
+
+void watchdog_init(WATCHDOG_T *wd);
+int  watchdog_add(WATCHDOG_T *wd, WATCHDOG_PORT_T *port, const char *name, int continuous,
+                  WATCHDOG_RECOVER_FN recover, void *ctx);
+void watchdog_arm(WATCHDOG_PORT_T *port, int armed);
+int  watchdog_start(WATCHDOG_T *wd);
+void watchdog_stop(WATCHDOG_T *wd);
+
+void watchdog_dump(WATCHDOG_T *wd, FILE *fp);
+void watchdog_write_report(WATCHDOG_T *wd);
+
+#endif /* WATCHDOG_H_ */
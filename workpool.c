@@ -0,0 +1,104 @@
+/*
+ * File:   workpool.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "workpool.h"
+
+static void *workpool_thread(void *arg)
+{
+    WORKPOOL_T *pool = (WORKPOOL_T *) arg;
+
+    while (1) {
+        WORKPOOL_JOB_T *job;
+
+        if (vcos_semaphore_wait(&pool->ready) != VCOS_SUCCESS)
+            continue;
+        vcos_mutex_lock(&pool->lock);
+        job = pool->head;
+        if (job) {
+            pool->head = job->next;
+            if (!pool->head)
+                pool->tail = NULL;
+            job->next = NULL;
+        }
+        vcos_mutex_unlock(&pool->lock);
+        if (!job)
+            continue;
+
+        job->run(job);
+        __sync_synchronize();
+        job->state = JOB_IDLE;
+    }
+    return NULL;
+}
+
+/**
+ * Start the worker threads
+ *
+ * @param threads Number of workers, clamped to 1..WORKPOOL_MAX_THREADS
+ * @return 0 if successful, -1 otherwise
+ */
+int workpool_start(WORKPOOL_T *pool, int threads)
+{
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    if (threads < 1)
+        threads = 1;
+    if (threads > WORKPOOL_MAX_THREADS)
+        threads = WORKPOOL_MAX_THREADS;
+
+    vcos_mutex_create(&pool->lock, "snoop_workpool-lock");
+    vcos_semaphore_create(&pool->ready, "snoop_workpool-sem", 0);
+    for (i = 0; i < threads; i++) {
+        if (vcos_thread_create(&pool->thread[i], "snoop_worker", NULL, workpool_thread, pool) != VCOS_SUCCESS) {
+            fprintf(stderr, "Error: unable to start worker %d\n", i);
+            return -1;
+        }
+        pool->numThreads++;
+    }
+    fprintf(stderr, "INFO: %d analysis workers\n", pool->numThreads);
+    return 0;
+}
+
+/**
+ * Block until the workers exit, which is never in normal operation
+ */
+void workpool_wait(WORKPOOL_T *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->numThreads; i++)
+        vcos_thread_join(&pool->thread[i], NULL);
+}
+
+/**
+ * Take ownership of an idle job so its buffer can be filled. Called by the
+ * job's single producer; never blocks.
+ *
+ * @return 1 if claimed, 0 if the job is still queued or running
+ */
+int workpool_claim(WORKPOOL_JOB_T *job)
+{
+    return __sync_bool_compare_and_swap(&job->state, JOB_IDLE, JOB_CLAIMED);
+}
+
+/**
+ * Queue a claimed job behind every job already waiting
+ */
+void workpool_submit(WORKPOOL_T *pool, WORKPOOL_JOB_T *job)
+{
+    vcos_mutex_lock(&pool->lock);
+    job->state = JOB_QUEUED;
+    job->next = NULL;
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    vcos_mutex_unlock(&pool->lock);
+    vcos_semaphore_post(&pool->ready);
+}
@@ -0,0 +1,44 @@
+/*
+ * File:   workpool.h
+ *
+ * Bounded pool of analysis threads shared by all streams.
+ *
+ * Each stream embeds one WORKPOOL_JOB_T and can have at most one frame in
+ * the pool at a time. Ready jobs are served first in, first out, so every
+ * stream with a frame waiting gets one turn per round however fast the
+ * others produce.
+ */
+
+#ifndef WORKPOOL_H_
+#define WORKPOOL_H_
+
+#include "interface/vcos/vcos.h"
+
+#define WORKPOOL_MAX_THREADS 8
+
+#define JOB_IDLE    0
+#define JOB_CLAIMED 1   /// Producer is filling the job's buffer
+#define JOB_QUEUED  2   /// Waiting for, or running on, a worker
+
+typedef struct WORKPOOL_JOB_T {
+    struct WORKPOOL_JOB_T *next;
+    void (*run)(struct WORKPOOL_JOB_T *job);
+    volatile int state;
+} WORKPOOL_JOB_T;
+
+typedef struct {
+    VCOS_MUTEX_T     lock;
+    VCOS_SEMAPHORE_T ready;           /// One count per queued job
+    WORKPOOL_JOB_T  *head;
+    WORKPOOL_JOB_T  *tail;
+    int              numThreads;
+    VCOS_THREAD_T    thread[WORKPOOL_MAX_THREADS];
+} WORKPOOL_T;
+
+int  workpool_start(WORKPOOL_T *pool, int threads);
+void workpool_wait(WORKPOOL_T *pool);
+
+int  workpool_claim(WORKPOOL_JOB_T *job);
+void workpool_submit(WORKPOOL_T *pool, WORKPOOL_JOB_T *job);
+
+#endif /* WORKPOOL_H_ */